@@ -0,0 +1,539 @@
+/***************************************
+* Author: Joao Francisco B. S. Martins *
+*                                      *
+*         joaofbsm@dcc.ufmg.br         *
+***************************************/
+
+/* Scaling benchmark and stress test.
+ *
+ * Usage: bench [-f blocksize] [-s size] [-o flags] [-j threads] [-n calls]
+ *              [-c files] [-d dirs] [-l bytes] [-z theta] [-m mix] [-u] [-k] image
+ *
+ * Creates =files files of up to =bytes bytes in =dirs directories under
+ * /bench.<pid>, then runs rounds of fs_* calls on them with 1 thread, 2, 4
+ * and so on up to =threads, all sharing one superblock.  Each thread makes
+ * =calls calls per round, and a line with the calls per second and the
+ * latency percentiles of the round is printed.  Files are picked uniformly,
+ * or with -z from a zipfian distribution of skew =theta (0.99 is typical),
+ * where a few files take most calls.  =mix weighs the calls, by default
+ * "read=50,write=20,lookup=20,list=5,unlink=5": read is an fs_pread_file of
+ * a block, write an fs_write_file of a new version of the file, lookup an
+ * fs_stat, list an fs_list_dir of the file's directory and unlink an
+ * fs_unlink.
+ *
+ * With -f the image is formatted first, after creating it with =size bytes
+ * if -s is given, and the FS_* =flags are enabled with -o.  fs.c must not
+ * be called from several threads at once, so the calls are made under one
+ * lock.  Linked with fsclient.o instead of fs.o and built with -DFSCLIENT
+ * (benchc), =image is the socket of an fsd daemon: there -u lets the
+ * threads share the connection without the lock, and several benchmarks
+ * may run at once, one per process.  bench rejects -u.
+ *
+ * Afterwards every file is read back and checked against the last version
+ * written, and fs_du of the tree must agree; the image is then closed,
+ * opened again and checked once more.  The tree is removed unless -k is
+ * given.  Exits with 0 on success, 4 if the image could not be used or
+ * failed the checks and 8 on usage errors. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "fs.h"
+
+#define MAX_THREADS 64
+#define PATH_MAX_LEN 96 /* Room for the path of a file */
+
+#define CALL_READ 0
+#define CALL_WRITE 1
+#define CALL_LOOKUP 2
+#define CALL_LIST 3
+#define CALL_UNLINK 4
+#define CALLS 5
+
+static const char *callnames[CALLS] = {"read", "write", "lookup", "list", "unlink"};
+
+struct file {
+	pthread_mutex_t lock; /* Held while the file is written or unlinked */
+	uint64_t version;     /* Last version written                      */
+	int present;          /* Zero once unlinked                        */
+};
+
+struct bench {
+	struct superblock *sb;
+	const char *image;
+	char root[32];
+	pthread_mutex_t lock; /* Held around each fs_* call unless =unlocked */
+	int unlocked;
+	struct file *files;
+	uint64_t nfiles, ndirs;
+	uint64_t maxbytes;    /* Largest file                              */
+	uint64_t calls;       /* Calls per thread and round                */
+	double *cdf;          /* Zipfian distribution of the files, or NULL */
+	unsigned weights[CALLS];
+	unsigned total;       /* Sum of =weights                           */
+};
+
+struct runner {
+	struct bench *b;
+	uint64_t rng;         /* xorshift state                            */
+	uint64_t *lat;        /* Nanoseconds each call of the round took   */
+	uint64_t errors;      /* Calls that failed unexpectedly            */
+	char *buf;            /* Contents read or written                  */
+};
+
+/************************
+*       UTILITIES       *
+************************/
+
+uint64_t bn_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t bn_random(struct runner *r) {
+	r->rng ^= r->rng << 13;
+	r->rng ^= r->rng >> 7;
+	r->rng ^= r->rng << 17;
+
+	return r->rng;
+}
+
+/* Picks a file, the first ones the most often if the distribution is zipfian */
+uint64_t bn_pick(struct runner *r) {
+	struct bench *b = r->b;
+	uint64_t lo = 0, hi = b->nfiles - 1, mid;
+	double u;
+
+	if(b->cdf == NULL) {
+		return bn_random(r) % b->nfiles;
+	}
+
+	u = (double) (bn_random(r) >> 11) / (double) (1ULL << 53);
+	while(lo < hi) { /* First file whose cumulative probability reaches =u */
+		mid = (lo + hi) / 2;
+		if(b->cdf[mid] < u) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+void bn_path(struct bench *b, uint64_t file, char *path) {
+	sprintf(path, "%s/d%llu/f%llu", b->root, (unsigned long long) (file % b->ndirs), (unsigned long long) file);
+}
+
+/* Size of version =version of =file, from half of the largest file up to it */
+uint64_t bn_size(struct bench *b, uint64_t file, uint64_t version) {
+	return b->maxbytes / 2 + (file * 131 + version * 71) % (b->maxbytes / 2 + 1);
+}
+
+/* Fills =buf with version =version of =file and returns its size */
+uint64_t bn_fill(struct bench *b, uint64_t file, uint64_t version, char *buf) {
+	uint64_t size = bn_size(b, file, version);
+
+	for(uint64_t i = 0; i < size; i++) {
+		buf[i] = (char) ((i * 31 + file * 7 + version * 13) % 251 + 1);
+	}
+
+	return size;
+}
+
+void bn_lock(struct bench *b) {
+	if(!b->unlocked) pthread_mutex_lock(&b->lock);
+}
+
+void bn_unlock(struct bench *b) {
+	if(!b->unlocked) pthread_mutex_unlock(&b->lock);
+}
+
+/* Makes call =call on =file and returns zero, or -1 if it failed in a way it should not have */
+int bn_call(struct runner *r, int call, uint64_t file) {
+	struct bench *b = r->b;
+	struct superblock *sb = b->sb;
+	struct file *f = &b->files[file];
+	struct fsstat st;
+	char path[PATH_MAX_LEN], *list;
+	uint64_t size;
+	int ret = 0;
+
+	bn_path(b, file, path);
+
+	switch(call) {
+	case CALL_READ: /* The file may be unlinked meanwhile */
+		bn_lock(b);
+		ret = (fs_pread_file(sb, path, r->buf, sb->blksz, bn_random(r) % b->maxbytes) < 0 && errno != ENOENT);
+		bn_unlock(b);
+		break;
+	case CALL_WRITE:
+		pthread_mutex_lock(&f->lock);
+		size = bn_fill(b, file, f->version + 1, r->buf);
+		bn_lock(b);
+		ret = fs_write_file(sb, path, r->buf, size);
+		bn_unlock(b);
+		if(ret == 0) {
+			f->version++;
+			f->present = 1;
+		}
+		pthread_mutex_unlock(&f->lock);
+		break;
+	case CALL_LOOKUP:
+		bn_lock(b);
+		ret = (fs_stat(sb, path, &st) != 0 && errno != ENOENT);
+		bn_unlock(b);
+		break;
+	case CALL_LIST:
+		*strrchr(path, '/') = '\0';
+		bn_lock(b);
+		list = fs_list_dir(sb, path);
+		bn_unlock(b);
+		ret = (list == NULL);
+		free(list);
+		break;
+	case CALL_UNLINK:
+		pthread_mutex_lock(&f->lock);
+		bn_lock(b);
+		ret = fs_unlink(sb, path);
+		bn_unlock(b);
+		if(f->present) {
+			f->present = (ret != 0);
+		}
+		else {
+			ret = (ret == 0 || errno != ENOENT);
+		}
+		pthread_mutex_unlock(&f->lock);
+		break;
+	}
+
+	return ret ? -1 : 0;
+}
+
+void * bn_runner(void *arg) {
+	struct runner *r = arg;
+	struct bench *b = r->b;
+	uint64_t start;
+	unsigned pick;
+	int call;
+
+	for(uint64_t i = 0; i < b->calls; i++) {
+		pick = bn_random(r) % b->total;
+		for(call = 0; pick >= b->weights[call]; call++) {
+			pick -= b->weights[call];
+		}
+
+		start = bn_now();
+		if(bn_call(r, call, bn_pick(r))) r->errors++;
+		r->lat[i] = bn_now() - start;
+	}
+
+	return NULL;
+}
+
+int bn_cmp_lat(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Runs a round with =nthreads threads and prints its line */
+void bn_round(struct bench *b, struct runner *runners, int nthreads) {
+	uint64_t start, elapsed, errors = 0, n = b->calls * nthreads;
+	uint64_t *all = malloc(n * sizeof *all);
+	pthread_t threads[MAX_THREADS];
+	int started[MAX_THREADS];
+
+	start = bn_now();
+	for(int i = 1; i < nthreads; i++) {
+		started[i] = (pthread_create(&threads[i], NULL, bn_runner, &runners[i]) == 0);
+		if(!started[i]) bn_runner(&runners[i]);
+	}
+	bn_runner(&runners[0]);
+	for(int i = 1; i < nthreads; i++) {
+		if(started[i]) pthread_join(threads[i], NULL);
+	}
+	elapsed = bn_now() - start;
+
+	for(int i = 0; i < nthreads; i++) {
+		memcpy(all + i * b->calls, runners[i].lat, b->calls * sizeof *all);
+		errors += runners[i].errors;
+		runners[i].errors = 0;
+	}
+	qsort(all, n, sizeof *all, bn_cmp_lat);
+
+	printf("%7d %10.0f %9.1f %9.1f %9.1f %9.1f %7llu\n", nthreads, n / (elapsed / 1e9),
+	       all[n / 2] / 1e3, all[n * 99 / 100] / 1e3, all[n * 999 / 1000] / 1e3, all[n - 1] / 1e3,
+	       (unsigned long long) errors);
+	fflush(stdout);
+
+	free(all);
+}
+
+/* Checks every file against the last version written and the totals of the tree against fs_du.
+ * Returns the number of mismatches. */
+uint64_t bn_check(struct bench *b, char *buf) {
+	struct superblock *sb = b->sb;
+	struct fsdu du;
+	struct fsstat st;
+	char path[PATH_MAX_LEN];
+	char *expect = malloc(b->maxbytes + 1);
+	uint64_t bad = 0, files = 0, bytes = 0, size;
+	ssize_t got;
+
+	for(uint64_t i = 0; i < b->nfiles; i++) {
+		bn_path(b, i, path);
+
+		if(!b->files[i].present) {
+			if(fs_stat(sb, path, &st) == 0 || errno != ENOENT) {
+				fprintf(stderr, "%s: unlinked file is still there\n", path);
+				bad++;
+			}
+			continue;
+		}
+
+		size = bn_fill(b, i, b->files[i].version, expect);
+		got  = fs_read_file(sb, path, buf, b->maxbytes + 1);
+		if(got != (ssize_t) size || memcmp(buf, expect, size)) {
+			fprintf(stderr, "%s: contents differ from version %llu\n", path,
+			        (unsigned long long) b->files[i].version);
+			bad++;
+		}
+		files++;
+		bytes += size;
+	}
+
+	if(fs_du(sb, b->root, &du) || du.files != files || du.size != bytes || du.dirs != b->ndirs + 1) {
+		fprintf(stderr, "%s: fs_du does not match the files written\n", b->root);
+		bad++;
+	}
+
+	free(expect);
+
+	return bad;
+}
+
+/************************
+*         MAIN          *
+************************/
+
+void bn_usage(const char *name) {
+	fprintf(stderr, "usage: %s [-f blocksize] [-s size] [-o flags] [-j threads] [-n calls] [-c files] "
+	                "[-d dirs] [-l bytes] [-z theta] [-m mix] [-u] [-k] image\n", name);
+}
+
+/* Reads the weights of =mix, as in "read=50,write=20". Returns -1 if it is malformed. */
+int bn_parse_mix(struct bench *b, const char *mix) {
+	char *copy = strdup(mix), *item, *save, *eq;
+	int call, ret = 0;
+
+	memset(b->weights, 0, sizeof b->weights);
+
+	for(item = strtok_r(copy, ",", &save); item != NULL && ret == 0; item = strtok_r(NULL, ",", &save)) {
+		if((eq = strchr(item, '=')) == NULL) {
+			ret = -1;
+			break;
+		}
+		*eq = '\0';
+		for(call = 0; call < CALLS && strcmp(item, callnames[call]); call++);
+		if(call == CALLS) ret = -1;
+		else b->weights[call] = atoi(eq + 1);
+	}
+
+	b->total = 0;
+	for(call = 0; call < CALLS; call++) {
+		b->total += b->weights[call];
+	}
+
+	free(copy);
+
+	return (ret == 0 && b->total > 0) ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+	int opt, nthreads = 8, keep = 0, fd;
+	uint64_t blksz = 0, size = 0, flags = 0, bad;
+	double theta = 0, sum = 0;
+	const char *mix = "read=50,write=20,lookup=20,list=5,unlink=5";
+	char path[PATH_MAX_LEN];
+	struct superblock *sb;
+	struct bench b;
+	struct runner runners[MAX_THREADS];
+
+	memset(&b, 0, sizeof b);
+	b.nfiles   = 1024;
+	b.ndirs    = 16;
+	b.maxbytes = 16384;
+	b.calls    = 10000;
+
+	while((opt = getopt(argc, argv, "f:s:o:j:n:c:d:l:z:m:uk")) != -1) {
+		switch(opt) {
+		case 'f':
+			blksz = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 0);
+			break;
+		case 'o':
+			flags = strtoull(optarg, NULL, 0);
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'n':
+			b.calls = strtoull(optarg, NULL, 0);
+			break;
+		case 'c':
+			b.nfiles = strtoull(optarg, NULL, 0);
+			break;
+		case 'd':
+			b.ndirs = strtoull(optarg, NULL, 0);
+			break;
+		case 'l':
+			b.maxbytes = strtoull(optarg, NULL, 0);
+			break;
+		case 'z':
+			theta = atof(optarg);
+			break;
+		case 'm':
+			mix = optarg;
+			break;
+		case 'u':
+#ifdef FSCLIENT
+			b.unlocked = 1;
+			break;
+#else
+			fprintf(stderr, "%s: -u needs the fsd client build, benchc\n", argv[0]);
+			return 8;
+#endif
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			bn_usage(argv[0]);
+			return 8;
+		}
+	}
+
+	if(optind + 1 != argc || b.nfiles == 0 || b.ndirs == 0 || b.maxbytes == 0 || b.calls == 0 || theta < 0 ||
+	   bn_parse_mix(&b, mix)) {
+		bn_usage(argv[0]);
+		return 8;
+	}
+
+	if(nthreads < 1) nthreads = 1;
+	if(nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+	b.image = argv[optind];
+
+	if(blksz != 0) {
+		if(size != 0) {
+			fd = open(b.image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if(fd == -1 || ftruncate(fd, size) == -1) {
+				perror(b.image);
+				return 4;
+			}
+			close(fd);
+		}
+		sb = fs_format(b.image, blksz);
+		if(sb != NULL && fs_setflags(sb, flags)) {
+			fs_close(sb);
+			sb = NULL;
+		}
+	}
+	else {
+		sb = fs_open(b.image);
+	}
+	if(sb == NULL) {
+		perror(b.image);
+		return 4;
+	}
+	b.sb = sb;
+
+	/* Zipfian popularity: file i is picked with a probability proportional to 1 / (i + 1)^theta */
+	if(theta > 0) {
+		b.cdf = malloc(b.nfiles * sizeof *b.cdf);
+		for(uint64_t i = 0; i < b.nfiles; i++) {
+			sum += 1 / pow(i + 1, theta);
+			b.cdf[i] = sum;
+		}
+		for(uint64_t i = 0; i < b.nfiles; i++) {
+			b.cdf[i] /= sum;
+		}
+	}
+
+	pthread_mutex_init(&b.lock, NULL);
+	b.files = calloc(b.nfiles, sizeof *b.files);
+	for(int i = 0; i < nthreads; i++) {
+		runners[i].b      = &b;
+		runners[i].rng    = 0x9e3779b97f4a7c15ULL * (i + 1);
+		runners[i].lat    = malloc(b.calls * sizeof *runners[i].lat);
+		runners[i].errors = 0;
+		runners[i].buf    = malloc(b.maxbytes + sb->blksz);
+	}
+
+	/* The tree and the first version of every file */
+	sprintf(b.root, "/bench.%d", (int) getpid());
+	if(fs_mkdir(sb, b.root)) {
+		perror(b.root);
+		return 4;
+	}
+	for(uint64_t d = 0; d < b.ndirs; d++) {
+		sprintf(path, "%s/d%llu", b.root, (unsigned long long) d);
+		if(fs_mkdir(sb, path)) {
+			perror(path);
+			return 4;
+		}
+	}
+	for(uint64_t i = 0; i < b.nfiles; i++) {
+		pthread_mutex_init(&b.files[i].lock, NULL);
+		b.files[i].version = 1;
+		b.files[i].present = 1;
+		bn_path(&b, i, path);
+		if(fs_write_file(sb, path, runners[0].buf, bn_fill(&b, i, 1, runners[0].buf))) {
+			perror(path);
+			return 4;
+		}
+	}
+
+	printf("%llu files of up to %llu bytes in %llu directories, %s, %s\n", (unsigned long long) b.nfiles,
+	       (unsigned long long) b.maxbytes, (unsigned long long) b.ndirs, (b.cdf != NULL) ? "zipfian" : "uniform",
+	       mix);
+	printf("%7s %10s %9s %9s %9s %9s %7s\n", "threads", "calls/s", "p50 us", "p99 us", "p99.9 us", "max us",
+	       "errors");
+
+	for(int n = 1; ; n *= 2) {
+		if(n > nthreads) n = nthreads;
+		bn_round(&b, runners, n);
+		if(n == nthreads) break;
+	}
+
+	/* Checked as left, then as found once the image is opened again */
+	bad = bn_check(&b, runners[0].buf);
+	if(fs_close(sb) || (b.sb = sb = fs_open(b.image)) == NULL) {
+		perror(b.image);
+		return 4;
+	}
+	bad += bn_check(&b, runners[0].buf);
+	printf("check: %llu errors\n", (unsigned long long) bad);
+
+	if(!keep && fs_rmtree(sb, b.root)) {
+		perror(b.root);
+		bad++;
+	}
+	if(fs_close(sb)) {
+		perror(b.image);
+		bad++;
+	}
+
+	return (bad != 0) ? 4 : 0;
+}
@@ -0,0 +1,621 @@
+/***************************************
+* Author: Joao Francisco B. S. Martins *
+*                                      *
+*         joaofbsm@dcc.ufmg.br         *
+***************************************/
+
+/* Offline defragmenter.
+ *
+ * Usage: defrag [-n] image
+ *
+ * Relocates every block in use so that the image is laid out as:
+ *
+ *     superblock | directories | files | tables | free space
+ *
+ * All directory inodes, their chains and nodeinfo are clustered right after
+ * the superblock, in breadth-first order from the root.  Each file follows
+ * with its inode, nodeinfo, indirect blocks and data blocks in logical
+ * order, so that its data is one contiguous run, and then the tail block
+ * holding its packed tail unless an earlier file placed it.  The
+ * fingerprint index and the reference count table come last, and the
+ * remaining blocks are left as the free range at the end of the
+ * filesystem.
+ *
+ * The new position of every block is planned first, without writing
+ * anything.  Blocks are then moved in place by following the cycles of the
+ * permutation, rewriting the block pointers of metadata as it is moved.
+ * The image must be consistent (see fsck) and a crash while blocks are being
+ * moved leaves it corrupted.  With -n, only the fragmentation report is
+ * printed. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "fs.h"
+
+#define LINK_MAX ((sb->blksz - 32) / sizeof(uint64_t))
+#define BUCKET_MAX (sb->blksz / sizeof(uint64_t))
+#define HASH_MAX ((sb->blksz - 16) / sizeof(struct hashent))
+#define FS_BUCKET(key) (((key) / HASH_MAX) % BUCKET_MAX)
+#define DIRECT_MAX (LINK_MAX - 3)
+#define PTR_MAX (sb->blksz / sizeof(uint64_t))
+
+/* Block types, telling which words of a block are block pointers */
+#define BDATA     1 /* File data or nodeinfo, no pointers */
+#define BINODE    2 /* File inode, whose =next is a packed tail */
+#define BDIRINODE 3 /* Directory inode or child inode */
+#define BDIRINFO  4 /* Directory nodeinfo */
+#define BBUCKETS  5 /* Bucket block of the fingerprint index */
+#define BHASHPAGE 6 /* Hash page of the fingerprint index */
+#define BREFS     7 /* Reference count table, rebuilt instead of moved */
+#define BINDIRECT 8 /* Indirect block of a file's block map */
+
+struct file {
+	uint64_t inode;
+	uint64_t *data;   /* Data blocks in logical order, holes left out */
+	uint64_t ndata;
+};
+
+struct plan {
+	struct superblock *sb;
+	uint64_t *map;    /* New position of each block in use, zero if the block is free */
+	uint8_t *type;
+	uint8_t *done;    /* Blocks already moved to their new position */
+	uint64_t used;    /* Next free position in the new layout */
+	struct file *files;
+	uint64_t nfiles, capfiles;
+	struct hashent *refs; /* Reference count entries, keys remapped at the end */
+	uint64_t nrefs;
+};
+
+struct report {
+	uint64_t extents;     /* Runs of contiguous data blocks, over all files */
+	uint64_t fragmented;  /* Files with more than one run */
+	uint64_t freeruns;    /* Runs of contiguous free blocks */
+	uint64_t largestfree; /* Longest run of free blocks */
+	uint64_t dirspan;     /* Distance between the first and last directory blocks */
+};
+
+/************************
+*       UTILITIES       *
+************************/
+
+void df_read(struct plan *p, uint64_t pos, void *data) {
+	struct superblock *sb = p->sb;
+
+	if(pread(sb->fd, data, sb->blksz, pos * sb->blksz) != sb->blksz) {
+		fprintf(stderr, "cannot read block %llu\n", (unsigned long long) pos);
+		exit(4);
+	}
+}
+
+void df_write(struct plan *p, uint64_t pos, void *data) {
+	struct superblock *sb = p->sb;
+
+	if(pwrite(sb->fd, data, sb->blksz, pos * sb->blksz) != sb->blksz) {
+		fprintf(stderr, "cannot write block %llu, image is corrupted\n", (unsigned long long) pos);
+		exit(4);
+	}
+}
+
+/* Gives =blk the next position in the new layout, unless it already has one (shared blocks) */
+void df_place(struct plan *p, uint64_t blk, uint8_t type) {
+	if(blk == 0 || blk >= p->sb->blks) {
+		fprintf(stderr, "block %llu out of range, run fsck first\n", (unsigned long long) blk);
+		exit(4);
+	}
+
+	if(p->map[blk] != 0) {
+		return;
+	}
+
+	p->map[blk]  = p->used++;
+	p->type[blk] = type;
+}
+
+uint64_t df_remap(struct plan *p, uint64_t blk) {
+	return blk == 0 ? 0 : p->map[blk];
+}
+
+/* Moves the byte address =pos of a packed tail along with its tail block */
+uint64_t df_remap_tail(struct plan *p, uint64_t pos) {
+	uint64_t blksz = p->sb->blksz;
+
+	return pos == 0 ? 0 : p->map[pos / blksz] * blksz + pos % blksz;
+}
+
+/************************
+*       PLANNING        *
+************************/
+
+/* Places a directory's inode chain and nodeinfo, queueing subdirectories in =queue and collecting
+ * its files in =p->files. */
+void df_plan_dir(struct plan *p, uint64_t dirblk, uint64_t *queue, uint64_t *qtail) {
+	struct superblock *sb = p->sb;
+	struct inode *inode = malloc(sb->blksz);
+	struct inode *entry = malloc(sb->blksz);
+	uint64_t blk = dirblk;
+
+	df_read(p, blk, inode);
+	df_place(p, blk, BDIRINODE);
+	df_place(p, inode->meta, BDIRINFO);
+
+	while(1) {
+		for(uint64_t i = 0; i < LINK_MAX; i++) {
+			/* Entities shared with snapshots are planned once */
+			if(inode->links[i] == 0 || p->type[inode->links[i]] != 0) continue;
+
+			df_read(p, inode->links[i], entry);
+			p->type[inode->links[i]] = (entry->mode == IMDIR) ? BDIRINODE : BINODE;
+			if(entry->mode == IMDIR) {
+				queue[(*qtail)++] = inode->links[i];
+			}
+			else {
+				if(p->nfiles == p->capfiles) {
+					p->capfiles = p->capfiles ? p->capfiles * 2 : 64;
+					p->files = realloc(p->files, p->capfiles * sizeof *p->files);
+				}
+				p->files[p->nfiles].inode = inode->links[i];
+				p->files[p->nfiles].data  = NULL;
+				p->files[p->nfiles].ndata = 0;
+				p->nfiles++;
+			}
+		}
+
+		if(inode->next == 0) break;
+
+		blk = inode->next;
+		df_place(p, blk, BDIRINODE);
+		df_read(p, blk, inode);
+	}
+
+	free(inode);
+	free(entry);
+}
+
+/* Places the indirect blocks of the tree of =depth levels under =blk, which maps =count blocks of
+ * file =f, and collects its data blocks in logical order */
+void df_plan_tree(struct plan *p, struct file *f, uint64_t blk, int depth, uint64_t count) {
+	struct superblock *sb = p->sb;
+	uint64_t span = 1, n;
+	uint64_t *ptrs;
+
+	if(blk == 0) {
+		return;
+	}
+
+	if(depth == 0) {
+		f->data[f->ndata++] = blk;
+		return;
+	}
+
+	df_place(p, blk, BINDIRECT);
+	ptrs = malloc(sb->blksz);
+	df_read(p, blk, ptrs);
+
+	for(int i = 1; i < depth; i++) {
+		span *= PTR_MAX;
+	}
+
+	for(uint64_t i = 0; i < PTR_MAX && i * span < count; i++) {
+		n = (count - i * span < span) ? count - i * span : span;
+		df_plan_tree(p, f, ptrs[i], depth - 1, n);
+	}
+
+	free(ptrs);
+}
+
+/* Places a file's inode, nodeinfo, indirect blocks and then its data blocks in logical order */
+void df_plan_file(struct plan *p, struct file *f) {
+	struct superblock *sb = p->sb;
+	struct inode *inode = malloc(sb->blksz);
+	struct nodeinfo *info = malloc(sb->blksz);
+	uint64_t blk = f->inode, nblks, base, span = 1;
+
+	df_read(p, blk, inode);
+	df_read(p, inode->meta, info);
+	df_place(p, blk, BINODE);
+	df_place(p, inode->meta, BDATA);
+
+	nblks = (info->size / sb->blksz) + ((info->size % sb->blksz) ? 1 : 0);
+	f->data = malloc((nblks ? nblks : 1) * sizeof *f->data);
+
+	for(uint64_t i = 0; i < DIRECT_MAX && i < nblks; i++) {
+		df_plan_tree(p, f, inode->links[i], 0, 1);
+	}
+
+	/* Indirect blocks first, so that the data run is not split by them */
+	base = DIRECT_MAX;
+	for(int depth = 1; depth <= 3 && base < nblks; depth++) {
+		span *= PTR_MAX;
+		df_plan_tree(p, f, inode->links[DIRECT_MAX + depth - 1], depth,
+		             (nblks - base < span) ? nblks - base : span);
+		base += span;
+	}
+
+	for(uint64_t i = 0; i < f->ndata; i++) {
+		df_place(p, f->data[i], BDATA);
+	}
+
+	if(inode->next != 0) {
+		df_place(p, inode->next / sb->blksz, BDATA);
+	}
+
+	free(inode);
+	free(info);
+}
+
+void df_plan_fingerprints(struct plan *p) {
+	struct superblock *sb = p->sb;
+	uint64_t *buckets = malloc(sb->blksz);
+	struct hashpage *page = malloc(sb->blksz);
+	uint64_t pageblk;
+
+	if(sb->fingerprints != 0) {
+		df_place(p, sb->fingerprints, BBUCKETS);
+		df_read(p, sb->fingerprints, buckets);
+
+		for(uint64_t b = 0; b < BUCKET_MAX; b++) {
+			for(pageblk = buckets[b]; pageblk != 0; pageblk = page->next) {
+				df_place(p, pageblk, BHASHPAGE);
+				df_read(p, pageblk, page);
+			}
+		}
+	}
+
+	free(buckets);
+	free(page);
+}
+
+/* Reads the reference count entries; the table itself is rebuilt once the keys are remapped */
+void df_collect_refs(struct plan *p) {
+	struct superblock *sb = p->sb;
+	uint64_t *buckets = malloc(sb->blksz);
+	struct hashpage *page = malloc(sb->blksz);
+	uint64_t pageblk;
+
+	if(sb->refcounts != 0) {
+		df_read(p, sb->refcounts, buckets);
+		p->type[sb->refcounts] = BREFS;
+
+		for(uint64_t b = 0; b < BUCKET_MAX; b++) {
+			for(pageblk = buckets[b]; pageblk != 0; pageblk = page->next) {
+				df_read(p, pageblk, page);
+				p->type[pageblk] = BREFS;
+				p->refs = realloc(p->refs, (p->nrefs + page->count) * sizeof *p->refs);
+				memcpy(p->refs + p->nrefs, page->ents, page->count * sizeof *p->refs);
+				p->nrefs += page->count;
+			}
+		}
+	}
+
+	free(buckets);
+	free(page);
+}
+
+/************************
+*       METRICS         *
+************************/
+
+/* Measures fragmentation where blocks are now, or where the plan puts them if =after is set */
+void df_measure(struct plan *p, int after, struct report *r) {
+	struct superblock *sb = p->sb;
+	uint64_t run = 0, pos, prev = 0, first = sb->blks, last = 0;
+	uint8_t *inuse = calloc(sb->blks, 1);
+
+	memset(r, 0, sizeof *r);
+
+	for(uint64_t i = 0; i < p->nfiles; i++) {
+		struct file *f = &p->files[i];
+		uint64_t extents = 0;
+
+		for(uint64_t j = 0; j < f->ndata; j++) {
+			pos = after ? p->map[f->data[j]] : f->data[j];
+			if(j == 0 || pos != prev + 1) extents++;
+			prev = pos;
+		}
+
+		r->extents += extents;
+		if(extents > 1) r->fragmented++;
+	}
+
+	inuse[0] = 1;
+	for(uint64_t blk = 1; blk < sb->blks; blk++) {
+		if(p->map[blk] == 0 && p->type[blk] != BREFS) continue;
+
+		pos = after ? p->map[blk] : blk;
+		if(after && p->type[blk] == BREFS) continue; /* Rebuilt after everything else */
+		inuse[pos] = 1;
+
+		if(p->type[blk] == BDIRINODE || p->type[blk] == BDIRINFO) {
+			if(pos < first) first = pos;
+			if(pos > last) last = pos;
+		}
+	}
+
+	if(after) { /* Reference count table, right after the blocks that were moved */
+		for(pos = 1; pos < p->used; pos++) inuse[pos] = 1;
+	}
+
+	for(uint64_t blk = 1; blk < sb->blks; blk++) {
+		if(inuse[blk]) {
+			run = 0;
+			continue;
+		}
+		if(run == 0) r->freeruns++;
+		run++;
+		if(run > r->largestfree) r->largestfree = run;
+	}
+
+	r->dirspan = last >= first ? last - first + 1 : 0;
+
+	free(inuse);
+}
+
+void df_print(const char *when, struct report *r, uint64_t nfiles) {
+	printf("%s: %llu files, %llu data extents (%.2f per file), %llu fragmented files, "
+	       "directories span %llu blocks, %llu free extents (largest %llu blocks)\n", when,
+	       (unsigned long long) nfiles, (unsigned long long) r->extents,
+	       nfiles ? (double) r->extents / nfiles : 0.0, (unsigned long long) r->fragmented,
+	       (unsigned long long) r->dirspan, (unsigned long long) r->freeruns,
+	       (unsigned long long) r->largestfree);
+}
+
+/************************
+*      RELOCATION       *
+************************/
+
+/* Rewrites the block pointers in =data, a block of type =type, to their new positions */
+void df_fix(struct plan *p, uint8_t type, void *data) {
+	struct superblock *sb = p->sb;
+	struct inode *inode = data;
+	struct hashpage *page = data;
+	uint64_t *words = data;
+
+	switch(type) {
+	case BINODE:
+	case BDIRINODE:
+		inode->parent = df_remap(p, inode->parent);
+		inode->meta   = df_remap(p, inode->meta);
+		inode->next   = (type == BINODE) ? df_remap_tail(p, inode->next) : df_remap(p, inode->next);
+		for(uint64_t i = 0; i < LINK_MAX; i++) {
+			inode->links[i] = df_remap(p, inode->links[i]);
+		}
+		break;
+	case BBUCKETS:
+	case BINDIRECT:
+		for(uint64_t i = 0; i < BUCKET_MAX; i++) {
+			words[i] = df_remap(p, words[i]);
+		}
+		break;
+	case BHASHPAGE:
+		page->next = df_remap(p, page->next);
+		for(uint64_t i = 0; i < page->count; i++) {
+			page->ents[i].value = df_remap(p, page->ents[i].value);
+		}
+		break;
+	}
+}
+
+/* Moves the block at =start and every block displaced by it, until a free position or =start
+ * itself is reached */
+void df_move_chain(struct plan *p, uint64_t start, char *buf, char *tmp) {
+	uint64_t src = start, dst;
+	char *swap;
+
+	df_read(p, src, buf);
+	df_fix(p, p->type[src], buf);
+	p->done[src] = 1;
+
+	while(1) {
+		dst = p->map[src];
+
+		if(dst != start && p->map[dst] != 0 && !p->done[dst]) {
+			/* Save the block being displaced before overwriting it */
+			df_read(p, dst, tmp);
+			df_fix(p, p->type[dst], tmp);
+			p->done[dst] = 1;
+			df_write(p, dst, buf);
+
+			swap = buf;
+			buf  = tmp;
+			tmp  = swap;
+			src  = dst;
+		}
+		else {
+			df_write(p, dst, buf);
+			break;
+		}
+	}
+}
+
+void df_relocate(struct plan *p) {
+	struct superblock *sb = p->sb;
+	char *buf = malloc(sb->blksz);
+	char *tmp = malloc(sb->blksz);
+
+	p->done[0] = 1;
+
+	/* Chains start at blocks moving out of the used area; no block is moved into them */
+	for(uint64_t blk = p->used; blk < sb->blks; blk++) {
+		if(p->map[blk] != 0 && !p->done[blk]) df_move_chain(p, blk, buf, tmp);
+	}
+
+	/* Whatever is left is made of cycles, or blocks that stay in place */
+	for(uint64_t blk = 1; blk < p->used; blk++) {
+		if(p->map[blk] != 0 && !p->done[blk]) df_move_chain(p, blk, buf, tmp);
+	}
+
+	free(buf);
+	free(tmp);
+}
+
+int df_cmp_ent(const void *a, const void *b) {
+	const struct hashent *x = a, *y = b;
+
+	if(x->key != y->key) return x->key < y->key ? -1 : 1;
+	return 0;
+}
+
+/* Writes the reference count table with remapped keys, right after the other blocks in use */
+void df_write_refs(struct plan *p) {
+	struct superblock *sb = p->sb;
+	uint64_t *buckets;
+	struct hashpage *page;
+	uint64_t i, j, bucket;
+
+	if(p->nrefs == 0) {
+		sb->refcounts = 0;
+		return;
+	}
+
+	buckets = calloc(1, sb->blksz);
+	page    = calloc(1, sb->blksz);
+
+	for(i = 0; i < p->nrefs; i++) {
+		p->refs[i].key = df_remap(p, p->refs[i].key);
+	}
+	qsort(p->refs, p->nrefs, sizeof *p->refs, df_cmp_ent); /* Groups entries by bucket */
+
+	sb->refcounts = p->used++;
+
+	for(i = 0; i < p->nrefs; i = j) {
+		bucket = FS_BUCKET(p->refs[i].key);
+		for(j = i; j < p->nrefs && FS_BUCKET(p->refs[j].key) == bucket; j++);
+
+		/* Entries of a bucket can come in several key ranges, append pages to its chain */
+		for(uint64_t k = i; k < j; k += HASH_MAX) {
+			memset(page, 0, sb->blksz);
+			page->count = (j - k < HASH_MAX) ? j - k : HASH_MAX;
+			page->next  = buckets[bucket];
+			memcpy(page->ents, p->refs + k, page->count * sizeof *p->refs);
+			buckets[bucket] = p->used;
+			df_write(p, p->used++, page);
+		}
+	}
+
+	df_write(p, sb->refcounts, buckets);
+
+	free(buckets);
+	free(page);
+}
+
+/* Leaves the blocks after the ones in use as the free range, with an empty free list */
+void df_free_tail(struct plan *p) {
+	struct superblock *sb = p->sb;
+
+	sb->freeblks = sb->blks - p->used;
+	sb->freelist = 0;
+	sb->frontier = sb->freeblks ? p->used : 0;
+}
+
+/************************
+*         MAIN          *
+************************/
+
+int main(int argc, char **argv) {
+	int opt, dryrun = 0;
+	uint64_t *queue, qhead = 0, qtail = 0, moved = 0;
+	struct superblock *sb;
+	struct plan p;
+	struct report before, after;
+	char *block;
+
+	while((opt = getopt(argc, argv, "n")) != -1) {
+		switch(opt) {
+		case 'n':
+			dryrun = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n] image\n", argv[0]);
+			return 8;
+		}
+	}
+
+	if(optind + 1 != argc) {
+		fprintf(stderr, "usage: %s [-n] image\n", argv[0]);
+		return 8;
+	}
+
+	sb = fs_open(argv[optind]);
+	if(sb == NULL) {
+		perror(argv[optind]);
+		return 8;
+	}
+
+	memset(&p, 0, sizeof p);
+	p.sb   = sb;
+	p.map  = calloc(sb->blks, sizeof *p.map);
+	p.type = calloc(sb->blks, 1);
+	p.done = calloc(sb->blks, 1);
+	p.used = 1; /* Superblock stays at block zero */
+
+	/* Directories first, breadth first from the root (which lands at block 1), then snapshots */
+	queue = malloc(sb->blks * sizeof *queue);
+	queue[qtail++] = sb->root;
+	p.type[sb->root] = BDIRINODE;
+	if(sb->snaps != 0) {
+		queue[qtail++] = sb->snaps;
+		p.type[sb->snaps] = BDIRINODE;
+	}
+	while(qhead < qtail) {
+		df_plan_dir(&p, queue[qhead++], queue, &qtail);
+	}
+	free(queue);
+
+	for(uint64_t i = 0; i < p.nfiles; i++) {
+		df_plan_file(&p, &p.files[i]);
+	}
+
+	df_plan_fingerprints(&p);
+	df_collect_refs(&p);
+
+	df_measure(&p, 0, &before);
+	df_print("before", &before, p.nfiles);
+
+	for(uint64_t blk = 1; blk < sb->blks; blk++) {
+		if(p.map[blk] != 0 && p.map[blk] != blk) moved++;
+	}
+
+	if(dryrun) {
+		printf("%llu blocks would be moved\n", (unsigned long long) moved);
+		fs_close(sb);
+		return 0;
+	}
+
+	df_relocate(&p);
+	df_write_refs(&p);
+	df_free_tail(&p);
+
+	sb->root = p.map[sb->root];
+	if(sb->snaps != 0) sb->snaps = p.map[sb->snaps];
+	if(sb->fingerprints != 0) sb->fingerprints = p.map[sb->fingerprints];
+	sb->tailpos = df_remap_tail(&p, sb->tailpos);
+
+	block = calloc(1, sb->blksz);
+	memcpy(block, sb, SUPERBLOCK_DISK_SIZE);
+	df_write(&p, 0, block);
+	free(block);
+
+	df_measure(&p, 1, &after);
+	df_print("after", &after, p.nfiles);
+	printf("%llu blocks moved\n", (unsigned long long) moved);
+
+	for(uint64_t i = 0; i < p.nfiles; i++) {
+		free(p.files[i].data);
+	}
+	free(p.files);
+	free(p.refs);
+	free(p.map);
+	free(p.type);
+	free(p.done);
+	fs_close(sb);
+
+	return 0;
+}
@@ -4,882 +4,5755 @@
 *         joaofbsm@dcc.ufmg.br         *
 ***************************************/
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fnmatch.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/mount.h>
 
 #include "fs.h"
 
-#define LINK_MAX (sb->blksz - 32) / sizeof(uint64_t)
-#define NAME_MAX sb->blksz - (8 * sizeof(uint64_t))
+#define LINK_MAX ((sb->blksz - 32) / sizeof(uint64_t))
+#define NAME_MAX (sb->blksz - (8 * sizeof(uint64_t)))
+#define HASH_MAX ((sb->blksz - 16) / sizeof(struct hashent))
+#define FREE_MAX ((sb->blksz - 16) / sizeof(uint64_t)) /* Links of a freepage */
+#define BUCKET_MAX (sb->blksz / sizeof(uint64_t))
+#define FS_BUCKET(key) (((key) / HASH_MAX) % BUCKET_MAX) /* Neighbouring keys share a page */
+#define DIRECT_MAX (LINK_MAX - 3)
+#define PTR_MAX (sb->blksz / sizeof(uint64_t))
+
+#define FS_ALLFLAGS (FS_DEDUP | FS_DELALLOC | FS_TAILPACK | FS_DISCARD)
+#define TAIL_MAX (sb->blksz / 2) /* Longest tail FS_TAILPACK packs */
+#define DELALLOC_MAX (8 << 20) /* Buffered bytes that trigger a flush */
+#define ZERO_STRIDE 16 /* Words fs_zero_block ors together before testing them */
+
+#define CACHE_MAX 1024 /* Blocks kept by the block cache */
+#define RA_MIN 4       /* Readahead window of a new sequential reader, in blocks */
+#define RA_MAX 128     /* Largest readahead window, also the longest prefetched run */
+#define RA_STREAMS 8   /* Files whose access pattern is tracked */
+#define RA_QUEUE 64    /* Runs waiting for the prefetch thread */
+
+#define POOL_MAX 16 /* Aligned buffers of an O_DIRECT image, callers wait when all are taken */
+
+#define SLOT_FREE 0
+#define SLOT_VALID 1
+#define SLOT_LOADING 2 /* Being read by the prefetch thread, never evicted */
+#define SLOT_DETACHED 3 /* Overwritten while pinned, freed by the last fs_release_views */
+
+#define PIN_MAX (CACHE_MAX / 2) /* Slots views may pin, the rest keep caching */
+
+#define COPY_MAX 64 /* Blocks moved per step when the kernel cannot copy between files */
+
+#define STRIPE_MIN 16 /* Whole blocks a read or write needs to drive the images of a stripe at once */
+#define STRIPE_IOV 64 /* Buffers gathered into one call to a striped image */
+
+#define WALK_THREADS 4 /* Threads walking a directory tree at once */
+
+#define RELEASE_ENTITY 0  /* fs_release a file or directory */
+#define RELEASE_TREE 1    /* fs_free_tree a data block or a tree of indirect blocks */
+#define RELEASE_TAIL 2    /* fs_put_tail a packed tail */
+#define RELEASE_DELAYED 3 /* fs_drop_delayed a file never flushed */
 
 /************************
-*       UTILITIES       * 
+*       BACKENDS        *
 ************************/
 
-int fs_has_links(struct superblock *sb, uint64_t thisblk);
-
-struct dir {
-	uint64_t dirnode;   /* Dir inode corresponding block            */
-	uint64_t nodeblock; /* The requested inode block, if it exists  */
-	char *nodename;     /* Name of the requested inode, file or dir */
+struct fileimage {
+	int fd;
 };
 
-struct link {
-	uint64_t inode; /* inode block that contains the link        */
-	int index;      /* Index of the link in inode array of links */
+struct memimage {
+	pthread_rwlock_t lock; /* Held for writing while =mem moves */
+	char *mem;
+	uint64_t size;
+	int fd; /* Mapped file, -1 for a RAM disk */
 };
 
-int get_file_size(const char *fname) {
-	int sz;
-	FILE *fd = fopen(fname, "r");
-	fseek(fd, 0L, SEEK_END);
-	sz = ftell(fd);
-	rewind(fd);
-	fclose(fd);
-	return sz;
-}
-
-void fs_write_data(struct superblock *sb, uint64_t pos, void *data) {
+/* Wraps the open descriptor =fd of an image for the file backend */
+void * fs_file_wrap(int fd) {
+	struct fileimage *f = malloc(sizeof *f);
 
-	/* DATA POSITIONS
-	* 0 - Superblock
-	* 1 - Root Inode
-	* 2 - Root Nodeinfo
-	* 3 - Freelist(Initial position)
-	*/
+	f->fd = fd;
 
-	lseek(sb->fd, pos * sb->blksz, SEEK_SET);
-	write(sb->fd, data, sb->blksz);
+	return f;
 }
 
-void fs_read_data(struct superblock *sb, uint64_t pos, void *data) {
-	lseek(sb->fd, pos * sb->blksz, SEEK_SET);
-	read(sb->fd, data, sb->blksz);
-}
+/* Opens and locks the image file =name, creating it with =size bytes if =size is not zero */
+int fs_file_lock(const char *name, uint64_t size) {
+	int fd = open(name, O_RDWR | (size != 0 ? O_CREAT : 0), 0666);
 
-/* Returns the name of the last inode, its parent dir inode position and its inode position(if it doesnt exists returns -1). 
- *  In case of error sets errno to the right value and returns NULL */
-struct dir * fs_find_dir_info(struct superblock *sb, const char *dpath) {
-	int pathlenght = 0;
-	char *token;
-	char *nodename = malloc(NAME_MAX);
-	char *pathcopy = malloc(NAME_MAX);
-	struct dir *dir = malloc(sizeof *dir); 
+	if(fd == -1) {
+		return -1;
+	}
 
-	strcpy(pathcopy, dpath);
+	if(flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		close(fd);
+		errno = EBUSY;
+		return -1;
+	}
 
-	token = strtok(pathcopy, "/");
-	if(token == NULL) {
-		dir->dirnode = 1;
-		dir->nodeblock = 1;
-		dir->nodename = "";
-		return dir;
+	if(size != 0 && ftruncate(fd, size) == -1) {
+		close(fd);
+		return -1;
 	}
 
-	while(token != NULL) {
-		strcpy(nodename, token);
-		pathlenght++;
-		token = strtok(NULL, "/");
-	} 
+	return fd;
+}
 
-	strcpy(pathcopy, dpath);
+void * fs_file_open(const char *name, uint64_t size) {
+	int fd = fs_file_lock(name, size);
 
-	uint64_t dirnode, nodeblock, j;
-	struct inode *inode          = malloc(sb->blksz);
-	struct inode *auxinode       = malloc(sb->blksz);
-	struct nodeinfo *nodeinfo    = malloc(sb->blksz);
-	struct nodeinfo *auxnodeinfo = malloc(sb->blksz);
+	return (fd != -1) ? fs_file_wrap(fd) : NULL;
+}
 
-	dirnode = 1;
+ssize_t fs_file_readv(void *image, const struct iovec *iov, int n, uint64_t offset) {
+	return preadv(((struct fileimage*) image)->fd, iov, n, offset);
+}
 
-	fs_read_data(sb, dirnode, (void*) inode);
-	fs_read_data(sb, inode->meta, (void*) nodeinfo);
-	token = strtok(pathcopy, "/");
+ssize_t fs_file_writev(void *image, const struct iovec *iov, int n, uint64_t offset) {
+	return pwritev(((struct fileimage*) image)->fd, iov, n, offset);
+}
 
-	j = 0;
+int fs_file_flush(void *image) {
+	return fdatasync(((struct fileimage*) image)->fd);
+}
 
-	for(int i = 0; i < pathlenght; i++) {
-		while(j < LINK_MAX) {
-			nodeblock = inode->links[j];
-			if(nodeblock != 0) {
-				fs_read_data(sb, nodeblock, (void*) auxinode);
-				fs_read_data(sb, auxinode->meta, (void*) auxnodeinfo);
+uint64_t fs_file_size(void *image) {
+	off_t size = lseek(((struct fileimage*) image)->fd, 0, SEEK_END); /* Works for block devices too */
 
-				if(!strcmp(auxnodeinfo->name, token)) {
-					if(i + 1 < pathlenght) dirnode = nodeblock;
-					inode = auxinode;
-					nodeinfo = auxnodeinfo;
-					break;
-				}	
-			}
+	return (size > 0) ? (uint64_t) size : 0;
+}
 
-			j++;
+/* Extends the image file =fd to =size bytes if it is a regular file. Devices have the size they
+ * have. */
+int fs_file_extend(int fd, uint64_t size) {
+	struct stat st;
 
-			if(j == LINK_MAX) {
-				if(inode->next != 0) { /* Restarts loop with child inode */
-					j = 0;
-					fs_read_data(sb, inode->next, (void*)inode);
-				}
-				else{ 
-					if(i + 1 == pathlenght) {
-						nodeblock = -1; /* Ends while without finding file */
-						break;
-					}
-					else { /* Error: Path doesn't exists */
-						free(dir);
-						free(nodename);
-						free(pathcopy);
-						free(inode);
-						free(nodeinfo);
-						errno = ENOENT;
-						return NULL;
-					}
-				}
-			}
-		}
-		j = 0;
-		token = strtok(NULL, "/");
+	if(fstat(fd, &st) == -1) {
+		return -1;
 	}
 
-	dir->dirnode = dirnode;
-	dir->nodeblock = nodeblock;
-	dir->nodename = malloc(NAME_MAX);
-	strcpy(dir->nodename, nodename);
+	if(S_ISREG(st.st_mode) && (uint64_t) st.st_size < size && ftruncate(fd, size) == -1) {
+		return -1;
+	}
 
-	free(nodename);
-	free(pathcopy);
-	free(inode);
-	free(nodeinfo);
+	return 0;
+}
 
-	return dir;
+int fs_file_resize(void *image, uint64_t size) {
+	return fs_file_extend(((struct fileimage*) image)->fd, size);
 }
 
-/* Returns the inode relative to parent that have a free link and the free link index in the array of links.
- * If the link is not found, return the last inode in the chain and -1 as link index. linkvalue should be 0 
- * when looking for a free link. */
-struct link * fs_find_link(struct superblock *sb, uint64_t inodeblk, uint64_t linkvalue) {
-	int i = 0;
-	uint64_t actualblk = inodeblk;
-	struct link *link = malloc(sizeof *link);
-	struct inode *inode = malloc(sb->blksz);
+int fs_file_fd(void *image) {
+	return ((struct fileimage*) image)->fd;
+}
 
-	fs_read_data(sb, inodeblk, (void*) inode);
+void fs_file_close(void *image) {
+	int fd = ((struct fileimage*) image)->fd;
 
-	while(i < LINK_MAX) {
-		if(inode->links[i] == linkvalue) {
-			link->inode = actualblk;
-			link->index = i;
-			break;
-		}
+	flock(fd, LOCK_UN);
+	close(fd);
+	free(image);
+}
 
-		i++;
+int fs_file_discard(void *image, uint64_t offset, uint64_t len) {
+	return fallocate(((struct fileimage*) image)->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+}
 
-		if(i == LINK_MAX) {
-			if(inode->next == 0) {
-				link->inode = actualblk;
-				link->index = -1;
-				break;
-			}
-			else{ /* Restarts loop with child inode */
-				i = 0;
-				actualblk = inode->next;
-				fs_read_data(sb, inode->next, (void*) inode);
-			}
+/* Copies between the =n buffers in =iov and byte =offset of =m, stopping at its end. Returns the
+ * number of bytes copied. */
+ssize_t fs_mem_copy(struct memimage *m, const struct iovec *iov, int n, uint64_t offset, int write) {
+	size_t done = 0, len;
+
+	pthread_rwlock_rdlock(&m->lock);
+
+	for(int i = 0; i < n && offset < m->size; i++) {
+		len = (iov[i].iov_len < m->size - offset) ? iov[i].iov_len : m->size - offset;
+		if(write) {
+			memcpy(m->mem + offset, iov[i].iov_base, len);
 		}
+		else {
+			memcpy(iov[i].iov_base, m->mem + offset, len);
+		}
+		done   += len;
+		offset += len;
 	}
 
-	free(inode);
+	pthread_rwlock_unlock(&m->lock);
 
-	return link;
+	return done;
 }
 
-/* Returns child inode pos in fs*/
-uint64_t fs_create_child(struct superblock *sb, uint64_t thisblk, uint64_t parentblk) {
-	uint64_t ret;
-	struct inode *inode     = malloc(sb->blksz);
-	struct inode *childnode = malloc(sb->blksz);
+ssize_t fs_mem_readv(void *image, const struct iovec *iov, int n, uint64_t offset) {
+	return fs_mem_copy(image, iov, n, offset, 0);
+}
 
-	fs_read_data(sb, thisblk, (void*) inode);
+ssize_t fs_mem_writev(void *image, const struct iovec *iov, int n, uint64_t offset) {
+	return fs_mem_copy(image, iov, n, offset, 1);
+}
 
-	inode->next = fs_get_block(sb);
+uint64_t fs_mem_size(void *image) {
+	return ((struct memimage*) image)->size;
+}
 
-	childnode->mode   = IMCHILD;
-	childnode->parent = parentblk;
-	childnode->meta   = thisblk;
-	childnode->next   = 0;
-	for(int i = 0; i < LINK_MAX; i++) {
-		childnode->links[i] = 0;
-	}
+/* Punches a hole in a mapped file, or gives the pages of a RAM disk back to the kernel. Bytes
+ * sharing a page with bytes kept are zeroed instead. */
+int fs_mem_discard(void *image, uint64_t offset, uint64_t len) {
+	struct memimage *m = image;
+	uintptr_t page = sysconf(_SC_PAGESIZE), lo, hi, start, end;
+	int ret = 0;
 
-	fs_write_data(sb, thisblk, (void*) inode);
-	fs_write_data(sb, inode->next, (void*) childnode);
+	pthread_rwlock_rdlock(&m->lock);
 
-	ret = inode->next;
+	if(offset >= m->size) {
+		pthread_rwlock_unlock(&m->lock);
+		return 0;
+	}
+	if(len > m->size - offset) len = m->size - offset;
+
+	if(m->fd != -1) {
+		ret = fallocate(m->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, len);
+	}
+	else {
+		lo    = (uintptr_t) m->mem + offset;
+		hi    = lo + len;
+		start = (lo + page - 1) & ~(page - 1);
+		end   = hi & ~(page - 1);
+		if(start < end) {
+			memset((void*) lo, 0, start - lo);
+			memset((void*) end, 0, hi - end);
+			ret = madvise((void*) start, end - start, MADV_DONTNEED);
+		}
+		else {
+			memset((void*) lo, 0, len);
+		}
+	}
 
-	free(inode);
-	free(childnode);
+	pthread_rwlock_unlock(&m->lock);
 
 	return ret;
 }
 
-void fs_add_link(struct superblock *sb, uint64_t parentblk, int linkindex, uint64_t newlink) {
-	uint64_t nodeinfoblk;
-	struct inode *inode = malloc(sb->blksz);
-	struct nodeinfo *nodeinfo = malloc(sb->blksz);
+/* Maps the whole image file =name, created with =size bytes if =size is not zero */
+void * fs_mmap_open(const char *name, uint64_t size) {
+	off_t len;
+	struct memimage *m;
+	int fd = fs_file_lock(name, size);
 
-	fs_read_data(sb, parentblk, (void*) inode);
-	nodeinfoblk = inode->meta;
-	if(inode->mode == IMCHILD) {
-		struct inode *parentnode = malloc(sb->blksz);
-		fs_read_data(sb, inode->parent, parentnode);
-		nodeinfoblk = parentnode->meta;
-		free(parentnode);
+	if(fd == -1) {
+		return NULL;
 	}
-  	fs_read_data(sb, nodeinfoblk, (void*) nodeinfo);	
 
-	inode->links[linkindex] = newlink;
-	nodeinfo->size++;
+	m = malloc(sizeof *m);
+	m->fd   = fd;
+	m->mem  = NULL;
+	m->size = ((len = lseek(fd, 0, SEEK_END)) > 0) ? len : 0;
 
-	fs_write_data(sb, parentblk, (void*) inode);
-	fs_write_data(sb, nodeinfoblk, (void*) nodeinfo);
+	if(m->size > 0 && (m->mem = mmap(NULL, m->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		free(m);
+		return NULL;
+	}
+	pthread_rwlock_init(&m->lock, NULL);
 
-	free(inode);
+	return m;
 }
 
-void fs_remove_link(struct superblock *sb, uint64_t parentblk, int linkindex) {
-	uint64_t nodeinfoblk;
-	struct inode *inode = malloc(sb->blksz);
-	struct nodeinfo *nodeinfo = malloc(sb->blksz);
+int fs_mmap_flush(void *image) {
+	struct memimage *m = image;
 
-	fs_read_data(sb, parentblk, (void*) inode);
-	nodeinfoblk = inode->meta;
-	if(inode->mode == IMCHILD) {
-		struct inode *parentnode = malloc(sb->blksz);
-		fs_read_data(sb, inode->parent, (void*) parentnode);
-		nodeinfoblk = parentnode->meta;
-		free(parentnode);
-	}
-	fs_read_data(sb, nodeinfoblk, (void*) nodeinfo);
+	return (m->size > 0) ? msync(m->mem, m->size, MS_SYNC) : 0;
+}
 
-	inode->links[linkindex] = 0;
-	nodeinfo->size--;
+int fs_mmap_resize(void *image, uint64_t size) {
+	char *mem;
+	struct memimage *m = image;
 
-	/* Delete inode for links that are completely unused */
-	if(inode->mode == IMCHILD && inode->next == 0 && !fs_has_links(sb, parentblk)) {
-		fs_put_block(sb, parentblk);
-		struct inode *previousnode = malloc(sb->blksz);
-		fs_read_data(sb, inode->meta, (void*) previousnode);
-		previousnode->next = 0;
-		fs_write_data(sb, inode->meta, (void*) previousnode);
-		free(previousnode);
-	}
-	else {
-		fs_write_data(sb, parentblk, (void*) inode);
+	if(size <= m->size) {
+		return 0;
 	}
-	fs_write_data(sb, nodeinfoblk, (void*) nodeinfo);
-
-	free(inode);
-}
-
-/* If inode has any links, return 1, else return 0*/
-int fs_has_links(struct superblock *sb, uint64_t thisblk) {
-	int ret;
-	struct inode *inode = malloc(sb->blksz);
 
-	fs_read_data(sb, thisblk, (void*) inode);
+	if(fs_file_extend(m->fd, size) == -1) {
+		return -1;
+	}
 
-	for(int i = 0; i < LINK_MAX; i++) {
-		ret = inode->links[i] ? 1 : 0;
+	pthread_rwlock_wrlock(&m->lock);
+	mem = (m->size > 0) ? mremap(m->mem, m->size, size, MREMAP_MAYMOVE)
+	                    : mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, m->fd, 0);
+	if(mem != MAP_FAILED) {
+		m->mem  = mem;
+		m->size = size;
 	}
+	pthread_rwlock_unlock(&m->lock);
 
-	free(inode);
+	return (mem != MAP_FAILED) ? 0 : -1;
+}
 
-	return ret;
+int fs_mmap_fd(void *image) {
+	return ((struct memimage*) image)->fd;
 }
 
-/************************
-* FILE SYSTEM FUNCTIONS *
-************************/
+void fs_mmap_close(void *image) {
+	struct memimage *m = image;
 
-struct superblock * fs_format(const char *fname, uint64_t blocksize) {
-	if(blocksize < MIN_BLOCK_SIZE) {
-		errno = EINVAL;
-		return NULL;
-	}
+	if(m->size > 0) munmap(m->mem, m->size);
+	flock(m->fd, LOCK_UN);
+	close(m->fd);
+	pthread_rwlock_destroy(&m->lock);
+	free(m);
+}
 
-	struct superblock *sb     = malloc(sizeof *sb);
-	struct inode *rootnode    = malloc(blocksize);
-	struct nodeinfo *rootinfo = malloc(blocksize);
-	struct freepage *freepage = malloc(blocksize);
+/* Allocates a RAM disk of =size bytes. There is nothing to open without a size. */
+void * fs_ram_open(const char *name, uint64_t size) {
+	struct memimage *m;
 
-	sb->magic    = 0xdcc605f5;
-	sb->blks     = get_file_size(fname) / blocksize;
-	sb->blksz    = blocksize;
-	sb->freeblks = sb->blks - 3;
-	sb->freelist = 3;
-	sb->root     = 1;
-	sb->fd       = open(fname, O_RDWR, 0666);
+	(void) name;
 
-	rootnode->mode   = IMDIR;
-	rootnode->parent = 1;
-	rootnode->meta   = 2;
-	rootnode->next   = 0;
-	for(int i = 0; i < LINK_MAX; i++) {
-		rootnode->links[i] = 0;
+	if(size == 0) {
+		errno = ENOENT;
+		return NULL;
 	}
 
-	rootinfo->size = 0;
-	strcpy(rootinfo->name, "/");
-
-	if(flock(sb->fd, LOCK_EX | LOCK_NB) == -1){
-		errno = EBUSY;
+	m = malloc(sizeof *m);
+	if(m == NULL || (m->mem = calloc(1, size)) == NULL) { /* Untouched pages cost nothing */
+		free(m);
+		errno = ENOMEM;
 		return NULL;
 	}
+	m->size = size;
+	m->fd   = -1;
+	pthread_rwlock_init(&m->lock, NULL);
 
-	fs_write_data(sb, 0, (void*) sb);
-	fs_write_data(sb, 1, (void*) rootnode);
-	fs_write_data(sb, 2, (void*) rootinfo);
+	return m;
+}
 
-	for(uint64_t i = 3; i < sb->blks; i++) {
-		if(i + 1 == sb->blks) {
-			freepage->next = 0;
-		}
-		else {
-			freepage->next = i + 1;
-		}
+int fs_ram_flush(void *image) {
+	(void) image;
 
-		freepage->count = 0;
-		fs_write_data(sb, i, (void*) freepage);
-	}
+	return 0;
+}
 
-	free(rootnode);
-	free(rootinfo);
-	free(freepage);
+int fs_ram_resize(void *image, uint64_t size) {
+	char *mem;
+	struct memimage *m = image;
 
-	if(sb->blks < MIN_BLOCK_COUNT) {
-		close(sb->fd);
-		free(sb);
-		errno = ENOSPC;
-		return NULL;
+	if(size <= m->size) {
+		return 0;
 	}
 
-	return sb;
-}
+	pthread_rwlock_wrlock(&m->lock);
+	if((mem = realloc(m->mem, size)) != NULL) {
+		memset(mem + m->size, 0, size - m->size);
+		m->mem  = mem;
+		m->size = size;
+	}
+	pthread_rwlock_unlock(&m->lock);
+
+	if(mem == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return 0;
+}
+
+void fs_ram_close(void *image) {
+	struct memimage *m = image;
+
+	pthread_rwlock_destroy(&m->lock);
+	free(m->mem);
+	free(m);
+}
+
+const struct backend fs_file_backend = {
+	"file", fs_file_open, fs_file_readv, fs_file_writev, fs_file_flush, fs_file_size, fs_file_resize,
+	fs_file_fd, fs_file_close, fs_file_discard
+};
+
+const struct backend fs_mmap_backend = {
+	"mmap", fs_mmap_open, fs_mem_readv, fs_mem_writev, fs_mmap_flush, fs_mem_size, fs_mmap_resize,
+	fs_mmap_fd, fs_mmap_close, fs_mem_discard
+};
+
+const struct backend fs_ram_backend = {
+	"ram", fs_ram_open, fs_mem_readv, fs_mem_writev, fs_ram_flush, fs_mem_size, fs_ram_resize,
+	NULL, fs_ram_close, fs_mem_discard
+};
+
+/************************
+*       UTILITIES       * 
+************************/
+
+int fs_has_links(struct superblock *sb, uint64_t thisblk);
+
+struct dir {
+	uint64_t dirnode;   /* Dir inode corresponding block            */
+	uint64_t nodeblock; /* The requested inode block, if it exists  */
+	char *nodename;     /* Name of the requested inode, file or dir */
+};
+
+struct link {
+	uint64_t inode; /* inode block that contains the link        */
+	int index;      /* Index of the link in inode array of links */
+};
+
+struct readop {
+	char *buf;       /* Destination of the bytes read            */
+	uint64_t offset; /* File offset of buf[0]                    */
+	size_t count;    /* Number of bytes to read                  */
+	char *scratch;   /* Block buffer for partially read blocks   */
+};
+
+struct delayed {
+	uint64_t inode;       /* Inode of the file, whose links are all zero until flushed */
+	char *data;           /* File contents                            */
+	size_t cnt;           /* File size                                */
+	uint64_t reserved;    /* Free blocks set aside for the flush      */
+	struct delayed *next;
+};
+
+struct batch {
+	uint64_t *blocks; /* Blocks freed so far             */
+	uint64_t count;   /* Blocks in =blocks               */
+	uint64_t max;     /* Room in =blocks before it grows */
+};
+
+struct writeop {
+	char *buf;       /* Bytes to write                           */
+	uint64_t offset; /* File offset of buf[0]                    */
+	size_t count;    /* Number of bytes to write                 */
+	uint64_t size;   /* File size after the write                */
+	uint64_t pending; /* Blocks the write may still allocate     */
+	int64_t stored;  /* Change in the number of data blocks      */
+	char *scratch;   /* Block buffer for the new content         */
+};
+
+struct pool {
+	pthread_mutex_t lock;
+	pthread_cond_t freed;
+	size_t align;           /* Alignment O_DIRECT transfers need */
+	int count;              /* Buffers in =free                  */
+	char *free[POOL_MAX];
+	char *mem;              /* POOL_MAX aligned blocks           */
+};
+
+struct viewop {
+	struct view *views; /* Views to fill                          */
+	int n, max;         /* Views filled and available             */
+	uint64_t offset;    /* File offset of the first viewed byte   */
+	size_t count;       /* Number of bytes to view                */
+	uint64_t tail;      /* Packed tail of the file, zero if none  */
+	uint64_t last;      /* Logical block the packed tail stands for */
+};
+
+struct mapop {
+	uint64_t first;   /* Logical block stored in blocks[0]        */
+	uint64_t *blocks; /* Blocks holding the walked logical blocks */
+};
+
+struct exportop {
+	int hostfd;      /* File the contents go to                  */
+	int stream;      /* Nonzero if =hostfd cannot seek           */
+	uint64_t size;   /* File size                                */
+	uint64_t first;  /* First logical block of the pending run   */
+	uint64_t blk;    /* Block holding it                         */
+	uint64_t count;  /* Blocks in the pending run                */
+	char *scratch;   /* Block buffer for copies and holes        */
+};
+
+struct stripeop {
+	struct superblock *sb;
+	int member;             /* Image whose blocks this thread moves       */
+	int write;              /* Nonzero to write the blocks, zero to read  */
+	const uint64_t *blocks; /* Blocks of the transfer, zero for holes     */
+	uint64_t count;
+	char *buf;              /* Block i of the transfer is at buf[i*blksz] */
+	int err;                /* errno of the first failed call, or zero    */
+};
+
+struct stream {
+	uint64_t inode;  /* File being read, zero for an unused slot */
+	uint64_t next;   /* Logical block a sequential read starts at */
+	uint64_t ahead;  /* Logical block the readahead has reached   */
+	uint64_t window; /* Blocks to keep ahead of the reader        */
+};
+
+struct run {
+	uint64_t blk;   /* First block of the run */
+	uint64_t count; /* Contiguous blocks      */
+};
+
+struct cache {
+	pthread_mutex_t lock;
+	pthread_cond_t work;    /* Runs were queued for the prefetch thread    */
+	pthread_cond_t loaded;  /* The prefetch thread filled some slots       */
+	pthread_t prefetcher;
+	int started, stop;
+	uint64_t keys[CACHE_MAX]; /* Block held by each slot                   */
+	char state[CACHE_MAX];
+	char ref[CACHE_MAX];      /* Clock reference bits                      */
+	int pins[CACHE_MAX];      /* Views of each slot, pinned slots stay put */
+	int pinned;               /* Slots with views                          */
+	int chain[CACHE_MAX];     /* Next slot in the same hash bucket, or -1  */
+	int buckets[CACHE_MAX];
+	int hand;
+	char *data;               /* CACHE_MAX blocks                          */
+	char *zero;               /* A block of zeros, viewed for holes        */
+	struct run queue[RA_QUEUE];
+	int qhead, qcount;
+	struct stream streams[RA_STREAMS]; /* Only used by the reading thread */
+	int nextstream;
+};
+
+/* Called for each block of a file walk with the logical block index and the block holding it
+ * (zero for holes). A nonzero return value stops the walk. */
+typedef int (*fs_blockfn)(struct superblock *sb, uint64_t index, uint64_t blk, void *arg);
+
+struct walkdir {
+	uint64_t blk; /* First inode of a directory left to walk */
+	char *path;   /* Its path, NULL unless the walk keeps them */
+};
+
+struct release {
+	int kind;       /* RELEASE_*                              */
+	int depth;      /* Levels of the tree under =blk           */
+	uint64_t blk;
+	uint64_t count; /* Data blocks mapped by the tree under =blk */
+};
+
+struct walker {
+	struct walkop *op;
+	struct walkdir *dirs;      /* Directories queued by this thread, stolen from the front */
+	size_t head, tail, max;
+	struct inode *inode;       /* Block buffers of this thread, the slab is not shared */
+	struct inode *entry;
+	struct nodeinfo *nodeinfo;
+	uint64_t *ptrs[3];         /* One per level of indirect blocks */
+	uint64_t *buckets;
+	struct hashpage *page;
+	struct fsdu du;            /* fs_du: totals of the entries seen     */
+	char **found;              /* fs_find: paths of the matching entries */
+	size_t nfound, maxfound;
+	struct batch freed;        /* fs_rmtree: blocks nothing else references */
+	struct release *releases;  /* fs_rmtree: shared blocks, released by the calling thread */
+	size_t nreleases, maxreleases;
+};
+
+/* Called on a walk thread for each entry =blk of a walked directory, with its inode, nodeinfo and
+ * path (NULL unless the walk keeps paths). Directories are walked into if it returns nonzero. */
+typedef int (*fs_entryfn)(struct walker *w, uint64_t blk, struct inode *inode, struct nodeinfo *nodeinfo,
+                          const char *path);
+
+struct walkop {
+	struct superblock *sb;
+	fs_entryfn fn;
+	int paths;             /* Nonzero to build the path of each entry          */
+	int freeing;           /* Nonzero to free the inodes of walked directories */
+	const char *pattern;   /* fs_find: names to look for                       */
+	pthread_mutex_t lock;  /* Guards the queues of every walker and =pending   */
+	pthread_cond_t work;   /* A directory was queued, or the walk is over      */
+	uint64_t pending;      /* Directories queued or being walked               */
+	struct walker walkers[WALK_THREADS];
+};
+
+/* Returns a block-sized buffer, reusing one given back with fs_slab_put when there is one. Buffers
+ * are only freed by fs_close, so a filesystem in use stops allocating once it has enough. */
+void * fs_slab_get(struct superblock *sb) {
+	void *buf = sb->slab;
+
+	if(buf == NULL) {
+		return malloc(sb->blksz);
+	}
+
+	sb->slab = *(void**) buf;
+
+	return buf;
+}
+
+/* Same as fs_slab_get, with the buffer filled with zeros */
+void * fs_slab_zero(struct superblock *sb) {
+	return memset(fs_slab_get(sb), 0, sb->blksz);
+}
+
+/* Gives back =buf, taken with fs_slab_get. Free buffers are linked through their first word. */
+void fs_slab_put(struct superblock *sb, void *buf) {
+	if(buf == NULL) return;
+
+	*(void**) buf = sb->slab;
+	sb->slab = buf;
+}
+
+void fs_slab_free(struct superblock *sb) {
+	void *next;
+
+	for(void *buf = sb->slab; buf != NULL; buf = next) {
+		next = *(void**) buf;
+		free(buf);
+	}
+	sb->slab = NULL;
+}
+
+/* Returns the alignment O_DIRECT transfers on =fd need: the logical block size of a block
+ * device, or what the filesystem holding an image file reports. Returns zero if the filesystem
+ * reports that it does not support O_DIRECT, and the sector size if it reports nothing. */
+size_t fs_direct_align(int fd) {
+	int ssz;
+	struct stat st;
+
+	if(fstat(fd, &st) == 0 && S_ISBLK(st.st_mode) && ioctl(fd, BLKSSZGET, &ssz) == 0) {
+		return ssz;
+	}
+
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+
+	if(statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN)) {
+		if(stx.stx_dio_offset_align == 0) return 0; /* Both are zero without O_DIRECT */
+		return (stx.stx_dio_mem_align > stx.stx_dio_offset_align) ? stx.stx_dio_mem_align
+		                                                           : stx.stx_dio_offset_align;
+	}
+#endif
+
+	return 512; /* Sector size, what most devices need */
+}
+
+/* Sets up the pool of buffers aligned to =align used for all transfers of an O_DIRECT image.
+ * Returns zero on success or a negative value if there is not enough memory. */
+int fs_pool_init(struct superblock *sb, size_t align) {
+	struct pool *p = malloc(sizeof *p);
+
+	if(p == NULL || posix_memalign((void**) &p->mem, align, POOL_MAX * sb->blksz)) {
+		free(p);
+		return -1;
+	}
+
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->freed, NULL);
+	p->align = align;
+	p->count = POOL_MAX;
+	for(int i = 0; i < POOL_MAX; i++) {
+		p->free[i] = p->mem + i * sb->blksz;
+	}
+
+	sb->pool = p;
+
+	return 0;
+}
+
+void fs_pool_free(struct superblock *sb) {
+	struct pool *p = sb->pool;
+
+	if(p == NULL) return;
+
+	pthread_mutex_destroy(&p->lock);
+	pthread_cond_destroy(&p->freed);
+	free(p->mem);
+	free(p);
+	sb->pool = NULL;
+}
+
+/* Takes an aligned block buffer from the pool, waiting for one if all are in use */
+char * fs_pool_get(struct superblock *sb) {
+	char *buf;
+	struct pool *p = sb->pool;
+
+	pthread_mutex_lock(&p->lock);
+	while(p->count == 0) {
+		pthread_cond_wait(&p->freed, &p->lock);
+	}
+	buf = p->free[--p->count];
+	pthread_mutex_unlock(&p->lock);
+
+	return buf;
+}
+
+void fs_pool_put(struct superblock *sb, char *buf) {
+	struct pool *p = sb->pool;
+
+	pthread_mutex_lock(&p->lock);
+	p->free[p->count++] = buf;
+	pthread_cond_signal(&p->freed);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/* Returns which image of a striped filesystem holds block =pos and sets =off to the offset of the
+ * block in it. A single image holds every block at its own offset. */
+int fs_image_member(struct superblock *sb, uint64_t pos, off_t *off) {
+	uint64_t chunk;
+
+	if(sb->stripe == 0) {
+		*off = pos * sb->blksz;
+		return 0;
+	}
+
+	chunk = pos / sb->stripe;
+	*off  = ((chunk / sb->members) * sb->stripe + pos % sb->stripe) * sb->blksz;
+
+	return chunk % sb->members;
+}
+
+/* Returns the host descriptor of the image holding block =pos, setting =off as fs_image_member
+ * does, or -1 if its backend has none */
+int fs_image_fd(struct superblock *sb, uint64_t pos, off_t *off) {
+	int member = fs_image_member(sb, pos, off);
+
+	return (sb->backend->fd != NULL) ? sb->backend->fd(sb->images[member]) : -1;
+}
+
+/* Returns how many of the =count blocks starting at =pos follow each other in the same image */
+uint64_t fs_image_span(struct superblock *sb, uint64_t pos, uint64_t count) {
+	uint64_t left;
+
+	if(sb->stripe == 0) return count;
+
+	left = sb->stripe - pos % sb->stripe; /* Up to the end of the chunk */
+
+	return (count < left) ? count : left;
+}
+
+/* Returns the number of images holding the blocks of =sb */
+int fs_image_count(struct superblock *sb) {
+	return (sb->stripe != 0) ? sb->members : 1;
+}
+
+/* Returns how many blocks of a filesystem of =blks blocks image =member holds */
+uint64_t fs_image_blocks(struct superblock *sb, int member, uint64_t blks) {
+	uint64_t round, rest;
+
+	if(sb->stripe == 0) return blks;
+
+	round = sb->stripe * sb->members; /* One chunk of each image */
+	rest  = blks % round;
+	rest  = (rest > member * sb->stripe) ? rest - member * sb->stripe : 0;
+
+	return (blks / round) * sb->stripe + ((rest < sb->stripe) ? rest : sb->stripe);
+}
+
+/* Moves the =count bytes at =buf to (=write nonzero) or from byte =off of image =member in one
+ * backend call. Returns what the backend returned. */
+ssize_t fs_image_rw(struct superblock *sb, int member, void *buf, size_t count, off_t off, int write) {
+	struct iovec iov;
+
+	iov.iov_base = buf;
+	iov.iov_len  = count;
+
+	return write ? sb->backend->writev(sb->images[member], &iov, 1, off)
+	             : sb->backend->readv(sb->images[member], &iov, 1, off);
+}
+
+/* Reads block =pos of the image into =data, through a pooled buffer for O_DIRECT images. Returns
+ * what pread returned. */
+ssize_t fs_read_image(struct superblock *sb, uint64_t pos, void *data) {
+	ssize_t ret;
+	off_t off;
+	char *buf;
+	int member = fs_image_member(sb, pos, &off);
+
+	if(sb->pool == NULL) {
+		return fs_image_rw(sb, member, data, sb->blksz, off, 0);
+	}
+
+	buf = fs_pool_get(sb);
+	ret = fs_image_rw(sb, member, buf, sb->blksz, off, 0);
+	memcpy(data, buf, sb->blksz);
+	fs_pool_put(sb, buf);
+
+	return ret;
+}
+
+/* Writes =data to block =pos of the image, through a pooled buffer for O_DIRECT images */
+void fs_write_image(struct superblock *sb, uint64_t pos, const void *data) {
+	off_t off;
+	char *buf;
+	int member = fs_image_member(sb, pos, &off);
+
+	if(sb->pool == NULL) {
+		fs_image_rw(sb, member, (void*) data, sb->blksz, off, 1);
+		return;
+	}
+
+	buf = fs_pool_get(sb);
+	memcpy(buf, data, sb->blksz);
+	fs_image_rw(sb, member, buf, sb->blksz, off, 1);
+	fs_pool_put(sb, buf);
+}
+
+/* Reads the =count blocks starting at =pos into =data, with one read for each stretch of them
+ * that lies in a single image. Returns the number of bytes read up to the first short read, or -1
+ * if nothing could be read. */
+ssize_t fs_read_run(struct superblock *sb, uint64_t pos, void *data, uint64_t count) {
+	uint64_t done = 0, n;
+	ssize_t got;
+	off_t off;
+	int member;
+
+	while(done < count) {
+		n      = fs_image_span(sb, pos + done, count - done);
+		member = fs_image_member(sb, pos + done, &off);
+		got    = fs_image_rw(sb, member, (char*) data + done * sb->blksz, n * sb->blksz, off, 0);
+
+		if(got == -1) return (done > 0) ? (ssize_t) (done * sb->blksz) : -1;
+		if((uint64_t) got < n * sb->blksz) return done * sb->blksz + got;
+		done += n;
+	}
+
+	return count * sb->blksz;
+}
+
+/* Moves the =n buffers in =iov to (=write nonzero) or from byte =off of image =member, calling the
+ * backend again until every byte is moved. Returns zero or -1. */
+int fs_image_iov(struct superblock *sb, int member, struct iovec *iov, int n, off_t off, int write) {
+	ssize_t got;
+
+	while(n > 0) {
+		got = write ? sb->backend->writev(sb->images[member], iov, n, off)
+		            : sb->backend->readv(sb->images[member], iov, n, off);
+		if(got == -1 && errno == EINTR) continue;
+		if(got <= 0) {
+			if(got == 0) errno = EIO; /* The image ends too soon */
+			return -1;
+		}
+
+		off += got;
+		for(; n > 0 && (size_t) got >= iov->iov_len; iov++, n--) {
+			got -= iov->iov_len;
+		}
+		if(n > 0) {
+			iov->iov_base = (char*) iov->iov_base + got;
+			iov->iov_len -= got;
+		}
+	}
+
+	return 0;
+}
+
+/* Moves the blocks of the stripeop in =arg that its image holds. Blocks that follow each other in
+ * the image are gathered into one call, and into one buffer if they also do in memory. */
+void * fs_stripe_member(void *arg) {
+	struct stripeop *op = arg;
+	struct superblock *sb = op->sb;
+	struct iovec iov[STRIPE_IOV];
+	off_t start = 0, next = 0, off = 0;
+	char *at;
+	int n = 0;
+
+	for(uint64_t i = 0; i <= op->count; i++) {
+		if(i < op->count && (op->blocks[i] == 0 || fs_image_member(sb, op->blocks[i], &off) != op->member)) {
+			continue;
+		}
+
+		at = op->buf + i * sb->blksz;
+
+		if(i < op->count && n > 0 && off == next) {
+			if((char*) iov[n - 1].iov_base + iov[n - 1].iov_len == at) {
+				iov[n - 1].iov_len += sb->blksz;
+				next += sb->blksz;
+				continue;
+			}
+			if(n < STRIPE_IOV) {
+				iov[n].iov_base  = at;
+				iov[n++].iov_len = sb->blksz;
+				next += sb->blksz;
+				continue;
+			}
+		}
+
+		if(n > 0 && fs_image_iov(sb, op->member, iov, n, start, op->write) == -1 && op->err == 0) {
+			op->err = errno;
+		}
+		if(i == op->count) break;
+
+		start = off;
+		next  = off + sb->blksz;
+		n     = 0;
+		iov[n].iov_base  = at;
+		iov[n++].iov_len = sb->blksz;
+	}
+
+	return NULL;
+}
+
+/* Sets up the block cache of =sb. Without memory for it, blocks are read from the image */
+void fs_cache_init(struct superblock *sb) {
+	struct cache *c = calloc(1, sizeof *c);
+
+	sb->cache = c;
+	if(c == NULL) return;
+
+	c->data = malloc(CACHE_MAX * sb->blksz);
+	c->zero = calloc(1, sb->blksz);
+	if(c->data == NULL || c->zero == NULL) {
+		free(c->data);
+		free(c->zero);
+		free(c);
+		sb->cache = NULL;
+		return;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->work, NULL);
+	pthread_cond_init(&c->loaded, NULL);
+
+	for(int i = 0; i < CACHE_MAX; i++) {
+		c->buckets[i] = -1;
+		c->chain[i] = -1;
+	}
+}
+
+/* Stops the prefetch thread and frees the block cache */
+void fs_cache_free(struct superblock *sb) {
+	struct cache *c = sb->cache;
+
+	if(c == NULL) return;
+
+	if(c->started) {
+		pthread_mutex_lock(&c->lock);
+		c->stop = 1;
+		pthread_cond_signal(&c->work);
+		pthread_mutex_unlock(&c->lock);
+		pthread_join(c->prefetcher, NULL);
+	}
+
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->work);
+	pthread_cond_destroy(&c->loaded);
+	free(c->data);
+	free(c->zero);
+	free(c);
+	sb->cache = NULL;
+}
+
+/* Returns the cache slot holding block =blk, or -1. Called with the cache locked. */
+int fs_cache_find(struct cache *c, uint64_t blk) {
+	int slot;
+
+	for(slot = c->buckets[blk % CACHE_MAX]; slot != -1 && c->keys[slot] != blk; slot = c->chain[slot]);
+
+	return slot;
+}
+
+/* Takes a cache slot for block =blk, evicting the least recently used one the clock hand finds.
+ * Returns the slot, or -1 if every slot is being loaded. Called with the cache locked. */
+int fs_cache_slot(struct cache *c, uint64_t blk) {
+	int slot, *prev;
+
+	for(int i = 0; ; i++) {
+		if(i == 2 * CACHE_MAX) return -1;
+
+		slot = c->hand;
+		c->hand = (c->hand + 1) % CACHE_MAX;
+
+		if(c->state[slot] == SLOT_LOADING || c->pins[slot] > 0) continue;
+		if(c->state[slot] == SLOT_VALID && c->ref[slot]) {
+			c->ref[slot] = 0; /* Second chance */
+			continue;
+		}
+		break;
+	}
+
+	if(c->state[slot] != SLOT_FREE) { /* Unhash the evicted block */
+		for(prev = &c->buckets[c->keys[slot] % CACHE_MAX]; *prev != slot; prev = &c->chain[*prev]);
+		*prev = c->chain[slot];
+	}
+
+	c->keys[slot]  = blk;
+	c->state[slot] = SLOT_VALID;
+	c->ref[slot]   = 1;
+	c->chain[slot] = c->buckets[blk % CACHE_MAX];
+	c->buckets[blk % CACHE_MAX] = slot;
+
+	return slot;
+}
+
+/* Forgets the cached copy in =slot. Called with the cache locked. */
+void fs_cache_drop(struct cache *c, int slot) {
+	int *prev;
+
+	for(prev = &c->buckets[c->keys[slot] % CACHE_MAX]; *prev != slot; prev = &c->chain[*prev]);
+	*prev = c->chain[slot];
+	c->state[slot] = SLOT_FREE;
+}
+
+/* Puts the =count blocks at =data, starting with block =blk, in the cache. Blocks not yet cached
+ * are only added if =add is nonzero. */
+void fs_cache_store(struct superblock *sb, uint64_t blk, const char *data, uint64_t count, int add) {
+	int slot;
+	struct cache *c = sb->cache;
+
+	pthread_mutex_lock(&c->lock);
+
+	for(uint64_t i = 0; i < count; i++) {
+		slot = fs_cache_find(c, blk + i);
+		if(slot != -1 && c->pins[slot] > 0) { /* Views keep the old contents */
+			fs_cache_drop(c, slot);
+			c->state[slot] = SLOT_DETACHED;
+			slot = -1;
+		}
+		if(slot == -1 && add) slot = fs_cache_slot(c, blk + i);
+		if(slot == -1) continue;
+
+		if(c->state[slot] == SLOT_LOADING) { /* Newer than what the prefetch thread reads */
+			c->state[slot] = SLOT_VALID;
+			pthread_cond_broadcast(&c->loaded);
+		}
+		memcpy(c->data + slot * sb->blksz, data + i * sb->blksz, sb->blksz);
+	}
+
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* Forgets the cached copies of the =count blocks starting at =blk, which were written behind the
+ * back of the cache. Blocks being prefetched are waited for, they may have read the old data. */
+void fs_cache_forget(struct superblock *sb, uint64_t blk, uint64_t count) {
+	int slot;
+	struct cache *c = sb->cache;
+
+	pthread_mutex_lock(&c->lock);
+
+	for(uint64_t i = 0; i < count; i++) {
+		while((slot = fs_cache_find(c, blk + i)) != -1 && c->state[slot] == SLOT_LOADING) {
+			pthread_cond_wait(&c->loaded, &c->lock);
+		}
+		if(slot == -1) continue;
+
+		fs_cache_drop(c, slot);
+		if(c->pins[slot] > 0) c->state[slot] = SLOT_DETACHED; /* Views keep the old contents */
+	}
+
+	pthread_mutex_unlock(&c->lock);
+}
+
+/* Reads the runs queued by fs_prefetch into the cache, one read per run */
+void * fs_prefetcher(void *arg) {
+	struct superblock *sb = arg;
+	struct cache *c = sb->cache;
+	struct run run;
+	int slots[RA_MAX], any;
+	ssize_t got;
+	char *buf;
+
+	/* Runs are read straight into an aligned buffer of their own, O_DIRECT or not */
+	if(posix_memalign((void**) &buf, sb->pool ? sb->pool->align : sizeof(void*), RA_MAX * sb->blksz)) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&c->lock);
+
+	while(!c->stop) {
+		if(c->qcount == 0) {
+			pthread_cond_wait(&c->work, &c->lock);
+			continue;
+		}
+
+		run = c->queue[c->qhead];
+		c->qhead = (c->qhead + 1) % RA_QUEUE;
+		c->qcount--;
+
+		any = 0;
+		for(uint64_t i = 0; i < run.count; i++) {
+			slots[i] = -1;
+			if(fs_cache_find(c, run.blk + i) == -1 && (slots[i] = fs_cache_slot(c, run.blk + i)) != -1) {
+				c->state[slots[i]] = SLOT_LOADING;
+				any = 1;
+			}
+		}
+		if(!any) continue;
+
+		pthread_mutex_unlock(&c->lock);
+		got = fs_read_run(sb, run.blk, buf, run.count);
+		pthread_mutex_lock(&c->lock);
+
+		for(uint64_t i = 0; i < run.count; i++) {
+			/* A slot written meanwhile already holds newer data */
+			if(slots[i] == -1 || c->state[slots[i]] != SLOT_LOADING) continue;
+
+			if(got >= 0 && (uint64_t) got >= (i + 1) * sb->blksz) {
+				memcpy(c->data + slots[i] * sb->blksz, buf + i * sb->blksz, sb->blksz);
+				c->state[slots[i]] = SLOT_VALID;
+				c->ref[slots[i]] = 0; /* Evicted first if nobody reads it */
+			}
+			else {
+				fs_cache_drop(c, slots[i]);
+			}
+		}
+
+		pthread_cond_broadcast(&c->loaded);
+	}
+
+	pthread_mutex_unlock(&c->lock);
+	free(buf);
+
+	return NULL;
+}
+
+/* Queues the =count blocks in =blocks to be read into the cache in the background. Consecutive
+ * blocks are read together, holes (zero) are skipped. */
+void fs_prefetch(struct superblock *sb, const uint64_t *blocks, uint64_t count) {
+	struct run *run = NULL;
+	struct cache *c = sb->cache;
+
+	if(c == NULL) return;
+
+	pthread_mutex_lock(&c->lock);
+
+	if(!c->started) {
+		c->started = (pthread_create(&c->prefetcher, NULL, fs_prefetcher, sb) == 0);
+	}
+
+	for(uint64_t i = 0; i < count && c->started; i++) {
+		if(blocks[i] == 0) continue;
+
+		if(run != NULL && blocks[i] == run->blk + run->count && run->count < RA_MAX) {
+			run->count++;
+			continue;
+		}
+
+		if(c->qcount == RA_QUEUE) break; /* Readahead is only a hint */
+
+		run = &c->queue[(c->qhead + c->qcount++) % RA_QUEUE];
+		run->blk   = blocks[i];
+		run->count = 1;
+	}
+
+	pthread_cond_signal(&c->work);
+	pthread_mutex_unlock(&c->lock);
+}
+
+void fs_write_data(struct superblock *sb, uint64_t pos, void *data) {
+
+	/* DATA POSITIONS
+	* 0 - Superblock
+	* 1 - Root Inode
+	* 2 - Root Nodeinfo
+	* 3 - Freelist(Initial position)
+	*/
+
+	fs_write_image(sb, pos, data);
+	if(sb->cache != NULL) fs_cache_store(sb, pos, data, 1, 1); /* Write-through */
+}
+
+void fs_read_data(struct superblock *sb, uint64_t pos, void *data) {
+	int slot;
+	struct cache *c = sb->cache;
+
+	if(c == NULL) {
+		fs_read_image(sb, pos, data);
+		return;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	while((slot = fs_cache_find(c, pos)) != -1 && c->state[slot] == SLOT_LOADING) {
+		pthread_cond_wait(&c->loaded, &c->lock); /* Already on its way */
+	}
+	if(slot != -1) {
+		memcpy(data, c->data + slot * sb->blksz, sb->blksz);
+		c->ref[slot] = 1;
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	if(fs_read_image(sb, pos, data) == (ssize_t) sb->blksz) {
+		fs_cache_store(sb, pos, data, 1, 1);
+	}
+}
+
+/* Pins block =pos in the cache, reading it if needed, and returns its slot. Returns -1 if too many
+ * slots are pinned already. */
+int fs_cache_pin(struct superblock *sb, uint64_t pos) {
+	int slot;
+	char *block = fs_slab_get(sb);
+	struct cache *c = sb->cache;
+
+	pthread_mutex_lock(&c->lock);
+
+	for(int tries = 0; tries < 3; tries++) { /* The prefetch thread may evict it in between */
+		while((slot = fs_cache_find(c, pos)) != -1 && c->state[slot] == SLOT_LOADING) {
+			pthread_cond_wait(&c->loaded, &c->lock);
+		}
+		if(slot != -1 || c->pinned >= PIN_MAX) break;
+
+		pthread_mutex_unlock(&c->lock);
+		fs_read_data(sb, pos, block); /* Caches it */
+		pthread_mutex_lock(&c->lock);
+	}
+
+	if(slot != -1 && (c->pins[slot] > 0 || c->pinned < PIN_MAX)) {
+		if(c->pins[slot]++ == 0) c->pinned++;
+		c->ref[slot] = 1;
+	}
+	else {
+		slot = -1;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+	fs_slab_put(sb, block);
+
+	return slot;
+}
+
+/* Writes the =count blocks at =data to the run of blocks starting at =pos with a single write for
+ * each image it spans, or one block at a time through the pool for O_DIRECT images */
+void fs_write_run(struct superblock *sb, uint64_t pos, void *data, uint64_t count) {
+	off_t off;
+	int member;
+
+	if(sb->pool != NULL) {
+		for(uint64_t i = 0; i < count; i++) {
+			fs_write_image(sb, pos + i, (char*) data + i * sb->blksz);
+		}
+	}
+	else {
+		for(uint64_t done = 0, n; done < count; done += n) {
+			n      = fs_image_span(sb, pos + done, count - done);
+			member = fs_image_member(sb, pos + done, &off);
+			fs_image_rw(sb, member, (char*) data + done * sb->blksz, n * sb->blksz, off, 1);
+		}
+	}
+	if(sb->cache != NULL) fs_cache_store(sb, pos, data, count, 0);
+}
+
+/* Reads or writes (=write nonzero) the =count blocks in =blocks, block i at =buf + i * blksz, with
+ * a thread for each image of a striped filesystem so that all of them work at once. Holes (zero)
+ * read as zeros and are not written. Returns zero, or -1 if an image failed. */
+int fs_stripe_io(struct superblock *sb, const uint64_t *blocks, uint64_t count, char *buf, int write) {
+	int err = 0;
+	uint64_t j;
+	struct stripeop *ops = malloc(sb->members * sizeof *ops);
+	pthread_t *threads   = malloc(sb->members * sizeof *threads);
+	char *started        = calloc(sb->members, 1);
+
+	for(uint64_t m = 0; m < sb->members; m++) {
+		ops[m].sb     = sb;
+		ops[m].member = m;
+		ops[m].write  = write;
+		ops[m].blocks = blocks;
+		ops[m].count  = count;
+		ops[m].buf    = buf;
+		ops[m].err    = 0;
+	}
+
+	/* The calling thread takes the first image */
+	for(uint64_t m = 1; m < sb->members; m++) {
+		started[m] = (pthread_create(&threads[m], NULL, fs_stripe_member, &ops[m]) == 0);
+		if(!started[m]) fs_stripe_member(&ops[m]);
+	}
+	fs_stripe_member(&ops[0]);
+
+	for(uint64_t m = 0; m < sb->members; m++) {
+		if(started[m]) pthread_join(threads[m], NULL);
+		if(err == 0) err = ops[m].err;
+	}
+
+	for(uint64_t i = 0; i < count; i = j) {
+		j = i + 1;
+		if(blocks[i] == 0) {
+			if(!write) memset(buf + i * sb->blksz, 0, sb->blksz);
+			continue;
+		}
+
+		/* Reads come from the image, which is written through, writes update cached copies */
+		while(j < count && blocks[j] == blocks[j - 1] + 1) j++;
+		if(write && sb->cache != NULL) fs_cache_store(sb, blocks[i], buf + i * sb->blksz, j - i, 0);
+	}
+
+	free(ops);
+	free(threads);
+	free(started);
+
+	if(err != 0) {
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Writes the superblock to block 0, padding the rest of the block with zeros */
+void fs_write_super(struct superblock *sb) {
+	char *block = fs_slab_zero(sb);
+
+	memcpy(block, sb, SUPERBLOCK_DISK_SIZE);
+	((struct superblock*) block)->freeblks += sb->reserved; /* Reservations are not saved */
+	fs_write_data(sb, 0, (void*) block);
+
+	fs_slab_put(sb, block);
+}
+
+/* 64-bit FNV-1a hash of a whole block */
+uint64_t fs_hash_block(struct superblock *sb, const void *data) {
+	const unsigned char *bytes = data;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for(uint64_t i = 0; i < sb->blksz; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* Same as fs_table_get, reading the table into the block buffers =buckets and =page. Safe to call
+ * from several threads at once while the table does not change. */
+int fs_table_lookup(struct superblock *sb, uint64_t table, uint64_t key, uint64_t *value,
+                    uint64_t *buckets, struct hashpage *page) {
+	int found = 0;
+	uint64_t pageblk;
+
+	if(table == 0) {
+		return 0;
+	}
+
+	fs_read_data(sb, table, (void*) buckets);
+	pageblk = buckets[FS_BUCKET(key)];
+
+	while(pageblk != 0 && !found) {
+		fs_read_data(sb, pageblk, (void*) page);
+		for(int i = 0; i < page->count; i++) {
+			if(page->ents[i].key == key) {
+				*value = page->ents[i].value;
+				found = 1;
+				break;
+			}
+		}
+		pageblk = page->next;
+	}
+
+	return found;
+}
+
+/* Looks =key up in the table whose bucket block is =table. Returns 1 and sets =value if the key
+ * is found, else returns 0. */
+int fs_table_get(struct superblock *sb, uint64_t table, uint64_t key, uint64_t *value) {
+	int found;
+	uint64_t *buckets;
+	struct hashpage *page;
+
+	if(table == 0) {
+		return 0;
+	}
+
+	buckets = fs_slab_get(sb);
+	page    = fs_slab_get(sb);
+
+	found = fs_table_lookup(sb, table, key, value, buckets, page);
+
+	fs_slab_put(sb, buckets);
+	fs_slab_put(sb, page);
+
+	return found;
+}
+
+/* Inserts =key or updates its value in the table pointed to by =table, allocating the bucket block
+ * and hash pages when needed. Returns 0 on success, or -1 and sets errno to ENOSPC if a needed
+ * block could not be allocated. */
+int fs_table_set(struct superblock *sb, uint64_t *table, uint64_t key, uint64_t value) {
+	uint64_t bucket, pageblk, roomblk;
+	uint64_t *buckets = fs_slab_get(sb);
+	struct hashpage *page = fs_slab_get(sb);
+
+	bucket = FS_BUCKET(key);
+
+	if(*table == 0) {
+		if(sb->freeblks < 2) {
+			fs_slab_put(sb, buckets);
+			fs_slab_put(sb, page);
+			errno = ENOSPC;
+			return -1;
+		}
+		memset(buckets, 0, sb->blksz);
+		*table = fs_get_block(sb);
+		fs_write_data(sb, *table, (void*) buckets);
+		fs_write_super(sb);
+	}
+
+	fs_read_data(sb, *table, (void*) buckets);
+	pageblk = buckets[bucket];
+	roomblk = 0;
+
+	while(pageblk != 0) { /* Update the key in place if it already exists */
+		fs_read_data(sb, pageblk, (void*) page);
+		for(int i = 0; i < page->count; i++) {
+			if(page->ents[i].key == key) {
+				page->ents[i].value = value;
+				fs_write_data(sb, pageblk, (void*) page);
+				fs_slab_put(sb, buckets);
+				fs_slab_put(sb, page);
+				return 0;
+			}
+		}
+		if(roomblk == 0 && page->count < HASH_MAX) {
+			roomblk = pageblk;
+		}
+		pageblk = page->next;
+	}
+
+	if(roomblk != 0) {
+		fs_read_data(sb, roomblk, (void*) page);
+	}
+	else { /* Bucket is full, push a new page in front of it */
+		if(sb->freeblks == 0) {
+			fs_slab_put(sb, buckets);
+			fs_slab_put(sb, page);
+			errno = ENOSPC;
+			return -1;
+		}
+		roomblk = fs_get_block(sb);
+		page->next  = buckets[bucket];
+		page->count = 0;
+		buckets[bucket] = roomblk;
+		fs_write_data(sb, *table, (void*) buckets);
+	}
+
+	page->ents[page->count].key   = key;
+	page->ents[page->count].value = value;
+	page->count++;
+	fs_write_data(sb, roomblk, (void*) page);
+
+	fs_slab_put(sb, buckets);
+	fs_slab_put(sb, page);
+
+	return 0;
+}
+
+/* Removes =key from the table pointed to by =table. Pages left empty are freed, and so is the
+ * bucket block once the whole table is empty. */
+void fs_table_del(struct superblock *sb, uint64_t *table, uint64_t key) {
+	int empty;
+	uint64_t bucket, pageblk, prevblk;
+	uint64_t *buckets;
+	struct hashpage *page, *prevpage;
+
+	if(*table == 0) {
+		return;
+	}
+
+	buckets  = fs_slab_get(sb);
+	page     = fs_slab_get(sb);
+	prevpage = fs_slab_get(sb);
+
+	bucket = FS_BUCKET(key);
+	fs_read_data(sb, *table, (void*) buckets);
+	pageblk = buckets[bucket];
+	prevblk = 0;
+
+	while(pageblk != 0) {
+		fs_read_data(sb, pageblk, (void*) page);
+		for(int i = 0; i < page->count; i++) {
+			if(page->ents[i].key != key) continue;
+
+			page->ents[i] = page->ents[page->count - 1];
+			page->count--;
+
+			if(page->count != 0) {
+				fs_write_data(sb, pageblk, (void*) page);
+			}
+			else if(prevblk != 0) {
+				prevpage->next = page->next;
+				fs_write_data(sb, prevblk, (void*) prevpage);
+				fs_put_block(sb, pageblk);
+			}
+			else {
+				buckets[bucket] = page->next;
+				fs_put_block(sb, pageblk);
+
+				empty = 1;
+				for(int j = 0; j < BUCKET_MAX; j++) {
+					if(buckets[j] != 0) {
+						empty = 0;
+						break;
+					}
+				}
+
+				if(empty) {
+					fs_put_block(sb, *table);
+					*table = 0;
+					fs_write_super(sb);
+				}
+				else {
+					fs_write_data(sb, *table, (void*) buckets);
+				}
+			}
+
+			fs_slab_put(sb, buckets);
+			fs_slab_put(sb, page);
+			fs_slab_put(sb, prevpage);
+			return;
+		}
+
+		memcpy(prevpage, page, sb->blksz);
+		prevblk = pageblk;
+		pageblk = page->next;
+	}
+
+	fs_slab_put(sb, buckets);
+	fs_slab_put(sb, page);
+	fs_slab_put(sb, prevpage);
+}
+
+/* Adds a reference to =block. Returns 0 on success or -1 if the reference could not be recorded */
+int fs_ref_block(struct superblock *sb, uint64_t block) {
+	uint64_t refs = 1;
+
+	fs_table_get(sb, sb->refcounts, block, &refs);
+
+	return fs_table_set(sb, &sb->refcounts, block, refs + 1);
+}
+
+/* Drops a reference to =block and returns how many references are left */
+uint64_t fs_unref_block(struct superblock *sb, uint64_t block) {
+	uint64_t refs;
+
+	if(!fs_table_get(sb, sb->refcounts, block, &refs)) {
+		return 0;
+	}
+
+	if(refs == 2) {
+		fs_table_del(sb, &sb->refcounts, block);
+	}
+	else {
+		fs_table_set(sb, &sb->refcounts, block, refs - 1);
+	}
+
+	return refs - 1;
+}
+
+/* Releases a file data block, putting it back in the free list once no file references it */
+int fs_put_data(struct superblock *sb, uint64_t block) {
+	uint64_t hash, indexed;
+
+	if(fs_unref_block(sb, block) > 0) {
+		return 0;
+	}
+
+	if(sb->fingerprints != 0) { /* Drop the block from the fingerprint index */
+		char *data = fs_slab_get(sb);
+
+		fs_read_data(sb, block, (void*) data);
+		hash = fs_hash_block(sb, data);
+		if(fs_table_get(sb, sb->fingerprints, hash, &indexed) && indexed == block) {
+			fs_table_del(sb, &sb->fingerprints, hash);
+		}
+
+		fs_slab_put(sb, data);
+	}
+
+	return fs_put_block(sb, block);
+}
+
+/* Returns 1 if the block in =data only contains zeros. The words of each stride are or'ed without
+ * a branch so the compiler can vectorize the inner loop, and the result is only tested between
+ * strides, which still stops early on most data blocks. */
+int fs_zero_block(struct superblock *sb, const void *data) {
+	const unsigned char *bytes = data;
+	uint64_t word, acc = 0, i = 0;
+
+	while(i + ZERO_STRIDE * sizeof word <= sb->blksz) {
+		for(int k = 0; k < ZERO_STRIDE; k++, i += sizeof word) {
+			memcpy(&word, bytes + i, sizeof word);
+			acc |= word;
+		}
+
+		if(acc != 0) {
+			return 0;
+		}
+	}
+
+	for(; i < sb->blksz; i++) {
+		acc |= bytes[i];
+	}
+
+	return acc == 0;
+}
+
+/* Stores a block of file data and returns the block that holds it, or zero if the block only
+ * contains zeros and is left as a hole. With FS_DEDUP, a block whose content is already in the
+ * fingerprint index is shared instead of written again. =reserve is the number of free blocks the
+ * caller still needs after this one; dedup is skipped when the index could eat into them. */
+uint64_t fs_store_block(struct superblock *sb, const void *data, uint64_t reserve) {
+	int same;
+	uint64_t hash, blk;
+	char *stored;
+
+	if(fs_zero_block(sb, data)) {
+		return 0;
+	}
+
+	if(!(sb->flags & FS_DEDUP) || sb->freeblks < reserve + 3) {
+		blk = fs_get_block(sb);
+		fs_write_data(sb, blk, (void*) data);
+		return blk;
+	}
+
+	hash = fs_hash_block(sb, data);
+
+	if(fs_table_get(sb, sb->fingerprints, hash, &blk)) {
+		stored = fs_slab_get(sb);
+		fs_read_data(sb, blk, (void*) stored);
+		same = !memcmp(stored, data, sb->blksz);
+		fs_slab_put(sb, stored);
+
+		if(same && fs_ref_block(sb, blk) == 0) {
+			return blk;
+		}
+
+		/* Hash collision: store the block without indexing it */
+		blk = fs_get_block(sb);
+		fs_write_data(sb, blk, (void*) data);
+		return blk;
+	}
+
+	blk = fs_get_block(sb);
+	fs_write_data(sb, blk, (void*) data);
+	fs_table_set(sb, &sb->fingerprints, hash, blk);
+
+	return blk;
+}
+
+/* Returns the =index-th block of the =cnt bytes in =buf. The last block is copied to =scratch and
+ * padded with zeros if =buf ends before it does. */
+char * fs_file_block(struct superblock *sb, char *buf, size_t cnt, uint64_t index, char *scratch) {
+	uint64_t offset = index * sb->blksz;
+
+	if(offset + sb->blksz <= cnt) {
+		return buf + offset;
+	}
+
+	memset(scratch, 0, sb->blksz);
+	memcpy(scratch, buf + offset, cnt - offset);
+
+	return scratch;
+}
+
+/* Returns the number of bytes at the end of the =cnt bytes in =buf that FS_TAILPACK packs, or zero
+ * if the last block is stored whole: it is not partial, its tail is longer than TAIL_MAX or only
+ * holds zeros, which are left as a hole. */
+uint64_t fs_tail_len(struct superblock *sb, const char *buf, size_t cnt) {
+	uint64_t len = cnt % sb->blksz;
+
+	if(!(sb->flags & FS_TAILPACK) || len == 0 || len > TAIL_MAX) {
+		return 0;
+	}
+
+	for(size_t i = cnt - len; i < cnt; i++) {
+		if(buf[i] != 0) return len;
+	}
+
+	return 0;
+}
+
+/* Packs the =len bytes of a file tail at =data after the tails already in the tail block being
+ * filled, or at the start of a new one when they do not fit. Returns the byte address of the
+ * packed tail. The caller leaves a free block for it. */
+uint64_t fs_pack_tail(struct superblock *sb, const char *data, uint64_t len) {
+	uint64_t pos = sb->tailpos;
+	char *block = fs_slab_zero(sb);
+
+	/* Each file whose tail is in a tail block holds a reference to it */
+	if(pos != 0 && pos % sb->blksz + len <= sb->blksz && fs_ref_block(sb, pos / sb->blksz) == 0) {
+		fs_read_data(sb, pos / sb->blksz, (void*) block);
+	}
+	else {
+		pos = fs_get_block(sb) * sb->blksz;
+	}
+
+	memcpy(block + pos % sb->blksz, data, len);
+	fs_write_data(sb, pos / sb->blksz, (void*) block);
+
+	sb->tailpos = ((pos + len) % sb->blksz != 0) ? pos + len : 0;
+	fs_write_super(sb);
+
+	fs_slab_put(sb, block);
+
+	return pos;
+}
+
+/* Drops the reference of a file to the tail block holding its packed tail at byte =pos, freeing
+ * the block once no file's tail is left in it. The space of the tail is not reused meanwhile. */
+void fs_put_tail(struct superblock *sb, uint64_t pos) {
+	uint64_t blk = pos / sb->blksz;
+
+	if(pos == 0 || fs_unref_block(sb, blk) > 0) {
+		return;
+	}
+
+	if(sb->tailpos / sb->blksz == blk) { /* No longer filled */
+		sb->tailpos = 0;
+	}
+
+	fs_put_block(sb, blk);
+}
+
+/* Copies the part of the readop =op that falls in the packed tail at byte =tail of the image, which
+ * holds the file from byte =start to its end. The block map has a hole there. */
+void fs_read_tail(struct superblock *sb, struct readop *op, uint64_t tail, uint64_t start) {
+	uint64_t from = (op->offset > start) ? op->offset : start;
+
+	if(tail == 0 || op->offset + op->count <= from) {
+		return;
+	}
+
+	fs_read_data(sb, tail / sb->blksz, (void*) op->scratch);
+	memcpy(op->buf + (from - op->offset), op->scratch + tail % sb->blksz + (from - start),
+	       op->offset + op->count - from);
+}
+
+/* Number of data blocks mapped by a tree of =depth levels of indirect blocks */
+uint64_t fs_tree_span(struct superblock *sb, int depth) {
+	uint64_t span = 1;
+
+	for(int i = 0; i < depth; i++) {
+		span *= PTR_MAX;
+	}
+
+	return span;
+}
+
+/* Largest number of data blocks a file can have: the direct links plus the single, double and
+ * triple indirect trees */
+uint64_t fs_file_max(struct superblock *sb) {
+	return DIRECT_MAX + fs_tree_span(sb, 1) + fs_tree_span(sb, 2) + fs_tree_span(sb, 3);
+}
+
+/* Number of indirect blocks needed to map =count data blocks when none of them is a hole */
+uint64_t fs_map_blocks(struct superblock *sb, uint64_t count) {
+	uint64_t total = 0, n, span;
+
+	if(count <= DIRECT_MAX) {
+		return 0;
+	}
+	count -= DIRECT_MAX;
+
+	for(int depth = 1; depth <= 3 && count > 0; depth++) {
+		n = (count < fs_tree_span(sb, depth)) ? count : fs_tree_span(sb, depth);
+		for(int h = 1; h <= depth; h++) {
+			span = fs_tree_span(sb, h);
+			total += (n / span) + ((n % span) ? 1 : 0);
+		}
+		count -= n;
+	}
+
+	return total;
+}
+
+/* Writes the indirect blocks mapping the =count blocks in =blocks with a tree of =depth levels.
+ * Indirect blocks are taken from =*pool if it is not NULL. Returns the top block of the tree, or
+ * zero if all the blocks are holes. */
+uint64_t fs_build_tree(struct superblock *sb, uint64_t *blocks, uint64_t count, int depth, uint64_t **pool) {
+	uint64_t span, blk, n, any = 0;
+	uint64_t *ptrs;
+
+	if(depth == 0) {
+		return blocks[0];
+	}
+
+	ptrs = fs_slab_zero(sb);
+	span = fs_tree_span(sb, depth - 1);
+
+	for(uint64_t i = 0; i * span < count; i++) {
+		n = (count - i * span < span) ? count - i * span : span;
+		ptrs[i] = fs_build_tree(sb, blocks + i * span, n, depth - 1, pool);
+		any |= ptrs[i];
+	}
+
+	if(any == 0) {
+		fs_slab_put(sb, ptrs);
+		return 0;
+	}
+
+	blk = (pool != NULL) ? *(*pool)++ : fs_get_block(sb);
+	fs_write_data(sb, blk, (void*) ptrs);
+	fs_slab_put(sb, ptrs);
+
+	return blk;
+}
+
+/* Fills the links of file =inode to map the =count blocks in =blocks, writing indirect blocks
+ * (taken from =*pool if it is not NULL) */
+void fs_build_map(struct superblock *sb, struct inode *inode, uint64_t *blocks, uint64_t count,
+                  uint64_t **pool) {
+	uint64_t base, span, n;
+
+	for(int i = 0; i < LINK_MAX; i++) {
+		inode->links[i] = (i < DIRECT_MAX && i < count) ? blocks[i] : 0;
+	}
+
+	base = DIRECT_MAX;
+	for(int depth = 1; depth <= 3 && base < count; depth++) {
+		span = fs_tree_span(sb, depth);
+		n = (count - base < span) ? count - base : span;
+		inode->links[DIRECT_MAX + depth - 1] = fs_build_tree(sb, blocks + base, n, depth, pool);
+		base += span;
+	}
+}
+
+/* Calls =fn for the logical blocks =first to =end-1 of the tree of =depth levels under =blk, which
+ * maps the logical blocks starting at =base. Each indirect block is read once. */
+int fs_walk_tree(struct superblock *sb, uint64_t blk, int depth, uint64_t base, uint64_t first,
+                 uint64_t end, fs_blockfn fn, void *arg) {
+	int ret = 0;
+	uint64_t span, lo, hi;
+	uint64_t *ptrs = NULL;
+
+	if(depth == 0) {
+		return fn(sb, base, blk, arg);
+	}
+
+	if(blk != 0) {
+		ptrs = fs_slab_get(sb);
+		fs_read_data(sb, blk, (void*) ptrs);
+	}
+
+	span = fs_tree_span(sb, depth - 1);
+
+	for(uint64_t i = (first - base) / span; i < PTR_MAX && base + i * span < end; i++) {
+		lo = base + i * span;
+		hi = (lo + span < end) ? lo + span : end;
+		ret = fs_walk_tree(sb, ptrs ? ptrs[i] : 0, depth - 1, lo, (first > lo) ? first : lo, hi, fn, arg);
+		if(ret != 0) break;
+	}
+
+	fs_slab_put(sb, ptrs);
+
+	return ret;
+}
+
+/* Calls =fn for the logical blocks =first to =end-1 of the file with =inode, in order. Locating
+ * any block takes at most three indirect block reads. */
+int fs_walk_file(struct superblock *sb, struct inode *inode, uint64_t first, uint64_t end,
+                 fs_blockfn fn, void *arg) {
+	int ret;
+	uint64_t base, span;
+
+	for(uint64_t i = first; i < end && i < DIRECT_MAX; i++) {
+		if((ret = fn(sb, i, inode->links[i], arg)) != 0) {
+			return ret;
+		}
+	}
+
+	base = DIRECT_MAX;
+	for(int depth = 1; depth <= 3 && base < end; depth++) {
+		span = fs_tree_span(sb, depth);
+		if(first < base + span) {
+			ret = fs_walk_tree(sb, inode->links[DIRECT_MAX + depth - 1], depth, base,
+			                   (first > base) ? first : base, (end < base + span) ? end : base + span, fn, arg);
+			if(ret != 0) return ret;
+		}
+		base += span;
+	}
+
+	return 0;
+}
+
+/* Copies the part of block =index that falls in the range of the readop in =arg */
+int fs_read_block(struct superblock *sb, uint64_t index, uint64_t blk, void *arg) {
+	struct readop *op = arg;
+	uint64_t start = index * sb->blksz, from, to;
+	char *dst;
+
+	from = (op->offset > start) ? op->offset : start;
+	to   = (op->offset + op->count < start + sb->blksz) ? op->offset + op->count : start + sb->blksz;
+	dst  = op->buf + (from - op->offset);
+
+	if(blk == 0) { /* Hole */
+		memset(dst, 0, to - from);
+	}
+	else if(from == start && to == start + sb->blksz) {
+		fs_read_data(sb, blk, (void*) dst);
+	}
+	else { /* Block does not fill the buffer */
+		fs_read_data(sb, blk, (void*) op->scratch);
+		memcpy(dst, op->scratch + (from - start), to - from);
+	}
+
+	return 0;
+}
+
+/* Records the block holding logical block =index in the mapop in =arg */
+int fs_map_block(struct superblock *sb, uint64_t index, uint64_t blk, void *arg) {
+	struct mapop *op = arg;
+
+	op->blocks[index - op->first] = blk;
+
+	return 0;
+}
+
+/* Adds a view of the part of block =index that falls in the range of the viewop in =arg, pinning
+ * the block in the cache. Stops the walk once the views are used up or no more can be pinned. */
+int fs_view_block(struct superblock *sb, uint64_t index, uint64_t blk, void *arg) {
+	int slot = -1;
+	struct viewop *op = arg;
+	struct view *view = &op->views[op->n];
+	uint64_t start = index * sb->blksz, from, to, shift = 0;
+
+	if(index == op->last && op->tail != 0) { /* Viewed inside its tail block */
+		blk   = op->tail / sb->blksz;
+		shift = op->tail % sb->blksz;
+	}
+
+	if(op->n == op->max || (blk != 0 && (slot = fs_cache_pin(sb, blk)) == -1)) {
+		return 1;
+	}
+
+	from = (op->offset > start) ? op->offset : start;
+	to   = (op->offset + op->count < start + sb->blksz) ? op->offset + op->count : start + sb->blksz;
+
+	view->data = ((slot == -1) ? sb->cache->zero : sb->cache->data + slot * sb->blksz) + shift + (from - start);
+	view->len  = to - from;
+	view->slot = slot;
+	op->n++;
+
+	return 0;
+}
+
+/* Notes a read of the logical blocks =first to =end-1 of the file with =inode, stored at =blk and
+ * =size bytes long. A read that starts where the previous one ended doubles the readahead window,
+ * any other read halves it. The blocks in the window are prefetched once less than half of it is
+ * left ahead of the reader. */
+void fs_readahead(struct superblock *sb, uint64_t blk, struct inode *inode, uint64_t size,
+                  uint64_t first, uint64_t end) {
+	uint64_t last;
+	struct mapop op;
+	struct stream *s = NULL;
+	struct cache *c = sb->cache;
+
+	if(c == NULL) return;
+
+	for(int i = 0; i < RA_STREAMS && s == NULL; i++) {
+		if(c->streams[i].inode == blk) s = &c->streams[i];
+	}
+
+	if(s == NULL) { /* New reader, replaces the oldest one */
+		s = &c->streams[c->nextstream];
+		c->nextstream = (c->nextstream + 1) % RA_STREAMS;
+		s->inode  = blk;
+		s->next   = 0;
+		s->ahead  = 0;
+		s->window = 0;
+	}
+
+	if(first == s->next) { /* Sequential */
+		s->window = (s->window == 0) ? RA_MIN : (2 * s->window < RA_MAX) ? 2 * s->window : RA_MAX;
+	}
+	else {
+		s->window /= 2;
+		s->ahead = end;
+	}
+
+	s->next = end;
+	if(s->ahead < end) s->ahead = end;
+
+	last = end + s->window;
+	if(last > (size + sb->blksz - 1) / sb->blksz) last = (size + sb->blksz - 1) / sb->blksz;
+
+	if(last <= s->ahead || s->ahead - end >= s->window / 2) {
+		return;
+	}
+
+	op.first  = s->ahead;
+	op.blocks = malloc((last - s->ahead) * sizeof *op.blocks);
+	fs_walk_file(sb, inode, s->ahead, last, fs_map_block, &op);
+	fs_prefetch(sb, op.blocks, last - s->ahead);
+	s->ahead = last;
+
+	free(op.blocks);
+}
+
+/* Reads the range of the readop =op from the file with =inode: the whole blocks from all images of
+ * a stripe at once, the partial blocks at either end through the cache. Returns zero or -1. */
+int fs_read_striped(struct superblock *sb, struct inode *inode, struct readop *op) {
+	int ret;
+	struct mapop map;
+	uint64_t first = (op->offset + sb->blksz - 1) / sb->blksz, end = (op->offset + op->count) / sb->blksz;
+
+	fs_walk_file(sb, inode, op->offset / sb->blksz, first, fs_read_block, op);
+	fs_walk_file(sb, inode, end, (op->offset + op->count + sb->blksz - 1) / sb->blksz, fs_read_block, op);
+
+	map.first  = first;
+	map.blocks = malloc((end - first + 1) * sizeof *map.blocks);
+	fs_walk_file(sb, inode, first, end, fs_map_block, &map);
+
+	ret = fs_stripe_io(sb, map.blocks, end - first, op->buf + (first * sb->blksz - op->offset), 0);
+	free(map.blocks);
+
+	return ret;
+}
+
+/* Releases the =count data blocks mapped by the tree of =depth levels under =blk, and the tree. A
+ * subtree still shared with a clone is only unreferenced. */
+void fs_free_tree(struct superblock *sb, uint64_t blk, int depth, uint64_t count) {
+	uint64_t span, n;
+	uint64_t *ptrs;
+
+	if(blk == 0) {
+		return;
+	}
+
+	if(depth == 0) {
+		fs_put_data(sb, blk);
+		return;
+	}
+
+	if(fs_unref_block(sb, blk) > 0) {
+		return;
+	}
+
+	ptrs = fs_slab_get(sb);
+	fs_read_data(sb, blk, (void*) ptrs);
+	span = fs_tree_span(sb, depth - 1);
+
+	for(uint64_t i = 0; i * span < count; i++) {
+		n = (count - i * span < span) ? count - i * span : span;
+		fs_free_tree(sb, ptrs[i], depth - 1, n);
+	}
+
+	fs_slab_put(sb, ptrs);
+	fs_put_block(sb, blk);
+}
+
+/* Releases the data and indirect blocks of the file with =inode, which has =count data blocks */
+void fs_free_file(struct superblock *sb, struct inode *inode, uint64_t count) {
+	uint64_t base, span, n;
+
+	for(uint64_t i = 0; i < DIRECT_MAX && i < count; i++) {
+		if(inode->links[i] != 0) fs_put_data(sb, inode->links[i]);
+	}
+
+	base = DIRECT_MAX;
+	for(int depth = 1; depth <= 3 && base < count; depth++) {
+		span = fs_tree_span(sb, depth);
+		n = (count - base < span) ? count - base : span;
+		fs_free_tree(sb, inode->links[DIRECT_MAX + depth - 1], depth, n);
+		base += span;
+	}
+}
+
+/* Returns 1 if =block is referenced more than once, by clones or deduplicated files */
+int fs_shared_block(struct superblock *sb, uint64_t block) {
+	uint64_t refs;
+
+	return fs_table_get(sb, sb->refcounts, block, &refs);
+}
+
+/* Upper bound on the blocks allocated by a write to the logical blocks =first to =end-1: the data
+ * blocks, the indirect blocks on their paths and, if blocks are shared, the reference count pages
+ * for the children of copied indirect blocks */
+uint64_t fs_cow_blocks(struct superblock *sb, uint64_t first, uint64_t end) {
+	uint64_t total = end - first, indirect = 0, base, span, lo, hi;
+
+	base = DIRECT_MAX;
+	for(int depth = 1; depth <= 3; depth++) {
+		span = fs_tree_span(sb, depth);
+		lo = (first > base) ? first : base;
+		hi = (end < base + span) ? end : base + span;
+		for(int h = 1; h <= depth && lo < hi; h++) {
+			indirect += (hi - lo) / fs_tree_span(sb, h) + 2;
+		}
+		base += span;
+	}
+
+	if(sb->refcounts != 0) {
+		indirect *= 1 + PTR_MAX / HASH_MAX + 1;
+	}
+
+	return total + indirect + 3;
+}
+
+/* Writes the part of the buffer in the writeop =arg that falls in logical block =index, held in
+ * =blk. Returns the block that holds the new content, which is =blk itself unless it was shared. */
+uint64_t fs_cow_data(struct superblock *sb, uint64_t index, uint64_t blk, struct writeop *op) {
+	uint64_t start = index * sb->blksz, from, to, newblk;
+	char *data;
+
+	from = (op->offset > start) ? op->offset : start;
+	to   = (op->offset + op->count < start + sb->blksz) ? op->offset + op->count : start + sb->blksz;
+
+	if(op->pending > 0) op->pending--;
+
+	if(from == start && (to == start + sb->blksz || to >= op->size)) { /* Whole block replaced */
+		data = fs_file_block(sb, op->buf + (start - op->offset), op->offset + op->count - start, 0,
+		                     op->scratch);
+	}
+	else {
+		if(blk != 0) {
+			fs_read_data(sb, blk, (void*) op->scratch);
+		}
+		else {
+			memset(op->scratch, 0, sb->blksz);
+		}
+		memcpy(op->scratch + (from - start), op->buf + (from - op->offset), to - from);
+		data = op->scratch;
+	}
+
+	/* Unshared blocks are overwritten in place, unless the fingerprint index could refer to them */
+	if(blk != 0 && sb->fingerprints == 0 && !fs_shared_block(sb, blk) && !fs_zero_block(sb, data)) {
+		fs_write_data(sb, blk, (void*) data);
+		return blk;
+	}
+
+	newblk = fs_store_block(sb, data, op->pending);
+
+	if(newblk != 0) op->stored++;
+	if(blk != 0) {
+		fs_put_data(sb, blk);
+		op->stored--;
+	}
+
+	return newblk;
+}
+
+/* Applies the writeop =op to the logical blocks =first to =end-1 of the tree of =depth levels
+ * under =blk, which maps the logical blocks from =base. Indirect blocks shared with a clone are
+ * copied before they are changed. Returns the new top block of the tree, zero if it is empty. */
+uint64_t fs_cow_tree(struct superblock *sb, uint64_t blk, int depth, uint64_t base, uint64_t first,
+                     uint64_t end, struct writeop *op) {
+	uint64_t span, lo, hi, any = 0;
+	uint64_t *ptrs;
+
+	if(depth == 0) {
+		return fs_cow_data(sb, base, blk, op);
+	}
+
+	ptrs = fs_slab_zero(sb);
+
+	if(blk != 0) {
+		fs_read_data(sb, blk, (void*) ptrs);
+
+		if(fs_shared_block(sb, blk)) { /* The copy references the same children */
+			for(uint64_t i = 0; i < PTR_MAX; i++) {
+				if(ptrs[i] != 0) fs_ref_block(sb, ptrs[i]);
+			}
+			fs_unref_block(sb, blk);
+			blk = 0;
+		}
+	}
+
+	span = fs_tree_span(sb, depth - 1);
+
+	for(uint64_t i = (first - base) / span; i < PTR_MAX && base + i * span < end; i++) {
+		lo = base + i * span;
+		hi = (lo + span < end) ? lo + span : end;
+		ptrs[i] = fs_cow_tree(sb, ptrs[i], depth - 1, lo, (first > lo) ? first : lo, hi, op);
+	}
+
+	for(uint64_t i = 0; i < PTR_MAX; i++) {
+		any |= ptrs[i];
+	}
+
+	if(any == 0) {
+		if(blk != 0) fs_put_block(sb, blk);
+		blk = 0;
+	}
+	else {
+		if(blk == 0) blk = fs_get_block(sb);
+		fs_write_data(sb, blk, (void*) ptrs);
+	}
+
+	fs_slab_put(sb, ptrs);
+
+	return blk;
+}
+
+/* Applies the writeop =op to the logical blocks =first to =end-1 of the file with =inode */
+void fs_cow_file(struct superblock *sb, struct inode *inode, uint64_t first, uint64_t end,
+                 struct writeop *op) {
+	uint64_t base, span;
+
+	for(uint64_t i = first; i < end && i < DIRECT_MAX; i++) {
+		inode->links[i] = fs_cow_data(sb, i, inode->links[i], op);
+	}
+
+	base = DIRECT_MAX;
+	for(int depth = 1; depth <= 3 && base < end; depth++) {
+		span = fs_tree_span(sb, depth);
+		if(first < base + span) {
+			inode->links[DIRECT_MAX + depth - 1] = fs_cow_tree(sb, inode->links[DIRECT_MAX + depth - 1],
+			                                                   depth, base, (first > base) ? first : base,
+			                                                   (end < base + span) ? end : base + span, op);
+		}
+		base += span;
+	}
+}
+
+/* Moves the packed tail of the file with =inode and =nodeinfo back into a block of its own, so that
+ * it can be changed in place or the file can grow past it. The caller writes the inode and the
+ * nodeinfo. Returns zero, or -1 if there is not enough space for the block. */
+int fs_unpack_tail(struct superblock *sb, struct inode *inode, struct nodeinfo *nodeinfo) {
+	uint64_t last = nodeinfo->size / sb->blksz;
+	struct writeop op;
+	char *block;
+
+	if(inode->next == 0) {
+		return 0;
+	}
+
+	if(fs_cow_blocks(sb, last, last + 1) > sb->freeblks) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	block = fs_slab_get(sb);
+	fs_read_data(sb, inode->next / sb->blksz, (void*) block);
+
+	op.buf     = block + inode->next % sb->blksz;
+	op.offset  = last * sb->blksz;
+	op.count   = nodeinfo->size - op.offset;
+	op.size    = nodeinfo->size;
+	op.pending = 1;
+	op.stored  = 0;
+	op.scratch = fs_slab_get(sb);
+
+	fs_cow_file(sb, inode, last, last + 1, &op);
+	fs_put_tail(sb, inode->next);
+
+	inode->next       = 0;
+	nodeinfo->blocks += op.stored;
+
+	fs_slab_put(sb, op.scratch);
+	fs_slab_put(sb, block);
+
+	return 0;
+}
+
+/* Returns the name of the last inode, its parent dir inode position and its inode position(if it doesnt exists returns -1). 
+ *  In case of error sets errno to the right value and returns NULL */
+struct dir * fs_find_dir_info(struct superblock *sb, const char *dpath) {
+	int pathlenght = 0;
+	char *token;
+	char *pathcopy;
+	struct dir *dir;
+
+	if(strlen(dpath) >= sb->blksz) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	/* The name is kept in the same block, right after the struct */
+	dir = fs_slab_get(sb);
+	dir->nodename = (char*) (dir + 1);
+	pathcopy = fs_slab_get(sb);
+	strcpy(pathcopy, dpath);
+
+	token = strtok(pathcopy, "/");
+	if(token == NULL) {
+		dir->dirnode = sb->root;
+		dir->nodeblock = sb->root;
+		dir->nodename[0] = '\0';
+		fs_slab_put(sb, pathcopy);
+		return dir;
+	}
+
+	while(token != NULL) {
+		if(strlen(token) >= NAME_MAX) {
+			fs_slab_put(sb, dir);
+			fs_slab_put(sb, pathcopy);
+			errno = ENAMETOOLONG;
+			return NULL;
+		}
+		strcpy(dir->nodename, token);
+		pathlenght++;
+		token = strtok(NULL, "/");
+	} 
+
+	strcpy(pathcopy, dpath);
+
+	uint64_t dirnode, nodeblock, j;
+	struct inode *inode          = fs_slab_get(sb);
+	struct inode *auxinode       = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo    = fs_slab_get(sb);
+	struct nodeinfo *auxnodeinfo = fs_slab_get(sb);
+
+	dirnode = sb->root;
+
+	fs_read_data(sb, dirnode, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+	token = strtok(pathcopy, "/");
+
+	j = 0;
+
+	for(int i = 0; i < pathlenght; i++) {
+		while(j < LINK_MAX) {
+			nodeblock = inode->links[j];
+			if(nodeblock != 0) {
+				fs_read_data(sb, nodeblock, (void*) auxinode);
+				fs_read_data(sb, auxinode->meta, (void*) auxnodeinfo);
+
+				if(!strcmp(auxnodeinfo->name, token)) {
+					if(i + 1 < pathlenght) {
+						if(auxinode->mode != IMDIR) { /* Error: Path goes through a file */
+							fs_slab_put(sb, dir);
+							fs_slab_put(sb, pathcopy);
+							fs_slab_put(sb, inode);
+							fs_slab_put(sb, nodeinfo);
+							fs_slab_put(sb, auxinode);
+							fs_slab_put(sb, auxnodeinfo);
+							errno = ENOTDIR;
+							return NULL;
+						}
+						dirnode = nodeblock;
+					}
+					/* Swap buffers, the entries of the found dir are read into auxinode */
+					struct inode *swapnode = inode;
+					struct nodeinfo *swapinfo = nodeinfo;
+					inode = auxinode;
+					nodeinfo = auxnodeinfo;
+					auxinode = swapnode;
+					auxnodeinfo = swapinfo;
+					break;
+				}	
+			}
+
+			j++;
+
+			if(j == LINK_MAX) {
+				if(inode->next != 0) { /* Restarts loop with child inode */
+					j = 0;
+					fs_read_data(sb, inode->next, (void*)inode);
+				}
+				else{ 
+					if(i + 1 == pathlenght) {
+						nodeblock = -1; /* Ends while without finding file */
+						break;
+					}
+					else { /* Error: Path doesn't exists */
+						fs_slab_put(sb, dir);
+						fs_slab_put(sb, pathcopy);
+						fs_slab_put(sb, inode);
+						fs_slab_put(sb, nodeinfo);
+						fs_slab_put(sb, auxinode);
+						fs_slab_put(sb, auxnodeinfo);
+						errno = ENOENT;
+						return NULL;
+					}
+				}
+			}
+		}
+		j = 0;
+		token = strtok(NULL, "/");
+	}
+
+	dir->dirnode = dirnode;
+	dir->nodeblock = nodeblock;
+
+	fs_slab_put(sb, pathcopy);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+	fs_slab_put(sb, auxinode);
+	fs_slab_put(sb, auxnodeinfo);
+
+	return dir;
+}
+
+/* Returns the inode relative to parent that have a free link and the free link index in the array of links.
+ * If the link is not found, return the last inode in the chain and -1 as link index. linkvalue should be 0 
+ * when looking for a free link. */
+struct link * fs_find_link(struct superblock *sb, uint64_t inodeblk, uint64_t linkvalue) {
+	int i = 0;
+	uint64_t actualblk = inodeblk;
+	struct link *link = fs_slab_get(sb);
+	struct inode *inode = fs_slab_get(sb);
+
+	fs_read_data(sb, inodeblk, (void*) inode);
+
+	while(i < LINK_MAX) {
+		if(inode->links[i] == linkvalue) {
+			link->inode = actualblk;
+			link->index = i;
+			break;
+		}
+
+		i++;
+
+		if(i == LINK_MAX) {
+			if(inode->next == 0) {
+				link->inode = actualblk;
+				link->index = -1;
+				break;
+			}
+			else{ /* Restarts loop with child inode */
+				i = 0;
+				actualblk = inode->next;
+				fs_read_data(sb, inode->next, (void*) inode);
+			}
+		}
+	}
+
+	fs_slab_put(sb, inode);
+
+	return link;
+}
+
+/* Returns child inode pos in fs*/
+uint64_t fs_create_child(struct superblock *sb, uint64_t thisblk, uint64_t parentblk) {
+	uint64_t ret;
+	struct inode *inode     = fs_slab_get(sb);
+	struct inode *childnode = fs_slab_get(sb);
+
+	fs_read_data(sb, thisblk, (void*) inode);
+
+	inode->next = fs_get_block(sb);
+
+	childnode->mode   = IMCHILD;
+	childnode->parent = parentblk;
+	childnode->meta   = thisblk;
+	childnode->next   = 0;
+	for(int i = 0; i < LINK_MAX; i++) {
+		childnode->links[i] = 0;
+	}
+
+	fs_write_data(sb, thisblk, (void*) inode);
+	fs_write_data(sb, inode->next, (void*) childnode);
+
+	ret = inode->next;
+
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, childnode);
+
+	return ret;
+}
+
+void fs_add_link(struct superblock *sb, uint64_t parentblk, int linkindex, uint64_t newlink) {
+	uint64_t nodeinfoblk;
+	struct inode *inode = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	fs_read_data(sb, parentblk, (void*) inode);
+	nodeinfoblk = inode->meta;
+	if(inode->mode == IMCHILD) {
+		struct inode *parentnode = fs_slab_get(sb);
+		fs_read_data(sb, inode->parent, parentnode);
+		nodeinfoblk = parentnode->meta;
+		fs_slab_put(sb, parentnode);
+	}
+  	fs_read_data(sb, nodeinfoblk, (void*) nodeinfo);	
+
+	inode->links[linkindex] = newlink;
+	nodeinfo->size++;
+
+	fs_write_data(sb, parentblk, (void*) inode);
+	fs_write_data(sb, nodeinfoblk, (void*) nodeinfo);
+
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+}
+
+void fs_remove_link(struct superblock *sb, uint64_t parentblk, int linkindex) {
+	uint64_t nodeinfoblk;
+	struct inode *inode = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	fs_read_data(sb, parentblk, (void*) inode);
+	nodeinfoblk = inode->meta;
+	if(inode->mode == IMCHILD) {
+		struct inode *parentnode = fs_slab_get(sb);
+		fs_read_data(sb, inode->parent, (void*) parentnode);
+		nodeinfoblk = parentnode->meta;
+		fs_slab_put(sb, parentnode);
+	}
+	fs_read_data(sb, nodeinfoblk, (void*) nodeinfo);
+
+	inode->links[linkindex] = 0;
+	nodeinfo->size--;
+
+	fs_write_data(sb, parentblk, (void*) inode);
+
+	/* Delete inode for links that are completely unused */
+	if(inode->mode == IMCHILD && inode->next == 0 && !fs_has_links(sb, parentblk)) {
+		fs_put_block(sb, parentblk);
+		struct inode *previousnode = fs_slab_get(sb);
+		fs_read_data(sb, inode->meta, (void*) previousnode);
+		previousnode->next = 0;
+		fs_write_data(sb, inode->meta, (void*) previousnode);
+		fs_slab_put(sb, previousnode);
+	}
+	fs_write_data(sb, nodeinfoblk, (void*) nodeinfo);
+
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+}
+
+/* If inode has any links, return 1, else return 0*/
+int fs_has_links(struct superblock *sb, uint64_t thisblk) {
+	int ret = 0;
+	struct inode *inode = fs_slab_get(sb);
+
+	fs_read_data(sb, thisblk, (void*) inode);
+
+	for(int i = 0; i < LINK_MAX && !ret; i++) {
+		ret = inode->links[i] ? 1 : 0;
+	}
+
+	fs_slab_put(sb, inode);
+
+	return ret;
+}
+
+/* Returns the entry named =name in directory =dirblk, or zero if there is none. If =link is not
+ * NULL, it is set to where the entry is linked from. */
+uint64_t fs_find_entry(struct superblock *sb, uint64_t dirblk, const char *name, struct link *link) {
+	uint64_t thisblk = dirblk, found = 0;
+	struct inode *inode       = fs_slab_get(sb);
+	struct inode *auxinode    = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	fs_read_data(sb, thisblk, (void*) inode);
+
+	while(found == 0) {
+		fs_prefetch(sb, &inode->next, 1); /* Next part of the directory, read while this one is */
+
+		for(int i = 0; i < LINK_MAX; i++) {
+			if(inode->links[i] == 0) continue;
+
+			fs_read_data(sb, inode->links[i], (void*) auxinode);
+			fs_read_data(sb, auxinode->meta, (void*) nodeinfo);
+
+			if(!strcmp(nodeinfo->name, name)) {
+				found = inode->links[i];
+				if(link != NULL) {
+					link->inode = thisblk;
+					link->index = i;
+				}
+				break;
+			}
+		}
+
+		if(found != 0 || inode->next == 0) break;
+
+		thisblk = inode->next;
+		fs_read_data(sb, thisblk, (void*) inode);
+	}
+
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, auxinode);
+	fs_slab_put(sb, nodeinfo);
+
+	return found;
+}
+
+/* Returns 1 if the path =prefix names a directory above the entity named by =path */
+int fs_path_prefix(const char *prefix, const char *path) {
+	size_t len;
+
+	while(1) {
+		while(*prefix == '/') prefix++;
+		while(*path == '/') path++;
+
+		if(*prefix == '\0') {
+			return *path != '\0';
+		}
+
+		len = strcspn(prefix, "/");
+		if(strncmp(prefix, path, len) != 0 || (path[len] != '/' && path[len] != '\0')) {
+			return 0;
+		}
+
+		prefix += len;
+		path   += len;
+	}
+}
+
+/* Copies the file or directory =blk, shared with a snapshot, to new blocks linked from directory
+ * =parent. The copy takes a reference to everything the entity links, and =blk loses the
+ * reference the copy replaces. Returns the copy, or zero if there is not enough space. */
+uint64_t fs_copy_entity(struct superblock *sb, uint64_t blk, uint64_t parent) {
+	uint64_t chain = 1, newblk, newmeta, thisblk, thisnew, nextnew, prevnew = 0, tail = 0;
+	struct inode *inode       = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	fs_read_data(sb, blk, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+
+	if(inode->mode == IMREG) { /* A file's =next is its packed tail, not a chain */
+		tail = inode->next;
+		inode->next = 0;
+	}
+
+	for(uint64_t next = inode->next; next != 0; chain++) {
+		struct inode *child = fs_slab_get(sb);
+		fs_read_data(sb, next, (void*) child);
+		next = child->next;
+		fs_slab_put(sb, child);
+	}
+
+	/* The inodes and nodeinfo, plus room for the reference counts */
+	if(sb->freeblks < chain + 1 + (chain * LINK_MAX) / HASH_MAX + 3) {
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = ENOSPC;
+		return 0;
+	}
+
+	if(inode->parent == blk) { /* A root is its own parent */
+		parent = 0;
+	}
+
+	newblk  = fs_get_block(sb);
+	newmeta = fs_get_block(sb);
+	thisblk = blk;
+	thisnew = newblk;
+
+	while(thisnew != 0) {
+		if(thisblk != blk) {
+			fs_read_data(sb, thisblk, (void*) inode);
+		}
+
+		for(int i = 0; i < LINK_MAX; i++) {
+			if(inode->links[i] != 0) fs_ref_block(sb, inode->links[i]);
+		}
+
+		nextnew = (inode->next != 0) ? fs_get_block(sb) : 0;
+
+		if(thisblk == blk) {
+			inode->parent = (parent != 0) ? parent : newblk;
+			inode->meta   = newmeta;
+		}
+		else {
+			inode->parent = newblk;
+			inode->meta   = prevnew;
+		}
+
+		thisblk = inode->next;
+		inode->next = nextnew;
+		if(tail != 0) { /* The copy shares the packed tail too */
+			fs_ref_block(sb, tail / sb->blksz);
+			inode->next = tail;
+		}
+		fs_write_data(sb, thisnew, (void*) inode);
+
+		prevnew = thisnew;
+		thisnew = nextnew;
+	}
+
+	fs_write_data(sb, newmeta, (void*) nodeinfo);
+	fs_unref_block(sb, blk);
+
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+
+	return newblk;
+}
+
+/* Makes the root and the directories on =path unshared, copying those still shared with a
+ * snapshot, so that they can be changed in place. With =last, the entity =path names is made
+ * unshared as well. Copies are made top-down, so each one is linked from an unshared directory.
+ * Returns zero, or -1 if there is not enough space for the copies. */
+int fs_unshare_path(struct superblock *sb, const char *path, int last) {
+	uint64_t thisblk, entry, copy;
+	char *pathcopy, *token, *next;
+	struct link link;
+	struct inode *inode;
+
+	if(sb->refcounts == 0) { /* Nothing is shared */
+		return 0;
+	}
+
+	if(fs_shared_block(sb, sb->root)) {
+		if((copy = fs_copy_entity(sb, sb->root, 0)) == 0) {
+			return -1;
+		}
+		sb->root = copy;
+		fs_write_super(sb);
+	}
+
+	if(strlen(path) >= sb->blksz) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	pathcopy = fs_slab_get(sb);
+	inode    = fs_slab_get(sb);
+	strcpy(pathcopy, path);
+
+	thisblk = sb->root;
+	token   = strtok(pathcopy, "/");
+
+	while(token != NULL) {
+		next = strtok(NULL, "/");
+		if(next == NULL && !last) break;
+
+		if((entry = fs_find_entry(sb, thisblk, token, &link)) == 0) {
+			break; /* The caller reports the missing path */
+		}
+
+		if(fs_shared_block(sb, entry)) {
+			if((copy = fs_copy_entity(sb, entry, thisblk)) == 0) {
+				fs_slab_put(sb, pathcopy);
+				fs_slab_put(sb, inode);
+				return -1;
+			}
+			fs_read_data(sb, link.inode, (void*) inode);
+			inode->links[link.index] = copy;
+			fs_write_data(sb, link.inode, (void*) inode);
+			entry = copy;
+		}
+
+		fs_read_data(sb, entry, (void*) inode);
+		if(inode->mode != IMDIR) break;
+
+		thisblk = entry;
+		token   = next;
+	}
+
+	fs_slab_put(sb, pathcopy);
+	fs_slab_put(sb, inode);
+
+	return 0;
+}
+
+int fs_cmp_block(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+/* Takes =count free blocks into =blocks in ascending order, writing the superblock once. When the
+ * free range at the end can hold all of them, they form a single run. The caller checks that
+ * there are enough free blocks. */
+void fs_get_blocks(struct superblock *sb, uint64_t count, uint64_t *blocks) {
+	uint64_t i = 0;
+	int loaded = 0, dirty = 0;
+	struct freepage *freepage = fs_slab_get(sb);
+
+	if(sb->frontier != 0 && sb->blks - sb->frontier >= count) {
+		for(; i < count; i++) {
+			blocks[i] = sb->frontier++;
+		}
+	}
+
+	for(; i < count; i++) {
+		if(sb->freelist == 0) {
+			blocks[i] = sb->frontier++;
+			continue;
+		}
+
+		if(!loaded) {
+			fs_read_data(sb, sb->freelist, (void*) freepage);
+			loaded = 1;
+		}
+
+		if(freepage->count > 0) { /* The blocks a freepage links go before it */
+			blocks[i] = freepage->links[--freepage->count];
+			dirty = 1;
+		}
+		else {
+			blocks[i] = sb->freelist;
+			sb->freelist = freepage->next;
+			loaded = dirty = 0;
+		}
+	}
+
+	if(dirty) fs_write_data(sb, sb->freelist, (void*) freepage);
+	if(sb->frontier == sb->blks) sb->frontier = 0;
+	sb->freeblks -= count;
+
+	qsort(blocks, count, sizeof *blocks, fs_cmp_block);
+	fs_write_super(sb);
+
+	fs_slab_put(sb, freepage);
+}
+
+/* Appends =block to =batch */
+void fs_batch_add(struct batch *batch, uint64_t block) {
+	if(batch->count == batch->max) {
+		batch->max    = 2 * batch->max + 64;
+		batch->blocks = realloc(batch->blocks, batch->max * sizeof *batch->blocks);
+	}
+	batch->blocks[batch->count++] = block;
+}
+
+/* Releases the storage of the =count blocks starting at =pos in the images, with one backend call
+ * for each stretch of them in a single image, and forgets their cached copies. Returns zero or -1. */
+int fs_discard_run(struct superblock *sb, uint64_t pos, uint64_t count) {
+	uint64_t done = 0, n;
+	off_t off;
+	int member, ret = 0;
+
+	if(sb->backend->discard == NULL) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	while(done < count) {
+		n      = fs_image_span(sb, pos + done, count - done);
+		member = fs_image_member(sb, pos + done, &off);
+		if(sb->backend->discard(sb->images[member], off, n * sb->blksz) == -1) ret = -1;
+		done  += n;
+	}
+
+	if(sb->cache != NULL) fs_cache_forget(sb, pos, count);
+
+	return ret;
+}
+
+/* Discards the =count blocks in =blocks, sorted in ascending order, in runs of consecutive blocks.
+ * Returns zero or -1. */
+int fs_discard_blocks(struct superblock *sb, const uint64_t *blocks, uint64_t count) {
+	uint64_t n;
+	int ret = 0;
+
+	for(uint64_t i = 0; i < count; i += n) {
+		for(n = 1; i + n < count && blocks[i + n] == blocks[i] + n; n++);
+		if(fs_discard_run(sb, blocks[i], n)) ret = -1;
+	}
+
+	return ret;
+}
+
+/* Puts the =count blocks in =blocks back in the free list as links of freepages and discards them,
+ * writing the superblock once. The freepage at the head of the list takes as many as it has room
+ * for. The lowest of the rest become freepages linking the others, so that only one block in
+ * several hundred keeps its storage and the discarded blocks form long runs. Returns zero, or -1 if
+ * some could not be discarded. */
+int fs_put_listed(struct superblock *sb, uint64_t *blocks, uint64_t count) {
+	uint64_t i = 0, pages, n;
+	int ret = 0;
+	struct freepage *freepage;
+
+	if(count == 0) {
+		return 0;
+	}
+
+	qsort(blocks, count, sizeof *blocks, fs_cmp_block);
+	freepage = fs_slab_zero(sb);
+
+	if(sb->freelist != 0) {
+		fs_read_data(sb, sb->freelist, (void*) freepage);
+		if(freepage->count < FREE_MAX) {
+			i = (count < FREE_MAX - freepage->count) ? count : FREE_MAX - freepage->count;
+			memcpy(freepage->links + freepage->count, blocks, i * sizeof *blocks);
+			freepage->count += i;
+			fs_write_data(sb, sb->freelist, (void*) freepage);
+			if(fs_discard_blocks(sb, blocks, i)) ret = -1;
+		}
+	}
+
+	pages = (count - i + FREE_MAX) / (FREE_MAX + 1);
+	for(uint64_t j = 0, k = i + pages; j < pages; j++, k += n) {
+		n = (count - k < FREE_MAX) ? count - k : FREE_MAX;
+
+		freepage->next  = sb->freelist;
+		freepage->count = n;
+		memcpy(freepage->links, blocks + k, n * sizeof *blocks);
+		memset(freepage->links + n, 0, (FREE_MAX - n) * sizeof *blocks); /* Left by the page before */
+		fs_write_data(sb, blocks[i + j], (void*) freepage);
+		sb->freelist = blocks[i + j];
+	}
+	if(fs_discard_blocks(sb, blocks + i + pages, count - i - pages)) ret = -1;
+
+	sb->freeblks += count;
+	fs_write_super(sb);
+
+	fs_slab_put(sb, freepage);
+
+	return ret;
+}
+
+/* Puts the =count blocks in =blocks back in the free list, writing the superblock once. They are
+ * sorted and chained in ascending order, so runs of consecutive blocks are written together and
+ * later handed out again in order. With FS_DISCARD they are listed and discarded instead. */
+void fs_put_blocks(struct superblock *sb, uint64_t *blocks, uint64_t count) {
+	uint64_t n;
+	struct freepage *freepage;
+	char *pages;
+
+	if(count == 0) {
+		return;
+	}
+
+	if(sb->flags & FS_DISCARD) {
+		fs_put_listed(sb, blocks, count);
+		return;
+	}
+
+	qsort(blocks, count, sizeof *blocks, fs_cmp_block);
+	pages = calloc(RA_MAX, sb->blksz);
+
+	for(uint64_t i = 0; i < count; i += n) {
+		for(n = 1; i + n < count && n < RA_MAX && blocks[i + n] == blocks[i] + n; n++);
+
+		for(uint64_t j = 0; j < n; j++) {
+			freepage = (struct freepage*) (pages + j * sb->blksz);
+			freepage->next  = (i + j + 1 < count) ? blocks[i + j + 1] : sb->freelist;
+			freepage->count = 0;
+		}
+		fs_write_run(sb, blocks[i], pages, n);
+	}
+
+	sb->freeblks += count;
+	sb->freelist = blocks[0];
+	fs_write_super(sb);
+
+	free(pages);
+}
+
+/* With FS_DISCARD, gathers the blocks freed from here on into =batch, so that fs_batch_end puts
+ * them back together and they are discarded in runs */
+void fs_batch_begin(struct superblock *sb, struct batch *batch) {
+	batch->blocks = NULL;
+	batch->count  = 0;
+	batch->max    = 0;
+
+	if((sb->flags & FS_DISCARD) && sb->batch == NULL) sb->batch = batch;
+}
+
+void fs_batch_end(struct superblock *sb, struct batch *batch) {
+	if(sb->batch == batch) {
+		sb->batch = NULL;
+		fs_put_blocks(sb, batch->blocks, batch->count);
+	}
+	free(batch->blocks);
+}
+
+/* Replaces the =stored nonzero entries among the =count in =blocks with data blocks taken in one
+ * batch, in ascending order. Returns the batch, whose first =mapblks blocks are left for the
+ * indirect blocks fs_map_placed builds. */
+uint64_t * fs_place_blocks(struct superblock *sb, uint64_t *blocks, uint64_t count, uint64_t stored,
+                           uint64_t mapblks) {
+	uint64_t *pool = malloc((mapblks + stored + 1) * sizeof *pool);
+	uint64_t *next = pool + mapblks;
+
+	fs_get_blocks(sb, mapblks + stored, pool);
+
+	/* Indirect blocks first, then the data in logical order */
+	for(uint64_t i = 0; i < count; i++) {
+		if(blocks[i] != 0) blocks[i] = *next++;
+	}
+
+	return pool;
+}
+
+/* Maps the =count blocks placed by fs_place_blocks into =inode and frees =pool, giving back the
+ * indirect blocks spared by holes */
+void fs_map_placed(struct superblock *sb, struct inode *inode, uint64_t *blocks, uint64_t count,
+                   uint64_t *pool, uint64_t mapblks) {
+	uint64_t *next = pool;
+
+	fs_build_map(sb, inode, blocks, count, &next);
+
+	for(; next < pool + mapblks; next++) {
+		fs_put_block(sb, *next);
+	}
+
+	free(pool);
+}
+
+/* Stores the =cnt bytes in =buf as the data of =inode, whose blocks are taken in one batch so the
+ * data lands in ascending order and is written in runs. Blocks of zeros are left as holes. Returns
+ * the number of data blocks stored. */
+uint64_t fs_place_file(struct superblock *sb, struct inode *inode, char *buf, size_t cnt, char *scratch) {
+	uint64_t datablks, mapblks, whole, stored = 0, j;
+	uint64_t *blocks, *pool;
+
+	datablks = (cnt / sb->blksz) + ((cnt % sb->blksz) ? 1 : 0);
+	mapblks  = fs_map_blocks(sb, datablks);
+	whole    = cnt / sb->blksz; /* Blocks written straight from =buf */
+	blocks   = malloc((datablks ? datablks : 1) * sizeof *blocks);
+
+	for(uint64_t i = 0; i < datablks; i++) {
+		blocks[i] = !fs_zero_block(sb, fs_file_block(sb, buf, cnt, i, scratch));
+		stored += blocks[i];
+	}
+
+	pool = fs_place_blocks(sb, blocks, datablks, stored, mapblks);
+
+	if(sb->stripe != 0 && whole >= STRIPE_MIN) { /* Every image writes its share at once */
+		fs_stripe_io(sb, blocks, whole, buf, 1);
+	}
+	else {
+		for(uint64_t i = 0; i < whole; i = j) {
+			j = i + 1;
+			if(blocks[i] == 0) continue;
+
+			while(j < whole && blocks[j] == blocks[j - 1] + 1) j++;
+			fs_write_run(sb, blocks[i], buf + i * sb->blksz, j - i);
+		}
+	}
+
+	if(whole < datablks && blocks[whole] != 0) { /* Last block, padded with zeros */
+		fs_write_data(sb, blocks[whole], fs_file_block(sb, buf, cnt, whole, scratch));
+	}
+
+	fs_map_placed(sb, inode, blocks, datablks, pool, mapblks);
+	free(blocks);
+
+	return stored;
+}
+
+/* Returns the delayed write of the file with inode =blk, or NULL if its data is on disk */
+struct delayed * fs_find_delayed(struct superblock *sb, uint64_t blk) {
+	struct delayed *d;
+
+	for(d = sb->delayed; d != NULL && d->inode != blk; d = d->next);
+
+	return d;
+}
+
+/* Keeps the =cnt bytes in =buf in memory as the contents of the file with inode =blk, setting
+ * =reserve free blocks aside for them. Everything is flushed once too much memory is used. */
+void fs_delay_file(struct superblock *sb, uint64_t blk, char *buf, size_t cnt, uint64_t reserve) {
+	uint64_t total = 0;
+	struct delayed **tail;
+	struct delayed *d = malloc(sizeof *d);
+
+	d->inode    = blk;
+	d->data     = malloc(cnt ? cnt : 1);
+	d->cnt      = cnt;
+	d->reserved = reserve;
+	d->next     = NULL;
+	memcpy(d->data, buf, cnt);
+
+	sb->freeblks -= reserve;
+	sb->reserved += reserve;
+
+	for(tail = &sb->delayed; *tail != NULL; tail = &(*tail)->next) { /* Flushed in write order */
+		total += (*tail)->cnt;
+	}
+	*tail = d;
+
+	if(total + cnt > DELALLOC_MAX) {
+		fs_flush(sb);
+	}
+}
+
+/* Forgets the delayed write of the file with inode =blk, if any, giving back its reservation */
+void fs_drop_delayed(struct superblock *sb, uint64_t blk) {
+	struct delayed *d;
+
+	for(struct delayed **prev = &sb->delayed; *prev != NULL; prev = &(*prev)->next) {
+		if((*prev)->inode == blk) {
+			d = *prev;
+			*prev = d->next;
+			sb->freeblks += d->reserved;
+			sb->reserved -= d->reserved;
+			free(d->data);
+			free(d);
+			return;
+		}
+	}
+}
+
+/* Allocates and writes the blocks of the delayed write =d */
+void fs_flush_file(struct superblock *sb, struct delayed *d) {
+	uint64_t datablks, mapblks, stored = 0, tail, cnt;
+	uint64_t *blocks;
+	struct inode *inode       = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+	char *scratch             = fs_slab_get(sb);
+
+	/* The reservation covered the worst case, allocate what is actually needed */
+	sb->freeblks += d->reserved;
+	sb->reserved -= d->reserved;
+	d->reserved   = 0;
+
+	fs_read_data(sb, d->inode, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+
+	tail = fs_tail_len(sb, d->data, d->cnt);
+	cnt  = d->cnt - tail; /* Bytes stored in blocks of their own */
+
+	if(sb->flags & FS_DEDUP) { /* Blocks may be shared, allocate them one at a time */
+		datablks = (cnt / sb->blksz) + ((cnt % sb->blksz) ? 1 : 0);
+		mapblks  = fs_map_blocks(sb, datablks);
+		blocks   = malloc((datablks ? datablks : 1) * sizeof *blocks);
+
+		for(uint64_t i = 0; i < datablks; i++) {
+			blocks[i] = fs_store_block(sb, fs_file_block(sb, d->data, cnt, i, scratch), datablks - i + mapblks);
+			if(blocks[i] != 0) stored++;
+		}
+		fs_build_map(sb, inode, blocks, datablks, NULL);
+
+		free(blocks);
+	}
+	else {
+		stored = fs_place_file(sb, inode, d->data, cnt, scratch);
+	}
+
+	if(tail != 0) {
+		inode->next = fs_pack_tail(sb, d->data + cnt, tail);
+	}
+
+	nodeinfo->blocks = stored;
+
+	fs_write_data(sb, d->inode, (void*) inode);
+	fs_write_data(sb, inode->meta, (void*) nodeinfo);
+
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+	fs_slab_put(sb, scratch);
+}
+
+/* Writes the delayed write =d to disk and forgets it */
+void fs_flush_delayed(struct superblock *sb, struct delayed *d) {
+	struct delayed **prev;
+
+	for(prev = &sb->delayed; *prev != d; prev = &(*prev)->next);
+	*prev = d->next;
+
+	fs_flush_file(sb, d);
+
+	free(d->data);
+	free(d);
+}
+
+/* Writes the =cnt bytes at =buf to =fd at =offset, or at its current offset if =offset is -1 */
+int fs_write_all(int fd, const char *buf, size_t cnt, off_t offset) {
+	ssize_t done;
+
+	while(cnt > 0) {
+		done = (offset == -1) ? write(fd, buf, cnt) : pwrite(fd, buf, cnt, offset);
+		if(done == -1) {
+			if(errno == EINTR) continue;
+			return -1;
+		}
+		buf += done;
+		cnt -= done;
+		if(offset != -1) offset += done;
+	}
+
+	return 0;
+}
+
+/* Marks in =blocks the =count blocks of host file =hostfd, =size bytes long, holding data, leaving
+ * the holes zero. Returns the number of blocks marked. Without hole reporting every block counts. */
+uint64_t fs_host_data(struct superblock *sb, int hostfd, uint64_t size, uint64_t *blocks, uint64_t count) {
+	off_t at, data, hole, saved = lseek(hostfd, 0, SEEK_CUR);
+	uint64_t stored = 0;
+
+	for(uint64_t i = 0; i < count; i++) {
+		blocks[i] = 0;
+	}
+
+	for(at = 0; (uint64_t) at < size; at = hole) {
+		if((data = lseek(hostfd, at, SEEK_DATA)) == -1) {
+			if(errno == ENXIO) break; /* Only a hole is left */
+			data = at;
+			hole = size;
+		}
+		else if((hole = lseek(hostfd, data, SEEK_HOLE)) == -1) {
+			hole = size;
+		}
+		if((uint64_t) data >= size) break;
+		if((uint64_t) hole > size) hole = size;
+
+		for(uint64_t i = data / sb->blksz; i < (hole + sb->blksz - 1) / sb->blksz; i++) {
+			if(blocks[i] == 0) stored++;
+			blocks[i] = 1;
+		}
+	}
+
+	if(saved != -1) lseek(hostfd, saved, SEEK_SET);
+
+	return stored;
+}
+
+/* Copies the =count whole blocks of host file =hostfd starting at byte =offset to the run of
+ * blocks starting at =blk. The kernel moves the data when it can, otherwise it goes through a
+ * buffer of at most COPY_MAX blocks. Bytes missing from the host file are zeros. */
+int fs_import_run(struct superblock *sb, int hostfd, off_t offset, uint64_t blk, uint64_t count) {
+	loff_t in, out;
+	off_t at;
+	uint64_t done = 0, step, pos;
+	ssize_t got = 0;
+	int fd;
+	char *buf;
+
+	/* O_DIRECT images only take aligned transfers from their pool */
+	while(sb->pool == NULL && done < count * sb->blksz) {
+		pos = blk + done / sb->blksz; /* Copied a stretch in a single image at a time */
+		if((fd = fs_image_fd(sb, pos, &at)) == -1) break; /* Not kept in a host file */
+		in  = offset + done;
+		out = at + done % sb->blksz;
+		got = copy_file_range(hostfd, &in, fd, &out,
+		                      fs_image_span(sb, pos, count - done / sb->blksz) * sb->blksz - done % sb->blksz, 0);
+		if(got <= 0) break;
+		done += got;
+	}
+
+	done /= sb->blksz; /* A partly copied block is copied again */
+	if(sb->cache != NULL && done > 0) fs_cache_forget(sb, blk, done);
+	if(done == count) return 0;
+
+	step = (count - done < COPY_MAX) ? count - done : COPY_MAX;
+	buf  = malloc(step * sb->blksz);
+
+	for(uint64_t i = done; i < count; i += step) {
+		if(step > count - i) step = count - i;
+
+		got = pread(hostfd, buf, step * sb->blksz, offset + i * sb->blksz);
+		if(got == -1) {
+			free(buf);
+			return -1;
+		}
+		memset(buf + got, 0, step * sb->blksz - got);
+		fs_write_run(sb, blk + i, buf, step);
+	}
+
+	free(buf);
+
+	return 0;
+}
+
+/* Imports =hostfd to =fname by reading it a buffer at a time, for host files whose size is not
+ * known in advance and for images whose blocks must be read to be shared */
+int fs_import_stream(struct superblock *sb, int hostfd, const char *fname, int seekable) {
+	int err;
+	ssize_t got;
+	uint64_t offset = 0;
+	char *buf = malloc(COPY_MAX * sb->blksz);
+
+	if(fs_write_file(sb, fname, buf, 0)) {
+		free(buf);
+		return -1;
+	}
+
+	for(;;) {
+		got = seekable ? pread(hostfd, buf, COPY_MAX * sb->blksz, offset) : read(hostfd, buf, COPY_MAX * sb->blksz);
+		if(got == -1 && errno == EINTR) continue;
+		if(got <= 0) break;
+
+		if(fs_pwrite_file(sb, fname, buf, got, offset) == -1) {
+			got = -1;
+			break;
+		}
+		offset += got;
+	}
+
+	free(buf);
+
+	if(got == -1) {
+		err = errno;
+		fs_unlink(sb, fname);
+		errno = err;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Writes the pending run of the exportop in =arg to its host file, through the kernel when it can
+ * and a block at a time otherwise */
+int fs_export_run(struct superblock *sb, struct exportop *op) {
+	loff_t in, out;
+	off_t at;
+	uint64_t bytes, done = 0, n, from, pos;
+	ssize_t got;
+	int fd;
+
+	if(op->count == 0) return 0;
+
+	bytes = op->count * sb->blksz;
+	if(op->first * sb->blksz + bytes > op->size) bytes = op->size - op->first * sb->blksz; /* Last block */
+
+	while(done < bytes) {
+		pos = op->blk + done / sb->blksz; /* Copied a stretch in a single image at a time */
+		if((fd = fs_image_fd(sb, pos, &at)) == -1) break; /* Not kept in a host file */
+		in  = at + done % sb->blksz;
+		out = op->first * sb->blksz + done;
+		n   = fs_image_span(sb, pos, op->count - done / sb->blksz) * sb->blksz - done % sb->blksz;
+		if(n > bytes - done) n = bytes - done;
+
+		if(op->stream) { /* Works when =hostfd is a pipe */
+			got = splice(fd, &in, op->hostfd, NULL, n, 0);
+		}
+		else {
+			got = copy_file_range(fd, &in, op->hostfd, &out, n, 0);
+		}
+		if(got <= 0) break;
+		done += got;
+	}
+
+	/* The image is written through, so what is on disk is current */
+	for(uint64_t i = done / sb->blksz; i < op->count && i * sb->blksz < bytes; i++) {
+		fs_read_data(sb, op->blk + i, (void*) op->scratch);
+
+		n    = (bytes - i * sb->blksz < sb->blksz) ? bytes - i * sb->blksz : sb->blksz;
+		from = (i == done / sb->blksz) ? done % sb->blksz : 0;
+		if(fs_write_all(op->hostfd, op->scratch + from, n - from,
+		                op->stream ? -1 : (off_t) ((op->first + i) * sb->blksz + from))) {
+			return -1;
+		}
+	}
+
+	op->count = 0;
+
+	return 0;
+}
+
+/* Adds logical block =index, stored at =blk, to the run the exportop in =arg is gathering. Holes
+ * end the run, and are written as zeros only to host files that cannot seek. */
+int fs_export_block(struct superblock *sb, uint64_t index, uint64_t blk, void *arg) {
+	struct exportop *op = arg;
+	uint64_t n;
+
+	if(blk != 0 && op->count > 0 && blk == op->blk + op->count) {
+		op->count++;
+		return 0;
+	}
+
+	if(fs_export_run(sb, op)) return -1;
+
+	if(blk != 0) {
+		op->first = index;
+		op->blk   = blk;
+		op->count = 1;
+	}
+	else if(op->stream) {
+		n = (op->size - index * sb->blksz < sb->blksz) ? op->size - index * sb->blksz : sb->blksz;
+		memset(op->scratch, 0, n);
+		if(fs_write_all(op->hostfd, op->scratch, n, -1)) return -1;
+	}
+
+	return 0;
+}
+
+/* Drops a reference to the file or directory =blk. Once neither a directory nor a snapshot links
+ * to it, it is freed along with everything it links. */
+void fs_release(struct superblock *sb, uint64_t blk) {
+	uint64_t numblks, next;
+	struct inode *inode       = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	if(fs_unref_block(sb, blk) > 0) {
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return;
+	}
+
+	fs_read_data(sb, blk, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+	fs_put_block(sb, inode->meta);
+
+	if(inode->mode == IMREG) {
+		fs_drop_delayed(sb, blk); /* Never flushed, nothing to free but the reservation */
+		numblks = (nodeinfo->size / sb->blksz) + ((nodeinfo->size % sb->blksz) ? 1 : 0);
+		fs_free_file(sb, inode, numblks);
+		fs_put_tail(sb, inode->next);
+		fs_put_block(sb, blk);
+	}
+	else {
+		for(uint64_t thisblk = blk; thisblk != 0; thisblk = next) {
+			if(thisblk != blk) fs_read_data(sb, thisblk, (void*) inode);
+			next = inode->next;
+			for(int i = 0; i < LINK_MAX; i++) {
+				if(inode->links[i] != 0) fs_release(sb, inode->links[i]);
+			}
+			fs_put_block(sb, thisblk);
+		}
+	}
+
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+}
+
+/* Sets up =op to walk a tree of =sb, calling =fn for each entry */
+void fs_walk_init(struct walkop *op, struct superblock *sb, fs_entryfn fn) {
+	struct walker *w;
+
+	memset(op, 0, sizeof *op);
+	op->sb = sb;
+	op->fn = fn;
+	pthread_mutex_init(&op->lock, NULL);
+	pthread_cond_init(&op->work, NULL);
+
+	for(int i = 0; i < WALK_THREADS; i++) {
+		w = &op->walkers[i];
+		w->op       = op;
+		w->inode    = malloc(sb->blksz);
+		w->entry    = malloc(sb->blksz);
+		w->nodeinfo = malloc(sb->blksz);
+		w->buckets  = malloc(sb->blksz);
+		w->page     = malloc(sb->blksz);
+		for(int depth = 0; depth < 3; depth++) {
+			w->ptrs[depth] = malloc(sb->blksz);
+		}
+	}
+}
+
+void fs_walk_free(struct walkop *op) {
+	struct walker *w;
+
+	for(int i = 0; i < WALK_THREADS; i++) {
+		w = &op->walkers[i];
+		for(size_t j = 0; j < w->nfound; j++) {
+			free(w->found[j]);
+		}
+		for(int depth = 0; depth < 3; depth++) {
+			free(w->ptrs[depth]);
+		}
+		free(w->dirs);
+		free(w->inode);
+		free(w->entry);
+		free(w->nodeinfo);
+		free(w->buckets);
+		free(w->page);
+		free(w->found);
+		free(w->freed.blocks);
+		free(w->releases);
+	}
+
+	pthread_mutex_destroy(&op->lock);
+	pthread_cond_destroy(&op->work);
+}
+
+/* Queues the directory =blk, whose path is =path, to be walked by =w or stolen by another thread */
+void fs_walk_push(struct walker *w, uint64_t blk, char *path) {
+	struct walkop *op = w->op;
+
+	pthread_mutex_lock(&op->lock);
+
+	if(w->tail == w->head) w->head = w->tail = 0; /* Everything was taken */
+	if(w->tail == w->max) {
+		w->max  = 2 * w->max + 16;
+		w->dirs = realloc(w->dirs, w->max * sizeof *w->dirs);
+	}
+	w->dirs[w->tail].blk  = blk;
+	w->dirs[w->tail].path = path;
+	w->tail++;
+
+	op->pending++;
+	pthread_cond_signal(&op->work);
+
+	pthread_mutex_unlock(&op->lock);
+}
+
+/* Takes the next directory for =w into =dir: the last one it queued, so it goes depth first, or
+ * else the oldest one another thread queued, which heads the largest subtree left. Returns 0 if
+ * every queue is empty. Called with the walk locked. */
+int fs_walk_take(struct walker *w, struct walkdir *dir) {
+	struct walkop *op = w->op;
+	struct walker *victim;
+
+	if(w->tail > w->head) {
+		*dir = w->dirs[--w->tail];
+		return 1;
+	}
+
+	for(int i = 1; i < WALK_THREADS; i++) {
+		victim = &op->walkers[(w - op->walkers + i) % WALK_THREADS];
+		if(victim->tail > victim->head) {
+			*dir = victim->dirs[victim->head++];
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Returns the path of entry =name of the directory whose path is =parent */
+char * fs_walk_path(const char *parent, const char *name) {
+	char *path = malloc(strlen(parent) + strlen(name) + 2);
+
+	sprintf(path, "%s/%s", parent, name);
+
+	return path;
+}
+
+/* Calls the walk function for each entry of the directory =dir, queueing the directories it
+ * walks into */
+void fs_walk_dir(struct walker *w, struct walkdir *dir) {
+	struct walkop *op = w->op;
+	struct superblock *sb = op->sb;
+	uint64_t blk;
+	char *path = NULL;
+
+	for(uint64_t thisblk = dir->blk; thisblk != 0; thisblk = w->inode->next) {
+		fs_read_data(sb, thisblk, (void*) w->inode);
+		fs_prefetch(sb, &w->inode->next, 1); /* Next part of the directory, read while this one is */
+		if(op->freeing && thisblk != dir->blk) fs_batch_add(&w->freed, thisblk);
+
+		for(int i = 0; i < LINK_MAX; i++) {
+			if((blk = w->inode->links[i]) == 0) continue;
+
+			fs_read_data(sb, blk, (void*) w->entry);
+			fs_read_data(sb, w->entry->meta, (void*) w->nodeinfo);
+			if(op->paths) path = fs_walk_path(dir->path, w->nodeinfo->name);
+
+			if(op->fn(w, blk, w->entry, w->nodeinfo, path) && w->entry->mode == IMDIR) {
+				fs_walk_push(w, blk, path);
+				path = NULL;
+			}
+
+			free(path);
+			path = NULL;
+		}
+	}
+
+	free(dir->path);
+}
+
+/* Walks directories until none is left in any queue and no other thread is walking one */
+void * fs_walk_thread(void *arg) {
+	struct walker *w = arg;
+	struct walkop *op = w->op;
+	struct walkdir dir;
+
+	pthread_mutex_lock(&op->lock);
+
+	while(1) {
+		if(fs_walk_take(w, &dir)) {
+			pthread_mutex_unlock(&op->lock);
+			fs_walk_dir(w, &dir);
+			pthread_mutex_lock(&op->lock);
+
+			if(--op->pending == 0) pthread_cond_broadcast(&op->work);
+		}
+		else if(op->pending == 0) {
+			break;
+		}
+		else { /* Others may still queue directories */
+			pthread_cond_wait(&op->work, &op->lock);
+		}
+	}
+
+	pthread_mutex_unlock(&op->lock);
+
+	return NULL;
+}
+
+/* Walks the directory =blk, whose path is =path, and every directory under it with WALK_THREADS
+ * threads, the calling thread included. Each thread walks the directories it finds and steals
+ * from the others when it runs out. */
+void fs_walk(struct walkop *op, uint64_t blk, char *path) {
+	pthread_t threads[WALK_THREADS];
+	int started[WALK_THREADS];
+
+	fs_walk_push(&op->walkers[0], blk, path);
+
+	/* Threads that fail to start leave their share to the others */
+	for(int i = 1; i < WALK_THREADS; i++) {
+		started[i] = (pthread_create(&threads[i], NULL, fs_walk_thread, &op->walkers[i]) == 0);
+	}
+	fs_walk_thread(&op->walkers[0]);
+
+	for(int i = 1; i < WALK_THREADS; i++) {
+		if(started[i]) pthread_join(threads[i], NULL);
+	}
+}
+
+/* Returns the number of references to =blk, read without touching the slab of =w's filesystem */
+uint64_t fs_walk_refs(struct walker *w, uint64_t blk) {
+	uint64_t refs = 1;
+	struct superblock *sb = w->op->sb;
+
+	fs_table_lookup(sb, sb->refcounts, blk, &refs, w->buckets, w->page);
+
+	return refs;
+}
+
+/* Leaves =blk to be released by the calling thread of an fs_rmtree walk */
+void fs_walk_release(struct walker *w, int kind, uint64_t blk, int depth, uint64_t count) {
+	struct release *rel;
+
+	if(w->nreleases == w->maxreleases) {
+		w->maxreleases = 2 * w->maxreleases + 16;
+		w->releases    = realloc(w->releases, w->maxreleases * sizeof *w->releases);
+	}
+
+	rel = &w->releases[w->nreleases++];
+	rel->kind  = kind;
+	rel->blk   = blk;
+	rel->depth = depth;
+	rel->count = count;
+}
+
+/* Adds entry =blk to the totals of =w */
+int fs_du_entry(struct walker *w, uint64_t blk, struct inode *inode, struct nodeinfo *nodeinfo,
+                const char *path) {
+	if(inode->mode == IMDIR) {
+		w->du.dirs++;
+		return 1;
+	}
+
+	w->du.files++;
+	w->du.size   += nodeinfo->size;
+	w->du.blocks += nodeinfo->blocks;
+
+	return 0;
+}
+
+/* Keeps the path of entry =blk if its name matches the pattern of the walk */
+int fs_match_entry(struct walker *w, uint64_t blk, struct inode *inode, struct nodeinfo *nodeinfo,
+                   const char *path) {
+	if(fnmatch(w->op->pattern, nodeinfo->name, 0) == 0) {
+		if(w->nfound == w->maxfound) {
+			w->maxfound = 2 * w->maxfound + 16;
+			w->found    = realloc(w->found, w->maxfound * sizeof *w->found);
+		}
+		w->found[w->nfound] = malloc(strlen(path) + 2);
+		sprintf(w->found[w->nfound++], "%s%s", path, (inode->mode == IMDIR) ? "/" : "");
+	}
+
+	return 1;
+}
+
+/* Same as fs_free_tree, for a walk thread: blocks referenced once are kept in the freed blocks of
+ * =w, the rest is left to the calling thread */
+void fs_rmtree_tree(struct walker *w, uint64_t blk, int depth, uint64_t count) {
+	uint64_t span, n;
+	uint64_t *ptrs;
+	struct superblock *sb = w->op->sb;
+
+	if(blk == 0) {
+		return;
+	}
+
+	/* Data blocks also leave the fingerprint index, which only the calling thread may change */
+	if(fs_walk_refs(w, blk) > 1 || (depth == 0 && sb->fingerprints != 0)) {
+		fs_walk_release(w, RELEASE_TREE, blk, depth, count);
+		return;
+	}
+
+	fs_batch_add(&w->freed, blk);
+	if(depth == 0) {
+		return;
+	}
+
+	ptrs = w->ptrs[depth - 1];
+	fs_read_data(sb, blk, (void*) ptrs);
+	span = fs_tree_span(sb, depth - 1);
+
+	for(uint64_t i = 0; i * span < count; i++) {
+		n = (count - i * span < span) ? count - i * span : span;
+		fs_rmtree_tree(w, ptrs[i], depth - 1, n);
+	}
+}
+
+/* Finds what removing entry =blk frees, as fs_release would, without writing anything */
+int fs_rmtree_entry(struct walker *w, uint64_t blk, struct inode *inode, struct nodeinfo *nodeinfo,
+                    const char *path) {
+	uint64_t numblks, base, span, n;
+	struct superblock *sb = w->op->sb;
+
+	if(fs_walk_refs(w, blk) > 1) { /* Still linked from a snapshot */
+		fs_walk_release(w, RELEASE_ENTITY, blk, 0, 0);
+		return 0;
+	}
+
+	fs_batch_add(&w->freed, blk);
+	fs_batch_add(&w->freed, inode->meta);
+
+	if(inode->mode == IMDIR) {
+		return 1;
+	}
+
+	if(sb->delayed != NULL) fs_walk_release(w, RELEASE_DELAYED, blk, 0, 0);
+	if(inode->next != 0) fs_walk_release(w, RELEASE_TAIL, inode->next, 0, 0);
+
+	numblks = (nodeinfo->size / sb->blksz) + ((nodeinfo->size % sb->blksz) ? 1 : 0);
+
+	for(uint64_t i = 0; i < DIRECT_MAX && i < numblks; i++) {
+		fs_rmtree_tree(w, inode->links[i], 0, 1);
+	}
+
+	base = DIRECT_MAX;
+	for(int depth = 1; depth <= 3 && base < numblks; depth++) {
+		span = fs_tree_span(sb, depth);
+		n = (numblks - base < span) ? numblks - base : span;
+		fs_rmtree_tree(w, inode->links[DIRECT_MAX + depth - 1], depth, n);
+		base += span;
+	}
+
+	return 0;
+}
+
+/************************
+* FILE SYSTEM FUNCTIONS *
+************************/
+
+/* Closes the first =n images in =images that were opened and frees =images. Keeps errno. */
+void fs_detach_images(const struct backend *backend, void **images, int n) {
+	int err = errno;
+
+	for(int i = 0; i < n; i++) {
+		if(images[i] != NULL) backend->close(images[i]);
+	}
+	free(images);
+
+	errno = err;
+}
+
+/* Opens the =n images in =names with =backend, creating them with =size bytes each if =size is
+ * not zero. Returns their backend states, or NULL with errno set. */
+void ** fs_attach_images(const struct backend *backend, const char **names, int n, uint64_t size) {
+	void **images = calloc(n, sizeof *images);
+
+	for(int i = 0; i < n; i++) {
+		if((images[i] = backend->open(names[i], size)) == NULL) {
+			fs_detach_images(backend, images, n);
+			return NULL;
+		}
+	}
+
+	return images;
+}
+
+/* Formats the =n images in =names kept in =backend, striped in chunks of =stripe blocks if there
+ * is more than one. Images are created with =size bytes, or keep their size if =size is zero. */
+struct superblock * fs_format_with(const struct backend *backend, const char **names, int n, uint64_t size,
+                                   uint64_t blocksize, uint64_t stripe) {
+	if(blocksize < MIN_BLOCK_SIZE || n < 1 || (n > 1 && stripe == 0)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	uint64_t blks, chunks = (uint64_t) -1;
+	void **images = fs_attach_images(backend, names, n, size);
+
+	if(images == NULL) {
+		return NULL;
+	}
+
+	/* Every image holds as many whole chunks as the smallest one */
+	for(int i = 0; i < n; i++) {
+		size = backend->size(images[i]);
+		if(n > 1 && size / blocksize / stripe < chunks) {
+			chunks = size / blocksize / stripe;
+		}
+	}
+	blks = (n == 1) ? size / blocksize : chunks * stripe * n;
+
+	if(blks < MIN_BLOCK_COUNT) {
+		fs_detach_images(backend, images, n);
+		errno = ENOSPC;
+		return NULL;
+	}
+
+	struct superblock *sb     = malloc(sizeof *sb);
+	struct inode *rootnode    = malloc(blocksize);
+	struct nodeinfo *rootinfo = malloc(blocksize);
+
+	/* Every block after the root directory is in the free range, which is never written */
+	sb->magic    = 0xdcc605f5;
+	sb->blks     = blks;
+	sb->blksz    = blocksize;
+	sb->freeblks = sb->blks - 3;
+	sb->freelist = 0;
+	sb->root     = 1;
+	sb->version  = SUPERBLOCK_VERSION;
+	sb->flags    = 0;
+	sb->fingerprints = 0;
+	sb->refcounts    = 0;
+	sb->snaps    = 0;
+	sb->members  = n;
+	sb->stripe   = (n > 1) ? stripe : 0;
+	sb->tailpos  = 0;
+	sb->frontier = 3;
+	sb->fd       = (backend->fd != NULL) ? backend->fd(images[0]) : -1;
+	sb->rdonly   = 0;
+	sb->delayed  = NULL;
+	sb->reserved = 0;
+	sb->cache    = NULL;
+	sb->pool     = NULL;
+	sb->slab     = NULL;
+	sb->batch    = NULL;
+	sb->backend  = backend;
+	sb->images   = images;
+
+	rootnode->mode   = IMDIR;
+	rootnode->parent = 1;
+	rootnode->meta   = 2;
+	rootnode->next   = 0;
+	for(int i = 0; i < LINK_MAX; i++) {
+		rootnode->links[i] = 0;
+	}
+
+	rootinfo->size   = 0;
+	rootinfo->blocks = 0;
+	strcpy(rootinfo->name, "/");
+
+	fs_write_super(sb);
+	fs_write_data(sb, 1, (void*) rootnode);
+	fs_write_data(sb, 2, (void*) rootinfo);
+
+	free(rootnode);
+	free(rootinfo);
+
+	fs_cache_init(sb);
+
+	return sb;
+}
+
+/* Returns zero if =sb, as read from an image, is a filesystem this code
+ * understands: its layout and every feature enabled in it are known */
+int fs_check_super(const struct superblock *sb) {
+	if(sb->magic != 0xdcc605f5 || sb->version != SUPERBLOCK_VERSION) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if(sb->flags & ~(uint64_t) FS_ALLFLAGS) {
+		errno = EBADF;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Opens the filesystem in the =n images in =names kept in =backend */
+struct superblock * fs_open_with(const struct backend *backend, const char **names, int n) {
+	struct superblock *sb;
+	struct iovec iov;
+	void **images;
+
+	if(n < 1) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if((images = fs_attach_images(backend, names, n, 0)) == NULL) {
+		return NULL;
+	}
+
+	sb = malloc(sizeof *sb);
+	iov.iov_base = sb;
+	iov.iov_len  = SUPERBLOCK_DISK_SIZE;
+
+	if(backend->readv(images[0], &iov, 1, 0) != SUPERBLOCK_DISK_SIZE) {
+		free(sb);
+		fs_detach_images(backend, images, n);
+		errno = EBADF;
+		return NULL;
+	}
+
+	if(fs_check_super(sb)) {
+		free(sb);
+		fs_detach_images(backend, images, n);
+		return NULL;
+	}
+
+	/* Blocks would be looked for in the wrong images */
+	if((sb->members > 1 ? sb->members : 1) != (uint64_t) n || (n == 1) != (sb->stripe == 0)) {
+		free(sb);
+		fs_detach_images(backend, images, n);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	sb->fd = (backend->fd != NULL) ? backend->fd(images[0]) : -1;
+	sb->rdonly = 0;
+	sb->delayed = NULL;
+	sb->reserved = 0;
+	sb->cache = NULL;
+	sb->pool = NULL;
+	sb->slab = NULL;
+	sb->batch = NULL;
+	sb->backend = backend;
+	sb->images = images;
+
+	fs_cache_init(sb);
+
+	return sb;
+}
+
+struct superblock * fs_format(const char *fname, uint64_t blocksize) {
+	return fs_format_with(&fs_file_backend, &fname, 1, 0, blocksize, 0);
+}
+
+struct superblock * fs_format_striped(const char **fnames, int n, uint64_t blocksize, uint64_t stripe) {
+	return fs_format_with(&fs_file_backend, fnames, n, 0, blocksize, stripe);
+}
+
+struct superblock * fs_format_backend(const struct backend *backend, const char *name, uint64_t size,
+                                      uint64_t blocksize) {
+	return fs_format_with(backend, &name, 1, size, blocksize, 0);
+}
 
 struct superblock * fs_open(const char *fname) {
-	struct superblock *sb = malloc(sizeof *sb);
-	int fd = open(fname, O_RDWR, 0666);
+	return fs_open_with(&fs_file_backend, &fname, 1);
+}
+
+struct superblock * fs_open_striped(const char **fnames, int n) {
+	return fs_open_with(&fs_file_backend, fnames, n);
+}
+
+struct superblock * fs_open_backend(const struct backend *backend, const char *name) {
+	return fs_open_with(backend, &name, 1);
+}
+
+struct superblock * fs_open_direct(const char *fname) {
+	size_t align;
+	char *block;
+	struct superblock *sb;
+	int fd = open(fname, O_RDWR | O_DIRECT, 0666);
+
+	if(fd == -1) {
+		return NULL;
+	}
+
+	if(flock(fd, LOCK_EX | LOCK_NB) == -1){
+		close(fd);
+		errno = EBUSY;
+		return NULL;
+	}
+
+	if((align = fs_direct_align(fd)) == 0 || posix_memalign((void**) &block, align, align)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	sb = malloc(sizeof *sb);
+	if(pread(fd, block, align, 0) != (ssize_t) align) memset(block, 0, align);
+	memcpy(sb, block, SUPERBLOCK_DISK_SIZE);
+	free(block);
+
+	sb->fd = fd;
+	sb->rdonly = 0;
+	sb->delayed = NULL;
+	sb->reserved = 0;
+	sb->cache = NULL;
+	sb->pool = NULL;
+	sb->slab = NULL;
+	sb->batch = NULL;
+
+	if(fs_check_super(sb)) {
+		close(fd);
+		free(sb);
+		return NULL;
+	}
+
+	if(sb->members > 1) { /* Only the first image of a stripe */
+		close(fd);
+		free(sb);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if(sb->blksz % align != 0) { /* Blocks could not be transferred on their own */
+		close(fd);
+		free(sb);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if(fs_pool_init(sb, align)) {
+		close(fd);
+		free(sb);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	/* The pool does the aligning, the file backend moves its buffers */
+	sb->backend   = &fs_file_backend;
+	sb->images    = malloc(sizeof *sb->images);
+	sb->images[0] = fs_file_wrap(fd);
+
+	fs_cache_init(sb);
+
+	return sb;
+}
+
+int fs_close(struct superblock *sb) {
+	if(sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if(!sb->rdonly) {
+		fs_flush(sb);
+	}
+	fs_cache_free(sb);
+	fs_pool_free(sb);
+	fs_slab_free(sb);
+	fs_detach_images(sb->backend, sb->images, fs_image_count(sb));
+	free(sb);
+
+	return 0;
+}
+
+int fs_flush(struct superblock *sb) {
+	if(sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+
+	while(sb->delayed != NULL) {
+		fs_flush_delayed(sb, sb->delayed);
+	}
+
+	for(int m = 0; m < fs_image_count(sb); m++) {
+		if(sb->backend->flush(sb->images[m]) == -1) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+uint64_t fs_get_block(struct superblock *sb) {
+	if(sb->rdonly) {
+		errno = EROFS;
+		return (uint64_t) -1;
+	}
+
+	if(sb->freeblks == 0) {
+		return 0;
+	}
+
+	if(sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return (uint64_t) -1;
+	}
+
+	uint64_t ret;
+
+	if(sb->freelist == 0) { /* Hand out the free range at the end */
+		if(sb->frontier == 0) {
+			return 0;
+		}
+
+		ret = sb->frontier++;
+		sb->freeblks--;
+		if(sb->frontier == sb->blks) sb->frontier = 0;
+
+		fs_write_super(sb);
+
+		return ret;
+	}
+
+	struct freepage *freepage = fs_slab_get(sb);
+
+	fs_read_data(sb, sb->freelist, (void*) freepage);
+
+	if(freepage->count > 0) { /* The blocks a freepage links go before it */
+		ret = freepage->links[--freepage->count];
+		fs_write_data(sb, sb->freelist, (void*) freepage);
+	}
+	else {
+		ret = sb->freelist;
+		sb->freelist = freepage->next;
+	}
+	sb->freeblks--;
+
+	fs_write_super(sb);
+
+	fs_slab_put(sb, freepage);
+
+	return ret;
+}
+
+int fs_put_block(struct superblock *sb, uint64_t block) {
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+
+	if(sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if(sb->batch != NULL) { /* Put back with the rest of the batch */
+		fs_batch_add(sb->batch, block);
+		return 0;
+	}
+
+	if(sb->flags & FS_DISCARD) {
+		fs_put_listed(sb, &block, 1);
+		return 0;
+	}
+
+	struct freepage *freepage = fs_slab_zero(sb);
+
+	freepage->next  = sb->freelist;
+	freepage->count = 0;
+
+	sb->freeblks++;
+	sb->freelist = block;
+
+	fs_write_data(sb, block, (void*) freepage);
+	fs_write_super(sb);
+
+	fs_slab_put(sb, freepage);
+
+	return 0;
+}
+
+int fs_grow(struct superblock *sb, uint64_t blks) {
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+
+	if(sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if(blks < sb->blks) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for(int m = 0; m < fs_image_count(sb); m++) { /* Each image grows by its share */
+		if(sb->backend->resize(sb->images[m], fs_image_blocks(sb, m, blks) * sb->blksz) == -1) {
+			return -1;
+		}
+	}
+
+	/* The free range always ends at the last block, the new blocks extend it */
+	if(sb->frontier == 0) sb->frontier = sb->blks;
+	sb->freeblks += blks - sb->blks;
+	sb->blks = blks;
+	if(sb->frontier == sb->blks) sb->frontier = 0;
+
+	fs_write_super(sb);
+
+	return 0;
+}
+
+int fs_trim(struct superblock *sb) {
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+
+	if(sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if(sb->backend->discard == NULL) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+
+	int ret;
+	struct batch batch = {NULL, 0, 0};
+	struct freepage *freepage = fs_slab_get(sb);
+
+	/* The free list is taken apart, freepages included, and listed anew */
+	for(uint64_t blk = sb->freelist; blk != 0; blk = freepage->next) {
+		fs_read_data(sb, blk, (void*) freepage);
+		fs_batch_add(&batch, blk);
+		for(uint64_t i = 0; i < freepage->count; i++) {
+			fs_batch_add(&batch, freepage->links[i]);
+		}
+	}
+	fs_slab_put(sb, freepage);
+
+	sb->freelist  = 0;
+	sb->freeblks -= batch.count;
+	ret = fs_put_listed(sb, batch.blocks, batch.count);
+	free(batch.blocks);
+
+	if(sb->frontier != 0 && fs_discard_run(sb, sb->frontier, sb->blks - sb->frontier)) {
+		ret = -1;
+	}
+
+	return ret;
+}
+
+int fs_setflags(struct superblock *sb, uint64_t flags) {
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+
+	if(sb->magic != 0xdcc605f5) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if(flags & ~(uint64_t) FS_ALLFLAGS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(!(flags & FS_DELALLOC)) {
+		fs_flush(sb);
+	}
+
+	sb->flags = flags;
+	fs_write_super(sb);
+
+	return 0;
+}
+
+int fs_write_file(struct superblock *sb, const char *fname, char *buf, size_t cnt) {
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if(fs_unshare_path(sb, fname, 0)) {
+		return -1;
+	}
+
+	uint64_t datablks, mapblks, neededblks, pending, tail;
+	uint64_t fileblk;
+	uint64_t *blocks;
+	int placed;
+	struct dir *dir;
+	struct link *link;
+	struct inode *inode       = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_zero(sb);
+	char *scratch             = fs_slab_get(sb);
+
+	datablks = (cnt / sb->blksz) + ((cnt % sb->blksz) ? 1 : 0); /* Blocks needed for data */
+	mapblks  = fs_map_blocks(sb, datablks); /* Indirect blocks needed to map them */
+
+	if(datablks > fs_file_max(sb)) {
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		fs_slab_put(sb, scratch);
+		errno = EFBIG;
+		return -1;
+	}
+
+	dir = fs_find_dir_info(sb, fname);
+
+	if(dir == NULL) { /* Path not found */
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		fs_slab_put(sb, scratch);
+		return -1;
+	}
+
+	if(dir->nodeblock != -1) {
+		fs_read_data(sb, dir->nodeblock, (void*) inode);
+		if(inode->mode != IMREG) {
+			fs_slab_put(sb, dir);
+			fs_slab_put(sb, inode);
+			fs_slab_put(sb, nodeinfo);
+			fs_slab_put(sb, scratch);
+			errno = EISDIR;
+			return -1;
+		}
+		fs_unlink(sb, fname);
+	}
+
+	link = fs_find_link(sb, dir->dirnode, 0);
+
+	neededblks = datablks + mapblks + 2 + (link->index == -1 ? 1 : 0);
+
+	if(neededblks > sb->freeblks) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, link);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		fs_slab_put(sb, scratch);
+		errno = ENOSPC;
+		return -1;
+	}
+
+	fileblk = fs_get_block(sb);
+
+	if(link->index == -1) { /* If no link exists, create child of dirnode to store it */
+		fs_add_link(sb, fs_create_child(sb, link->inode, dir->dirnode), 0, fileblk);
+	}
+	else {
+		fs_add_link(sb, link->inode, link->index, fileblk);
+	}
+
+	inode->mode   = IMREG;
+	inode->parent = dir->dirnode;
+	inode->meta   = fs_get_block(sb);
+	inode->next   = 0;
+
+	/* Data first, then the indirect blocks mapping it */
+	blocks  = malloc((datablks ? datablks : 1) * sizeof *blocks);
+	pending = datablks + mapblks; /* Blocks still to be allocated */
+	nodeinfo->blocks = 0;
+
+	if(sb->flags & FS_DELALLOC) { /* Blocks are chosen by fs_flush, until then the file is a hole */
+		for(uint64_t i = 0; i < datablks; i++) {
+			blocks[i] = 0;
+		}
+	}
+
+	/* A packed tail leaves the last block a hole, delayed files are packed when flushed */
+	tail = (sb->flags & FS_DELALLOC) ? 0 : fs_tail_len(sb, buf, cnt);
+
+	/* The blocks of a striped filesystem are taken in one batch, so all images write at once */
+	placed = (sb->stripe != 0 && !(sb->flags & (FS_DEDUP | FS_DELALLOC)));
+	if(placed) {
+		nodeinfo->blocks = fs_place_file(sb, inode, buf, cnt - tail, scratch);
+	}
+
+	for(uint64_t i = 0; i < datablks && !placed && !(sb->flags & FS_DELALLOC); i++) {
+		pending--;
+		blocks[i] = (tail != 0 && i == datablks - 1) ? 0 :
+		            fs_store_block(sb, fs_file_block(sb, buf, cnt, i, scratch), pending);
+		if(blocks[i] != 0) nodeinfo->blocks++;
+	}
+
+	if(!placed) {
+		fs_build_map(sb, inode, blocks, datablks, NULL);
+	}
+
+	if(tail != 0) {
+		inode->next = fs_pack_tail(sb, buf + (cnt - tail), tail);
+	}
+
+	nodeinfo->size = cnt;
+	strcpy(nodeinfo->name, dir->nodename);
+
+	fs_write_data(sb, fileblk, (void*) inode);
+	fs_write_data(sb, inode->meta, (void*) nodeinfo);
+
+	if(sb->flags & FS_DELALLOC) {
+		fs_delay_file(sb, fileblk, buf, cnt, pending);
+	}
+
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, link);
+	free(blocks);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+	fs_slab_put(sb, scratch);
+
+	return 0;
+}
+
+ssize_t fs_pread_file(struct superblock *sb, const char *fname, char *buf, size_t bufsz, uint64_t offset) {
+	ssize_t ret;
+	struct dir *dir;
+	struct readop op;
+	struct delayed *d;
+	struct inode *inode = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	dir = fs_find_dir_info(sb, fname);
+
+	if(dir == NULL || dir->nodeblock == -1) {
+		if(dir != NULL) errno = ENOENT;
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return -1;
+	}
+
+	fs_read_data(sb, dir->nodeblock, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+
+	if(inode->mode != IMREG) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = EISDIR;
+		return -1;
+	}
+
+	if(offset >= nodeinfo->size) {
+		bufsz = 0;
+	}
+	else if(bufsz > nodeinfo->size - offset) {
+		bufsz = nodeinfo->size - offset;
+	}
+
+	ret        = bufsz;
+	op.buf     = buf;
+	op.offset  = offset;
+	op.count   = bufsz;
+	op.scratch = fs_slab_get(sb);
+
+	if(bufsz > 0 && (d = fs_find_delayed(sb, dir->nodeblock)) != NULL) { /* Not flushed yet */
+		memcpy(buf, d->data + offset, bufsz);
+	}
+	else if(sb->stripe != 0 && bufsz >= STRIPE_MIN * sb->blksz) {
+		if(fs_read_striped(sb, inode, &op)) ret = -1;
+		fs_read_tail(sb, &op, inode->next, nodeinfo->size / sb->blksz * sb->blksz);
+	}
+	else if(bufsz > 0) {
+		/* Start the next blocks on their way before waiting for these */
+		fs_readahead(sb, dir->nodeblock, inode, nodeinfo->size, offset / sb->blksz,
+		             (offset + bufsz + sb->blksz - 1) / sb->blksz);
+		fs_walk_file(sb, inode, offset / sb->blksz, (offset + bufsz + sb->blksz - 1) / sb->blksz,
+		             fs_read_block, &op);
+		fs_read_tail(sb, &op, inode->next, nodeinfo->size / sb->blksz * sb->blksz);
+	}
+
+	fs_slab_put(sb, op.scratch);
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+	return ret;
+}
+
+ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf, size_t bufsz) {
+	return fs_pread_file(sb, fname, buf, bufsz, 0);
+}
+
+int fs_view_file(struct superblock *sb, const char *fname, uint64_t offset, size_t count,
+                 struct view *views, int max) {
+	struct dir *dir;
+	struct viewop op;
+	struct delayed *d;
+	struct inode *inode = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	if(sb->cache == NULL) {
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	dir = fs_find_dir_info(sb, fname);
+
+	if(dir == NULL || dir->nodeblock == -1) {
+		if(dir != NULL) errno = ENOENT;
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return -1;
+	}
+
+	fs_read_data(sb, dir->nodeblock, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+
+	if(inode->mode != IMREG) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = EISDIR;
+		return -1;
+	}
+
+	if(offset >= nodeinfo->size) {
+		count = 0;
+	}
+	else if(count > nodeinfo->size - offset) {
+		count = nodeinfo->size - offset;
+	}
+
+	if((d = fs_find_delayed(sb, dir->nodeblock)) != NULL) { /* Views need the blocks on disk */
+		fs_flush_delayed(sb, d);
+		fs_read_data(sb, dir->nodeblock, (void*) inode);
+	}
+
+	op.views  = views;
+	op.n      = 0;
+	op.max    = max;
+	op.offset = offset;
+	op.count  = count;
+	op.tail   = inode->next;
+	op.last   = nodeinfo->size / sb->blksz;
+
+	if(count > 0) {
+		fs_readahead(sb, dir->nodeblock, inode, nodeinfo->size, offset / sb->blksz,
+		             (offset + count + sb->blksz - 1) / sb->blksz);
+		fs_walk_file(sb, inode, offset / sb->blksz, (offset + count + sb->blksz - 1) / sb->blksz,
+		             fs_view_block, &op);
+	}
+
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+
+	if(count > 0 && op.n == 0) { /* Every pinnable slot is held by other views */
+		errno = ENOBUFS;
+		return -1;
+	}
+
+	return op.n;
+}
+
+void fs_release_views(struct superblock *sb, struct view *views, int n) {
+	int slot;
+	struct cache *c = sb->cache;
+
+	pthread_mutex_lock(&c->lock);
+
+	for(int i = 0; i < n; i++) {
+		if((slot = views[i].slot) == -1) continue;
+
+		if(--c->pins[slot] == 0) {
+			c->pinned--;
+			if(c->state[slot] == SLOT_DETACHED) c->state[slot] = SLOT_FREE;
+		}
+		views[i].slot = -1;
+		views[i].data = NULL;
+	}
+
+	pthread_mutex_unlock(&c->lock);
+}
+
+int fs_import(struct superblock *sb, int hostfd, const char *fname) {
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+
+	int ret = 0, err;
+	uint64_t size, datablks, mapblks, stored, j;
+	uint64_t *blocks, *pool;
+	struct stat st;
+	struct dir *dir;
+	struct inode *inode;
+	struct nodeinfo *nodeinfo;
+	char *tail;
+
+	if(fstat(hostfd, &st) == -1) {
+		return -1;
+	}
+
+	if(!S_ISREG(st.st_mode) || (sb->flags & FS_DEDUP)) {
+		return fs_import_stream(sb, hostfd, fname, S_ISREG(st.st_mode));
+	}
+
+	size     = st.st_size;
+	datablks = (size / sb->blksz) + ((size % sb->blksz) ? 1 : 0);
+	mapblks  = fs_map_blocks(sb, datablks);
+
+	if(datablks > fs_file_max(sb)) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	/* An empty file takes the directory entry, replacing an older file */
+	tail = fs_slab_zero(sb);
+	if(fs_write_file(sb, fname, tail, 0)) {
+		fs_slab_put(sb, tail);
+		return -1;
+	}
+
+	dir      = fs_find_dir_info(sb, fname);
+	inode    = fs_slab_get(sb);
+	nodeinfo = fs_slab_get(sb);
+	blocks   = malloc((datablks ? datablks : 1) * sizeof *blocks);
+
+	fs_drop_delayed(sb, dir->nodeblock); /* The data is allocated right away */
+	fs_read_data(sb, dir->nodeblock, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+
+	stored = fs_host_data(sb, hostfd, size, blocks, datablks);
+
+	if(stored + mapblks > sb->freeblks) {
+		fs_unlink(sb, fname);
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		fs_slab_put(sb, tail);
+		free(blocks);
+		errno = ENOSPC;
+		return -1;
+	}
+
+	pool = fs_place_blocks(sb, blocks, datablks, stored, mapblks);
+
+	for(uint64_t i = 0; i < datablks && ret == 0; i = j) {
+		j = i + 1;
+		if(blocks[i] == 0) continue;
+
+		if((i + 1) * sb->blksz > size) { /* Last block, padded with zeros */
+			if(pread(hostfd, tail, size - i * sb->blksz, i * sb->blksz) == -1) ret = -1;
+			fs_write_data(sb, blocks[i], tail);
+			continue;
+		}
+
+		while(j < datablks && blocks[j] == blocks[j - 1] + 1 && (j + 1) * sb->blksz <= size) {
+			j++;
+		}
+		ret = fs_import_run(sb, hostfd, i * sb->blksz, blocks[i], j - i);
+	}
+
+	fs_map_placed(sb, inode, blocks, datablks, pool, mapblks);
+
+	nodeinfo->size   = size;
+	nodeinfo->blocks = stored;
+
+	fs_write_data(sb, dir->nodeblock, (void*) inode);
+	fs_write_data(sb, inode->meta, (void*) nodeinfo);
+
+	if(ret != 0) { /* The host file could not be read */
+		err = errno;
+		fs_unlink(sb, fname);
+		errno = err;
+	}
+
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+	fs_slab_put(sb, tail);
+	free(blocks);
+
+	return ret;
+}
+
+int fs_export(struct superblock *sb, const char *fname, int hostfd) {
+	int ret = 0;
+	uint64_t last;
+	struct dir *dir;
+	struct stat st;
+	struct delayed *d;
+	struct exportop op;
+	struct inode *inode = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	dir = fs_find_dir_info(sb, fname);
+
+	if(dir == NULL || dir->nodeblock == -1) {
+		if(dir != NULL) errno = ENOENT;
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return -1;
+	}
+
+	fs_read_data(sb, dir->nodeblock, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+
+	if(inode->mode != IMREG) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = EISDIR;
+		return -1;
+	}
+
+	if(fstat(hostfd, &st) == -1) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return -1;
+	}
+
+	if((d = fs_find_delayed(sb, dir->nodeblock)) != NULL) { /* The kernel copies what is on disk */
+		fs_flush_delayed(sb, d);
+		fs_read_data(sb, dir->nodeblock, (void*) inode);
+	}
+
+	op.hostfd  = hostfd;
+	op.stream  = !S_ISREG(st.st_mode);
+	op.size    = nodeinfo->size;
+	op.count   = 0;
+	op.scratch = fs_slab_get(sb);
+
+	if(!op.stream && ftruncate(hostfd, 0) == -1) { /* Holes are left unwritten */
+		ret = -1;
+	}
+
+	/* A packed tail is written after the blocks, out of its tail block */
+	last = (inode->next != 0) ? op.size / sb->blksz : (op.size + sb->blksz - 1) / sb->blksz;
+
+	if(ret == 0) {
+		ret = fs_walk_file(sb, inode, 0, last, fs_export_block, &op);
+	}
+	if(ret == 0) {
+		ret = fs_export_run(sb, &op);
+	}
+	if(ret == 0 && inode->next != 0) {
+		fs_read_data(sb, inode->next / sb->blksz, (void*) op.scratch);
+		ret = fs_write_all(hostfd, op.scratch + inode->next % sb->blksz, op.size - last * sb->blksz,
+		                   op.stream ? -1 : (off_t) (last * sb->blksz));
+	}
+	if(ret == 0 && !op.stream) {
+		ret = ftruncate(hostfd, op.size);
+	}
+
+	fs_slab_put(sb, op.scratch);
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+
+	return ret;
+}
+
+ssize_t fs_pwrite_file(struct superblock *sb, const char *fname, char *buf, size_t cnt, uint64_t offset) {
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if(fs_unshare_path(sb, fname, 1)) {
+		return -1;
+	}
+
+	uint64_t first, end, newsize, reserve;
+	struct dir *dir;
+	struct delayed *d;
+	struct writeop op;
+	struct inode *inode = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	dir = fs_find_dir_info(sb, fname);
+
+	if(dir == NULL || dir->nodeblock == -1) {
+		if(dir != NULL) errno = ENOENT;
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return -1;
+	}
+
+	fs_read_data(sb, dir->nodeblock, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+
+	if(inode->mode != IMREG) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = EISDIR;
+		return -1;
+	}
+
+	newsize = (offset + cnt > nodeinfo->size) ? offset + cnt : nodeinfo->size;
+	first   = offset / sb->blksz;
+	end     = (offset + cnt + sb->blksz - 1) / sb->blksz;
+
+	if((newsize + sb->blksz - 1) / sb->blksz > fs_file_max(sb)) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = EFBIG;
+		return -1;
+	}
+
+	if((d = fs_find_delayed(sb, dir->nodeblock)) != NULL) { /* Not flushed yet, write in memory */
+		reserve = (newsize / sb->blksz) + ((newsize % sb->blksz) ? 1 : 0);
+		reserve += fs_map_blocks(sb, reserve);
+
+		if(reserve > d->reserved && reserve - d->reserved > sb->freeblks) {
+			fs_slab_put(sb, dir);
+			fs_slab_put(sb, inode);
+			fs_slab_put(sb, nodeinfo);
+			errno = ENOSPC;
+			return -1;
+		}
+
+		sb->freeblks = sb->freeblks + d->reserved - reserve;
+		sb->reserved = sb->reserved - d->reserved + reserve;
+		d->reserved  = reserve;
+
+		if(newsize > d->cnt) {
+			d->data = realloc(d->data, newsize);
+			memset(d->data + d->cnt, 0, newsize - d->cnt);
+			d->cnt = newsize;
+		}
+		memcpy(d->data + offset, buf, cnt);
+
+		nodeinfo->size = newsize;
+		fs_write_data(sb, inode->meta, (void*) nodeinfo);
+
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return cnt;
+	}
+
+	/* A packed tail is only written in a block of its own */
+	if(cnt > 0 && offset + cnt > nodeinfo->size / sb->blksz * sb->blksz && fs_unpack_tail(sb, inode, nodeinfo)) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return -1;
+	}
+
+	if(cnt > 0 && fs_cow_blocks(sb, first, end) > sb->freeblks) {
+		fs_write_data(sb, dir->nodeblock, (void*) inode); /* The tail may have been moved */
+		fs_write_data(sb, inode->meta, (void*) nodeinfo);
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = ENOSPC;
+		return -1;
+	}
+
+	op.buf     = buf;
+	op.offset  = offset;
+	op.count   = cnt;
+	op.size    = newsize;
+	op.pending = end - first;
+	op.stored  = 0;
+	op.scratch = fs_slab_get(sb);
 
-	if(flock(fd, LOCK_EX | LOCK_NB) == -1){
-		errno = EBUSY;
-		return NULL;
+	if(cnt > 0) {
+		fs_cow_file(sb, inode, first, end, &op);
 	}
 
-	read(fd, sb, sizeof *sb);
-	sb->fd = fd;
+	nodeinfo->size    = newsize;
+	nodeinfo->blocks += op.stored;
 
-	if(sb->magic != 0xdcc605f5) {
-		errno = EBADF;
-		return NULL;
+	fs_write_data(sb, dir->nodeblock, (void*) inode);
+	fs_write_data(sb, inode->meta, (void*) nodeinfo);
+
+	fs_slab_put(sb, op.scratch);
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+	return cnt;
+}
+
+int fs_clone(struct superblock *sb, const char *srcname, const char *dstname) {
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if(fs_unshare_path(sb, dstname, 0)) {
+		return -1;
 	}
 
-	return sb;
+	uint64_t fileblk;
+	int i, shared, tailref = 0;
+	struct dir *src, *dst;
+	struct link *link;
+	struct delayed *d;
+	struct inode *inode       = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	src = fs_find_dir_info(sb, srcname);
+	dst = (src != NULL) ? fs_find_dir_info(sb, dstname) : NULL;
+
+	if(src == NULL || dst == NULL) {
+		fs_slab_put(sb, src);
+		fs_slab_put(sb, dst);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return -1;
+	}
+
+	errno = 0;
+
+	if(src->nodeblock == -1) {
+		errno = ENOENT;
+	}
+	else if(dst->nodeblock != -1) {
+		errno = EEXIST;
+	}
+	else {
+		if((d = fs_find_delayed(sb, src->nodeblock)) != NULL) { /* The clone shares blocks on disk */
+			fs_flush_delayed(sb, d);
+		}
+		fs_read_data(sb, src->nodeblock, (void*) inode);
+		if(inode->mode != IMREG) errno = EISDIR;
+	}
+
+	link = NULL;
+	if(errno == 0) {
+		link = fs_find_link(sb, dst->dirnode, 0);
+		if(sb->freeblks < 2 + (link->index == -1 ? 1 : 0)) errno = ENOSPC;
+	}
+
+	/* The clone shares the data and indirect blocks linked from the inode */
+	for(i = 0, shared = 0; errno == 0 && i < LINK_MAX; i++) {
+		if(inode->links[i] == 0) continue;
+		if(fs_ref_block(sb, inode->links[i])) {
+			errno = ENOSPC;
+			break;
+		}
+		shared = i + 1;
+	}
+
+	if(errno == 0 && inode->next != 0) { /* And the block holding its packed tail */
+		if(fs_ref_block(sb, inode->next / sb->blksz)) {
+			errno = ENOSPC;
+		}
+		else {
+			tailref = 1;
+		}
+	}
+
+	/* The reference count table may have used the blocks reserved for the clone */
+	if(errno == 0 && sb->freeblks < 2 + (link->index == -1 ? 1 : 0)) {
+		errno = ENOSPC;
+	}
+
+	if(errno != 0) {
+		for(i = 0; link != NULL && i < shared; i++) { /* Undo the references taken */
+			if(inode->links[i] != 0) fs_unref_block(sb, inode->links[i]);
+		}
+		if(tailref) {
+			fs_unref_block(sb, inode->next / sb->blksz);
+		}
+		fs_slab_put(sb, src);
+		fs_slab_put(sb, dst);
+		fs_slab_put(sb, link);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return -1;
+	}
+
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+
+	fileblk = fs_get_block(sb);
+
+	if(link->index == -1) {
+		fs_add_link(sb, fs_create_child(sb, link->inode, dst->dirnode), 0, fileblk);
+	}
+	else {
+		fs_add_link(sb, link->inode, link->index, fileblk);
+	}
+
+	inode->parent = dst->dirnode;
+	inode->meta   = fs_get_block(sb);
+	strcpy(nodeinfo->name, dst->nodename);
+
+	fs_write_data(sb, fileblk, (void*) inode);
+	fs_write_data(sb, inode->meta, (void*) nodeinfo);
+
+	fs_slab_put(sb, src);
+	fs_slab_put(sb, dst);
+	fs_slab_put(sb, link);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+
+	return 0;
 }
 
-int fs_close(struct superblock *sb) {
-	if(sb->magic != 0xdcc605f5) {
-		errno = EBADF;
+int fs_unlink(struct superblock *sb, const char *fname) {
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if(fs_unshare_path(sb, fname, 0)) {
 		return -1;
 	}
 
-	flock(sb->fd, LOCK_UN);
-	close(sb->fd);
-	free(sb);
+	struct dir *dir;
+	struct link *link;
+	struct batch batch;
+	struct inode *inode = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	dir = fs_find_dir_info(sb, fname);
+
+	if(dir == NULL || dir->nodeblock == -1) {
+		if(dir != NULL) errno = ENOENT;
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return -1;
+	}
+
+	fs_read_data(sb, dir->nodeblock, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+
+	if(inode->mode != IMREG) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = ENOENT;
+		return -1;
+	}
+
+	/* Remove parent link to file, then free it unless a snapshot still has it */
+	link = fs_find_link(sb, dir->dirnode, dir->nodeblock);
+
+	fs_batch_begin(sb, &batch);
+	fs_remove_link(sb, link->inode, link->index);
+	fs_release(sb, dir->nodeblock);
+	fs_batch_end(sb, &batch);
+
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, link);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
 
 	return 0;
 }
 
-uint64_t fs_get_block(struct superblock *sb) {
-	if(sb->freeblks == 0) {
+int fs_mkdir(struct superblock *sb, const char *dname) {
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if(fs_unshare_path(sb, dname, 0)) {
+		return -1;
+	}
+
+	uint64_t dirblk;
+	struct dir *dir;
+	struct link *link;
+	struct inode *inode       = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_zero(sb);
+
+	dir = fs_find_dir_info(sb, dname);
+
+	if(dir == NULL) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return -1;
+	}
+
+	if(dir->nodeblock != -1) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = EEXIST;
+		return -1;
+	}
+
+	link = fs_find_link(sb, dir->dirnode, 0);
+
+	if((sb->freeblks < (2 + (link->index == -1 ? 1 : 0)))) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, link);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = ENOSPC;
+		return -1;
+	}
+
+	dirblk = fs_get_block(sb);
+
+	/* If no free links was found, needs to create new child inode */
+	if(link->index == -1) {
+		fs_add_link(sb, fs_create_child(sb, link->inode, dir->dirnode), 0, dirblk);
+	}
+	else {
+		fs_add_link(sb, link->inode, link->index, dirblk);
+	}
+
+	inode->mode = IMDIR;
+	inode->parent = dir->dirnode;
+	inode->meta = fs_get_block(sb);
+	inode->next = 0;
+	for(int i = 0; i < LINK_MAX; i++) {
+		inode->links[i] = 0;
+	}
+
+	nodeinfo->size   = 0;
+	nodeinfo->blocks = 0;
+	strcpy(nodeinfo->name, dir->nodename);
+
+	fs_write_data(sb, dirblk, (void*) inode);
+	fs_write_data(sb, inode->meta, (void*) nodeinfo);
+
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, link);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+
+	return 0;
+}
+
+int fs_rmdir(struct superblock *sb, const char *dname) {
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if(fs_unshare_path(sb, dname, 0)) {
+		return -1;
+	}
+
+	struct dir *dir;
+	struct link *link;
+	struct batch batch;
+	struct inode *inode       = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	dir = fs_find_dir_info(sb, dname);
+
+	if(dir == NULL) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return -1;
+	}
+
+	if(dir->nodeblock == sb->root) { /* Trying to remove root */
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = EBUSY;
+		return -1;
+	}
+
+	fs_read_data(sb, dir->nodeblock, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+
+	if(inode->mode != IMDIR) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = ENOTDIR;
+		return -1;
+	}
+
+	if(nodeinfo->size) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		errno = ENOTEMPTY;
+		return -1;
+	}	
+
+	link = fs_find_link(sb, dir->dirnode, dir->nodeblock);
+
+	fs_batch_begin(sb, &batch);
+	fs_remove_link(sb, link->inode, link->index);
+	fs_release(sb, dir->nodeblock);
+	fs_batch_end(sb, &batch);
+
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, link);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
+
+	return 0;
+}
+
+int fs_rename(struct superblock *sb, const char *oldpath, const char *newpath, int flags) {
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+	if(fs_unshare_path(sb, oldpath, 1) || fs_unshare_path(sb, newpath, 0)) {
+		return -1;
+	}
+
+	struct dir *src, *dst;
+	struct link *link;
+	struct inode *inode          = fs_slab_get(sb);
+	struct inode *auxinode       = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo    = fs_slab_get(sb);
+	struct nodeinfo *auxnodeinfo = fs_slab_get(sb);
+
+	src = fs_find_dir_info(sb, oldpath);
+	dst = (src != NULL) ? fs_find_dir_info(sb, newpath) : NULL;
+
+	if(src == NULL || dst == NULL) {
+		fs_slab_put(sb, src);
+		fs_slab_put(sb, dst);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, auxinode);
+		fs_slab_put(sb, nodeinfo);
+		fs_slab_put(sb, auxnodeinfo);
+		return -1;
+	}
+
+	errno = 0;
+
+	if(src->nodeblock == -1) {
+		errno = ENOENT;
+	}
+	else if(src->nodeblock == sb->root || dst->nodeblock == sb->root) { /* Renaming root or over it */
+		errno = EBUSY;
+	}
+	else if(flags & ~FS_RENAME_REPLACE) {
+		errno = EINVAL;
+	}
+
+	if(errno == 0 && dst->nodeblock == src->nodeblock) { /* Same entity, nothing to do */
+		fs_slab_put(sb, src);
+		fs_slab_put(sb, dst);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, auxinode);
+		fs_slab_put(sb, nodeinfo);
+		fs_slab_put(sb, auxnodeinfo);
 		return 0;
 	}
 
-	if(sb->magic != 0xdcc605f5) {
-		errno = EBADF;
-		return (uint64_t) -1;
+	if(errno == 0) {
+		fs_read_data(sb, src->nodeblock, (void*) inode);
+		fs_read_data(sb, inode->meta, (void*) nodeinfo);
+
+		/* A directory cannot be moved into its own subtree */
+		if(inode->mode == IMDIR && fs_path_prefix(oldpath, newpath)) {
+			errno = EINVAL;
+		}
+	}
+
+	if(errno == 0 && dst->nodeblock != -1) {
+		fs_read_data(sb, dst->nodeblock, (void*) auxinode);
+		fs_read_data(sb, auxinode->meta, (void*) auxnodeinfo);
+
+		if(!(flags & FS_RENAME_REPLACE)) {
+			errno = EEXIST;
+		}
+		else if(inode->mode == IMDIR && auxinode->mode != IMDIR) {
+			errno = ENOTDIR;
+		}
+		else if(inode->mode != IMDIR && auxinode->mode == IMDIR) {
+			errno = EISDIR;
+		}
+		else if(auxinode->mode == IMDIR && auxnodeinfo->size) {
+			errno = ENOTEMPTY;
+		}
+	}
+
+	link = NULL;
+	if(errno == 0 && dst->nodeblock == -1) {
+		link = fs_find_link(sb, dst->dirnode, 0);
+		if(link->index == -1 && sb->freeblks < 1) {
+			errno = ENOSPC;
+		}
+	}
+
+	if(errno != 0) {
+		fs_slab_put(sb, src);
+		fs_slab_put(sb, dst);
+		fs_slab_put(sb, link);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, auxinode);
+		fs_slab_put(sb, nodeinfo);
+		fs_slab_put(sb, auxnodeinfo);
+		return -1;
+	}
+
+	/* Link the entity under its new name before unlinking the old one, so that it is always
+	 * reachable. A replaced target's link is overwritten in place. */
+	if(dst->nodeblock != -1) {
+		struct inode *dirnode = fs_slab_get(sb);
+		link = fs_find_link(sb, dst->dirnode, dst->nodeblock);
+		fs_read_data(sb, link->inode, (void*) dirnode);
+		dirnode->links[link->index] = src->nodeblock;
+		fs_write_data(sb, link->inode, (void*) dirnode);
+		fs_slab_put(sb, dirnode);
+	}
+	else if(link->index == -1) {
+		fs_add_link(sb, fs_create_child(sb, link->inode, dst->dirnode), 0, src->nodeblock);
+	}
+	else {
+		fs_add_link(sb, link->inode, link->index, src->nodeblock);
+	}
+	fs_slab_put(sb, link);
+
+	link = fs_find_link(sb, src->dirnode, src->nodeblock);
+	fs_remove_link(sb, link->inode, link->index);
+	fs_slab_put(sb, link);
+
+	inode->parent = dst->dirnode;
+	strcpy(nodeinfo->name, dst->nodename);
+	fs_write_data(sb, src->nodeblock, (void*) inode);
+	fs_write_data(sb, inode->meta, (void*) nodeinfo);
+
+	/* Release the replaced target */
+	if(dst->nodeblock != -1) {
+		fs_release(sb, dst->nodeblock);
+	}
+
+	fs_slab_put(sb, src);
+	fs_slab_put(sb, dst);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, auxinode);
+	fs_slab_put(sb, nodeinfo);
+	fs_slab_put(sb, auxnodeinfo);
+
+	return 0;
+}
+
+char * fs_list_dir(struct superblock *sb, const char *dname) {
+	size_t len = 0, cap = NAME_MAX;
+	char *ret = malloc(cap);
+	uint64_t elements, size;
+	struct dir *dir;
+	struct inode *inode          = fs_slab_get(sb);
+	struct inode *auxinode       = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo    = fs_slab_get(sb);
+	struct nodeinfo *auxnodeinfo = fs_slab_get(sb);
+
+	strcpy(ret, "");
+	dir = fs_find_dir_info(sb, dname);
+
+	if(dir == NULL) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, auxinode);
+		fs_slab_put(sb, nodeinfo);
+		fs_slab_put(sb, auxnodeinfo);
+		free(ret);
+		return NULL;
+	}
+
+	fs_read_data(sb, dir->nodeblock, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+
+	if(inode->mode != IMDIR) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, auxinode);
+		fs_slab_put(sb, nodeinfo);
+		fs_slab_put(sb, auxnodeinfo);
+		free(ret);
+		errno = ENOTDIR;
+		return NULL;
+	}
+
+	if(nodeinfo->size == 0) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, auxinode);
+		fs_slab_put(sb, nodeinfo);
+		fs_slab_put(sb, auxnodeinfo);
+		return ret;
 	}
 
-	uint64_t ret;
+	elements = 0;
+	size = nodeinfo->size;
 
-	struct freepage *freepage = malloc(sb->blksz);
+	while(elements < size) {
+		fs_prefetch(sb, &inode->next, 1); /* Next part of the directory, read while this one is */
 
-	fs_read_data(sb, sb->freelist, (void*) freepage);
+		for(int i = 0; i < LINK_MAX; i++) {
+			if(inode->links[i] != 0) {
+				fs_read_data(sb, inode->links[i], (void*) auxinode);
+				fs_read_data(sb, auxinode->meta, (void*) auxnodeinfo);
 
-	ret = sb->freelist;
-	sb->freeblks--;
-	sb->freelist = freepage->next;
+				if(len + strlen(auxnodeinfo->name) + 3 > cap) { /* Room for "/ " and the terminator */
+					cap = 2 * cap + strlen(auxnodeinfo->name);
+					ret = realloc(ret, cap);
+				}
 
-	fs_write_data(sb, 0, (void*) sb);
+				len += sprintf(ret + len, "%s", auxnodeinfo->name);
+				if(auxinode->mode == IMDIR) len += sprintf(ret + len, "/");
 
-	free(freepage);
+				elements++;
+
+				if(elements < size) len += sprintf(ret + len, " ");
+			}
+		}
+		if(inode->next != 0) {
+			fs_read_data(sb, inode->next, (void*) inode);
+		}
+		else {
+			break;
+		}
+	}
+
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, auxinode);
+	fs_slab_put(sb, nodeinfo);
+	fs_slab_put(sb, auxnodeinfo);
 
 	return ret;
 }
 
-int fs_put_block(struct superblock *sb, uint64_t block) {
+int fs_stat(struct superblock *sb, const char *path, struct fsstat *st) {
+	struct dir *dir;
+	struct inode *inode;
+	struct nodeinfo *nodeinfo;
+
 	if(sb->magic != 0xdcc605f5) {
 		errno = EBADF;
 		return -1;
 	}
 
-	struct freepage *freepage = malloc(sb->blksz);
+	inode = fs_slab_get(sb);
+	nodeinfo = fs_slab_get(sb);
+	dir = fs_find_dir_info(sb, path);
 
-	freepage->next  = sb->freelist;
-	freepage->count = 0;
+	if(dir == NULL || dir->nodeblock == -1) {
+		if(dir != NULL) errno = ENOENT;
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return -1;
+	}
 
-	sb->freeblks++;
-	sb->freelist = block;
+	/* Both were read while looking the path up, so they usually come from the cache */
+	fs_read_data(sb, dir->nodeblock, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
 
-	fs_write_data(sb, block, (void*) freepage);
-	fs_write_data(sb, 0, (void*) sb);
+	st->mode   = inode->mode;
+	st->size   = nodeinfo->size;
+	st->blocks = nodeinfo->blocks;
+	st->inode  = dir->nodeblock;
 
-	free(freepage);
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
 
 	return 0;
 }
 
-int fs_write_file(struct superblock *sb, const char *fname, char *buf, size_t cnt) {
-	uint64_t datablks, extrainodes, neededblks, links;
-	uint64_t fileblk, previousblk, linkblk;
-	struct dir *dir;
-	struct link *link;
-	struct inode *inode       = malloc(sb->blksz);
-	struct inode *childnode   = malloc(sb->blksz);
-	struct nodeinfo *nodeinfo = malloc(sb->blksz);
-
-	datablks = (cnt / sb->blksz) + ((cnt % sb->blksz) ? 1 : 0); /* Blocks needed for data */
-	extrainodes = 0; /* Child inodes needed to store all the links to blocks */
-
-	if(datablks > LINK_MAX) {
-		extrainodes = (datablks / LINK_MAX) + (datablks % LINK_MAX ? 1 : 0);
-	}
-
-	dir = fs_find_dir_info(sb, fname);
+int fs_statfs(struct superblock *sb, struct fsstatfs *st) {
+	uint64_t ondisk;
 
-	if(dir == NULL) { /* Path not found */
-		free(dir);
-		free(inode);
-		free(childnode);
-		free(nodeinfo);
+	if(sb->magic != 0xdcc605f5) {
+		errno = EBADF;
 		return -1;
 	}
 
-	if(dir->nodeblock != -1) {
-		fs_unlink(sb, fname);
-	}
+	ondisk = sb->freeblks + sb->reserved; /* Free blocks, reservations included */
 
-	link = fs_find_link(sb, dir->dirnode, 0);
+	st->blks      = sb->blks;
+	st->blksz     = sb->blksz;
+	st->freeblks  = sb->freeblks;
+	st->reserved  = sb->reserved;
+	st->freerange = (sb->frontier != 0) ? sb->blks - sb->frontier : 0;
+	st->fragmentation = (ondisk != 0) ? (double) (ondisk - st->freerange) / ondisk : 0;
 
-	neededblks = datablks + 2 + extrainodes + (link->index == -1 ? 1 : 0);
+	return 0;
+}
 
-	if(neededblks > sb->freeblks) {
-		free(dir);
-		free(link);
-		free(inode);
-		free(childnode);
-		free(nodeinfo);
-		errno = ENOSPC;
+int fs_rmtree(struct superblock *sb, const char *path) {
+	if(sb->rdonly) {
+		errno = EROFS;
 		return -1;
 	}
-
-	fileblk = fs_get_block(sb);
-
-	if(link->index == -1) { /* If no link exists, create child of dirnode to store it */
-		fs_add_link(sb, fs_create_child(sb, link->inode, dir->dirnode), 0, fileblk);
+	if(fs_unshare_path(sb, path, 0)) {
+		return -1;
 	}
-	else {
-		fs_add_link(sb, link->inode, link->index, fileblk);
+
+	struct dir *dir;
+	struct link *link;
+	struct walker *w;
+	struct release *rel;
+	struct walkop op;
+	struct batch batch = {NULL, 0, 0};
+	struct inode *inode       = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	dir = fs_find_dir_info(sb, path);
+
+	if(dir == NULL || dir->nodeblock == -1 || dir->nodeblock == sb->root) {
+		if(dir != NULL) errno = (dir->nodeblock == -1) ? ENOENT : EBUSY;
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
+		return -1;
 	}
 
-	inode->mode   = IMREG;
-	inode->parent = dir->dirnode;
-	inode->meta   = fs_get_block(sb);
-	inode->next   = 0;
+	fs_read_data(sb, dir->nodeblock, (void*) inode);
+	fs_read_data(sb, inode->meta, (void*) nodeinfo);
 
-	fs_write_data(sb, fileblk, (void*) inode);
+	/* Every block freed from here on is put back at the end */
+	sb->batch = &batch;
 
-	links = (datablks > LINK_MAX) ? LINK_MAX : datablks;
-	for(int i = 0; i < LINK_MAX; i++) {
-		if(i < links) {
-			linkblk = fs_get_block(sb);
-			fs_write_data(sb, linkblk, (void*) (buf + i * sb->blksz));
-			inode->links[i] = linkblk;
-		}
-		else{
-			inode->links[i] = 0;
-		}
-	}
-	datablks -= links;
+	link = fs_find_link(sb, dir->dirnode, dir->nodeblock);
+	fs_remove_link(sb, link->inode, link->index);
 
-	previousblk = fileblk;
-	for(int i = 0; i < extrainodes; i++) {
-		previousblk = fs_create_child(sb, previousblk, fileblk);
+	/* The walk threads only read, what they find is released by this thread afterwards */
+	fs_walk_init(&op, sb, fs_rmtree_entry);
+	op.freeing = 1;
+	if(fs_rmtree_entry(&op.walkers[0], dir->nodeblock, inode, nodeinfo, NULL)) {
+		fs_walk(&op, dir->nodeblock, NULL);
+	}
 
-		fs_read_data(sb, previousblk, (void*) childnode);
+	for(int i = 0; i < WALK_THREADS; i++) {
+		w = &op.walkers[i];
 
-		links = (datablks > LINK_MAX) ? LINK_MAX : datablks;
-		for(int j = 0; j < LINK_MAX; j++) {
-			if(j < links) {
-				linkblk = fs_get_block(sb);
-				fs_write_data(sb, linkblk, (void*) (buf + i * j * sb->blksz));
-				childnode->links[j] = linkblk;
-			}
-			else{
-				childnode->links[j] = 0;
+		for(size_t j = 0; j < w->nreleases; j++) {
+			rel = &w->releases[j];
+			switch(rel->kind) {
+			case RELEASE_ENTITY:
+				fs_release(sb, rel->blk);
+				break;
+			case RELEASE_TREE:
+				fs_free_tree(sb, rel->blk, rel->depth, rel->count);
+				break;
+			case RELEASE_TAIL:
+				fs_put_tail(sb, rel->blk);
+				break;
+			case RELEASE_DELAYED:
+				fs_drop_delayed(sb, rel->blk);
+				break;
 			}
 		}
-		fs_write_data(sb, previousblk, (void*) childnode);
-		datablks -= links;
-	}
 
-	nodeinfo->size = cnt;
-	strcpy(nodeinfo->name, dir->nodename);
+		for(uint64_t j = 0; j < w->freed.count; j++) {
+			fs_batch_add(&batch, w->freed.blocks[j]);
+		}
+	}
 
-	fs_write_data(sb, fileblk, (void*) inode);
-	fs_write_data(sb, inode->meta, (void*) nodeinfo);
+	sb->batch = NULL;
+	fs_put_blocks(sb, batch.blocks, batch.count);
 
-	free(dir);
-	free(link);
-	free(inode);
-	free(childnode);
-	free(nodeinfo);
+	fs_walk_free(&op);
+	free(batch.blocks);
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, link);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
 
 	return 0;
 }
 
-ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf, size_t bufsz) {
-	size_t numblks;
+int fs_du(struct superblock *sb, const char *path, struct fsdu *du) {
 	struct dir *dir;
-	struct inode *inode = malloc(sb->blksz);
-	struct nodeinfo *nodeinfo = malloc(sb->blksz);
-
-	dir = fs_find_dir_info(sb, fname);
-
-	if(dir->nodeblock == -1) {
-		free(dir);
-		free(inode);
-		free(nodeinfo);
-		errno = ENOENT;
+	struct walker *w;
+	struct walkop op;
+	struct inode *inode       = fs_slab_get(sb);
+	struct nodeinfo *nodeinfo = fs_slab_get(sb);
+
+	dir = fs_find_dir_info(sb, path);
+
+	if(dir == NULL || dir->nodeblock == -1) {
+		if(dir != NULL) errno = ENOENT;
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		fs_slab_put(sb, nodeinfo);
 		return -1;
 	}
 
 	fs_read_data(sb, dir->nodeblock, (void*) inode);
 	fs_read_data(sb, inode->meta, (void*) nodeinfo);
 
-	if(inode->mode != IMREG) {
-		free(dir);
-		free(inode);
-		free(nodeinfo);
-		errno = EISDIR;
-		return -1;
+	fs_walk_init(&op, sb, fs_du_entry);
+	if(fs_du_entry(&op.walkers[0], dir->nodeblock, inode, nodeinfo, NULL)) {
+		fs_walk(&op, dir->nodeblock, NULL);
 	}
 
-	if(bufsz > nodeinfo->size) bufsz = nodeinfo->size;
-	numblks = (bufsz / sb->blksz) + ((bufsz % sb->blksz) ? 1 : 0);
+	memset(du, 0, sizeof *du);
+	for(int i = 0; i < WALK_THREADS; i++) {
+		w = &op.walkers[i];
+		du->files  += w->du.files;
+		du->dirs   += w->du.dirs;
+		du->size   += w->du.size;
+		du->blocks += w->du.blocks;
+	}
 
+	fs_walk_free(&op);
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
 
-	for(int i = 0; i < numblks; i++) {
-		if((i != 0) && (i % LINK_MAX == 0)) {
-			if(inode->next != 0) {
-				fs_read_data(sb, inode->next, (void*) inode);
-			}
-			else {
-				free(dir);
-				free(inode);
-				free(nodeinfo);
-				errno = EPERM;
-				return -1;
-			}
-		}
-		
-		fs_read_data(sb, inode->links[i % LINK_MAX], (void*) (buf + i * sb->blksz));
-	}
+	return 0;
+}
 
-	free(dir);
-	free(inode);
-	free(nodeinfo);
-	return bufsz;
+/* Orders the strings =a and =b point to, for qsort */
+int fs_cmp_path(const void *a, const void *b) {
+	return strcmp(*(char* const*) a, *(char* const*) b);
 }
 
-int fs_unlink(struct superblock *sb, const char *fname) {
-	int numblks, numlinks;
-	uint64_t thisblk, nextblk;
+char * fs_find(struct superblock *sb, const char *dname, const char *pattern) {
+	size_t len = 0, count = 0;
+	char *ret, *start, *token;
+	char **paths;
 	struct dir *dir;
-	struct link *link;
-	struct inode *inode = malloc(sb->blksz);
-	struct nodeinfo *nodeinfo = malloc(sb->blksz);
+	struct walker *w;
+	struct walkop op;
+	struct inode *inode = fs_slab_get(sb);
 
-	dir = fs_find_dir_info(sb, fname);
+	dir = fs_find_dir_info(sb, dname);
 
-	if(dir->nodeblock == -1) {
-		free(dir);
-		free(inode);
-		free(nodeinfo);
-		errno = ENOENT;
-		return -1;
+	if(dir == NULL || dir->nodeblock == -1) {
+		if(dir != NULL) errno = ENOENT;
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		return NULL;
 	}
 
 	fs_read_data(sb, dir->nodeblock, (void*) inode);
-	fs_read_data(sb, inode->meta, (void*) nodeinfo);
 
-	if(inode->mode != IMREG) {
-		free(dir);
-		free(inode);
-		free(nodeinfo);
-		errno = ENOENT;
-		return -1;
-	}
-	/* Free all blocks used including the one with the inode */
-	numblks = (nodeinfo->size / sb->blksz) + ((nodeinfo->size % sb->blksz) ? 1 : 0);
-	numlinks = (numblks > LINK_MAX) ? LINK_MAX : numblks;
-	for(int i = 0; i < numlinks; i++) {
-		fs_put_block(sb, inode->links[i]);
+	if(inode->mode != IMDIR) {
+		fs_slab_put(sb, dir);
+		fs_slab_put(sb, inode);
+		errno = ENOTDIR;
+		return NULL;
 	}
-	numblks -= numlinks;
-	nextblk = inode->next;
-	fs_put_block(sb, dir->nodeblock);
-	fs_put_block(sb, inode->meta);
 
-	while(nextblk != 0) {
-		fs_read_data(sb, nextblk, inode);
-		thisblk = nextblk;
-		nextblk = inode->next;
+	/* Paths found are built on the one of =dname, without repeated or trailing slashes */
+	start = malloc(2 * strlen(dname) + 1);
+	ret   = strdup(dname);
+	start[0] = '\0';
+	for(token = strtok(ret, "/"); token != NULL; token = strtok(NULL, "/")) {
+		strcat(start, "/");
+		strcat(start, token);
+	}
+	free(ret);
 
-		numlinks = (numblks > LINK_MAX) ? LINK_MAX : numblks;
-		for(int i = 0; i < numlinks; i++) {
-			fs_put_block(sb, inode->links[i]);
-		}
-		numblks -= numlinks;
+	fs_walk_init(&op, sb, fs_match_entry);
+	op.paths   = 1;
+	op.pattern = pattern;
+	fs_walk(&op, dir->nodeblock, start);
 
-		fs_put_block(sb, thisblk);
-		fs_put_block(sb, inode->meta);
+	for(int i = 0; i < WALK_THREADS; i++) {
+		count += op.walkers[i].nfound;
 	}
 
-	/* Remove parent link to file */
-	link = fs_find_link(sb, dir->dirnode, dir->nodeblock);
+	paths = malloc((count + 1) * sizeof *paths);
+	count = 0;
+	for(int i = 0; i < WALK_THREADS; i++) {
+		w = &op.walkers[i];
+		for(size_t j = 0; j < w->nfound; j++) {
+			paths[count++] = w->found[j];
+			len += strlen(w->found[j]) + 1;
+		}
+	}
+	qsort(paths, count, sizeof *paths, fs_cmp_path);
 
-	fs_remove_link(sb, link->inode, link->index);
+	ret = malloc(len + 1);
+	ret[0] = '\0';
+	len = 0;
+	for(size_t i = 0; i < count; i++) {
+		len += sprintf(ret + len, (i + 1 < count) ? "%s " : "%s", paths[i]);
+	}
 
-	free(dir);
-	free(link);
-	free(inode);
-	free(nodeinfo);
+	free(paths);
+	fs_walk_free(&op);
+	fs_slab_put(sb, dir);
+	fs_slab_put(sb, inode);
 
-	return 0;
+	return ret;
 }
 
-int fs_mkdir(struct superblock *sb, const char *dname) {
-	uint64_t dirblk;
-	struct dir *dir;
+int fs_snapshot(struct superblock *sb, const char *name) {
+	uint64_t recblk;
 	struct link *link;
-	struct inode *inode       = malloc(sb->blksz);
-	struct nodeinfo *nodeinfo = malloc(sb->blksz);
+	struct inode *inode;
+	struct nodeinfo *nodeinfo;
 
-	dir = fs_find_dir_info(sb, dname);
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
 
-	if(dir == NULL) {
-		free(dir);
-		free(inode);
-		free(nodeinfo);
+	if(name[0] == '\0' || strchr(name, '/') != NULL || strlen(name) >= NAME_MAX) {
+		errno = EINVAL;
 		return -1;
 	}
 
-	if(dir->nodeblock != -1) {
-		free(dir);
-		free(inode);
-		free(nodeinfo);
+	if(sb->snaps != 0 && fs_find_entry(sb, sb->snaps, name, NULL) != 0) {
 		errno = EEXIST;
 		return -1;
 	}
 
-	link = fs_find_link(sb, dir->dirnode, 0);
+	fs_flush(sb); /* Files in the snapshot are complete on disk */
 
-	if((sb->freeblks < (2 + (link->index == -1 ? 1 : 0)))) {
-		free(dir);
-		free(link);
-		free(inode);
-		free(nodeinfo);
+	/* Snapshot directory, record, a child inode for the directory and reference counts */
+	if(sb->freeblks < (sb->snaps == 0 ? 2 : 0) + 2 + 1 + 3) {
 		errno = ENOSPC;
 		return -1;
 	}
 
-	dirblk = fs_get_block(sb);
-
-	/* If no free links was found, needs to create new child inode */
-	if(link->index == -1) {
-		fs_add_link(sb, fs_create_child(sb, link->inode, dir->dirnode), 0, dirblk);
-	}
-	else {
-		fs_add_link(sb, link->inode, link->index, dirblk);
-	}
+	inode    = fs_slab_get(sb);
+	nodeinfo = fs_slab_zero(sb);
 
-	inode->mode = IMDIR;
-	inode->parent = dir->dirnode;
-	inode->meta = fs_get_block(sb);
-	inode->next = 0;
 	for(int i = 0; i < LINK_MAX; i++) {
 		inode->links[i] = 0;
 	}
+	inode->mode = IMDIR;
+	inode->next = 0;
+	nodeinfo->blocks = 0;
 
-	nodeinfo->size = 0;
-	strcpy(nodeinfo->name, dir->nodename);
+	if(sb->snaps == 0) { /* Created with the first snapshot, it is a root of its own */
+		sb->snaps = fs_get_block(sb);
 
-	fs_write_data(sb, dirblk, (void*) inode);
-	fs_write_data(sb, inode->meta, (void*) nodeinfo);
+		inode->parent  = sb->snaps;
+		inode->meta    = fs_get_block(sb);
+		nodeinfo->size = 0;
+		strcpy(nodeinfo->name, "/");
 
-	free(dir);
-	free(link);
-	free(inode);
-	free(nodeinfo);
+		fs_write_data(sb, sb->snaps, (void*) inode);
+		fs_write_data(sb, inode->meta, (void*) nodeinfo);
+		fs_write_super(sb);
+	}
 
-	return 0;
-}
+	/* The record links to the root, which is now shared until it is changed */
+	recblk = fs_get_block(sb);
 
-int fs_rmdir(struct superblock *sb, const char *dname) {
-	struct dir *dir;
-	struct link *link;
-	struct inode *inode       = malloc(sb->blksz);
-	struct nodeinfo *nodeinfo = malloc(sb->blksz);
+	inode->parent   = sb->snaps;
+	inode->meta     = fs_get_block(sb);
+	inode->links[0] = sb->root;
+	nodeinfo->size  = 1;
+	strcpy(nodeinfo->name, name);
 
-	dir = fs_find_dir_info(sb, dname);
+	fs_write_data(sb, recblk, (void*) inode);
+	fs_write_data(sb, inode->meta, (void*) nodeinfo);
+	fs_ref_block(sb, sb->root);
 
-	if(dir == NULL) {
-		free(dir);
-		free(inode);
-		free(nodeinfo);
-		return -1;
-	}
+	link = fs_find_link(sb, sb->snaps, 0);
 
-	if(dir->nodeblock == 1) { /* Trying to remove root */
-		free(dir);
-		free(inode);
-		free(nodeinfo);
-		errno = EBUSY;
-		return -1;
+	if(link->index == -1) {
+		fs_add_link(sb, fs_create_child(sb, link->inode, sb->snaps), 0, recblk);
 	}
-
-	fs_read_data(sb, dir->nodeblock, (void*) inode);
-	fs_read_data(sb, inode->meta, (void*) nodeinfo);
-
-	if(inode->mode != IMDIR) {
-		free(dir);
-		free(inode);
-		free(nodeinfo);
-		errno = ENOTDIR;
-		return -1;
+	else {
+		fs_add_link(sb, link->inode, link->index, recblk);
 	}
 
-	if(nodeinfo->size) {
-		free(dir);
-		free(inode);
-		free(nodeinfo);
-		errno = ENOTEMPTY;
-		return -1;
-	}	
-
-	fs_put_block(sb, dir->nodeblock);
-	fs_put_block(sb, inode->meta);
-
-	link = fs_find_link(sb, dir->dirnode, dir->nodeblock);
-
-	fs_remove_link(sb, link->inode, link->index);
+	fs_write_super(sb);
 
-	free(dir);
-	free(link);
-	free(inode);
-	free(nodeinfo);
+	fs_slab_put(sb, link);
+	fs_slab_put(sb, inode);
+	fs_slab_put(sb, nodeinfo);
 
 	return 0;
 }
 
-char * fs_list_dir(struct superblock *sb, const char *dname) {
-	char *ret = malloc(NAME_MAX);
-	uint64_t elements, size;
-	struct dir *dir;
-	struct inode *inode          = malloc(sb->blksz);
-	struct inode *auxinode       = malloc(sb->blksz);
-	struct nodeinfo *nodeinfo    = malloc(sb->blksz);
-	struct nodeinfo *auxnodeinfo = malloc(sb->blksz);
+struct superblock * fs_open_snapshot(const char *fname, const char *name) {
+	uint64_t recblk;
+	struct inode *inode;
+	struct superblock *sb;
+	struct iovec iov;
+	void **images;
+	int fd = open(fname, O_RDONLY);
 
-	strcpy(ret, "");
-	dir = fs_find_dir_info(sb, dname);
+	if(fd == -1) {
+		return NULL;
+	}
 
-	if(dir == NULL) {
-		free(dir);
-		free(inode);
-		free(auxinode);
-		free(nodeinfo);
-		free(auxnodeinfo);
+	/* No lock: the snapshot's blocks are not changed by writers of the live tree */
+	images = malloc(sizeof *images);
+	images[0] = fs_file_wrap(fd);
+
+	sb = malloc(sizeof *sb);
+	iov.iov_base = sb;
+	iov.iov_len  = SUPERBLOCK_DISK_SIZE;
+
+	if(fs_file_backend.readv(images[0], &iov, 1, 0) != SUPERBLOCK_DISK_SIZE) {
+		free(sb);
+		fs_detach_images(&fs_file_backend, images, 1);
+		errno = EBADF;
 		return NULL;
 	}
 
-	fs_read_data(sb, dir->nodeblock, (void*) inode);
-	fs_read_data(sb, inode->meta, (void*) nodeinfo);
+	if(fs_check_super(sb)) {
+		free(sb);
+		fs_detach_images(&fs_file_backend, images, 1);
+		return NULL;
+	}
 
-	if(inode->mode != IMDIR) {
-		free(dir);
-		free(inode);
-		free(auxinode);
-		free(nodeinfo);
-		free(auxnodeinfo);
-		errno = ENOTDIR;
+	if(sb->members > 1) { /* Only the first image of a stripe */
+		free(sb);
+		fs_detach_images(&fs_file_backend, images, 1);
+		errno = EINVAL;
 		return NULL;
 	}
 
-	if(nodeinfo->size == 0) {
-		free(dir);
-		free(inode);
-		free(auxinode);
-		free(nodeinfo);
-		free(auxnodeinfo);
-		return ret;
+	sb->fd = fd;
+	sb->rdonly = 1;
+	sb->delayed = NULL;
+	sb->reserved = 0;
+	sb->cache = NULL;
+	sb->pool = NULL;
+	sb->slab = NULL;
+	sb->batch = NULL;
+	sb->backend = &fs_file_backend;
+	sb->images = images;
+
+	if(sb->snaps == 0 || (recblk = fs_find_entry(sb, sb->snaps, name, NULL)) == 0) {
+		fs_slab_free(sb);
+		fs_detach_images(sb->backend, sb->images, 1);
+		free(sb);
+		errno = ENOENT;
+		return NULL;
 	}
 
-	elements = 0;
-	size = nodeinfo->size;
+	inode = fs_slab_get(sb);
+	fs_read_data(sb, recblk, (void*) inode);
+	sb->root = inode->links[0];
+	fs_slab_put(sb, inode);
 
-	while(elements < size) {
-		for(int i = 0; i < LINK_MAX; i++) {
-			if(inode->links[i] != 0) {
-				fs_read_data(sb, inode->links[i], (void*) auxinode);
-				fs_read_data(sb, auxinode->meta, (void*) auxnodeinfo);
+	fs_cache_init(sb); /* Only after the snapshot directory, which writers change, was read */
 
-				strcat(ret, auxnodeinfo->name);
-				if(auxinode->mode == IMDIR) strcat(ret, "/");
+	return sb;
+}
 
-				elements++;
+int fs_snapshot_delete(struct superblock *sb, const char *name) {
+	uint64_t recblk;
+	struct link link;
+	struct batch batch;
 
-				if(elements < size) strcat(ret, " ");
-			}
-		}
-		if(inode->next != 0) {
-			fs_read_data(sb, inode->next, (void*) inode);
-		}
-		else {
-			break;
-		}
+	if(sb->rdonly) {
+		errno = EROFS;
+		return -1;
+	}
+
+	if(sb->snaps == 0 || (recblk = fs_find_entry(sb, sb->snaps, name, &link)) == 0) {
+		errno = ENOENT;
+		return -1;
 	}
 
-	free(dir);
-	free(inode);
-	free(auxinode);
-	free(nodeinfo);
-	free(auxnodeinfo);
+	fs_batch_begin(sb, &batch);
+	fs_remove_link(sb, link.inode, link.index);
+	fs_release(sb, recblk);
+	fs_batch_end(sb, &batch);
 
-	return ret;
-}
\ No newline at end of file
+	return 0;
+}
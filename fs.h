@@ -19,11 +19,58 @@
  */
 
 #include <inttypes.h>
+#include <stddef.h>
+#include <sys/uio.h>
 
 #define IMREG 1   /* regular inode */
 #define IMDIR 2   /* directory inode */
 #define IMCHILD 4 /* child inode */
 
+#define FS_DEDUP 1 /* share identical data blocks between files */
+#define FS_DELALLOC 2 /* choose data blocks when files are flushed */
+#define FS_TAILPACK 4 /* pack the short last blocks of files into shared blocks */
+#define FS_DISCARD 8 /* release the storage of freed blocks in the images */
+
+#define FS_RENAME_REPLACE 1 /* fs_rename: replace an existing target */
+
+struct delayed;
+struct cache;
+struct pool;
+struct batch;
+
+/* Storage the images of a filesystem are kept in.  =open opens the image
+ * =name and returns the state the other functions take, or NULL with errno
+ * set; if =size is not zero the image is created with =size bytes, and
+ * otherwise it must exist.  =readv and =writev move the buffers in =iov
+ * from or to byte =offset of the image and return the number of bytes
+ * moved or -1, like preadv and pwritev; they may be called from several
+ * threads at once.  =flush makes what was written durable, =size returns
+ * the size of the image in bytes, =resize extends it to at least =size
+ * bytes and =close releases it.  =fd may be NULL; otherwise it returns a
+ * host descriptor with the contents of the image, which the kernel may
+ * copy from and to directly.  =discard may be NULL; otherwise it releases
+ * the storage of the =len bytes at byte =offset of the image, which then
+ * read as zeros, and returns zero or -1. */
+struct backend {
+	const char *name;
+	void * (*open)(const char *name, uint64_t size);
+	ssize_t (*readv)(void *image, const struct iovec *iov, int n, uint64_t offset);
+	ssize_t (*writev)(void *image, const struct iovec *iov, int n, uint64_t offset);
+	int (*flush)(void *image);
+	uint64_t (*size)(void *image);
+	int (*resize)(void *image, uint64_t size);
+	int (*fd)(void *image);
+	void (*close)(void *image);
+	int (*discard)(void *image, uint64_t offset, uint64_t len);
+};
+
+/* Image files or block devices, locked while open; discarding punches holes */
+extern const struct backend fs_file_backend;
+/* Image files mapped into memory, locked while open */
+extern const struct backend fs_mmap_backend;
+/* RAM disks, whose contents are lost when the filesystem is closed */
+extern const struct backend fs_ram_backend;
+
 struct superblock {
 	uint64_t magic; /* 0xdcc605f5 */
 	uint64_t blks; /* number of blocks in the filesystem */
@@ -31,27 +78,88 @@ struct superblock {
 	uint64_t freeblks; /* number of free blocks in the filesystem */
 	uint64_t freelist; /* pointer to free block list */
 	uint64_t root; /* pointer to root directory's inode */
-	int fd; /* file descriptor for the filesystem image */
+	uint64_t version; /* SUPERBLOCK_VERSION, layout of the fields below */
+	uint64_t flags; /* FS_* features enabled in this filesystem */
+	uint64_t fingerprints; /* pointer to data block fingerprint index */
+	uint64_t refcounts; /* pointer to block reference count table */
+	/* =fingerprints and =refcounts point to blocks whose words are the
+	 * heads of hashpage chains (buckets), or are zero if the table is
+	 * empty.  =fingerprints maps block content hashes to data blocks.
+	 * =refcounts maps block numbers to their reference counts; blocks
+	 * absent from =refcounts are referenced exactly once. */
+	uint64_t snaps;
+	/* pointer to the directory of snapshots, or zero if no snapshot was
+	 * ever taken.  each entry is a record directory named after the
+	 * snapshot, whose only link is the root the snapshot froze. */
+	uint64_t members; /* image files holding the blocks, zero or one for a single image */
+	uint64_t stripe;
+	/* blocks per chunk of a filesystem spanning several images.  blocks
+	 * are cut into chunks of =stripe blocks dealt to the images in turn:
+	 * chunk k is chunk k / =members of image k % =members, so block 0 and
+	 * the superblock are in the first image. */
+	uint64_t tailpos;
+	/* byte address in the image where the next packed tail goes, in
+	 * the tail block being filled; zero if the next tail takes a new
+	 * block.  a tail block holds the packed tails of several files and
+	 * its reference count is the number of files whose tail it holds. */
+	uint64_t frontier;
+	/* blocks from =frontier to =blks-1 are free but not in the free
+	 * list; zero if there is no such range.  the range is handed out
+	 * in ascending order once the free list is empty. */
+	int fd; /* file descriptor for the filesystem image, -1 if its backend has none */
+	int rdonly; /* nonzero for snapshots opened with fs_open_snapshot */
+	struct delayed *delayed; /* files written with FS_DELALLOC, not flushed */
+	uint64_t reserved;
+	/* free blocks set aside for the delayed files.  they are left out
+	 * of =freeblks in memory but not in the image. */
+	struct cache *cache; /* recently used blocks, filled ahead of readers */
+	struct pool *pool; /* aligned buffers of images opened with O_DIRECT */
+	void *slab; /* block-sized scratch buffers free for reuse */
+	struct batch *batch;
+	/* blocks freed by the running call, put back in the free list
+	 * together when it is done; NULL if freed blocks go back at once */
+	const struct backend *backend; /* storage the images are kept in */
+	void **images; /* backend state of each image, one per member */
 };
 
+/* Bytes of the superblock saved in block 0.  The fields from =fd on are
+ * only kept in memory. */
+#define SUPERBLOCK_DISK_SIZE offsetof(struct superblock, fd)
+
+/* Layout of the saved fields, bumped whenever they change.  Images that
+ * hold another value, such as the stale bytes the original superblock
+ * left after =root, are refused. */
+#define SUPERBLOCK_VERSION 0xdcc605f500000001ULL
+
 struct inode {
 	uint64_t mode;
 	uint64_t parent;
 	/* if =mode does not contain IMCHILD, then =parent points to the
-	 * directory that contains this inode.  if =mode contains IMCHILD,
-	 * then =parent points to the first inode (i.e., the inode without
-	 * IMCHILD) for the entity represented by this inode. */
+	 * directory that contains this inode (a root points to itself).
+	 * if =mode contains IMCHILD, then =parent points to the first inode
+	 * (i.e., the inode without IMCHILD) for the entity represented by
+	 * this inode.  an entity shared with a snapshot is linked from more
+	 * than one copy of its directory, and =parent names only one. */
 	uint64_t meta;
 	/* if =mode does not contain IMCHILD, then meta points to this inode's
 	 * metadata (struct iinfo).  if =mode contains IMCHILD, then meta
 	 * points to the previous inode for this inode's entity. */
 	uint64_t next;
 	/* if this file's date block do not fit in this inode, =next points to
-	 * the next inode for this entity; otherwise =next should be zero. */
+	 * the next inode for this entity; otherwise =next should be zero.
+	 * files (mode IMREG) have no next inode: for them =next is the byte
+	 * address in the image of the file's packed tail, the bytes after its
+	 * last whole block (see FS_TAILPACK), or zero if it has none. */
 	uint64_t links[];
 	/* if =mode contains IMDIR, then entries in =links point to inode's
 	 * for each entity in the directory.  otherwise, if =mode contains
-	 * IMREG, then entries in =links point to this file's data blocks. */
+	 * IMREG, then the first entries in =links point to this file's data
+	 * blocks and the last three point to its single, double and triple
+	 * indirect blocks, whose words point to data blocks or to the next
+	 * level of indirect blocks.  a zero link in a file is a hole: a block
+	 * of zeros (or a whole subtree of them) that is not stored in the
+	 * filesystem.  the last block of a file with a packed tail is a hole
+	 * in its block map. */
 };
 
 struct nodeinfo {
@@ -59,7 +167,12 @@ struct nodeinfo {
 	/* for files (mode IMREG), =size should contain the size of the file in 
 	 * bytes.  for directories (mode IMDIR), =size should contain the
 	 * number of files in the directory. */
-	uint64_t reserved[7];
+	uint64_t blocks;
+	/* for files, =blocks counts the data blocks stored for the file,
+	 * which is less than =size suggests if the file has holes.  indirect
+	 * blocks and the tail block of a packed tail are not counted.  zero
+	 * for directories. */
+	uint64_t reserved[6];
 	/* reserving some space to implement security and ownership in the
 	 * future. */
 	char name[];
@@ -73,7 +186,22 @@ struct freepage {
 	uint64_t links[];
 	/* remainder of block used to store links to free blocks.  =count
 	 * counts the number of elements in links, stored from links[0] to
-	 * links[counts-1]. */
+	 * links[counts-1].  the linked blocks are free and hold nothing, so
+	 * their storage may be discarded (see FS_DISCARD); they are handed
+	 * out before the freepage itself. */
+};
+
+struct hashpage {
+	uint64_t next;
+	/* link to next hashpage in this bucket; or zero if this is the last
+	 * hashpage */
+	uint64_t count;
+	struct hashent {
+		uint64_t key;
+		uint64_t value;
+	} ents[];
+	/* remainder of block used to store table entries.  =count counts the
+	 * number of elements in ents, stored from ents[0] to ents[count-1]. */
 };
 
 #define MIN_BLOCK_SIZE 128
@@ -83,18 +211,59 @@ struct freepage {
  * in the OS's filesystem).  The new filesystem should use =blocksize as its
  * block size; the number of blocks in the filesystem will be automatically
  * computed from the file size.  The filesystem will be initialized with an
- * empty root directory.  This function returns NULL on error and sets errno
- * to the appropriate error code.  If the block size is smaller than
- * MIN_BLOCK_SIZE bytes, then the format fails and the function sets errno to
- * EINVAL.  If there is insufficient space to store MIN_BLOCK_COUNT blocks in
- * =fname, then the function fails and sets errno to ENOSPC. */
+ * empty root directory.  Only the superblock and the root directory are
+ * written, the other blocks start out as the free range, so formatting
+ * takes the same time whatever the size and leaves a sparse file sparse
+ * (fs_format_backend creates one of a given size).  This function returns
+ * NULL on error and sets errno to the appropriate error code.  If the block
+ * size is smaller than MIN_BLOCK_SIZE bytes, then the format fails and the
+ * function sets errno to EINVAL.  If there is insufficient space to store
+ * MIN_BLOCK_COUNT blocks in =fname, then the function fails and sets errno
+ * to ENOSPC. */
 struct superblock * fs_format(const char *fname, uint64_t blocksize);
 
 /* Open the filesystem in =fname and return its superblock.  Returns NULL on
  * error, and sets errno accordingly.  If =fname does not contain a
- * 0xdcc605fs, then errno is set to EBADF. */
+ * 0xdcc605fs, if its superblock is not of SUPERBLOCK_VERSION or if it
+ * enables FS_* flags this code does not know, then errno is set to EBADF. */
 struct superblock * fs_open(const char *fname);
 
+/* Like fs_open, but the image is opened with O_DIRECT so its blocks are
+ * only cached by the filesystem's own block cache and not by the host.
+ * Every transfer goes through a fixed pool of aligned buffers, so memory
+ * use does not grow with the image.  If the filesystem holding =fname does
+ * not support O_DIRECT, or if the block size of the image is not a multiple
+ * of the logical block size of the device, errno is set to EINVAL. */
+struct superblock * fs_open_direct(const char *fname);
+
+/* Like fs_format, but the filesystem spans the =n images in =fnames, whose
+ * blocks are striped across them in chunks of =stripe blocks so that large
+ * reads and writes keep every image busy at once.  Each image contributes
+ * the whole chunks that fit in the smallest of them.  errno is set to
+ * EINVAL if =n is zero, or if =stripe is zero for more than one image. */
+struct superblock * fs_format_striped(const char **fnames, int n,
+                                      uint64_t blocksize, uint64_t stripe);
+
+/* Open the filesystem spanning the =n images in =fnames, which must be
+ * given in the order they were passed to fs_format_striped.  errno is set
+ * to EINVAL if the filesystem was formatted for a different number of
+ * images; fs_open, fs_open_direct and fs_open_snapshot fail the same way
+ * on the first image of a striped filesystem. */
+struct superblock * fs_open_striped(const char **fnames, int n);
+
+/* Like fs_format, but the image =name is kept in =backend.  If =size is not
+ * zero the image is created with =size bytes (a RAM disk needs one), which
+ * for fs_file_backend is a sparse file taking room on the host only as
+ * blocks are written; otherwise it must exist and its size is used. */
+struct superblock * fs_format_backend(const struct backend *backend,
+                                      const char *name, uint64_t size,
+                                      uint64_t blocksize);
+
+/* Like fs_open, but the image =name is kept in =backend.  RAM disks cannot
+ * be opened again once closed, so errno is set to ENOENT for them. */
+struct superblock * fs_open_backend(const struct backend *backend,
+                                    const char *name);
+
 /* Close the filesystem pointed to by =sb.  Returns zero on success and a
  * negative number on error.  If there is an error, all resources are freed
  * and errno is set appropriately. */
@@ -111,18 +280,233 @@ uint64_t fs_get_block(struct superblock *sb);
  * accordingly. */
 int fs_put_block(struct superblock *sb, uint64_t block);
 
+/* Grow the filesystem pointed to by =sb to =blks blocks while it is open,
+ * extending the image file if it is smaller.  The new blocks are appended
+ * to the free range at the end of the filesystem, so growing takes constant
+ * time regardless of the number of blocks added.  Returns zero on success
+ * or a negative value on error.  If =blks is smaller than the current
+ * number of blocks, errno is set to EINVAL. */
+int fs_grow(struct superblock *sb, uint64_t blks);
+
+/* Release the storage of every free block of the filesystem pointed to by
+ * =sb in its images, as FS_DISCARD does for blocks as they are freed.  The
+ * free list is rebuilt so that all but one block in several hundred are
+ * links of freepages, which hold nothing, and those and the free range at
+ * the end are discarded in runs of consecutive blocks.  Meant to be run
+ * once on an image used without FS_DISCARD.  Returns zero on success or a
+ * negative value on error (errno is set to EOPNOTSUPP if the backend
+ * cannot discard). */
+int fs_trim(struct superblock *sb);
+
+/* Write the files buffered by FS_DELALLOC to the image.  Each file's
+ * indirect and data blocks are allocated in one batch, in ascending order
+ * and as a single run when the free range at the end can hold them, and
+ * contiguous data is written with a single write.  Called by fs_close, when
+ * FS_DELALLOC is disabled and when the buffered data exceeds a few
+ * megabytes.  Until then the files read back from memory but are holes in
+ * the image.  Everything written is then made durable by the backend's
+ * flush.  Returns zero on success or a negative value on error. */
+int fs_flush(struct superblock *sb);
+
+/* Enable the FS_* features in =flags for the filesystem pointed to by =sb,
+ * disabling those not present.  Flags are saved in the superblock.  With
+ * FS_DEDUP, fs_write_file looks each data block up in the fingerprint index
+ * and shares identical blocks instead of allocating new ones.  With
+ * FS_DELALLOC, fs_write_file keeps file data in memory and reserves the
+ * space it needs; data blocks are only chosen when the file is flushed
+ * (see fs_flush), and a file unlinked before that never gets any.  With
+ * FS_TAILPACK, the tail of a file written by fs_write_file or flushed,
+ * when it is at most half a block, is packed next to the tails of other
+ * files in a shared tail block instead of taking a block of its own; a
+ * write that reaches the tail with fs_pwrite_file moves it back into a
+ * block.  With FS_DISCARD, blocks freed are put in the free list as links
+ * of freepages and their storage is released in the images (see
+ * fs_trim), so the images only take room for the blocks in use.  The
+ * blocks fs_unlink, fs_rmdir, fs_rmtree and fs_snapshot_delete free are
+ * put back together and discarded in runs of consecutive blocks.  Files
+ * written before a flag is changed keep their layout.  Returns zero on
+ * success or a negative value on error (errno is set to EINVAL if =flags
+ * contains unknown features). */
+int fs_setflags(struct superblock *sb, uint64_t flags);
+
 int fs_write_file(struct superblock *sb, const char *fname, char *buf,
                   size_t cnt);
 
 ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf,
                      size_t bufsz);
 
+/* Read up to =bufsz bytes starting at byte =offset of file =fname into
+ * =buf.  Returns the number of bytes read, which is zero if =offset is at
+ * or past the end of the file, or a negative value on error.  Any block of
+ * the file is located with at most three indirect block reads.  Reads that
+ * continue where the previous read of the same file ended grow a readahead
+ * window, and the blocks in it are read into the block cache by a
+ * background thread; other reads shrink it. */
+ssize_t fs_pread_file(struct superblock *sb, const char *fname, char *buf,
+                      size_t bufsz, uint64_t offset);
+
+/* A read-only view of part of a file, see fs_view_file. */
+struct view {
+	const char *data; /* the viewed bytes */
+	size_t len; /* number of bytes at =data */
+	int slot; /* block cache slot held by the view, -1 for holes */
+};
+
+/* Fill up to =max views with the =count bytes starting at byte =offset of
+ * file =fname, one view per block, in file order.  The views point
+ * straight into the block cache, which keeps the blocks pinned and
+ * unchanged until the views are given back with fs_release_views; writes
+ * made meanwhile are not seen through them.  Returns the number of views
+ * filled, which is zero if =offset is at or past the end of the file, or a
+ * negative value on error.  Fewer views than needed are returned when half
+ * of the cache is already pinned; errno is set to ENOBUFS if not even one
+ * could be.  Views must be released before fs_close. */
+int fs_view_file(struct superblock *sb, const char *fname, uint64_t offset,
+                 size_t count, struct view *views, int max);
+
+/* Give back the =n views in =views filled by fs_view_file. */
+void fs_release_views(struct superblock *sb, struct view *views, int n);
+
+/* Create or replace the file =fname with the contents of the host file
+ * open at =hostfd, read from its start.  The data blocks are allocated in
+ * one batch and the kernel copies the data into each run of them
+ * (copy_file_range), so it does not pass through user space; holes of the
+ * host file stay holes.  Where the kernel cannot copy, on O_DIRECT images,
+ * and for pipes or FS_DEDUP images the data goes through a buffer of a few
+ * blocks instead.  Returns zero on success or a negative value on error. */
+int fs_import(struct superblock *sb, int hostfd, const char *fname);
+
+/* Write the contents of the file =fname to the host file open at =hostfd.
+ * A regular host file is truncated and written from its start, with the
+ * holes of =fname left as holes; anything else, such as a pipe, gets the
+ * bytes in order.  Runs of blocks are moved by the kernel (copy_file_range,
+ * or splice for pipes) when it can, and a block at a time otherwise.
+ * Returns zero on success or a negative value on error. */
+int fs_export(struct superblock *sb, const char *fname, int hostfd);
+
+/* Write the =cnt bytes in =buf to the existing file =fname starting at
+ * byte =offset, extending the file if the write ends past its end (a gap
+ * between the old end and =offset reads as zeros).  Only the blocks the
+ * write touches are changed; blocks shared with a clone are copied first,
+ * so the other file keeps its contents.  Returns =cnt on success or a
+ * negative value on error. */
+ssize_t fs_pwrite_file(struct superblock *sb, const char *fname, char *buf,
+                       size_t cnt, uint64_t offset);
+
+/* Create the file =dstname as a copy of the file =srcname that shares all
+ * its blocks, counting one more reference to each block linked from the
+ * source inode.  Only an inode and a nodeinfo are written, whatever the
+ * size of the file.  Later writes to either file copy the shared blocks
+ * they change (see fs_pwrite_file).  Returns zero on success or a negative
+ * value on error; errno is set to EEXIST if =dstname exists and EISDIR if
+ * =srcname is a directory. */
+int fs_clone(struct superblock *sb, const char *srcname, const char *dstname);
+
 int fs_unlink(struct superblock *sb, const char *fname);
 
 int fs_mkdir(struct superblock *sb, const char *dname);
 
 int fs_rmdir(struct superblock *sb, const char *dname);
 
+/* Remove the file or directory =path and everything under it.  The tree
+ * is walked by several threads at once, which only find the blocks to
+ * free; the blocks are then put back in the free list together, with a
+ * single superblock write.  Whatever a snapshot or a clone outside the
+ * tree still shares is kept for them.  Returns zero on success or a
+ * negative value on error (errno is set to EBUSY for the root). */
+int fs_rmtree(struct superblock *sb, const char *path);
+
+/* Move the file or directory at =oldpath to =newpath, which may be in
+ * another directory.  Only directory links, the entity's name and its
+ * parent are updated; no data is copied.  If =newpath exists, errno is set
+ * to EEXIST unless =flags contains FS_RENAME_REPLACE, in which case the
+ * target (a file, or an empty directory if =oldpath is a directory) is
+ * replaced: its link is pointed at the moved entity in a single write, so
+ * =newpath never disappears, and the target is freed afterwards.  Moving a
+ * directory into its own subtree sets errno to EINVAL.  Returns zero on
+ * success or a negative value on error. */
+int fs_rename(struct superblock *sb, const char *oldpath, const char *newpath,
+              int flags);
+
 char * fs_list_dir(struct superblock *sb, const char *dname);
 
+/* Metadata of a file or directory, see fs_stat. */
+struct fsstat {
+	uint64_t mode; /* IMREG or IMDIR */
+	uint64_t size; /* bytes of a file, entries of a directory */
+	uint64_t blocks; /* data blocks stored for a file, see struct nodeinfo */
+	uint64_t inode; /* block holding the entity's (first) inode */
+};
+
+/* Fill =st with the metadata of the file or directory =path, taken from its
+ * inode and nodeinfo alone (usually found in the block cache) without
+ * reading any data.  The blocks of a file written with FS_DELALLOC are only
+ * counted once it is flushed.  Returns zero on success or a negative value
+ * on error (errno is set to ENOENT if =path does not exist). */
+int fs_stat(struct superblock *sb, const char *path, struct fsstat *st);
+
+/* Space usage of a filesystem, see fs_statfs. */
+struct fsstatfs {
+	uint64_t blks; /* blocks in the filesystem */
+	uint64_t blksz; /* block size (bytes) */
+	uint64_t freeblks; /* free blocks, less those reserved for delayed files */
+	uint64_t reserved; /* free blocks reserved for files not flushed yet */
+	uint64_t freerange; /* free blocks in the range at the end, one run */
+	double fragmentation;
+	/* share of the free blocks outside the free range, from 0 when all
+	 * free space is a single run to 1.  blocks in the free list are
+	 * counted as scattered, since where they are is only known by
+	 * reading the list. */
+};
+
+/* Fill =st with the space usage of the filesystem pointed to by =sb.  The
+ * figures come from the superblock in memory, so no block is read.
+ * Returns zero on success or a negative value on error. */
+int fs_statfs(struct superblock *sb, struct fsstatfs *st);
+
+/* Totals of a directory tree, see fs_du. */
+struct fsdu {
+	uint64_t files; /* files in the tree */
+	uint64_t dirs; /* directories in the tree, its top included */
+	uint64_t size; /* bytes in the files */
+	uint64_t blocks;
+	/* data blocks of the files, see struct nodeinfo.  a block shared
+	 * by several files is counted for each of them. */
+};
+
+/* Fill =du with the totals of the directory tree under =path, or of the
+ * file =path, reading only the inodes and nodeinfos of its entries.
+ * Subdirectories are walked by several threads at once.  Returns zero on
+ * success or a negative value on error. */
+int fs_du(struct superblock *sb, const char *path, struct fsdu *du);
+
+/* Return the paths of the entries at any depth under the directory =dname
+ * whose names match the shell wildcard =pattern (see fnmatch(3)).  The
+ * paths are sorted and separated by spaces, and those of directories end
+ * in a slash, as with fs_list_dir.  Subdirectories are walked by several
+ * threads at once.  Returns a string the caller should free, or NULL on
+ * error (errno is set to ENOTDIR if =dname is a file). */
+char * fs_find(struct superblock *sb, const char *dname, const char *pattern);
+
+/* Take a snapshot named =name of the directory tree of =sb.  The snapshot
+ * shares the whole tree: only the root gains a reference, and later
+ * changes copy each shared file or directory the first time it is changed,
+ * so the cost is proportional to the metadata changed afterwards.  Returns
+ * zero on success or a negative value on error; errno is set to EEXIST if
+ * the name is taken and EINVAL if it is empty or contains '/'. */
+int fs_snapshot(struct superblock *sb, const char *name);
+
+/* Open the snapshot =name of the filesystem in =fname read-only.  The
+ * returned superblock works with the reading functions and fs_close;
+ * functions that change the filesystem fail with errno set to EROFS.  The
+ * live filesystem may stay open and be written meanwhile, but the snapshot
+ * must not be deleted while it is open.  Returns NULL on error, with errno
+ * set to ENOENT if there is no such snapshot. */
+struct superblock * fs_open_snapshot(const char *fname, const char *name);
+
+/* Delete the snapshot =name, freeing the blocks only it still uses.
+ * Returns zero on success or a negative value on error (ENOENT if there is
+ * no such snapshot). */
+int fs_snapshot_delete(struct superblock *sb, const char *name);
+
 #endif
@@ -0,0 +1,645 @@
+/***************************************
+* Author: Joao Francisco B. S. Martins *
+*                                      *
+*         joaofbsm@dcc.ufmg.br         *
+***************************************/
+
+/* Offline consistency checker.
+ *
+ * Usage: fsck [-j threads] [-r] image
+ *
+ * Walks the directory tree from the root and the snapshots, checking every
+ * directory inode chain, file block map and nodeinfo, and counts how many
+ * times each block is referenced.  An entity shared between snapshots is
+ * walked once.  The tree walk is split across worker threads: each worker
+ * owns a queue of inodes to visit and steals from the other queues when
+ * its own runs dry.  A tail block counts a reference from each file whose
+ * packed tail it holds.  The reference counts are then checked against the
+ * free space, the reference count table and the fingerprint index.  With
+ * -r, blocks that are neither reachable nor free (leaked) are put back in
+ * the free list.
+ *
+ * Exits with 0 if the image is clean, 1 if all errors were repaired and 4
+ * if errors were left in the image. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "fs.h"
+
+#define LINK_MAX ((sb->blksz - 32) / sizeof(uint64_t))
+#define NAME_MAX (sb->blksz - (8 * sizeof(uint64_t)))
+#define BUCKET_MAX (sb->blksz / sizeof(uint64_t))
+#define HASH_MAX ((sb->blksz - 16) / sizeof(struct hashent))
+#define FREE_MAX ((sb->blksz - 16) / sizeof(uint64_t))
+#define DIRECT_MAX (LINK_MAX - 3)
+#define PTR_MAX (sb->blksz / sizeof(uint64_t))
+
+#define MAX_THREADS 64
+
+struct task {
+	uint64_t inode;  /* First inode of the entity to check */
+	uint64_t parent; /* Inode of the directory that links to it */
+};
+
+struct queue {
+	pthread_mutex_t lock;
+	struct task *tasks;
+	size_t head; /* Thieves take tasks from the head */
+	size_t tail; /* The owner pushes and pops at the tail */
+	size_t cap;
+};
+
+struct checker {
+	struct superblock *sb;
+	uint32_t *refs;        /* Number of references found to each block */
+	uint8_t *freemap;      /* Blocks found in the free list */
+	struct queue queues[MAX_THREADS];
+	int nthreads;
+	uint64_t pending;      /* Tasks queued or running, across all queues */
+	uint64_t errors;
+	uint64_t files, dirs;
+	pthread_mutex_t outlock;
+};
+
+struct worker {
+	struct checker *ck;
+	int id;
+};
+
+/************************
+*       UTILITIES       *
+************************/
+
+void ck_error(struct checker *ck, const char *fmt, ...) {
+	va_list ap;
+
+	pthread_mutex_lock(&ck->outlock);
+	ck->errors++;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+	pthread_mutex_unlock(&ck->outlock);
+}
+
+/* Reads block =pos without touching the shared file offset, so workers can read concurrently */
+int ck_read(struct checker *ck, uint64_t pos, void *data) {
+	struct superblock *sb = ck->sb;
+
+	if(pos == 0 || pos >= sb->blks) {
+		return -1;
+	}
+
+	if(pread(sb->fd, data, sb->blksz, pos * sb->blksz) != sb->blksz) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Counts a reference to =blk. Returns the number of references it had before, or -1 if the block
+ * number is out of range. */
+int64_t ck_mark(struct checker *ck, uint64_t blk, const char *what, uint64_t owner) {
+	if(blk == 0 || blk >= ck->sb->blks) {
+		ck_error(ck, "%s %llu of inode %llu is out of range", what, (unsigned long long) blk,
+		         (unsigned long long) owner);
+		return -1;
+	}
+
+	return __atomic_fetch_add(&ck->refs[blk], 1, __ATOMIC_RELAXED);
+}
+
+void ck_push(struct checker *ck, int id, uint64_t inode, uint64_t parent) {
+	struct queue *q = &ck->queues[id];
+
+	__atomic_fetch_add(&ck->pending, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&q->lock);
+	if(q->tail == q->cap) {
+		if(q->head > 0) { /* Reclaim the room left by stolen tasks */
+			memmove(q->tasks, q->tasks + q->head, (q->tail - q->head) * sizeof *q->tasks);
+			q->tail -= q->head;
+			q->head  = 0;
+		}
+		if(q->tail == q->cap) {
+			q->cap = q->cap ? q->cap * 2 : 64;
+			q->tasks = realloc(q->tasks, q->cap * sizeof *q->tasks);
+		}
+	}
+	q->tasks[q->tail].inode  = inode;
+	q->tasks[q->tail].parent = parent;
+	q->tail++;
+	pthread_mutex_unlock(&q->lock);
+}
+
+/* Pops from the worker's own queue (depth first), else steals the oldest task of another worker.
+ * Returns 0 if no task was found. */
+int ck_take(struct checker *ck, int id, struct task *task) {
+	struct queue *q = &ck->queues[id];
+
+	pthread_mutex_lock(&q->lock);
+	if(q->tail > q->head) {
+		*task = q->tasks[--q->tail];
+		pthread_mutex_unlock(&q->lock);
+		return 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	for(int i = 1; i < ck->nthreads; i++) {
+		q = &ck->queues[(id + i) % ck->nthreads];
+
+		pthread_mutex_lock(&q->lock);
+		if(q->tail > q->head) {
+			*task = q->tasks[q->head++];
+			pthread_mutex_unlock(&q->lock);
+			return 1;
+		}
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	return 0;
+}
+
+/************************
+*      TREE CHECKS      *
+************************/
+
+/* Checks the nodeinfo of =blk and returns 0 if it can be used */
+int ck_nodeinfo(struct checker *ck, uint64_t blk, struct inode *inode, struct nodeinfo *info) {
+	struct superblock *sb = ck->sb;
+
+	if(ck_mark(ck, inode->meta, "nodeinfo", blk) < 0) {
+		return -1;
+	}
+
+	if(ck_read(ck, inode->meta, info)) {
+		ck_error(ck, "cannot read nodeinfo of inode %llu", (unsigned long long) blk);
+		return -1;
+	}
+
+	if(memchr(info->name, '\0', NAME_MAX) == NULL) {
+		ck_error(ck, "name of inode %llu is not terminated", (unsigned long long) blk);
+		info->name[NAME_MAX - 1] = '\0';
+	}
+
+	/* Roots (the live one, those frozen by snapshots and the snapshot directory) are their own
+	 * parent and are named "/" */
+	if(inode->parent != blk && (info->name[0] == '\0' || strchr(info->name, '/') != NULL)) {
+		ck_error(ck, "inode %llu has an invalid name \"%s\"", (unsigned long long) blk, info->name);
+	}
+
+	return 0;
+}
+
+/* Walks the IMCHILD chain after directory =inode, which is held in =blk, queueing each entry for
+ * the workers. */
+void ck_chain(struct checker *ck, int id, uint64_t blk, struct inode *inode, struct nodeinfo *info) {
+	struct superblock *sb = ck->sb;
+	uint64_t first = blk, prev = 0, thisblk = blk, links = 0;
+
+	while(1) {
+		for(uint64_t i = 0; i < LINK_MAX; i++) {
+			uint64_t link = inode->links[i];
+
+			if(link == 0) {
+				continue;
+			}
+
+			links++;
+			if(ck_mark(ck, link, "entry", thisblk) == 0) {
+				ck_push(ck, id, link, first);
+			}
+		}
+
+		if(inode->next == 0) {
+			break;
+		}
+
+		prev    = thisblk;
+		thisblk = inode->next;
+
+		if(ck_mark(ck, thisblk, "child inode", prev) != 0 || ck_read(ck, thisblk, inode)) {
+			ck_error(ck, "broken inode chain after inode %llu", (unsigned long long) prev);
+			break;
+		}
+
+		if(inode->mode != IMCHILD || inode->parent != first || inode->meta != prev) {
+			ck_error(ck, "child inode %llu has bad mode or back links", (unsigned long long) thisblk);
+		}
+	}
+
+	if(links != info->size) {
+		ck_error(ck, "directory %llu (%s) has %llu entries but nodeinfo says %llu",
+		         (unsigned long long) first, info->name, (unsigned long long) links,
+		         (unsigned long long) info->size);
+	}
+}
+
+/* Checks the tree of =depth levels under =blk, which maps =count data blocks of file =file, and
+ * returns the number of data blocks stored in it. The blocks are marked only if =mark is set: the
+ * children of an indirect block shared between clones are counted once, from its first parent. */
+uint64_t ck_tree(struct checker *ck, uint64_t file, uint64_t blk, int depth, uint64_t count, int mark) {
+	struct superblock *sb = ck->sb;
+	uint64_t span = 1, stored = 0, n;
+	int64_t seen = 0;
+	uint64_t *ptrs;
+
+	if(blk == 0) {
+		return 0;
+	}
+
+	if(depth == 0) {
+		return !mark || ck_mark(ck, blk, "data block", file) >= 0;
+	}
+
+	ptrs = malloc(sb->blksz);
+	if((mark && (seen = ck_mark(ck, blk, "indirect block", file)) < 0) || ck_read(ck, blk, ptrs)) {
+		free(ptrs);
+		return 0;
+	}
+
+	for(int i = 1; i < depth; i++) {
+		span *= PTR_MAX;
+	}
+
+	for(uint64_t i = 0; i < PTR_MAX; i++) {
+		if(i * span >= count) {
+			if(ptrs[i] != 0 && mark && seen == 0) {
+				ck_error(ck, "indirect block %llu of inode %llu maps past the end of its file",
+				         (unsigned long long) blk, (unsigned long long) file);
+			}
+			continue;
+		}
+		n = (count - i * span < span) ? count - i * span : span;
+		stored += ck_tree(ck, file, ptrs[i], depth - 1, n, mark && seen == 0);
+	}
+
+	free(ptrs);
+	return stored;
+}
+
+/* Checks the block map of file =inode, which is held in =blk */
+void ck_file(struct checker *ck, uint64_t blk, struct inode *inode, struct nodeinfo *info) {
+	struct superblock *sb = ck->sb;
+	uint64_t nblks, stored = 0, base, span, n;
+
+	nblks = (info->size / sb->blksz) + ((info->size % sb->blksz) ? 1 : 0);
+
+	if(inode->next != 0) { /* Packed tail */
+		if(info->size % sb->blksz == 0 || inode->next % sb->blksz + info->size % sb->blksz > sb->blksz) {
+			ck_error(ck, "packed tail of file %llu (%s) does not fit in its tail block",
+			         (unsigned long long) blk, info->name);
+		}
+		else {
+			ck_mark(ck, inode->next / sb->blksz, "tail block", blk);
+		}
+	}
+
+	for(uint64_t i = 0; i < DIRECT_MAX; i++) {
+		if(inode->links[i] == 0) {
+			continue;
+		}
+		if(i >= nblks) {
+			ck_error(ck, "inode %llu links past the end of its file", (unsigned long long) blk);
+		}
+		else {
+			stored += ck_tree(ck, blk, inode->links[i], 0, 1, 1);
+		}
+	}
+
+	base = DIRECT_MAX;
+	span = 1;
+	for(int depth = 1; depth <= 3; depth++) {
+		span *= PTR_MAX;
+		n = (nblks > base) ? nblks - base : 0;
+		if(n > span) n = span;
+
+		if(n == 0 && inode->links[DIRECT_MAX + depth - 1] != 0) {
+			ck_error(ck, "inode %llu links past the end of its file", (unsigned long long) blk);
+		}
+		else {
+			stored += ck_tree(ck, blk, inode->links[DIRECT_MAX + depth - 1], depth, n, 1);
+		}
+		base += span;
+	}
+
+	if(nblks > base) {
+		ck_error(ck, "file %llu (%s) is larger than its block map", (unsigned long long) blk, info->name);
+	}
+
+	if(stored != info->blocks) {
+		ck_error(ck, "file %llu (%s) stores %llu blocks but nodeinfo says %llu",
+		         (unsigned long long) blk, info->name, (unsigned long long) stored,
+		         (unsigned long long) info->blocks);
+	}
+}
+
+void ck_entity(struct checker *ck, int id, struct task *task, struct inode *inode,
+               struct nodeinfo *info) {
+	if(ck_read(ck, task->inode, inode)) {
+		ck_error(ck, "cannot read inode %llu", (unsigned long long) task->inode);
+		return;
+	}
+
+	if(inode->mode != IMREG && inode->mode != IMDIR) {
+		ck_error(ck, "inode %llu linked from %llu has bad mode %llu", (unsigned long long) task->inode,
+		         (unsigned long long) task->parent, (unsigned long long) inode->mode);
+		return;
+	}
+
+	/* Once snapshots were taken, entities are linked from several copies of their directory */
+	if(ck->sb->snaps == 0 && inode->parent != task->parent) {
+		ck_error(ck, "inode %llu has parent %llu but is linked from %llu",
+		         (unsigned long long) task->inode, (unsigned long long) inode->parent,
+		         (unsigned long long) task->parent);
+	}
+
+	if(ck_nodeinfo(ck, task->inode, inode, info)) {
+		return;
+	}
+
+	if(inode->mode == IMDIR) {
+		__atomic_fetch_add(&ck->dirs, 1, __ATOMIC_RELAXED);
+		ck_chain(ck, id, task->inode, inode, info);
+	}
+	else {
+		__atomic_fetch_add(&ck->files, 1, __ATOMIC_RELAXED);
+		ck_file(ck, task->inode, inode, info);
+	}
+}
+
+void * ck_worker(void *arg) {
+	struct worker *w = arg;
+	struct checker *ck = w->ck;
+	struct inode *inode = malloc(ck->sb->blksz);
+	struct nodeinfo *info = malloc(ck->sb->blksz);
+	struct task task;
+
+	while(__atomic_load_n(&ck->pending, __ATOMIC_SEQ_CST) != 0) {
+		if(!ck_take(ck, w->id, &task)) {
+			sched_yield();
+			continue;
+		}
+
+		ck_entity(ck, w->id, &task, inode, info);
+		__atomic_fetch_sub(&ck->pending, 1, __ATOMIC_SEQ_CST);
+	}
+
+	free(inode);
+	free(info);
+
+	return NULL;
+}
+
+/************************
+*     SPACE CHECKS      *
+************************/
+
+/* Marks the blocks of the hash table rooted at =table. With =refcounts, also checks every entry
+ * against the references found in the tree. */
+void ck_table(struct checker *ck, uint64_t table, const char *what, int refcounts) {
+	struct superblock *sb = ck->sb;
+	uint64_t *buckets = malloc(sb->blksz);
+	struct hashpage *page = malloc(sb->blksz);
+	uint64_t pageblk;
+
+	if(table == 0) {
+		free(buckets);
+		free(page);
+		return;
+	}
+
+	if(ck_mark(ck, table, what, 0) != 0 || ck_read(ck, table, buckets)) {
+		ck_error(ck, "%s table block %llu is unusable", what, (unsigned long long) table);
+		free(buckets);
+		free(page);
+		return;
+	}
+
+	for(uint64_t b = 0; b < BUCKET_MAX; b++) {
+		pageblk = buckets[b];
+
+		while(pageblk != 0) {
+			if(ck_mark(ck, pageblk, what, table) != 0 || ck_read(ck, pageblk, page) ||
+			   page->count > HASH_MAX) {
+				ck_error(ck, "%s page %llu is unusable", what, (unsigned long long) pageblk);
+				break;
+			}
+
+			for(uint64_t i = 0; i < page->count; i++) {
+				struct hashent *ent = &page->ents[i];
+
+				if(refcounts) {
+					if(ent->key == 0 || ent->key >= sb->blks) {
+						ck_error(ck, "reference count for block %llu out of range",
+						         (unsigned long long) ent->key);
+					}
+					else {
+						if(ck->refs[ent->key] != ent->value) {
+							ck_error(ck, "block %llu has %llu references but its count is %llu",
+							         (unsigned long long) ent->key,
+							         (unsigned long long) ck->refs[ent->key],
+							         (unsigned long long) ent->value);
+						}
+						ck->refs[ent->key] = 1; /* Checked, the sweep below only sees unlisted blocks */
+					}
+				}
+				else if(ent->value == 0 || ent->value >= sb->blks || ck->refs[ent->value] == 0) {
+					ck_error(ck, "fingerprint points to unused block %llu", (unsigned long long) ent->value);
+				}
+			}
+
+			pageblk = page->next;
+		}
+	}
+
+	free(buckets);
+	free(page);
+}
+
+/* Walks the free list and the free range, marking every free block in =freemap. Returns the number
+ * of free blocks. */
+uint64_t ck_freelist(struct checker *ck) {
+	struct superblock *sb = ck->sb;
+	struct freepage *fp = malloc(sb->blksz);
+	uint64_t count = 0, blk = sb->freelist;
+
+	while(blk != 0) {
+		if(blk >= sb->blks || ck->freemap[blk]) {
+			ck_error(ck, "free list is broken at block %llu", (unsigned long long) blk);
+			break;
+		}
+
+		ck->freemap[blk] = 1;
+		count++;
+
+		if(ck_read(ck, blk, fp) || fp->count > FREE_MAX) {
+			ck_error(ck, "free page %llu is unusable", (unsigned long long) blk);
+			break;
+		}
+
+		for(uint64_t i = 0; i < fp->count; i++) {
+			if(fp->links[i] == 0 || fp->links[i] >= sb->blks || ck->freemap[fp->links[i]]) {
+				ck_error(ck, "free page %llu has a bad link", (unsigned long long) blk);
+				continue;
+			}
+			ck->freemap[fp->links[i]] = 1;
+			count++;
+		}
+
+		blk = fp->next;
+	}
+
+	if(sb->frontier != 0) {
+		for(blk = sb->frontier; blk < sb->blks; blk++) {
+			if(ck->freemap[blk]) {
+				ck_error(ck, "block %llu is in the free list and the free range", (unsigned long long) blk);
+			}
+			ck->freemap[blk] = 1;
+			count++;
+		}
+	}
+
+	free(fp);
+
+	return count;
+}
+
+/************************
+*         MAIN          *
+************************/
+
+int main(int argc, char **argv) {
+	int opt, repair = 0, nthreads;
+	uint64_t freecount, leaked = 0, repaired = 0;
+	struct superblock *sb;
+	struct checker ck;
+	struct worker workers[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while((opt = getopt(argc, argv, "j:r")) != -1) {
+		switch(opt) {
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		case 'r':
+			repair = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-j threads] [-r] image\n", argv[0]);
+			return 8;
+		}
+	}
+
+	if(optind + 1 != argc) {
+		fprintf(stderr, "usage: %s [-j threads] [-r] image\n", argv[0]);
+		return 8;
+	}
+
+	if(nthreads < 1) nthreads = 1;
+	if(nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+	sb = fs_open(argv[optind]);
+	if(sb == NULL) {
+		perror(argv[optind]);
+		return 8;
+	}
+
+	if(sb->blksz < MIN_BLOCK_SIZE || sb->root == 0 || sb->root >= sb->blks || sb->frontier >= sb->blks ||
+	   sb->snaps >= sb->blks || sb->tailpos / sb->blksz >= sb->blks ||
+	   sb->blks * sb->blksz > (uint64_t) lseek(sb->fd, 0, SEEK_END)) {
+		fprintf(stderr, "%s: bad superblock\n", argv[optind]);
+		return 8;
+	}
+
+	memset(&ck, 0, sizeof ck);
+	ck.sb       = sb;
+	ck.nthreads = nthreads;
+	ck.refs     = calloc(sb->blks, sizeof *ck.refs);
+	ck.freemap  = calloc(sb->blks, 1);
+	pthread_mutex_init(&ck.outlock, NULL);
+	for(int i = 0; i < nthreads; i++) {
+		pthread_mutex_init(&ck.queues[i].lock, NULL);
+	}
+
+	ck.refs[0] = 1; /* Superblock */
+
+	/* Directory tree, split across the workers */
+	ck_mark(&ck, sb->root, "root", 0);
+	ck_push(&ck, 0, sb->root, sb->root);
+	if(sb->snaps != 0 && ck_mark(&ck, sb->snaps, "snapshot directory", 0) == 0) {
+		ck_push(&ck, 0, sb->snaps, sb->snaps);
+	}
+
+	for(int i = 0; i < nthreads; i++) {
+		workers[i].ck = &ck;
+		workers[i].id = i;
+		pthread_create(&threads[i], NULL, ck_worker, &workers[i]);
+	}
+	for(int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	if(sb->tailpos != 0 && ck.refs[sb->tailpos / sb->blksz] == 0) {
+		ck_error(&ck, "tail block %llu being filled holds no tail",
+		         (unsigned long long) (sb->tailpos / sb->blksz));
+	}
+
+	/* Tables, then every block against the free list */
+	ck_table(&ck, sb->fingerprints, "fingerprint", 0);
+	ck_table(&ck, sb->refcounts, "reference count", 1);
+
+	freecount = ck_freelist(&ck);
+	if(freecount != sb->freeblks) {
+		ck_error(&ck, "free list has %llu blocks but superblock says %llu",
+		         (unsigned long long) freecount, (unsigned long long) sb->freeblks);
+	}
+
+	for(uint64_t blk = 0; blk < sb->blks; blk++) {
+		if(ck.refs[blk] > 1) {
+			ck_error(&ck, "block %llu is referenced %u times without a reference count",
+			         (unsigned long long) blk, ck.refs[blk]);
+		}
+
+		if(ck.refs[blk] != 0 && ck.freemap[blk]) {
+			ck_error(&ck, "block %llu is in use and free", (unsigned long long) blk);
+		}
+
+		if(ck.refs[blk] == 0 && !ck.freemap[blk]) {
+			leaked++;
+			if(repair && fs_put_block(sb, blk) == 0) {
+				repaired++;
+			}
+		}
+	}
+
+	if(leaked != 0) {
+		printf("%llu blocks leaked%s\n", (unsigned long long) leaked, repair ? ", put back in free list" : "");
+	}
+
+	printf("%s: %llu files, %llu directories, %llu/%llu blocks free, %llu errors\n", argv[optind],
+	       (unsigned long long) ck.files, (unsigned long long) ck.dirs, (unsigned long long) sb->freeblks,
+	       (unsigned long long) sb->blks, (unsigned long long) (ck.errors + leaked));
+
+	for(int i = 0; i < nthreads; i++) {
+		free(ck.queues[i].tasks);
+	}
+	free(ck.refs);
+	free(ck.freemap);
+	fs_close(sb);
+
+	if(ck.errors == 0 && leaked == 0) return 0;
+	if(ck.errors == 0 && leaked == repaired) return 1;
+	return 4;
+}
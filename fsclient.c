@@ -0,0 +1,553 @@
+/***************************************
+* Author: Joao Francisco B. S. Martins *
+*                                      *
+*         joaofbsm@dcc.ufmg.br         *
+***************************************/
+
+/* Client library of fsd.
+ *
+ * Implements the API of fs.h by sending each call to an fsd daemon, so a
+ * program links with fsclient.o instead of fs.o to share an image with
+ * other processes.  fs_open takes the path of the daemon's socket instead
+ * of the image; the superblock it returns mirrors the daemon's after every
+ * call (=blks, =freeblks and =flags are kept current).
+ *
+ * A superblock may be used by several threads at once.  Requests are sent
+ * as soon as they are made and responses are read in order, each thread
+ * waiting for its own.  Calls moving more than FSD_DATA_MAX bytes are split
+ * and keep FSD_WINDOW requests in flight.  fs_write_file of more than
+ * FSD_DATA_MAX bytes is made of several requests, so other clients may see
+ * the file before it is complete; it is unlinked if a later part fails.
+ *
+ * fs_format, the striped and backend variants of fs_format and fs_open,
+ * fs_open_direct, fs_open_snapshot and fs_view_file are not available
+ * through the daemon and set errno to ENOTSUP. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "fs.h"
+#include "fsd.h"
+
+struct client {
+	struct superblock sb; /* Handed to the caller, =fd is the socket */
+	pthread_mutex_t sendlock;
+	pthread_mutex_t lock;
+	pthread_cond_t turn;  /* Another response was read */
+	uint64_t sent;        /* Requests sent */
+	uint64_t received;    /* Responses read */
+};
+
+/************************
+*       UTILITIES       *
+************************/
+
+int fc_send_all(int fd, struct iovec *iov, int iovcnt, int passfd) {
+	char ctl[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t sent;
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov    = iov;
+	msg.msg_iovlen = iovcnt;
+
+	if(passfd != -1) { /* Goes with the first byte of the request */
+		memset(ctl, 0, sizeof ctl);
+		msg.msg_control    = ctl;
+		msg.msg_controllen = sizeof ctl;
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &passfd, sizeof(int));
+	}
+
+	while(msg.msg_iovlen > 0) {
+		sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if(sent == -1 && errno == EINTR) continue;
+		if(sent == -1) return -1;
+
+		msg.msg_control    = NULL;
+		msg.msg_controllen = 0;
+
+		while(msg.msg_iovlen > 0 && (size_t) sent >= msg.msg_iov->iov_len) {
+			sent -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if(msg.msg_iovlen > 0) {
+			msg.msg_iov->iov_base = (char*) msg.msg_iov->iov_base + sent;
+			msg.msg_iov->iov_len -= sent;
+		}
+	}
+
+	return 0;
+}
+
+int fc_recv_all(int fd, void *buf, size_t len) {
+	ssize_t got;
+
+	while(len > 0) {
+		got = recv(fd, buf, len, 0);
+		if(got == -1 && errno == EINTR) continue;
+		if(got <= 0) {
+			if(got == 0) errno = ECONNRESET;
+			return -1;
+		}
+		buf  = (char*) buf + got;
+		len -= got;
+	}
+
+	return 0;
+}
+
+/* Sends a request for operation =op with the arguments =a0 and =a1, the paths =p0 and =p1 (or
+ * NULL), the =len bytes at =data and the descriptor =passfd (or -1). Returns the request's ticket,
+ * which fc_wait takes, or -1. */
+int64_t fc_send(struct client *c, uint32_t op, uint64_t a0, uint64_t a1, const char *p0, const char *p1,
+                const char *data, size_t len, int passfd) {
+	struct fsd_request req;
+	struct iovec iov[4];
+	int n = 1;
+	int64_t ticket;
+
+	req.op     = op;
+	req.len    = len;
+	req.arg[0] = a0;
+	req.arg[1] = a1;
+	iov[0].iov_base = &req;
+	iov[0].iov_len  = sizeof req;
+
+	if(p0 != NULL) {
+		iov[n].iov_base = (void*) p0;
+		iov[n].iov_len  = strlen(p0) + 1;
+		req.len += iov[n++].iov_len;
+	}
+	if(p1 != NULL) {
+		iov[n].iov_base = (void*) p1;
+		iov[n].iov_len  = strlen(p1) + 1;
+		req.len += iov[n++].iov_len;
+	}
+	if(len > 0) {
+		iov[n].iov_base = (void*) data;
+		iov[n++].iov_len = len;
+	}
+
+	pthread_mutex_lock(&c->sendlock);
+	ticket = c->sent;
+	if(fc_send_all(c->sb.fd, iov, n, passfd) == 0) {
+		c->sent++;
+	}
+	else {
+		ticket = -1;
+	}
+	pthread_mutex_unlock(&c->sendlock);
+
+	return ticket;
+}
+
+/* Waits for the response to request =ticket and returns its value, setting errno if it failed. Up
+ * to =bufsz payload bytes go to =buf, or all of them to a new buffer in =*alloc. */
+int64_t fc_wait(struct client *c, int64_t ticket, char *buf, size_t bufsz, char **alloc) {
+	struct fsd_response resp;
+	char *payload = NULL;
+	int err = 0, ok = 0;
+
+	if(ticket == -1) return -1;
+
+	pthread_mutex_lock(&c->lock);
+	while(c->received != (uint64_t) ticket) {
+		pthread_cond_wait(&c->turn, &c->lock);
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	/* Only the owner of the next response reads from the socket */
+	if(fc_recv_all(c->sb.fd, &resp, sizeof resp) == 0) {
+		ok = 1;
+		payload = (alloc != NULL) ? malloc(resp.len ? resp.len : 1) : buf;
+		if(alloc == NULL && resp.len > bufsz) {
+			resp.ret = -1;
+			resp.err = EPROTO;
+			payload = malloc(resp.len);
+		}
+		if(fc_recv_all(c->sb.fd, payload, resp.len) == -1) {
+			resp.ret = -1;
+			resp.err = errno;
+		}
+		if(payload != buf && alloc == NULL) free(payload);
+	}
+	else {
+		resp.ret = -1;
+		resp.err = errno;
+		resp.len = 0;
+	}
+
+	if(ok) {
+		c->sb.blks     = resp.blks;
+		c->sb.freeblks = resp.freeblks;
+		c->sb.flags    = resp.flags;
+	}
+	if(alloc != NULL) *alloc = payload;
+	if(resp.ret < 0) err = resp.err;
+
+	pthread_mutex_lock(&c->lock);
+	c->received++;
+	pthread_cond_broadcast(&c->turn);
+	pthread_mutex_unlock(&c->lock);
+
+	if(err != 0) errno = err;
+	return resp.ret;
+}
+
+int64_t fc_call(struct superblock *sb, uint32_t op, uint64_t a0, uint64_t a1, const char *p0, const char *p1,
+                int passfd) {
+	struct client *c = (struct client*) sb;
+
+	return fc_wait(c, fc_send(c, op, a0, a1, p0, p1, NULL, 0, passfd), NULL, 0, NULL);
+}
+
+/************************
+*          API          *
+************************/
+
+struct superblock * fs_format(const char *fname, uint64_t blocksize) {
+	(void) fname;
+	(void) blocksize;
+	errno = ENOTSUP;
+	return NULL;
+}
+
+struct superblock * fs_open(const char *fname) {
+	struct sockaddr_un addr;
+	struct client *c;
+	char *super = NULL;
+	int fd, err;
+
+	if(strlen(fname) >= sizeof addr.sun_path) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, fname);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd == -1) return NULL;
+	if(connect(fd, (struct sockaddr*) &addr, sizeof addr) == -1) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	c = calloc(1, sizeof *c);
+	c->sb.fd = fd;
+	pthread_mutex_init(&c->sendlock, NULL);
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->turn, NULL);
+
+	if(fc_wait(c, fc_send(c, FSD_SUPER, 0, 0, NULL, NULL, NULL, 0, -1), NULL, 0, &super) == -1) {
+		err = errno;
+		free(super);
+		fs_close(&c->sb);
+		errno = err;
+		return NULL;
+	}
+
+	memcpy(&c->sb, super, SUPERBLOCK_DISK_SIZE);
+	free(super);
+
+	return &c->sb;
+}
+
+struct superblock * fs_open_direct(const char *fname) {
+	(void) fname;
+	errno = ENOTSUP;
+	return NULL;
+}
+
+struct superblock * fs_format_striped(const char **fnames, int n, uint64_t blocksize, uint64_t stripe) {
+	(void) fnames;
+	(void) n;
+	(void) blocksize;
+	(void) stripe;
+	errno = ENOTSUP;
+	return NULL;
+}
+
+struct superblock * fs_open_striped(const char **fnames, int n) {
+	(void) fnames;
+	(void) n;
+	errno = ENOTSUP;
+	return NULL;
+}
+
+struct superblock * fs_format_backend(const struct backend *backend, const char *name, uint64_t size,
+                                      uint64_t blocksize) {
+	(void) backend;
+	(void) name;
+	(void) size;
+	(void) blocksize;
+	errno = ENOTSUP;
+	return NULL;
+}
+
+struct superblock * fs_open_backend(const struct backend *backend, const char *name) {
+	(void) backend;
+	(void) name;
+	errno = ENOTSUP;
+	return NULL;
+}
+
+int fs_close(struct superblock *sb) {
+	struct client *c = (struct client*) sb;
+
+	close(sb->fd);
+	pthread_mutex_destroy(&c->sendlock);
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->turn);
+	free(c);
+
+	return 0;
+}
+
+uint64_t fs_get_block(struct superblock *sb) {
+	return (uint64_t) fc_call(sb, FSD_GET_BLOCK, 0, 0, NULL, NULL, -1);
+}
+
+int fs_put_block(struct superblock *sb, uint64_t block) {
+	return fc_call(sb, FSD_PUT_BLOCK, block, 0, NULL, NULL, -1);
+}
+
+int fs_grow(struct superblock *sb, uint64_t blks) {
+	return fc_call(sb, FSD_GROW, blks, 0, NULL, NULL, -1);
+}
+
+int fs_trim(struct superblock *sb) {
+	return fc_call(sb, FSD_TRIM, 0, 0, NULL, NULL, -1);
+}
+
+int fs_flush(struct superblock *sb) {
+	return fc_call(sb, FSD_FLUSH, 0, 0, NULL, NULL, -1);
+}
+
+int fs_setflags(struct superblock *sb, uint64_t flags) {
+	return fc_call(sb, FSD_SETFLAGS, flags, 0, NULL, NULL, -1);
+}
+
+/* Sends the =cnt bytes in =buf to be written at =offset of =fname, in requests of at most
+ * FSD_DATA_MAX bytes with FSD_WINDOW of them in flight. The first request is =op, the others
+ * FSD_PWRITE. Returns =cnt, or -1 if any of them failed. */
+ssize_t fc_write(struct client *c, uint32_t op, const char *fname, const char *buf, size_t cnt,
+                 uint64_t offset) {
+	int64_t tickets[FSD_WINDOW];
+	uint64_t head = 0, tail = 0; /* Requests waited for and sent */
+	size_t sent = 0, n;
+	int err = 0;
+
+	do {
+		if(tail - head == FSD_WINDOW) {
+			if(fc_wait(c, tickets[head++ % FSD_WINDOW], NULL, 0, NULL) == -1 && err == 0) err = errno;
+		}
+
+		n = (cnt - sent < FSD_DATA_MAX) ? cnt - sent : FSD_DATA_MAX;
+		tickets[tail % FSD_WINDOW] = fc_send(c, (tail == 0) ? op : FSD_PWRITE, 0, offset + sent, fname, NULL,
+		                                     buf + sent, n, -1);
+		tail++;
+		sent += n;
+	} while(sent < cnt && err == 0);
+
+	for(; head < tail; head++) {
+		if(fc_wait(c, tickets[head % FSD_WINDOW], NULL, 0, NULL) == -1 && err == 0) err = errno;
+	}
+
+	if(err != 0) {
+		errno = err;
+		return -1;
+	}
+
+	return cnt;
+}
+
+/* Reads up to =bufsz bytes at =offset of =fname into =buf, in requests of at most FSD_DATA_MAX
+ * bytes with FSD_WINDOW of them in flight, until one comes back short. Returns the number of
+ * bytes read or -1. */
+ssize_t fc_read(struct client *c, const char *fname, char *buf, size_t bufsz, uint64_t offset) {
+	int64_t tickets[FSD_WINDOW], got;
+	size_t want[FSD_WINDOW], start[FSD_WINDOW];
+	uint64_t head = 0, tail = 0;
+	size_t asked = 0, total = 0;
+	int err = 0, eof = 0;
+
+	while(head < tail || tail == 0 || (asked < bufsz && !eof && err == 0)) {
+		if(tail - head < FSD_WINDOW && (tail == 0 || (asked < bufsz && !eof && err == 0))) {
+			want[tail % FSD_WINDOW]    = (bufsz - asked < FSD_DATA_MAX) ? bufsz - asked : FSD_DATA_MAX;
+			start[tail % FSD_WINDOW]   = asked;
+			tickets[tail % FSD_WINDOW] = fc_send(c, FSD_PREAD, want[tail % FSD_WINDOW], offset + asked,
+			                                     fname, NULL, NULL, 0, -1);
+			asked += want[tail++ % FSD_WINDOW];
+			continue;
+		}
+
+		got = fc_wait(c, tickets[head % FSD_WINDOW], buf + start[head % FSD_WINDOW], want[head % FSD_WINDOW],
+		              NULL);
+		if(got == -1 && err == 0) err = errno;
+		if(got >= 0 && !eof) { /* Bytes after a short read are not part of the result */
+			total += got;
+			if((size_t) got < want[head % FSD_WINDOW]) eof = 1;
+		}
+		head++;
+	}
+
+	if(err != 0) {
+		errno = err;
+		return -1;
+	}
+
+	return total;
+}
+
+int fs_write_file(struct superblock *sb, const char *fname, char *buf, size_t cnt) {
+	int err;
+
+	if(fc_write((struct client*) sb, FSD_WRITE_FILE, fname, buf, cnt, 0) == -1) {
+		if(cnt > FSD_DATA_MAX) { /* Do not leave part of the file behind */
+			err = errno;
+			fc_call(sb, FSD_UNLINK, 0, 0, fname, NULL, -1);
+			errno = err;
+		}
+		return -1;
+	}
+
+	return 0;
+}
+
+ssize_t fs_read_file(struct superblock *sb, const char *fname, char *buf, size_t bufsz) {
+	return fc_read((struct client*) sb, fname, buf, bufsz, 0);
+}
+
+ssize_t fs_pread_file(struct superblock *sb, const char *fname, char *buf, size_t bufsz, uint64_t offset) {
+	return fc_read((struct client*) sb, fname, buf, bufsz, offset);
+}
+
+int fs_view_file(struct superblock *sb, const char *fname, uint64_t offset, size_t count, struct view *views,
+                 int max) {
+	(void) sb;
+	(void) fname;
+	(void) offset;
+	(void) count;
+	(void) views;
+	(void) max;
+	errno = ENOTSUP;
+	return -1;
+}
+
+void fs_release_views(struct superblock *sb, struct view *views, int n) {
+	(void) sb;
+	(void) views;
+	(void) n;
+}
+
+int fs_import(struct superblock *sb, int hostfd, const char *fname) {
+	return fc_call(sb, FSD_IMPORT, 0, 0, fname, NULL, hostfd);
+}
+
+int fs_export(struct superblock *sb, const char *fname, int hostfd) {
+	return fc_call(sb, FSD_EXPORT, 0, 0, fname, NULL, hostfd);
+}
+
+ssize_t fs_pwrite_file(struct superblock *sb, const char *fname, char *buf, size_t cnt, uint64_t offset) {
+	return fc_write((struct client*) sb, FSD_PWRITE, fname, buf, cnt, offset);
+}
+
+int fs_clone(struct superblock *sb, const char *srcname, const char *dstname) {
+	return fc_call(sb, FSD_CLONE, 0, 0, srcname, dstname, -1);
+}
+
+int fs_unlink(struct superblock *sb, const char *fname) {
+	return fc_call(sb, FSD_UNLINK, 0, 0, fname, NULL, -1);
+}
+
+int fs_mkdir(struct superblock *sb, const char *dname) {
+	return fc_call(sb, FSD_MKDIR, 0, 0, dname, NULL, -1);
+}
+
+int fs_rmdir(struct superblock *sb, const char *dname) {
+	return fc_call(sb, FSD_RMDIR, 0, 0, dname, NULL, -1);
+}
+
+int fs_rename(struct superblock *sb, const char *oldpath, const char *newpath, int flags) {
+	return fc_call(sb, FSD_RENAME, flags, 0, oldpath, newpath, -1);
+}
+
+char * fs_list_dir(struct superblock *sb, const char *dname) {
+	struct client *c = (struct client*) sb;
+	char *list;
+
+	if(fc_wait(c, fc_send(c, FSD_LIST_DIR, 0, 0, dname, NULL, NULL, 0, -1), NULL, 0, &list) == -1) {
+		free(list);
+		return NULL;
+	}
+
+	return list;
+}
+
+/* Runs the request =op, whose response carries a struct of =len bytes copied to =st */
+int fc_stat(struct superblock *sb, uint32_t op, const char *path, void *st, size_t len) {
+	struct client *c = (struct client*) sb;
+
+	return (fc_wait(c, fc_send(c, op, 0, 0, path, NULL, NULL, 0, -1), st, len, NULL) == -1) ? -1 : 0;
+}
+
+int fs_stat(struct superblock *sb, const char *path, struct fsstat *st) {
+	return fc_stat(sb, FSD_STAT, path, st, sizeof *st);
+}
+
+int fs_statfs(struct superblock *sb, struct fsstatfs *st) {
+	return fc_stat(sb, FSD_STATFS, NULL, st, sizeof *st);
+}
+
+int fs_rmtree(struct superblock *sb, const char *path) {
+	return fc_call(sb, FSD_RMTREE, 0, 0, path, NULL, -1);
+}
+
+int fs_du(struct superblock *sb, const char *path, struct fsdu *du) {
+	return fc_stat(sb, FSD_DU, path, du, sizeof *du);
+}
+
+char * fs_find(struct superblock *sb, const char *dname, const char *pattern) {
+	struct client *c = (struct client*) sb;
+	char *list;
+
+	if(fc_wait(c, fc_send(c, FSD_FIND, 0, 0, dname, pattern, NULL, 0, -1), NULL, 0, &list) == -1) {
+		free(list);
+		return NULL;
+	}
+
+	return list;
+}
+
+int fs_snapshot(struct superblock *sb, const char *name) {
+	return fc_call(sb, FSD_SNAPSHOT, 0, 0, name, NULL, -1);
+}
+
+struct superblock * fs_open_snapshot(const char *fname, const char *name) {
+	(void) fname;
+	(void) name;
+	errno = ENOTSUP;
+	return NULL;
+}
+
+int fs_snapshot_delete(struct superblock *sb, const char *name) {
+	return fc_call(sb, FSD_SNAPSHOT_DELETE, 0, 0, name, NULL, -1);
+}
@@ -0,0 +1,459 @@
+/***************************************
+* Author: Joao Francisco B. S. Martins *
+*                                      *
+*         joaofbsm@dcc.ufmg.br         *
+***************************************/
+
+/* Filesystem daemon.
+ *
+ * Usage: fsd [-f blocksize] [-d] image socket
+ *
+ * Opens =image (formatting it first with -f, or with O_DIRECT with -d) and
+ * serves the fs_* calls of local clients on the Unix socket =socket, so that
+ * many processes share one image and one block cache.  The client library
+ * in fsclient.c offers the API of fs.h over the socket; see fsd.h for the
+ * protocol.
+ *
+ * A single thread polls every connection.  All the complete requests a
+ * read brings in are served in a row and their responses are sent back
+ * together, so clients that pipeline requests pay one round trip per batch.
+ * Calls are served one at a time, in the order each client sent them.  A
+ * client that stops reading its responses is dropped once too many are
+ * waiting.  Imports and exports only take host files and block devices, as
+ * a pipe would hold up the other clients until its other end is drained;
+ * other descriptors fail with ESPIPE.
+ *
+ * Runs until SIGINT or SIGTERM, then closes the image, which writes out
+ * anything buffered.  Exits with 0 on success, 4 if the image could not be
+ * opened or served and 8 on usage errors. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "fs.h"
+#include "fsd.h"
+
+#define MAX_CLIENTS 256
+#define FDS_MAX 16                    /* Descriptors a client may pass ahead of its requests */
+#define PAYLOAD_MAX (FSD_DATA_MAX + (1 << 16)) /* Data and paths of one request */
+#define OUT_MAX (64 << 20)            /* Response bytes a client may leave unread */
+
+struct client {
+	int fd;
+	char *in;              /* Bytes received, starting with a request */
+	size_t inlen, incap;
+	char *out;             /* Responses not sent yet, from =outoff on */
+	size_t outlen, outoff, outcap;
+	int fds[FDS_MAX];      /* Descriptors received, oldest first */
+	int nfds;
+};
+
+static volatile sig_atomic_t stop;
+
+/************************
+*       UTILITIES       *
+************************/
+
+void sd_stop(int sig) {
+	(void) sig;
+	stop = 1;
+}
+
+void sd_reserve(char **buf, size_t *cap, size_t need) {
+	if(need <= *cap) return;
+
+	while(*cap < need) *cap = *cap ? *cap * 2 : 4096;
+	*buf = realloc(*buf, *cap);
+}
+
+/* Queues a response carrying =ret, errno if it signals an error and the =len bytes at =data */
+void sd_respond(struct superblock *sb, struct client *c, int64_t ret, int err, const void *data, size_t len) {
+	struct fsd_response resp;
+
+	resp.ret      = ret;
+	resp.err      = err;
+	resp.len      = len;
+	resp.blks     = sb->blks;
+	resp.freeblks = sb->freeblks;
+	resp.flags    = sb->flags;
+
+	sd_reserve(&c->out, &c->outcap, c->outlen + sizeof resp + len);
+	memcpy(c->out + c->outlen, &resp, sizeof resp);
+	if(len > 0) memcpy(c->out + c->outlen + sizeof resp, data, len);
+	c->outlen += sizeof resp + len;
+}
+
+/* Returns the oldest descriptor the client passed, or -1 */
+int sd_take_fd(struct client *c) {
+	int fd;
+
+	if(c->nfds == 0) return -1;
+
+	fd = c->fds[0];
+	memmove(c->fds, c->fds + 1, --c->nfds * sizeof *c->fds);
+
+	return fd;
+}
+
+void sd_drop(struct client *c) {
+	close(c->fd);
+	while(c->nfds > 0) close(sd_take_fd(c));
+	free(c->in);
+	free(c->out);
+	memset(c, 0, sizeof *c);
+	c->fd = -1;
+}
+
+/************************
+*        SERVING        *
+************************/
+
+/* Serves the request =req, whose payload is at =payload, queueing its response */
+void sd_serve(struct superblock *sb, struct client *c, struct fsd_request *req, char *payload) {
+	char *path[2] = {NULL, NULL}, *data = payload, *list, *buf;
+	size_t len = req->len, n;
+	int64_t ret = -1;
+	int fd, npaths = (req->op == FSD_RENAME || req->op == FSD_CLONE || req->op == FSD_FIND) ? 2 : 1;
+	struct fsstat st;
+	struct fsstatfs stfs;
+	struct fsdu du;
+	struct stat hst;
+
+	/* Paths first, each terminated by a NUL byte, then data that may hold NUL bytes too */
+	for(int i = 0; i < npaths && len > 0; i++) {
+		if(memchr(data, '\0', len) == NULL) break;
+		n = strlen(data) + 1;
+		path[i] = data;
+		data += n;
+		len  -= n;
+	}
+
+	errno = 0;
+
+	switch(req->op) {
+	case FSD_SUPER:
+		sd_respond(sb, c, 0, 0, sb, SUPERBLOCK_DISK_SIZE);
+		return;
+	case FSD_WRITE_FILE:
+		if(path[0] == NULL) break;
+		ret = fs_write_file(sb, path[0], data, len);
+		break;
+	case FSD_PREAD:
+		if(path[0] == NULL || req->arg[0] > FSD_DATA_MAX) break;
+		buf = malloc(req->arg[0] ? req->arg[0] : 1);
+		ret = fs_pread_file(sb, path[0], buf, req->arg[0], req->arg[1]);
+		sd_respond(sb, c, ret, errno, buf, ret > 0 ? ret : 0);
+		free(buf);
+		return;
+	case FSD_PWRITE:
+		if(path[0] == NULL) break;
+		ret = fs_pwrite_file(sb, path[0], data, len, req->arg[1]);
+		break;
+	case FSD_UNLINK:
+		if(path[0] == NULL) break;
+		ret = fs_unlink(sb, path[0]);
+		break;
+	case FSD_MKDIR:
+		if(path[0] == NULL) break;
+		ret = fs_mkdir(sb, path[0]);
+		break;
+	case FSD_RMDIR:
+		if(path[0] == NULL) break;
+		ret = fs_rmdir(sb, path[0]);
+		break;
+	case FSD_LIST_DIR:
+		if(path[0] == NULL) break;
+		if((list = fs_list_dir(sb, path[0])) == NULL) {
+			sd_respond(sb, c, -1, errno, NULL, 0);
+			return;
+		}
+		sd_respond(sb, c, 0, 0, list, strlen(list) + 1);
+		free(list);
+		return;
+	case FSD_RENAME:
+		if(path[1] == NULL) break;
+		ret = fs_rename(sb, path[0], path[1], req->arg[0]);
+		break;
+	case FSD_CLONE:
+		if(path[1] == NULL) break;
+		ret = fs_clone(sb, path[0], path[1]);
+		break;
+	case FSD_FLUSH:
+		ret = fs_flush(sb);
+		break;
+	case FSD_SETFLAGS:
+		ret = fs_setflags(sb, req->arg[0]);
+		break;
+	case FSD_GROW:
+		ret = fs_grow(sb, req->arg[0]);
+		break;
+	case FSD_TRIM:
+		ret = fs_trim(sb);
+		break;
+	case FSD_GET_BLOCK:
+		ret = (int64_t) fs_get_block(sb);
+		break;
+	case FSD_PUT_BLOCK:
+		ret = fs_put_block(sb, req->arg[0]);
+		break;
+	case FSD_SNAPSHOT:
+		if(path[0] == NULL) break;
+		ret = fs_snapshot(sb, path[0]);
+		break;
+	case FSD_SNAPSHOT_DELETE:
+		if(path[0] == NULL) break;
+		ret = fs_snapshot_delete(sb, path[0]);
+		break;
+	case FSD_IMPORT:
+	case FSD_EXPORT:
+		if((fd = sd_take_fd(c)) == -1) {
+			errno = EBADF;
+			break;
+		}
+		/* Copies are made synchronously, see the header comment */
+		if(fstat(fd, &hst) == -1 || !(S_ISREG(hst.st_mode) || S_ISBLK(hst.st_mode))) {
+			errno = ESPIPE;
+		} else if(path[0] != NULL) {
+			ret = (req->op == FSD_IMPORT) ? fs_import(sb, fd, path[0]) : fs_export(sb, path[0], fd);
+		}
+		close(fd);
+		break;
+	case FSD_STAT:
+		if(path[0] == NULL) break;
+		ret = fs_stat(sb, path[0], &st);
+		sd_respond(sb, c, ret, errno, &st, (ret == 0) ? sizeof st : 0);
+		return;
+	case FSD_STATFS:
+		ret = fs_statfs(sb, &stfs);
+		sd_respond(sb, c, ret, errno, &stfs, (ret == 0) ? sizeof stfs : 0);
+		return;
+	case FSD_RMTREE:
+		if(path[0] == NULL) break;
+		ret = fs_rmtree(sb, path[0]);
+		break;
+	case FSD_DU:
+		if(path[0] == NULL) break;
+		ret = fs_du(sb, path[0], &du);
+		sd_respond(sb, c, ret, errno, &du, (ret == 0) ? sizeof du : 0);
+		return;
+	case FSD_FIND:
+		if(path[1] == NULL) break;
+		if((list = fs_find(sb, path[0], path[1])) == NULL) {
+			sd_respond(sb, c, -1, errno, NULL, 0);
+			return;
+		}
+		sd_respond(sb, c, 0, 0, list, strlen(list) + 1);
+		free(list);
+		return;
+	default:
+		errno = ENOSYS;
+		break;
+	}
+
+	if(ret == -1 && errno == 0) errno = EINVAL; /* Malformed request */
+	sd_respond(sb, c, ret, (ret < 0) ? errno : 0, NULL, 0);
+}
+
+/* Reads what client =c sent, with any descriptors passed along, and serves every complete request.
+ * Returns -1 if the client is gone or misbehaves. */
+int sd_read(struct superblock *sb, struct client *c) {
+	char ctl[CMSG_SPACE(FDS_MAX * sizeof(int))];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	struct fsd_request req;
+	size_t done = 0;
+	ssize_t got;
+	int *fds, nfds;
+
+	sd_reserve(&c->in, &c->incap, c->inlen + FSD_DATA_MAX);
+
+	memset(&msg, 0, sizeof msg);
+	iov.iov_base       = c->in + c->inlen;
+	iov.iov_len        = c->incap - c->inlen;
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = ctl;
+	msg.msg_controllen = sizeof ctl;
+
+	got = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+	if(got == -1 && (errno == EAGAIN || errno == EINTR)) return 0;
+	if(got <= 0) return -1;
+	c->inlen += got;
+
+	for(cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+		fds  = (int*) CMSG_DATA(cmsg);
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for(int i = 0; i < nfds; i++) {
+			if(c->nfds == FDS_MAX) close(fds[i]);
+			else c->fds[c->nfds++] = fds[i];
+		}
+	}
+
+	while(c->inlen - done >= sizeof req) {
+		memcpy(&req, c->in + done, sizeof req);
+		if(req.len > PAYLOAD_MAX) return -1;
+		if(c->inlen - done < sizeof req + req.len) break;
+
+		sd_serve(sb, c, &req, c->in + done + sizeof req);
+		done += sizeof req + req.len;
+	}
+
+	memmove(c->in, c->in + done, c->inlen - done);
+	c->inlen -= done;
+
+	return (c->outlen - c->outoff > OUT_MAX) ? -1 : 0;
+}
+
+/* Sends as many of the responses waiting for =c as the socket takes. Returns -1 if the client is
+ * gone. */
+int sd_write(struct client *c) {
+	ssize_t sent;
+
+	while(c->outoff < c->outlen) {
+		sent = send(c->fd, c->out + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+		if(sent == -1 && errno == EINTR) continue;
+		if(sent == -1 && errno == EAGAIN) return 0;
+		if(sent == -1) return -1;
+		c->outoff += sent;
+	}
+
+	c->outlen = c->outoff = 0;
+
+	return 0;
+}
+
+/************************
+*         MAIN          *
+************************/
+
+int main(int argc, char **argv) {
+	int opt, direct = 0, lfd, fd, nclients = 0;
+	uint64_t blksz = 0;
+	struct superblock *sb;
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct pollfd pfds[MAX_CLIENTS + 1];
+	struct client *clients = calloc(MAX_CLIENTS, sizeof *clients);
+
+	while((opt = getopt(argc, argv, "f:d")) != -1) {
+		switch(opt) {
+		case 'f':
+			blksz = strtoull(optarg, NULL, 0);
+			break;
+		case 'd':
+			direct = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-f blocksize] [-d] image socket\n", argv[0]);
+			return 8;
+		}
+	}
+
+	if(optind + 2 != argc || strlen(argv[optind + 1]) >= sizeof addr.sun_path) {
+		fprintf(stderr, "usage: %s [-f blocksize] [-d] image socket\n", argv[0]);
+		return 8;
+	}
+
+	if(blksz != 0) {
+		sb = fs_format(argv[optind], blksz);
+		if(sb != NULL && direct) {
+			fs_close(sb);
+			sb = fs_open_direct(argv[optind]);
+		}
+	}
+	else {
+		sb = direct ? fs_open_direct(argv[optind]) : fs_open(argv[optind]);
+	}
+	if(sb == NULL) {
+		perror(argv[optind]);
+		return 4;
+	}
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, argv[optind + 1]);
+	unlink(addr.sun_path);
+
+	lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(lfd == -1 || bind(lfd, (struct sockaddr*) &addr, sizeof addr) == -1 || listen(lfd, 64) == -1) {
+		perror(argv[optind + 1]);
+		fs_close(sb);
+		return 4;
+	}
+
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = sd_stop;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	for(int i = 0; i < MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+
+	while(!stop) {
+		pfds[0].fd     = lfd;
+		pfds[0].events = (nclients < MAX_CLIENTS) ? POLLIN : 0;
+		for(int i = 0; i < MAX_CLIENTS; i++) {
+			pfds[i + 1].fd     = clients[i].fd;
+			pfds[i + 1].events = POLLIN | ((clients[i].outlen > clients[i].outoff) ? POLLOUT : 0);
+		}
+
+		if(poll(pfds, MAX_CLIENTS + 1, -1) == -1) {
+			if(errno == EINTR) continue;
+			perror("poll");
+			break;
+		}
+
+		if(pfds[0].revents & POLLIN) {
+			fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+			for(int i = 0; fd != -1 && i < MAX_CLIENTS; i++) {
+				if(clients[i].fd == -1) {
+					clients[i].fd = fd;
+					nclients++;
+					break;
+				}
+			}
+		}
+
+		for(int i = 0; i < MAX_CLIENTS; i++) {
+			struct client *c = &clients[i];
+
+			if(c->fd == -1 || pfds[i + 1].revents == 0) continue;
+
+			/* Responses go out together, after everything that was read is served */
+			if(((pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) && sd_read(sb, c) == -1) ||
+			   sd_write(c) == -1) {
+				sd_drop(c);
+				nclients--;
+			}
+		}
+	}
+
+	for(int i = 0; i < MAX_CLIENTS; i++) {
+		if(clients[i].fd != -1) sd_drop(&clients[i]);
+	}
+	free(clients);
+	close(lfd);
+	unlink(addr.sun_path);
+
+	if(fs_close(sb)) {
+		perror(argv[optind]);
+		return 4;
+	}
+
+	return 0;
+}
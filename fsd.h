@@ -0,0 +1,62 @@
+#ifndef __FSD_HEADER__
+#define __FSD_HEADER__
+
+/* Protocol between fsd and the client library in fsclient.c.
+ *
+ * A client sends requests over a stream Unix socket: a struct fsd_request
+ * followed by =len payload bytes, which hold the request's paths, each
+ * terminated by a NUL byte, then its data.  Requests may be sent without
+ * waiting for the previous responses.  fsd answers each request, in the
+ * order they were sent, with a struct fsd_response followed by =len payload
+ * bytes (data read or a directory listing).  FSD_IMPORT and FSD_EXPORT
+ * pass the host file descriptor along with the request (SCM_RIGHTS); it
+ * must be a regular file or a block device. */
+
+#include <inttypes.h>
+
+#define FSD_DATA_MAX (1 << 20) /* Largest data payload of a request or response */
+#define FSD_WINDOW 4 /* Requests a client keeps in flight for a single call */
+
+/* Operations, and the paths (p) and arguments (a) each one takes */
+#define FSD_SUPER 1 /* Superblock fields as the payload */
+#define FSD_WRITE_FILE 2 /* p: file, data */
+#define FSD_PREAD 3 /* p: file, a: count and offset */
+#define FSD_PWRITE 4 /* p: file, a: -, offset, data */
+#define FSD_UNLINK 5 /* p: file */
+#define FSD_MKDIR 6 /* p: directory */
+#define FSD_RMDIR 7 /* p: directory */
+#define FSD_LIST_DIR 8 /* p: directory */
+#define FSD_RENAME 9 /* p: old and new path, a: flags */
+#define FSD_CLONE 10 /* p: source and destination */
+#define FSD_FLUSH 11
+#define FSD_SETFLAGS 12 /* a: flags */
+#define FSD_GROW 13 /* a: blocks */
+#define FSD_GET_BLOCK 14
+#define FSD_PUT_BLOCK 15 /* a: block */
+#define FSD_SNAPSHOT 16 /* p: name */
+#define FSD_SNAPSHOT_DELETE 17 /* p: name */
+#define FSD_IMPORT 18 /* p: file, a descriptor */
+#define FSD_EXPORT 19 /* p: file, a descriptor */
+#define FSD_STAT 20 /* p: path, struct fsstat as the payload */
+#define FSD_STATFS 21 /* struct fsstatfs as the payload */
+#define FSD_RMTREE 22 /* p: path */
+#define FSD_DU 23 /* p: path, struct fsdu as the payload */
+#define FSD_FIND 24 /* p: directory and pattern */
+#define FSD_TRIM 25
+
+struct fsd_request {
+	uint32_t op;
+	uint32_t len; /* payload bytes */
+	uint64_t arg[2];
+};
+
+struct fsd_response {
+	int64_t ret; /* return value of the fs_* call */
+	int32_t err; /* errno if =ret signals an error */
+	uint32_t len; /* payload bytes */
+	uint64_t blks; /* superblock fields after the call */
+	uint64_t freeblks;
+	uint64_t flags;
+};
+
+#endif
@@ -4,7 +4,7 @@ set -u
 # DCC605F5: Filesystem implementation programming assignment
 # Autograding script
 
-total=6
+total=29
 ecnt=0
 
 if ! tests/test1.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
@@ -13,6 +13,29 @@ if ! tests/test3.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
 if ! tests/test4.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
 if ! tests/test5.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
 if ! tests/test6.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test7.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test8.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test9.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test10.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test11.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test12.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test13.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test14.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test15.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test16.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test17.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test18.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test19.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test20.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test21.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test22.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test23.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test24.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test25.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test26.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test27.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test28.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
+if ! tests/test29.sh ; then ecnt=$(( $ecnt + 1 )) ; fi
 
 echo "your code passes $(( $total - $ecnt )) of $total tests"
 rm -f fs.o
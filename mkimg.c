@@ -0,0 +1,615 @@
+/***************************************
+* Author: Joao Francisco B. S. Martins *
+*                                      *
+*         joaofbsm@dcc.ufmg.br         *
+***************************************/
+
+/* Image builder.
+ *
+ * Usage: mkimg [-b blocksize] [-s size] [-j threads] image directory
+ *
+ * Formats =image and fills it with the files and directories under the host
+ * =directory, laid out as defrag would leave them:
+ *
+ *     superblock | directories | files | free space
+ *
+ * The host tree is scanned first, breadth first, and the position of every
+ * block is planned before anything is written.  Directories (inode, nodeinfo
+ * and child inodes) are clustered after the superblock, the root at block 1.
+ * Each file follows with its inode, nodeinfo, indirect blocks and data, the
+ * data in one contiguous run.  The blocks left are the free range at the end.
+ *
+ * The image is then written in a single pass in ascending block order, with
+ * file data read by worker threads a chunk at a time, ahead of the writer,
+ * into a bounded window of buffers.  Every data block is stored, zeros
+ * included.  Entries other than files and directories (links, devices) are
+ * skipped.  Without -s the image is made just large enough for the tree.
+ *
+ * Exits with 0 on success, 4 if the image could not be built and 8 on
+ * usage errors. */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "fs.h"
+
+#define LINK_MAX ((sb->blksz - 32) / sizeof(uint64_t))
+#undef NAME_MAX /* The host limit, from dirent.h */
+#define NAME_MAX (sb->blksz - (8 * sizeof(uint64_t)))
+#define DIRECT_MAX (LINK_MAX - 3)
+#define PTR_MAX (sb->blksz / sizeof(uint64_t))
+
+#define MAX_THREADS 64
+#define CHUNK_BYTES (1 << 20) /* Host bytes read by one job */
+#define OUT_MAX 256           /* Metadata blocks gathered before they are written */
+
+struct node {
+	char *path;       /* Host path */
+	const char *name; /* Last component of =path */
+	int isdir;
+	uint64_t parent;  /* Index of the directory holding it */
+	uint64_t first;   /* Directories: index of the first entry, entries are contiguous */
+	uint64_t nents;   /* Directories: number of entries */
+	uint64_t size;    /* Files: size in bytes */
+	uint64_t inode;   /* Block of the inode, followed by the nodeinfo */
+	uint64_t nmap;    /* Files: indirect blocks, right after the nodeinfo */
+	uint64_t data;    /* Files: first data block, right after the indirect blocks */
+};
+
+struct job {
+	uint64_t node;   /* File to read */
+	uint64_t offset; /* Byte of the file the chunk starts at */
+	uint64_t count;  /* Blocks in the chunk */
+};
+
+struct builder {
+	struct superblock *sb;
+	struct node *nodes;
+	uint64_t nnodes, capnodes;
+	uint64_t used;        /* Blocks taken by the layout */
+	struct job *jobs;
+	uint64_t njobs;
+	uint64_t chunk;       /* Blocks per job */
+	uint64_t window;      /* Jobs whose buffers may be in use at once */
+	char *bufs;           /* =window buffers of =chunk blocks */
+	uint64_t *ready;      /* Job held by each buffer once it is read, plus one */
+	uint64_t next;        /* Next job a worker takes */
+	uint64_t written;     /* Jobs the writer is done with */
+	pthread_mutex_t lock;
+	pthread_cond_t space; /* A buffer was freed */
+	pthread_cond_t filled; /* A buffer was read */
+	char *out;            /* Metadata blocks waiting to be written */
+	uint64_t outpos, outcount;
+	uint64_t files, dirs;
+};
+
+/************************
+*       UTILITIES       *
+************************/
+
+void mb_write(struct builder *b, uint64_t pos, const void *data, uint64_t count) {
+	struct superblock *sb = b->sb;
+
+	if(pwrite(sb->fd, data, count * sb->blksz, pos * sb->blksz) != (ssize_t) (count * sb->blksz)) {
+		fprintf(stderr, "cannot write block %llu: %s\n", (unsigned long long) pos, strerror(errno));
+		exit(4);
+	}
+}
+
+void mb_flush(struct builder *b) {
+	if(b->outcount > 0) mb_write(b, b->outpos, b->out, b->outcount);
+	b->outpos  += b->outcount;
+	b->outcount = 0;
+}
+
+/* Queues block =data to be written to =pos, together with the blocks before it if they are
+ * contiguous */
+void mb_emit(struct builder *b, uint64_t pos, const void *data) {
+	struct superblock *sb = b->sb;
+
+	if(b->outcount == OUT_MAX || pos != b->outpos + b->outcount) mb_flush(b);
+	if(b->outcount == 0) b->outpos = pos;
+
+	memcpy(b->out + b->outcount++ * sb->blksz, data, sb->blksz);
+}
+
+/* Indirect blocks needed to map =count blocks with a tree of =depth levels */
+uint64_t mb_tree_blocks(struct superblock *sb, uint64_t count, int depth) {
+	uint64_t total = 0, span = 1;
+
+	for(int d = 1; d <= depth; d++) {
+		span  *= PTR_MAX;
+		total += (count + span - 1) / span;
+	}
+
+	return total;
+}
+
+/* Fills =map with the indirect blocks of the tree of =depth levels mapping the =count data blocks
+ * starting at =data, children before their parent, from block =*next on. Returns the root. */
+uint64_t mb_build_tree(struct superblock *sb, char *map, uint64_t base, uint64_t data, uint64_t count,
+                       int depth, uint64_t *next) {
+	uint64_t span = 1, n, blk;
+	uint64_t *ptrs;
+
+	if(depth == 0) {
+		return data;
+	}
+
+	for(int i = 1; i < depth; i++) {
+		span *= PTR_MAX;
+	}
+
+	ptrs = calloc(1, sb->blksz);
+	for(uint64_t i = 0; i * span < count; i++) {
+		n = (count - i * span < span) ? count - i * span : span;
+		ptrs[i] = mb_build_tree(sb, map, base, data + i * span, n, depth - 1, next);
+	}
+
+	blk = (*next)++;
+	memcpy(map + (blk - base) * sb->blksz, ptrs, sb->blksz);
+	free(ptrs);
+
+	return blk;
+}
+
+/************************
+*       SCANNING        *
+************************/
+
+int mb_cmp_name(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+uint64_t mb_add(struct builder *b, char *path, int isdir, uint64_t parent, uint64_t size) {
+	struct node *n;
+
+	if(b->nnodes == b->capnodes) {
+		b->capnodes = b->capnodes ? b->capnodes * 2 : 64;
+		b->nodes = realloc(b->nodes, b->capnodes * sizeof *b->nodes);
+	}
+
+	n = &b->nodes[b->nnodes];
+	memset(n, 0, sizeof *n);
+	n->path   = path;
+	n->name   = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	n->isdir  = isdir;
+	n->parent = parent;
+	n->size   = size;
+
+	return b->nnodes++;
+}
+
+/* Appends the entries of directory =dir to the nodes, in name order */
+void mb_scan_dir(struct builder *b, uint64_t dir) {
+	struct superblock *sb = b->sb;
+	struct dirent *ent;
+	struct stat st;
+	char **names = NULL, *path;
+	size_t count = 0, cap = 0;
+	DIR *d = opendir(b->nodes[dir].path);
+
+	if(d == NULL) {
+		fprintf(stderr, "%s: %s\n", b->nodes[dir].path, strerror(errno));
+		exit(4);
+	}
+
+	while((ent = readdir(d)) != NULL) {
+		if(!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, "..")) continue;
+
+		if(strlen(ent->d_name) >= NAME_MAX) {
+			fprintf(stderr, "%s/%s: %s\n", b->nodes[dir].path, ent->d_name, strerror(ENAMETOOLONG));
+			exit(4);
+		}
+
+		if(count == cap) {
+			cap = cap ? cap * 2 : 16;
+			names = realloc(names, cap * sizeof *names);
+		}
+		names[count++] = strdup(ent->d_name);
+	}
+	closedir(d);
+
+	qsort(names, count, sizeof *names, mb_cmp_name);
+
+	b->nodes[dir].first = b->nnodes;
+	for(size_t i = 0; i < count; i++) {
+		path = malloc(strlen(b->nodes[dir].path) + strlen(names[i]) + 2);
+		sprintf(path, "%s/%s", b->nodes[dir].path, names[i]);
+		free(names[i]);
+
+		if(lstat(path, &st) == -1) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			exit(4);
+		}
+		if(!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+			fprintf(stderr, "%s: skipped, not a file or directory\n", path);
+			free(path);
+			continue;
+		}
+
+		mb_add(b, path, S_ISDIR(st.st_mode), dir, S_ISREG(st.st_mode) ? st.st_size : 0);
+		b->nodes[dir].nents++;
+	}
+
+	free(names);
+}
+
+/************************
+*       PLANNING        *
+************************/
+
+/* Gives every directory, then every file, its blocks, and splits the file data into jobs */
+void mb_plan(struct builder *b) {
+	struct superblock *sb = b->sb;
+	uint64_t datablks, chain, rest, base, span, filemax;
+	struct node *n;
+
+	b->used = 1; /* Superblock */
+
+	for(uint64_t i = 0; i < b->nnodes; i++) {
+		n = &b->nodes[i];
+		if(!n->isdir) continue;
+
+		chain = n->nents ? (n->nents + LINK_MAX - 1) / LINK_MAX : 1;
+		n->inode = b->used;
+		b->used += 1 + chain; /* Inode and nodeinfo, then the child inodes */
+		b->dirs++;
+	}
+
+	filemax = DIRECT_MAX + PTR_MAX + PTR_MAX * PTR_MAX + PTR_MAX * PTR_MAX * PTR_MAX;
+
+	for(uint64_t i = 0; i < b->nnodes; i++) {
+		n = &b->nodes[i];
+		if(n->isdir) continue;
+
+		datablks = (n->size + sb->blksz - 1) / sb->blksz;
+		if(datablks > filemax) {
+			fprintf(stderr, "%s: %s\n", n->path, strerror(EFBIG));
+			exit(4);
+		}
+
+		n->nmap = 0;
+		base = DIRECT_MAX;
+		span = 1;
+		for(int depth = 1; depth <= 3 && base < datablks; depth++) {
+			span *= PTR_MAX;
+			rest = (datablks - base < span) ? datablks - base : span;
+			n->nmap += mb_tree_blocks(sb, rest, depth);
+			base += span;
+		}
+
+		n->inode = b->used;
+		n->data  = n->inode + 2 + n->nmap;
+		b->used  = n->data + datablks;
+		b->files++;
+
+		for(uint64_t off = 0; off < datablks; off += b->chunk) {
+			if(b->njobs % 1024 == 0) {
+				b->jobs = realloc(b->jobs, (b->njobs + 1024) * sizeof *b->jobs);
+			}
+			b->jobs[b->njobs].node   = i;
+			b->jobs[b->njobs].offset = off * sb->blksz;
+			b->jobs[b->njobs].count  = (datablks - off < b->chunk) ? datablks - off : b->chunk;
+			b->njobs++;
+		}
+	}
+}
+
+/************************
+*        READING        *
+************************/
+
+/* Reads the chunks of host files into the window, never more than =window jobs ahead of the
+ * writer */
+void * mb_reader(void *arg) {
+	struct builder *b = arg;
+	struct superblock *sb = b->sb;
+	struct job *job;
+	uint64_t k, want, got = 0;
+	ssize_t r;
+	char *buf;
+	int fd;
+
+	while(1) {
+		pthread_mutex_lock(&b->lock);
+		while(b->next < b->njobs && b->next >= b->written + b->window) {
+			pthread_cond_wait(&b->space, &b->lock);
+		}
+		if(b->next == b->njobs) {
+			pthread_mutex_unlock(&b->lock);
+			break;
+		}
+		k = b->next++;
+		pthread_mutex_unlock(&b->lock);
+
+		job  = &b->jobs[k];
+		buf  = b->bufs + (k % b->window) * b->chunk * sb->blksz;
+		want = job->count * sb->blksz;
+
+		if((fd = open(b->nodes[job->node].path, O_RDONLY)) == -1) {
+			fprintf(stderr, "%s: %s\n", b->nodes[job->node].path, strerror(errno));
+			exit(4);
+		}
+		for(got = 0; got < want; got += r) {
+			r = pread(fd, buf + got, want - got, job->offset + got);
+			if(r == -1 && errno == EINTR) {
+				r = 0;
+				continue;
+			}
+			if(r == -1) {
+				fprintf(stderr, "%s: %s\n", b->nodes[job->node].path, strerror(errno));
+				exit(4);
+			}
+			if(r == 0) break; /* File shrank since the scan, or last block */
+		}
+		close(fd);
+		memset(buf + got, 0, want - got);
+
+		pthread_mutex_lock(&b->lock);
+		b->ready[k % b->window] = k + 1;
+		pthread_cond_broadcast(&b->filled);
+		pthread_mutex_unlock(&b->lock);
+	}
+
+	return NULL;
+}
+
+/************************
+*        WRITING        *
+************************/
+
+void mb_write_dir(struct builder *b, uint64_t i) {
+	struct superblock *sb = b->sb;
+	struct node *n = &b->nodes[i];
+	struct inode *inode = malloc(sb->blksz);
+	struct nodeinfo *info = calloc(1, sb->blksz);
+	uint64_t blk = n->inode, chain = n->nents ? (n->nents + LINK_MAX - 1) / LINK_MAX : 1, e = 0;
+
+	for(uint64_t c = 0; c < chain; c++) {
+		memset(inode, 0, sb->blksz);
+
+		if(c == 0) {
+			inode->mode   = IMDIR;
+			inode->parent = (i == 0) ? blk : b->nodes[n->parent].inode;
+			inode->meta   = blk + 1;
+		}
+		else { /* Child inodes follow the nodeinfo */
+			inode->mode   = IMCHILD;
+			inode->parent = blk;
+			inode->meta   = (c == 1) ? blk : blk + c;
+		}
+		inode->next = (c + 1 < chain) ? blk + 2 + c : 0;
+
+		for(uint64_t l = 0; l < LINK_MAX && e < n->nents; l++, e++) {
+			inode->links[l] = b->nodes[n->first + e].inode;
+		}
+
+		mb_emit(b, (c == 0) ? blk : blk + 1 + c, inode);
+
+		if(c == 0) {
+			info->size = n->nents;
+			strcpy(info->name, (i == 0) ? "/" : n->name);
+			mb_emit(b, blk + 1, info);
+		}
+	}
+
+	free(inode);
+	free(info);
+}
+
+void mb_write_file(struct builder *b, uint64_t i) {
+	struct superblock *sb = b->sb;
+	struct node *n = &b->nodes[i];
+	struct inode *inode = calloc(1, sb->blksz);
+	struct nodeinfo *info = calloc(1, sb->blksz);
+	uint64_t datablks = (n->size + sb->blksz - 1) / sb->blksz, base, span = 1, next = n->inode + 2;
+	char *map = calloc(n->nmap ? n->nmap : 1, sb->blksz);
+
+	inode->mode   = IMREG;
+	inode->parent = b->nodes[n->parent].inode;
+	inode->meta   = n->inode + 1;
+	inode->next   = 0;
+
+	info->size   = n->size;
+	info->blocks = datablks;
+	strcpy(info->name, n->name);
+
+	for(uint64_t l = 0; l < DIRECT_MAX && l < datablks; l++) {
+		inode->links[l] = n->data + l;
+	}
+
+	base = DIRECT_MAX;
+	for(int depth = 1; depth <= 3 && base < datablks; depth++) {
+		span *= PTR_MAX;
+		inode->links[DIRECT_MAX + depth - 1] = mb_build_tree(sb, map, n->inode + 2, n->data + base,
+		                                                     (datablks - base < span) ? datablks - base : span,
+		                                                     depth, &next);
+		base += span;
+	}
+
+	mb_emit(b, n->inode, inode);
+	mb_emit(b, n->inode + 1, info);
+	for(uint64_t m = 0; m < n->nmap; m++) {
+		mb_emit(b, n->inode + 2 + m, map + m * sb->blksz);
+	}
+
+	free(inode);
+	free(info);
+	free(map);
+}
+
+/* Writes the image in ascending block order, data chunks as the readers fill them */
+void mb_write_image(struct builder *b) {
+	struct superblock *sb = b->sb;
+	uint64_t k = 0;
+	struct job *job;
+	char *block = calloc(1, sb->blksz);
+
+	memcpy(block, sb, SUPERBLOCK_DISK_SIZE);
+	mb_emit(b, 0, block);
+	free(block);
+
+	for(uint64_t i = 0; i < b->nnodes; i++) {
+		if(b->nodes[i].isdir) mb_write_dir(b, i);
+	}
+
+	for(uint64_t i = 0; i < b->nnodes; i++) {
+		if(b->nodes[i].isdir) continue;
+
+		mb_write_file(b, i);
+		mb_flush(b);
+
+		for(; k < b->njobs && b->jobs[k].node == i; k++) {
+			job = &b->jobs[k];
+
+			pthread_mutex_lock(&b->lock);
+			while(b->ready[k % b->window] != k + 1) {
+				pthread_cond_wait(&b->filled, &b->lock);
+			}
+			pthread_mutex_unlock(&b->lock);
+
+			mb_write(b, b->nodes[i].data + job->offset / sb->blksz,
+			         b->bufs + (k % b->window) * b->chunk * sb->blksz, job->count);
+
+			pthread_mutex_lock(&b->lock);
+			b->written++;
+			pthread_cond_broadcast(&b->space);
+			pthread_mutex_unlock(&b->lock);
+		}
+	}
+
+	mb_flush(b);
+}
+
+/************************
+*         MAIN          *
+************************/
+
+int main(int argc, char **argv) {
+	int opt, nthreads;
+	uint64_t blksz = 4096, size = 0;
+	struct superblock sbuf, *sb = &sbuf;
+	struct builder b;
+	pthread_t threads[MAX_THREADS];
+	char *root;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while((opt = getopt(argc, argv, "b:s:j:")) != -1) {
+		switch(opt) {
+		case 'b':
+			blksz = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			size = strtoull(optarg, NULL, 0);
+			break;
+		case 'j':
+			nthreads = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-b blocksize] [-s size] [-j threads] image directory\n", argv[0]);
+			return 8;
+		}
+	}
+
+	if(optind + 2 != argc) {
+		fprintf(stderr, "usage: %s [-b blocksize] [-s size] [-j threads] image directory\n", argv[0]);
+		return 8;
+	}
+
+	if(blksz < MIN_BLOCK_SIZE || blksz % sizeof(uint64_t) != 0) {
+		fprintf(stderr, "%s: bad block size %llu\n", argv[0], (unsigned long long) blksz);
+		return 8;
+	}
+
+	if(nthreads < 1) nthreads = 1;
+	if(nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+	memset(sb, 0, sizeof *sb);
+	memset(&b, 0, sizeof b);
+	sb->magic = 0xdcc605f5;
+	sb->blksz = blksz;
+	b.sb      = sb;
+	b.chunk   = (CHUNK_BYTES > blksz) ? CHUNK_BYTES / blksz : 1;
+	b.window  = 2 * nthreads;
+
+	/* Host tree, breadth first: the nodes double as the queue of directories to scan */
+	root = strdup(argv[optind + 1]);
+	while(strlen(root) > 1 && root[strlen(root) - 1] == '/') root[strlen(root) - 1] = '\0';
+	mb_add(&b, root, 1, 0, 0);
+	b.nodes[0].name = "";
+
+	for(uint64_t i = 0; i < b.nnodes; i++) {
+		if(b.nodes[i].isdir) mb_scan_dir(&b, i);
+	}
+
+	mb_plan(&b);
+
+	sb->blks = size ? size / blksz : b.used;
+	if(sb->blks < MIN_BLOCK_COUNT) sb->blks = MIN_BLOCK_COUNT;
+	if(sb->blks < b.used) {
+		fprintf(stderr, "%s: %s, %llu blocks needed\n", argv[optind], strerror(ENOSPC),
+		        (unsigned long long) b.used);
+		return 4;
+	}
+
+	sb->freeblks = sb->blks - b.used;
+	sb->freelist = 0;
+	sb->frontier = sb->freeblks ? b.used : 0;
+	sb->root     = 1;
+	sb->version  = SUPERBLOCK_VERSION;
+
+	/* Stale contents of an existing image are dropped, free blocks are never written */
+	sb->fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0666);
+	if(sb->fd == -1 || ftruncate(sb->fd, sb->blks * blksz) == -1) {
+		perror(argv[optind]);
+		return 4;
+	}
+
+	b.out   = malloc(OUT_MAX * blksz);
+	b.bufs  = malloc(b.window * b.chunk * blksz);
+	b.ready = calloc(b.window, sizeof *b.ready);
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.space, NULL);
+	pthread_cond_init(&b.filled, NULL);
+
+	for(int i = 0; i < nthreads; i++) {
+		pthread_create(&threads[i], NULL, mb_reader, &b);
+	}
+
+	mb_write_image(&b);
+
+	for(int i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	if(fsync(sb->fd) == -1 || close(sb->fd) == -1) {
+		perror(argv[optind]);
+		return 4;
+	}
+
+	printf("%s: %llu files, %llu directories, %llu/%llu blocks free\n", argv[optind],
+	       (unsigned long long) b.files, (unsigned long long) b.dirs, (unsigned long long) sb->freeblks,
+	       (unsigned long long) sb->blks);
+
+	for(uint64_t i = 0; i < b.nnodes; i++) {
+		free(b.nodes[i].path);
+	}
+	free(b.nodes);
+	free(b.jobs);
+	free(b.out);
+	free(b.bufs);
+	free(b.ready);
+
+	return 0;
+}
@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 21};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t ptrs = blksz / sizeof(uint64_t), direct = (blksz - 32) / sizeof(uint64_t) - 3;
+	uint64_t maxblks = direct + ptrs + ptrs * ptrs + ptrs * ptrs * ptrs;
+	uint64_t freeblks, nblks = fsize / blksz / 2;
+	uint64_t offs[] = {0, 1, direct * blksz - 1, (direct + ptrs) * blksz - 5,
+	                   (direct + ptrs + ptrs * ptrs) * blksz - 7, 0};
+	size_t cnt, len;
+	char *data, *back;
+
+	if(nblks > maxblks) nblks = maxblks;
+	cnt  = nblks * blksz - 11;
+	data = malloc(cnt);
+	back = malloc(cnt);
+	for(size_t i = 0; i < cnt; i++) data[i] = (char)(i % 251 + 1);
+	offs[NELEMS(offs) - 1] = cnt - 3;
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	freeblks = sb->freeblks;
+
+	if(fs_write_file(sb, "/big", data, cnt)) ERROR("FAIL fs_write_file\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open\n");
+
+	if(fs_read_file(sb, "/big", back, cnt) != cnt || memcmp(data, back, cnt))
+		ERROR("FAIL fs_read_file\n");
+
+	/* Reads that start inside and straddle each level of the block map */
+	for(int i = 0; i < NELEMS(offs); i++) {
+		if(offs[i] >= cnt) continue;
+		len = (cnt - offs[i] < 3 * blksz) ? cnt - offs[i] : 3 * blksz;
+		memset(back, 0, cnt);
+		if(fs_pread_file(sb, "/big", back, 3 * blksz, offs[i]) != len)
+			ERROR("FAIL fs_pread_file count\n");
+		if(memcmp(data + offs[i], back, len)) ERROR("FAIL fs_pread_file data\n");
+	}
+	if(fs_pread_file(sb, "/big", back, blksz, cnt) != 0) ERROR("FAIL fs_pread_file past end\n");
+	if(fs_pread_file(sb, "/none", back, blksz, 0) >= 0) ERROR("FAIL fs_pread_file missing file\n");
+
+	if(fs_unlink(sb, "/big")) ERROR("FAIL fs_unlink\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+
+	/* A hole spanning whole indirect trees stores only the last block */
+	memset(data, 0, cnt);
+	data[cnt - 1] = 1;
+	if(fs_write_file(sb, "/sparse", data, cnt)) ERROR("FAIL fs_write_file sparse\n");
+	if(freeblks - sb->freeblks > 2 + 1 + 3) ERROR("FAIL hole stored\n");
+	memset(back, 0xff, cnt);
+	if(fs_read_file(sb, "/sparse", back, cnt) != cnt || memcmp(data, back, cnt))
+		ERROR("FAIL fs_read_file sparse\n");
+	if(fs_unlink(sb, "/sparse")) ERROR("FAIL fs_unlink sparse\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL sparse blocks leaked\n");
+
+	/* One block more than the block map can address */
+	if(maxblks * blksz < fsize) {
+		if(fs_write_file(sb, "/huge", data, maxblks * blksz + 1) == 0 || errno != EFBIG)
+			ERROR("FAIL file larger than the block map\n");
+		if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked on EFBIG\n");
+	}
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	free(data);
+	free(back);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 16, 1 << 20};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks, before;
+	size_t cnt = blksz * 20 + 7;
+	char *data = malloc(cnt);
+	char *back = malloc(cnt);
+	char *list;
+
+	for(size_t i = 0; i < cnt; i++) data[i] = (char)(i % 253 + 1);
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	freeblks = sb->freeblks;
+
+	if(fs_mkdir(sb, "/a") || fs_mkdir(sb, "/b") || fs_mkdir(sb, "/a/c")) ERROR("FAIL fs_mkdir\n");
+	if(fs_write_file(sb, "/a/f", data, cnt)) ERROR("FAIL fs_write_file\n");
+	before = sb->freeblks;
+
+	/* Renames and moves only relink */
+	if(fs_rename(sb, "/a/f", "/a/g", 0)) ERROR("FAIL fs_rename same dir\n");
+	if(fs_rename(sb, "/a/g", "/b/h", 0)) ERROR("FAIL fs_rename across dirs\n");
+	if(fs_rename(sb, "/a/c", "/b/c", 0)) ERROR("FAIL fs_rename dir\n");
+	if(fs_rename(sb, "/b", "/d", 0)) ERROR("FAIL fs_rename non-empty dir\n");
+	if(sb->freeblks != before) ERROR("FAIL fs_rename allocated blocks\n");
+
+	if(fs_read_file(sb, "/a/f", back, cnt) >= 0 || errno != ENOENT) ERROR("FAIL old name still exists\n");
+	if(fs_read_file(sb, "/d/h", back, cnt) != cnt || memcmp(data, back, cnt)) ERROR("FAIL moved file data\n");
+	if((list = fs_list_dir(sb, "/d")) == NULL || (strcmp(list, "h c/") && strcmp(list, "c/ h")))
+		ERROR("FAIL moved dir entries\n");
+	free(list);
+	if((list = fs_list_dir(sb, "/a")) == NULL || strcmp(list, "")) ERROR("FAIL source dir not empty\n");
+	free(list);
+
+	/* Moves that would detach a subtree or clobber without asking */
+	if(fs_rename(sb, "/d", "/d/c/e", 0) == 0 || errno != EINVAL) ERROR("FAIL dir moved into itself\n");
+	if(fs_write_file(sb, "/x", data, blksz)) ERROR("FAIL fs_write_file\n");
+	if(fs_rename(sb, "/x", "/d/h", 0) == 0 || errno != EEXIST) ERROR("FAIL replaced without flag\n");
+	if(fs_rename(sb, "/x", "/d", FS_RENAME_REPLACE) == 0 || errno != EISDIR) ERROR("FAIL replaced a dir\n");
+	if(fs_rename(sb, "/a", "/x", FS_RENAME_REPLACE) == 0 || errno != ENOTDIR) ERROR("FAIL dir over file\n");
+	if(fs_rename(sb, "/a", "/d", FS_RENAME_REPLACE) == 0 || errno != ENOTEMPTY) ERROR("FAIL non-empty dir replaced\n");
+	if(fs_rename(sb, "/nope", "/y", 0) == 0 || errno != ENOENT) ERROR("FAIL missing source\n");
+
+	/* Replacing frees the old target */
+	if(fs_rename(sb, "/d/h", "/x", FS_RENAME_REPLACE)) ERROR("FAIL fs_rename replace\n");
+	if(fs_read_file(sb, "/x", back, cnt) != cnt || memcmp(data, back, cnt)) ERROR("FAIL replaced data\n");
+	if(sb->freeblks != before) ERROR("FAIL replaced file leaked\n");
+	if(fs_rename(sb, "/d/c", "/a", FS_RENAME_REPLACE)) ERROR("FAIL fs_rename replace dir\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open\n");
+
+	if(fs_read_file(sb, "/x", back, cnt) != cnt || memcmp(data, back, cnt)) ERROR("FAIL data after reopen\n");
+	if(fs_unlink(sb, "/x") || fs_rmdir(sb, "/a") || fs_rmdir(sb, "/d")) ERROR("FAIL cleanup\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	free(data);
+	free(back);
+	return 0;
+}
+/*}}}*/
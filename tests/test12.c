@@ -0,0 +1,125 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 21};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int check(struct superblock *sb, const char *path, char *want, size_t cnt, char *back)/*{{{*/
+{
+	memset(back, 0xff, cnt);
+	return fs_read_file(sb, path, back, cnt) != cnt || memcmp(want, back, cnt);
+}
+/*}}}*/
+
+
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks, before, nblks = 300;
+	size_t cnt = nblks * blksz - 5, grown = cnt + 3 * blksz;
+	uint64_t mid = cnt / 2, late = cnt - blksz / 2;
+	char *a = malloc(grown), *b = malloc(grown), *back = malloc(grown);
+
+	for(size_t i = 0; i < cnt; i++) a[i] = (char)(i % 249 + 1);
+	memcpy(b, a, cnt);
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	freeblks = sb->freeblks;
+
+	if(fs_write_file(sb, "/a", a, cnt)) ERROR("FAIL fs_write_file\n");
+
+	/* Overwriting an unshared file in place allocates nothing */
+	before = sb->freeblks;
+	a[mid] = 'x';
+	if(fs_pwrite_file(sb, "/a", a + mid, 1, mid) != 1) ERROR("FAIL fs_pwrite_file\n");
+	if(sb->freeblks != before) ERROR("FAIL in-place write allocated blocks\n");
+	b[mid] = 'x';
+
+	/* A clone costs metadata only */
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL fs_mkdir\n");
+	before = sb->freeblks;
+	if(fs_clone(sb, "/a", "/d/b")) ERROR("FAIL fs_clone\n");
+	if(before - sb->freeblks >= nblks / 4) ERROR("FAIL fs_clone copied data\n");
+	if(check(sb, "/d/b", b, cnt, back)) ERROR("FAIL clone contents\n");
+
+	if(fs_clone(sb, "/a", "/d/b") == 0 || errno != EEXIST) ERROR("FAIL clone over existing file\n");
+	if(fs_clone(sb, "/d", "/e") == 0 || errno != EISDIR) ERROR("FAIL clone of a directory\n");
+	if(fs_pwrite_file(sb, "/none", a, 1, 0) >= 0 || errno != ENOENT) ERROR("FAIL pwrite missing file\n");
+
+	/* Writes to either copy only change that copy */
+	before = sb->freeblks;
+	b[mid] = 'y';
+	if(fs_pwrite_file(sb, "/d/b", b + mid, 1, mid) != 1) ERROR("FAIL fs_pwrite_file clone\n");
+	if(before - sb->freeblks > 1 + 3 + 8) ERROR("FAIL copy on write copied too much\n");
+	a[late] = 'z';
+	a[late + 1] = 'z';
+	if(fs_pwrite_file(sb, "/a", a + late, 2, late) != 2) ERROR("FAIL fs_pwrite_file source\n");
+	if(check(sb, "/a", a, cnt, back)) ERROR("FAIL source changed by clone write\n");
+	if(check(sb, "/d/b", b, cnt, back)) ERROR("FAIL clone changed by source write\n");
+
+	/* Writing past the end leaves a hole */
+	memset(b + cnt, 0, grown - cnt);
+	b[grown - 1] = 'w';
+	if(fs_pwrite_file(sb, "/d/b", b + grown - 1, 1, grown - 1) != 1) ERROR("FAIL extending write\n");
+	if(check(sb, "/d/b", b, grown, back)) ERROR("FAIL extended clone\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open\n");
+
+	if(fs_unlink(sb, "/a")) ERROR("FAIL fs_unlink source\n");
+	if(check(sb, "/d/b", b, grown, back)) ERROR("FAIL clone after unlinking source\n");
+	if(fs_unlink(sb, "/d/b") || fs_rmdir(sb, "/d")) ERROR("FAIL cleanup\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(sb->refcounts != 0) ERROR("FAIL reference counts left\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	free(a);
+	free(b);
+	free(back);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,135 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 21};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int check(struct superblock *sb, const char *path, char *want, size_t cnt, char *back)/*{{{*/
+{
+	memset(back, 0xff, cnt);
+	return fs_read_file(sb, path, back, cnt) != cnt || memcmp(want, back, cnt);
+}
+/*}}}*/
+
+
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks, before;
+	size_t cnt = 40 * blksz + 9;
+	char *a = malloc(cnt), *b = malloc(cnt), *back = malloc(cnt);
+	char path[32], *list;
+	struct superblock *snap;
+
+	for(size_t i = 0; i < cnt; i++) a[i] = (char)(i % 241 + 1);
+	memcpy(b, a, cnt);
+	b[cnt / 2] = 'x';
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	freeblks = sb->freeblks;
+
+	if(fs_write_file(sb, "/a", a, cnt) || fs_mkdir(sb, "/d")) ERROR("FAIL setup\n");
+	for(int i = 0; i < 40; i++) {
+		sprintf(path, "/d/f%d", i);
+		if(fs_write_file(sb, path, a + i, blksz)) ERROR("FAIL setup files\n");
+	}
+
+	/* Taking a snapshot does not depend on the size of the tree */
+	before = sb->freeblks;
+	if(fs_snapshot(sb, "s1")) ERROR("FAIL fs_snapshot\n");
+	if(before - sb->freeblks > 8) ERROR("FAIL fs_snapshot copied the tree\n");
+	if(fs_snapshot(sb, "s1") == 0 || errno != EEXIST) ERROR("FAIL duplicate snapshot\n");
+	if(fs_snapshot(sb, "a/b") == 0 || errno != EINVAL) ERROR("FAIL bad snapshot name\n");
+
+	/* Change the live tree */
+	if(fs_pwrite_file(sb, "/a", b + cnt / 2, 1, cnt / 2) != 1) ERROR("FAIL fs_pwrite_file\n");
+	if(fs_unlink(sb, "/d/f3") || fs_mkdir(sb, "/e") || fs_rename(sb, "/a", "/e/a", 0))
+		ERROR("FAIL changing live tree\n");
+	if(check(sb, "/e/a", b, cnt, back)) ERROR("FAIL live file\n");
+	if(fs_read_file(sb, "/d/f3", back, cnt) >= 0) ERROR("FAIL unlinked file in live tree\n");
+
+	/* The snapshot still has the old tree, with the live one open */
+	snap = fs_open_snapshot(fname, "s1");
+	if(snap == NULL) ERROR("FAIL fs_open_snapshot\n");
+	if(check(snap, "/a", a, cnt, back)) ERROR("FAIL snapshot file changed\n");
+	if(fs_read_file(snap, "/d/f3", back, blksz) != blksz || memcmp(back, a + 3, blksz))
+		ERROR("FAIL snapshot lost unlinked file\n");
+	if((list = fs_list_dir(snap, "/")) == NULL || (strcmp(list, "a d/") && strcmp(list, "d/ a")))
+		ERROR("FAIL snapshot root\n");
+	free(list);
+	if(fs_write_file(snap, "/z", a, 1) == 0 || errno != EROFS) ERROR("FAIL wrote to snapshot\n");
+	if(fs_unlink(snap, "/a") == 0 || errno != EROFS) ERROR("FAIL unlinked in snapshot\n");
+	if(fs_close(snap)) ERROR("FAIL fs_close snapshot\n");
+	if(fs_open_snapshot(fname, "none") != NULL || errno != ENOENT) ERROR("FAIL opened missing snapshot\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open\n");
+
+	snap = fs_open_snapshot(fname, "s1");
+	if(snap == NULL || check(snap, "/a", a, cnt, back)) ERROR("FAIL snapshot after reopen\n");
+	fs_close(snap);
+
+	/* Deleting the snapshot frees what only it used */
+	if(fs_snapshot_delete(sb, "s1")) ERROR("FAIL fs_snapshot_delete\n");
+	if(fs_snapshot_delete(sb, "s1") == 0 || errno != ENOENT) ERROR("FAIL deleted twice\n");
+	if(sb->refcounts != 0) ERROR("FAIL references left after delete\n");
+	if(check(sb, "/e/a", b, cnt, back)) ERROR("FAIL live file after delete\n");
+
+	for(int i = 0; i < 40; i++) {
+		sprintf(path, "/d/f%d", i);
+		if(i != 3 && fs_unlink(sb, path)) ERROR("FAIL cleanup files\n");
+	}
+	if(fs_unlink(sb, "/e/a") || fs_rmdir(sb, "/e") || fs_rmdir(sb, "/d")) ERROR("FAIL cleanup\n");
+	if(sb->freeblks != freeblks - 2) ERROR("FAIL blocks leaked\n"); /* Snapshot directory stays */
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	free(a);
+	free(b);
+	free(back);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int in_image(char *want, size_t cnt);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 21};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int check(struct superblock *sb, const char *path, char *want, size_t cnt, char *back)/*{{{*/
+{
+	memset(back, 0xff, cnt);
+	return fs_read_file(sb, path, back, cnt) != cnt || memcmp(want, back, cnt);
+}
+/*}}}*/
+
+
+int in_image(char *want, size_t cnt)/*{{{*/
+{
+	int found = 0;
+	size_t size;
+	char *img;
+	FILE *fd = fopen(fname, "r");
+
+	fseek(fd, 0, SEEK_END);
+	size = ftell(fd);
+	fseek(fd, 0, SEEK_SET);
+	img = malloc(size);
+	if(fread(img, 1, size, fd) != size) size = 0;
+	fclose(fd);
+
+	for(size_t i = 0; i + cnt <= size && !found; i++) {
+		found = !memcmp(img + i, want, cnt);
+	}
+
+	free(img);
+	return found;
+}
+/*}}}*/
+
+
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks, before, used, nblks = 300;
+	size_t cnt = nblks * blksz - 5, mid = cnt / 2;
+	char *a = malloc(cnt), *t = malloc(cnt), *back = malloc(cnt);
+
+	for(size_t i = 0; i < cnt; i++) a[i] = (char)(i % 249 + 1);
+	for(size_t i = 0; i < cnt; i++) t[i] = (char)(250 - i % 241); /* Descending, never found in a */
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	freeblks = sb->freeblks;
+
+	/* Space used by a regular write, for comparison */
+	if(fs_write_file(sb, "/n", a, cnt)) ERROR("FAIL fs_write_file\n");
+	used = freeblks - sb->freeblks;
+	if(fs_unlink(sb, "/n")) ERROR("FAIL fs_unlink\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL regular file leaked\n");
+
+	if(fs_setflags(sb, FS_DELALLOC)) ERROR("FAIL fs_setflags\n");
+
+	/* A delayed write takes the same space but leaves the image alone */
+	if(fs_write_file(sb, "/a", a, cnt)) ERROR("FAIL fs_write_file delayed\n");
+	if(freeblks - sb->freeblks != used) ERROR("FAIL delayed write space\n");
+	if(check(sb, "/a", a, cnt, back)) ERROR("FAIL read before flush\n");
+	a[mid] = 'x';
+	if(fs_pwrite_file(sb, "/a", a + mid, 1, mid) != 1) ERROR("FAIL fs_pwrite_file\n");
+	if(check(sb, "/a", a, cnt, back)) ERROR("FAIL pwrite before flush\n");
+
+	/* A file unlinked before the flush never reaches the disk */
+	before = sb->freeblks;
+	if(fs_write_file(sb, "/t", t, cnt)) ERROR("FAIL fs_write_file temporary\n");
+	if(fs_unlink(sb, "/t")) ERROR("FAIL fs_unlink temporary\n");
+	if(sb->freeblks != before) ERROR("FAIL temporary file leaked\n");
+
+	if(in_image(a, 64)) ERROR("FAIL data written before flush\n");
+	if(fs_flush(sb)) ERROR("FAIL fs_flush\n");
+	if(sb->reserved != 0) ERROR("FAIL reservation left\n");
+	if(freeblks - sb->freeblks != used) ERROR("FAIL flushed file space\n");
+	if(in_image(t, 64)) ERROR("FAIL temporary file written\n");
+	if(!in_image(a, cnt)) ERROR("FAIL flushed data is not contiguous\n");
+
+	/* Closing flushes pending files */
+	if(fs_write_file(sb, "/b", t, cnt)) ERROR("FAIL fs_write_file second\n");
+	before = sb->freeblks;
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open\n");
+	if(sb->freeblks != before) ERROR("FAIL free blocks after reopen\n");
+	if(check(sb, "/a", a, cnt, back)) ERROR("FAIL first file after reopen\n");
+	if(check(sb, "/b", t, cnt, back)) ERROR("FAIL second file after reopen\n");
+
+	if(fs_unlink(sb, "/a") || fs_unlink(sb, "/b")) ERROR("FAIL cleanup\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	free(a);
+	free(t);
+	free(back);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21, 1 << 22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int check(struct superblock *sb, const char *path, char *want, size_t cnt, char *back)/*{{{*/
+{
+	memset(back, 0xff, cnt);
+	return fs_read_file(sb, path, back, cnt) != cnt || memcmp(want, back, cnt);
+}
+/*}}}*/
+
+
+
+
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t nblks = 600, off, ahead;
+	size_t cnt = nblks * blksz - 7, chunk;
+	char *a = malloc(cnt), *b = malloc(cnt), *back = malloc(cnt);
+	char name[32];
+
+	for(size_t i = 0; i < cnt; i++) a[i] = (char)(i % 249 + 1);
+	for(size_t i = 0; i < cnt; i++) b[i] = (char)(i % 239 + 3);
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(fs_write_file(sb, "/a", a, cnt) || fs_write_file(sb, "/b", b, cnt)) ERROR("FAIL fs_write_file\n");
+
+	/* Sequential reads of two files at once, writing just ahead of the reader */
+	for(off = 0, chunk = 1; off < cnt; off += chunk, chunk = chunk * 2 % (9 * blksz) + 1) {
+		if(chunk > cnt - off) chunk = cnt - off;
+
+		ahead = off + chunk + 2 * blksz + 1;
+		if(ahead < cnt) {
+			a[ahead] = 'x';
+			if(fs_pwrite_file(sb, "/a", a + ahead, 1, ahead) != 1) ERROR("FAIL fs_pwrite_file\n");
+		}
+
+		memset(back, 0, chunk);
+		if(fs_pread_file(sb, "/a", back, chunk, off) != chunk || memcmp(back, a + off, chunk)) {
+			ERROR("FAIL sequential read\n");
+		}
+		if(fs_pread_file(sb, "/b", back, chunk, off) != chunk || memcmp(back, b + off, chunk)) {
+			ERROR("FAIL interleaved sequential read\n");
+		}
+	}
+
+	/* Random reads */
+	srand(blksz);
+	for(int i = 0; i < 200; i++) {
+		off = rand() % cnt;
+		chunk = rand() % (3 * blksz) + 1;
+		if(chunk > cnt - off) chunk = cnt - off;
+		if(fs_pread_file(sb, "/a", back, chunk, off) != chunk || memcmp(back, a + off, chunk)) {
+			ERROR("FAIL random read\n");
+		}
+	}
+
+	/* A directory spanning several inodes */
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL fs_mkdir\n");
+	for(int i = 0; i < 100; i++) {
+		sprintf(name, "/d/f%d", i);
+		if(fs_write_file(sb, name, name, strlen(name) + 1)) ERROR("FAIL fs_write_file small\n");
+	}
+	for(int i = 0; i < 100; i++) {
+		sprintf(name, "/d/f%d", i);
+		if(fs_read_file(sb, name, back, 32) != strlen(name) + 1 || strcmp(back, name)) {
+			ERROR("FAIL directory read\n");
+		}
+	}
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open\n");
+
+	if(fs_read_file(sb, "/a", back, cnt) != cnt || memcmp(back, a, cnt)) ERROR("FAIL read after reopen\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	free(a);
+	free(b);
+	free(back);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,113 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+void generate_file(uint64_t fsize);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21, 1 << 22};
+	uint64_t blkszs[] = {128, 512, 1024, 4096};
+	int i, j, fd;
+
+	generate_file(1 << 20);
+	fd = open(fname, O_RDWR | O_DIRECT);
+	if(fd == -1) { /* Nothing to test on this filesystem */
+		printf("O_DIRECT not supported, skipped\n");
+		exit(EXIT_SUCCESS);
+	}
+	close(fd);
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t nblks = 100;
+	size_t cnt = nblks * blksz - 3, mid = cnt / 3;
+	char *a = malloc(cnt + 1), *b = malloc(cnt + 1), *back = malloc(cnt + 1);
+	struct superblock *sb;
+
+	for(size_t i = 0; i < cnt; i++) a[i + 1] = (char)(i % 249 + 1);
+	for(size_t i = 0; i < cnt; i++) b[i] = (char)(i % 239 + 3);
+
+	generate_file(fsize);
+	sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+
+	sb = fs_open_direct(fname);
+	if(blksz % 512 != 0) { /* Smaller than any device block */
+		if(sb != NULL || errno != EINVAL) ERROR("FAIL unaligned block size accepted\n");
+		return 0;
+	}
+	if(sb == NULL) ERROR("FAIL fs_open_direct\n");
+
+	/* User buffers need no alignment */
+	if(fs_write_file(sb, "/a", a + 1, cnt)) ERROR("FAIL fs_write_file\n");
+	if(fs_read_file(sb, "/a", back + 1, cnt) != cnt || memcmp(back + 1, a + 1, cnt)) ERROR("FAIL read\n");
+
+	a[mid + 1] = 'x';
+	if(fs_pwrite_file(sb, "/a", a + mid + 1, 1, mid) != 1) ERROR("FAIL fs_pwrite_file\n");
+
+	/* Delayed files are flushed in runs */
+	if(fs_mkdir(sb, "/d") || fs_setflags(sb, FS_DELALLOC)) ERROR("FAIL setup\n");
+	if(fs_write_file(sb, "/d/b", b, cnt)) ERROR("FAIL fs_write_file delayed\n");
+	if(fs_flush(sb)) ERROR("FAIL fs_flush\n");
+	if(fs_read_file(sb, "/d/b", back, cnt) != cnt || memcmp(back, b, cnt)) ERROR("FAIL delayed read\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+
+	/* Everything reached the image */
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open\n");
+	if(fs_read_file(sb, "/a", back, cnt) != cnt || memcmp(back, a + 1, cnt)) ERROR("FAIL reopen\n");
+	if(fs_read_file(sb, "/d/b", back, cnt) != cnt || memcmp(back, b, cnt)) ERROR("FAIL reopen delayed\n");
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+
+	free(a);
+	free(b);
+	free(back);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <malloc.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+
+#define ERROR(str) { puts(str); return -1; }
+int churn(struct superblock *sb, char *buf, size_t cnt)/*{{{*/
+{
+	char *list;
+
+	if(fs_mkdir(sb, "/t") || fs_write_file(sb, "/t/f", buf, cnt)) return -1;
+	if(fs_pwrite_file(sb, "/t/f", buf, cnt / 2, cnt / 3) < 0) return -1;
+	if(fs_read_file(sb, "/t/f", buf, cnt) != cnt) return -1;
+	if(fs_rename(sb, "/t/f", "/g", 0)) return -1;
+	if((list = fs_list_dir(sb, "/")) == NULL) return -1;
+	free(list);
+	if(fs_unlink(sb, "/g") || fs_rmdir(sb, "/t")) return -1;
+
+	return 0;
+}
+/*}}}*/
+
+
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	size_t cnt = 40 * blksz + 11, used;
+	char *buf = malloc(cnt), *path = malloc(2 * blksz), *list;
+	char name[64];
+	int entries = 0;
+
+	for(size_t i = 0; i < cnt; i++) buf[i] = (char)(i % 251 + 1);
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	/* Scratch buffers are reused, so a steady workload stops allocating */
+	for(int i = 0; i < 20; i++) {
+		if(churn(sb, buf, cnt)) ERROR("FAIL warm up\n");
+	}
+	used = mallinfo2().uordblks;
+	for(int i = 0; i < 200; i++) {
+		if(churn(sb, buf, cnt)) ERROR("FAIL churn\n");
+	}
+	if(mallinfo2().uordblks != used) ERROR("FAIL memory use grew\n");
+
+	/* Listings longer than a block */
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL fs_mkdir\n");
+	for(int i = 0; i < 60; i++) {
+		sprintf(name, "/d/a-rather-long-file-name-%d", i);
+		if(fs_write_file(sb, name, buf, 1)) ERROR("FAIL fs_write_file\n");
+	}
+	if((list = fs_list_dir(sb, "/d")) == NULL) ERROR("FAIL fs_list_dir\n");
+	for(char *s = strtok(list, " "); s != NULL; s = strtok(NULL, " ")) entries++;
+	if(entries != 60) ERROR("FAIL listing\n");
+	free(list);
+
+	/* Paths and names that do not fit are refused */
+	memset(path, 'p', 2 * blksz - 1);
+	path[0] = '/';
+	path[2 * blksz - 1] = '\0';
+	if(fs_write_file(sb, path, buf, 1) == 0 || errno != ENAMETOOLONG) ERROR("FAIL long path\n");
+	path[blksz - 8] = '\0';
+	if(fs_mkdir(sb, path) == 0 || errno != ENAMETOOLONG) ERROR("FAIL long name\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	free(buf);
+	free(path);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,123 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+int view_all(struct superblock *sb, const char *path, uint64_t offset, char *back);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21, 1 << 22};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int view_all(struct superblock *sb, const char *path, uint64_t offset, char *back)/*{{{*/
+{
+	struct view views[16];
+	int n;
+	size_t got = 0;
+
+	while((n = fs_view_file(sb, path, offset + got, (size_t) -1, views, 16)) > 0) {
+		for(int i = 0; i < n; i++) {
+			memcpy(back + got, views[i].data, views[i].len);
+			got += views[i].len;
+		}
+		fs_release_views(sb, views, n);
+	}
+
+	return (n < 0) ? -1 : (int) got;
+}
+/*}}}*/
+
+
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t nblks = 700, hole = 3 * blksz + 5;
+	size_t cnt = nblks * blksz - 9, mid = cnt / 2 / blksz * blksz + 1, total = cnt + hole + 100;
+	char *a = calloc(1, total), *back = malloc(total);
+	struct view *views = malloc(nblks * sizeof *views), first[4];
+	int n, m;
+
+	for(size_t i = 0; i < cnt; i++) a[i] = (char)(i % 249 + 1);
+	for(size_t i = cnt + hole; i < total; i++) a[i] = 'e';
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	if(fs_write_file(sb, "/a", a, cnt)) ERROR("FAIL fs_write_file\n");
+	if(fs_pwrite_file(sb, "/a", a + cnt + hole, 100, cnt + hole) != 100) ERROR("FAIL fs_pwrite_file\n");
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL fs_mkdir\n");
+
+	/* Views cover the file, holes included, in order */
+	if(view_all(sb, "/a", 0, back) != total || memcmp(back, a, total)) ERROR("FAIL view whole file\n");
+	if(view_all(sb, "/a", mid, back) != total - mid || memcmp(back, a + mid, total - mid)) {
+		ERROR("FAIL view from the middle\n");
+	}
+	if(fs_view_file(sb, "/a", total, 10, first, 4) != 0) ERROR("FAIL view past the end\n");
+	if(fs_view_file(sb, "/d", 0, 10, first, 4) >= 0 || errno != EISDIR) ERROR("FAIL view of a directory\n");
+	if(fs_view_file(sb, "/x", 0, 10, first, 4) >= 0 || errno != ENOENT) ERROR("FAIL view of missing file\n");
+
+	/* Views keep what they saw, even across writes */
+	if(fs_view_file(sb, "/a", mid, 10, first, 4) != 1 || first[0].len != 10) ERROR("FAIL small view\n");
+	a[mid] = 'x';
+	if(fs_pwrite_file(sb, "/a", a + mid, 1, mid) != 1) ERROR("FAIL fs_pwrite_file pinned\n");
+	if(first[0].data[0] == 'x') ERROR("FAIL view changed by a write\n");
+	if(fs_read_file(sb, "/a", back, total) != total || memcmp(back, a, total)) ERROR("FAIL read while viewed\n");
+	fs_release_views(sb, first, 1);
+	if(view_all(sb, "/a", 0, back) != total || memcmp(back, a, total)) ERROR("FAIL view after write\n");
+
+	/* Pinning stops before it starves the cache */
+	n = fs_view_file(sb, "/a", 0, cnt, views, nblks);
+	if(n <= 0 || n >= nblks) ERROR("FAIL pin limit\n");
+	if(fs_view_file(sb, "/a", n * blksz, cnt, first, 4) >= 0 || errno != ENOBUFS) ERROR("FAIL no more pins\n");
+	if(fs_read_file(sb, "/a", back, total) != total || memcmp(back, a, total)) ERROR("FAIL read while pinned\n");
+	m = fs_view_file(sb, "/a", 0, blksz, first, 4); /* Already pinned */
+	if(m != 1 || memcmp(first[0].data, a, blksz)) ERROR("FAIL view of pinned block\n");
+	fs_release_views(sb, first, m);
+	fs_release_views(sb, views, n);
+	if(view_all(sb, "/a", 0, back) != total || memcmp(back, a, total)) ERROR("FAIL view after release\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	free(a);
+	free(back);
+	free(views);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,166 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t flags);
+int host_file(const char *path, const char *buf, size_t cnt, size_t hole);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+static char *hostin = "test19.in";
+static char *hostout = "test19.dat";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21};
+	uint64_t blkszs[] = {128, 512, 1024, 4096};
+	uint64_t flags[] = {0, FS_DEDUP, FS_DELALLOC};
+	int i, j, k;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < NELEMS(flags); k++) {
+		printf("fsize %d blksz %d flags %d\n", (int)fsizes[j], (int)blkszs[i], (int)flags[k]);
+		if(test(fsizes[j], blkszs[i], flags[k])) exit(EXIT_FAILURE);
+	}
+	}
+	}
+
+	unlink(hostin);
+	unlink(hostout);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+/* Writes =buf to a new host file, leaving the =hole bytes after its first half unwritten */
+int host_file(const char *path, const char *buf, size_t cnt, size_t hole)/*{{{*/
+{
+	int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	size_t half = cnt / 2;
+
+	if(fd == -1) return -1;
+	if(pwrite(fd, buf, half, 0) != half) return -1;
+	if(pwrite(fd, buf + half + hole, cnt - half - hole, half + hole) != cnt - half - hole) return -1;
+	lseek(fd, 0, SEEK_SET);
+	return fd;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, uint64_t flags)/*{{{*/
+{
+	uint64_t nblks = fsize / blksz / 8, hole = 5 * blksz + 7;
+	size_t cnt = nblks * blksz - 9, small = 5 * blksz + 3, got;
+	char *a = calloc(1, cnt), *b = malloc(cnt), *back = malloc(fsize);
+	struct stat st;
+	int fd, pfd[2];
+
+	for(size_t i = 0; i < cnt; i++) {
+		if(i < cnt / 2 || i >= cnt / 2 + hole) a[i] = (char)(i % 249 + 1);
+		b[i] = (char)(i % 251 + 2);
+	}
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(fs_setflags(sb, flags)) ERROR("FAIL fs_setflags\n");
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL fs_mkdir\n");
+
+	/* Import a sparse host file, then replace it with a shorter one */
+	if((fd = host_file(hostin, a, cnt, hole)) == -1) ERROR("FAIL host file\n");
+	if(fs_import(sb, fd, "/a")) ERROR("FAIL fs_import\n");
+	if(lseek(fd, 0, SEEK_CUR) != 0) ERROR("FAIL host offset moved\n");
+	close(fd);
+	if(fs_read_file(sb, "/a", back, fsize) != cnt || memcmp(back, a, cnt)) ERROR("FAIL read imported\n");
+
+	if((fd = host_file(hostin, b, cnt - blksz, 0)) == -1) ERROR("FAIL host file\n");
+	if(fs_import(sb, fd, "/d/b")) ERROR("FAIL fs_import into dir\n");
+	if(fs_import(sb, fd, "/a")) ERROR("FAIL fs_import replace\n");
+	if(fs_import(sb, fd, "/d") == 0 || errno != EISDIR) ERROR("FAIL import over a directory\n");
+	if(fs_import(sb, fd, "/x/y") == 0 || errno != ENOENT) ERROR("FAIL import to missing dir\n");
+	close(fd);
+	if(fs_read_file(sb, "/a", back, fsize) != cnt - blksz || memcmp(back, b, cnt - blksz)) {
+		ERROR("FAIL read replaced\n");
+	}
+	if(fs_read_file(sb, "/d/b", back, fsize) != cnt - blksz || memcmp(back, b, cnt - blksz)) {
+		ERROR("FAIL read in dir\n");
+	}
+
+	/* Written after an import, the file changes as usual */
+	if(fs_pwrite_file(sb, "/a", a, 10, 3) != 10) ERROR("FAIL fs_pwrite_file\n");
+
+	/* Export to a regular host file, replacing what it held */
+	if((fd = host_file(hostout, a, cnt, 0)) == -1) ERROR("FAIL host file\n");
+	if(fs_export(sb, "/a", fd)) ERROR("FAIL fs_export\n");
+	if(fstat(fd, &st) || st.st_size != cnt - blksz) ERROR("FAIL exported size\n");
+	if(pread(fd, back, fsize, 0) != cnt - blksz) ERROR("FAIL exported read\n");
+	if(memcmp(back, b, 3) || memcmp(back + 3, a, 10) || memcmp(back + 13, b + 13, cnt - blksz - 13)) {
+		ERROR("FAIL exported data\n");
+	}
+	if(fs_export(sb, "/d", fd) == 0 || errno != EISDIR) ERROR("FAIL export of a directory\n");
+	if(fs_export(sb, "/x", fd) == 0 || errno != ENOENT) ERROR("FAIL export of missing file\n");
+	close(fd);
+
+	/* Pipes go both ways, holes included */
+	if(pipe(pfd)) ERROR("FAIL pipe\n");
+	if(write(pfd[1], a + cnt / 2 - small / 2, small) != small) ERROR("FAIL pipe write\n");
+	close(pfd[1]);
+	if(fs_import(sb, pfd[0], "/p")) ERROR("FAIL fs_import pipe\n");
+	close(pfd[0]);
+
+	if(pipe(pfd)) ERROR("FAIL pipe\n");
+	if(fs_export(sb, "/p", pfd[1])) ERROR("FAIL fs_export pipe\n");
+	close(pfd[1]);
+	for(got = 0; (fd = read(pfd[0], back + got, fsize - got)) > 0; got += fd);
+	close(pfd[0]);
+	if(got != small || memcmp(back, a + cnt / 2 - small / 2, small)) ERROR("FAIL piped data\n");
+
+	/* No space is used by an import that does not fit, even with every block different */
+	for(size_t i = 0; i < fsize / sizeof(uint64_t); i++) ((uint64_t*) back)[i] = i + 1;
+	if((fd = host_file(hostin, back, fsize, 0)) == -1) ERROR("FAIL host file\n");
+	if(fs_import(sb, fd, "/big") == 0 || (errno != ENOSPC && errno != EFBIG)) ERROR("FAIL import too big\n");
+	close(fd);
+	if(fs_read_file(sb, "/big", back, fsize) >= 0) ERROR("FAIL partial import left\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+
+	/* Imported data is on disk, and O_DIRECT images take the buffered path */
+	if((sb = fs_open_direct(fname)) == NULL && (sb = fs_open(fname)) == NULL) ERROR("FAIL fs_open\n");
+	if(fs_read_file(sb, "/d/b", back, fsize) != cnt - blksz || memcmp(back, b, cnt - blksz)) ERROR("FAIL read reopened\n");
+	if((fd = host_file(hostin, a, cnt, hole)) == -1) ERROR("FAIL host file\n");
+	if(fs_import(sb, fd, "/d/b")) ERROR("FAIL fs_import reopened\n");
+	close(fd);
+	if(fs_read_file(sb, "/d/b", back, fsize) != cnt || memcmp(back, a, cnt)) ERROR("FAIL read reimported\n");
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+
+	free(a);
+	free(b);
+	free(back);
+	return 0;
+}
+/*}}}*/
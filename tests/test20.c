@@ -0,0 +1,250 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+#include "fs.h"
+#include "fsd.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define PROCS 4
+#define THREADS 3
+
+static char *fname = "img";
+static char *sockname = "test20.sock";
+static char *hostname = "test20.dat";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 25};
+	uint64_t blkszs[] = {512, 4096};
+	int i, j;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	unlink(hostname);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* Starts fsd on the image, formatting it if =blksz is not zero, and connects to it */
+struct superblock * start_daemon(uint64_t blksz, pid_t *pid)/*{{{*/
+{
+	char arg[32];
+	struct superblock *sb = NULL;
+
+	unlink(sockname);
+	snprintf(arg, sizeof arg, "%d", (int)blksz);
+	if((*pid = fork()) == 0) {
+		if(blksz) execl("./fsd", "fsd", "-f", arg, fname, sockname, (char*) NULL);
+		else execl("./fsd", "fsd", fname, sockname, (char*) NULL);
+		_exit(127);
+	}
+
+	for(int i = 0; i < 500 && sb == NULL; i++) {
+		if((sb = fs_open(sockname)) == NULL) usleep(10000);
+	}
+	return sb;
+}
+/*}}}*/
+
+
+int stop_daemon(pid_t pid)/*{{{*/
+{
+	int status;
+
+	kill(pid, SIGTERM);
+	if(waitpid(pid, &status, 0) != pid) return -1;
+	return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+/*}}}*/
+
+
+void fill(char *buf, size_t cnt, int seed)/*{{{*/
+{
+	for(size_t i = 0; i < cnt; i++) buf[i] = (char)((i + seed) % 251 + seed);
+}
+/*}}}*/
+
+
+struct worker { struct superblock *sb; int proc, thread, failed; };
+
+/* Writes and reads back its own file a few times over a connection shared with other threads */
+void * worker(void *arg)/*{{{*/
+{
+	struct worker *w = arg;
+	size_t cnt = FSD_DATA_MAX + FSD_DATA_MAX / 2 + w->thread;
+	char *a = malloc(cnt), *back = malloc(cnt + 10), path[32];
+
+	snprintf(path, sizeof path, "/p%d_%d", w->proc, w->thread);
+	for(int round = 0; round < 3 && !w->failed; round++) {
+		fill(a, cnt, w->proc * 16 + w->thread * 4 + round);
+		if(fs_write_file(w->sb, path, a, cnt)) w->failed = 1;
+		if(fs_read_file(w->sb, path, back, cnt + 10) != cnt || memcmp(a, back, cnt)) w->failed = 1;
+	}
+
+	free(a);
+	free(back);
+	return NULL;
+}
+/*}}}*/
+
+
+/* A client process with a few threads sharing its connection */
+int client(int proc)/*{{{*/
+{
+	struct superblock *sb = fs_open(sockname);
+	struct worker w[THREADS];
+	pthread_t threads[THREADS];
+	int failed = (sb == NULL);
+
+	for(int i = 0; i < THREADS && sb != NULL; i++) {
+		w[i].sb = sb;
+		w[i].proc = proc;
+		w[i].thread = i;
+		w[i].failed = 0;
+		pthread_create(&threads[i], NULL, worker, &w[i]);
+	}
+	for(int i = 0; i < THREADS && sb != NULL; i++) {
+		pthread_join(threads[i], NULL);
+		failed |= w[i].failed;
+	}
+
+	if(sb != NULL) fs_close(sb);
+	return failed;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	size_t cnt = 3 * FSD_DATA_MAX + 123, off = FSD_DATA_MAX - 10;
+	char *a = malloc(cnt), *b = malloc(2 * FSD_DATA_MAX), *back = malloc(cnt + 100), *list;
+	uint64_t before;
+	struct view views[2];
+	struct fsstat st;
+	struct fsstatfs stfs;
+	struct fsdu du;
+	pid_t pid, procs[PROCS];
+	int status, fd, pipefd[2];
+
+	generate_file(fsize);
+	struct superblock *sb = start_daemon(blksz, &pid);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	if(sb->blksz != blksz || sb->blks != fsize / blksz) ERROR("FAIL superblock\n");
+
+	/* Calls larger than a request are split, and the superblock follows the daemon's */
+	fill(a, cnt, 1);
+	before = sb->freeblks;
+	if(fs_write_file(sb, "/big", a, cnt)) ERROR("FAIL fs_write_file\n");
+	if(sb->freeblks + cnt / blksz > before) ERROR("FAIL freeblks not updated\n");
+	if(fs_read_file(sb, "/big", back, cnt + 100) != cnt || memcmp(a, back, cnt)) ERROR("FAIL fs_read_file\n");
+	if(fs_pread_file(sb, "/big", back, 100, off) != 100 || memcmp(a + off, back, 100)) ERROR("FAIL fs_pread_file\n");
+
+	fill(b, 2 * FSD_DATA_MAX, 7);
+	memcpy(a + 100, b, 2 * FSD_DATA_MAX);
+	if(fs_pwrite_file(sb, "/big", b, 2 * FSD_DATA_MAX, 100) != 2 * FSD_DATA_MAX) ERROR("FAIL fs_pwrite_file\n");
+	if(fs_read_file(sb, "/big", back, cnt) != cnt || memcmp(a, back, cnt)) ERROR("FAIL read after pwrite\n");
+
+	/* Namespace calls and their errors */
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL fs_mkdir\n");
+	if(fs_mkdir(sb, "/d") == 0 || errno != EEXIST) ERROR("FAIL fs_mkdir twice\n");
+	if(fs_rename(sb, "/big", "/d/big", 0)) ERROR("FAIL fs_rename\n");
+	if(fs_clone(sb, "/d/big", "/c")) ERROR("FAIL fs_clone\n");
+	if((list = fs_list_dir(sb, "/")) == NULL || strcmp(list, "c d/")) ERROR("FAIL fs_list_dir\n");
+	free(list);
+	if(fs_list_dir(sb, "/c") != NULL || errno != ENOTDIR) ERROR("FAIL fs_list_dir on a file\n");
+	if(fs_stat(sb, "/c", &st) || st.mode != IMREG || st.size != cnt) ERROR("FAIL fs_stat\n");
+	if(fs_stat(sb, "/c/x", &st) == 0 || errno != ENOTDIR) ERROR("FAIL fs_stat through a file\n");
+	if(fs_statfs(sb, &stfs) || stfs.freeblks != sb->freeblks || stfs.blksz != blksz) ERROR("FAIL fs_statfs\n");
+	if(fs_du(sb, "/", &du) || du.files != 2 || du.dirs != 2 || du.size != 2 * cnt) ERROR("FAIL fs_du\n");
+	if((list = fs_find(sb, "/", "*big")) == NULL || strcmp(list, "/d/big")) ERROR("FAIL fs_find\n");
+	free(list);
+	if(fs_unlink(sb, "/c")) ERROR("FAIL fs_unlink\n");
+	if(fs_read_file(sb, "/c", back, cnt) >= 0 || errno != ENOENT) ERROR("FAIL read missing\n");
+	if(fs_view_file(sb, "/d/big", 0, 10, views, 2) >= 0 || errno != ENOTSUP) ERROR("FAIL fs_view_file\n");
+
+	/* Host descriptors are passed to the daemon */
+	if((fd = open(hostname, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) ERROR("FAIL open host file\n");
+	if(fs_export(sb, "/d/big", fd)) ERROR("FAIL fs_export\n");
+	if(pread(fd, back, cnt + 100, 0) != cnt || memcmp(a, back, cnt)) ERROR("FAIL exported data\n");
+	if(fs_import(sb, fd, "/imported")) ERROR("FAIL fs_import\n");
+	close(fd);
+	if(fs_read_file(sb, "/imported", back, cnt) != cnt || memcmp(a, back, cnt)) ERROR("FAIL imported data\n");
+	if(fs_unlink(sb, "/imported")) ERROR("FAIL fs_unlink imported\n");
+
+	/* A pipe nobody drains must not hang the daemon */
+	if(pipe(pipefd)) ERROR("FAIL pipe\n");
+	if(fs_export(sb, "/d/big", pipefd[1]) == 0 || errno != ESPIPE) ERROR("FAIL fs_export to a pipe\n");
+	if(fs_import(sb, pipefd[0], "/piped") == 0 || errno != ESPIPE) ERROR("FAIL fs_import from a pipe\n");
+	close(pipefd[0]);
+	close(pipefd[1]);
+	if(fs_stat(sb, "/d/big", &st)) ERROR("FAIL fs_stat after pipe\n");
+
+	/* Processes, each with threads sharing a connection, use the image at once */
+	for(int i = 0; i < PROCS; i++) {
+		if((procs[i] = fork()) == 0) _exit(client(i));
+	}
+	for(int i = 0; i < PROCS; i++) {
+		if(waitpid(procs[i], &status, 0) != procs[i] || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			ERROR("FAIL concurrent client\n");
+		}
+	}
+	for(int i = 0; i < PROCS; i++) {
+		for(int t = 0; t < THREADS; t++) {
+			char path[32];
+			size_t n = FSD_DATA_MAX + FSD_DATA_MAX / 2 + t;
+			snprintf(path, sizeof path, "/p%d_%d", i, t);
+			fill(b, n, i * 16 + t * 4 + 2);
+			if(fs_read_file(sb, path, back, cnt) != n || memcmp(b, back, n)) ERROR("FAIL client file\n");
+			if(fs_unlink(sb, path)) ERROR("FAIL unlink client file\n");
+		}
+	}
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	if(stop_daemon(pid)) ERROR("FAIL daemon exit\n");
+
+	/* What the daemon wrote is in the image */
+	if((sb = start_daemon(0, &pid)) == NULL) ERROR("FAIL reopen\n");
+	if(fs_read_file(sb, "/d/big", back, cnt + 100) != cnt || memcmp(a, back, cnt)) ERROR("FAIL read reopened\n");
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	if(stop_daemon(pid)) ERROR("FAIL daemon exit\n");
+
+	free(a);
+	free(b);
+	free(back);
+	return 0;
+}
+/*}}}*/
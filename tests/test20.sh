@@ -0,0 +1,20 @@
+#!/bin/bash
+set -u
+
+i=20
+
+gcc -g -std=c99 -Wall -c fs.c &>> gcc.log
+gcc -g -std=c99 -Wall -pthread -I. fsd.c fs.o -o fsd &>> gcc.log
+gcc -g -std=c99 -Wall -pthread -I. tests/test$i.c fsclient.c -o test$i &>> gcc.log
+if [ ! -x test$i ] || [ ! -x fsd ] ; then
+    echo "[$i] compilation error"
+    exit 1 ;
+fi
+
+if ! ./test$i > test$i.out 2> test$i.err ; then
+    echo "[$i] error"
+    exit 1
+fi
+
+rm -f test$i test$i.out test$i.err fsd
+exit 0
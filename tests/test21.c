@@ -0,0 +1,198 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t stripe);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define MEMBERS 3
+#define MARK 0x5721be5ddcc605f5ULL
+
+static const char *fnames[MEMBERS] = {"img", "img.1", "img.2"};
+static char *hostname = "test21.dat";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 22};
+	uint64_t blkszs[] = {512, 4096};
+	uint64_t stripes[] = {1, 8};
+	int i, j, k;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < NELEMS(stripes); k++) {
+		printf("fsize %d blksz %d stripe %d\n", (int)fsizes[j], (int)blkszs[i], (int)stripes[k]);
+		if(test(fsizes[j], blkszs[i], stripes[k])) exit(EXIT_FAILURE);
+	}
+	}
+	}
+
+	for(i = 1; i < MEMBERS; i++) unlink(fnames[i]);
+	unlink(hostname);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(const char *fname, uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* Fills =cnt bytes with blocks that name themselves, except for some blocks of zeros */
+void fill(char *buf, size_t cnt, uint64_t blksz)/*{{{*/
+{
+	for(uint64_t i = 0; i * blksz < cnt; i++) {
+		char *blk = buf + i * blksz;
+		size_t n = (cnt - i * blksz < blksz) ? cnt - i * blksz : blksz;
+		uint64_t head[2] = {MARK, i};
+
+		if(i % 97 == 3) {
+			memset(blk, 0, n);
+			continue;
+		}
+		for(size_t j = 0; j < n; j++) blk[j] = (char)((i * 7 + j) % 253);
+		memcpy(blk, head, (n < sizeof head) ? n : sizeof head);
+	}
+}
+/*}}}*/
+
+
+/* Checks that every whole block of =a is in exactly one image, and that each image holds some */
+int check_images(const char *a, size_t cnt, uint64_t blksz)/*{{{*/
+{
+	uint64_t whole = cnt / blksz, head[2];
+	char *seen = calloc(whole, 1), *img;
+	int fd, ret = 0;
+	struct stat st;
+
+	for(int m = 0; m < MEMBERS && ret == 0; m++) {
+		int found = 0;
+
+		if((fd = open(fnames[m], O_RDONLY)) == -1 || fstat(fd, &st) == -1) return -1;
+		img = malloc(st.st_size);
+		if(pread(fd, img, st.st_size, 0) != st.st_size) ret = -1;
+		close(fd);
+
+		for(off_t off = 0; off + blksz <= st.st_size && ret == 0; off += blksz) {
+			memcpy(head, img + off, sizeof head);
+			if(head[0] != MARK || head[1] >= whole) continue;
+			if(memcmp(img + off, a + head[1] * blksz, blksz) || seen[head[1]]++) ret = -1;
+			found++;
+		}
+		if(found == 0) ret = -1;
+		free(img);
+	}
+
+	for(uint64_t i = 0; i < whole && ret == 0; i++) {
+		if(seen[i] != (i % 97 != 3)) ret = -1;
+	}
+
+	free(seen);
+	return ret;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, uint64_t stripe)/*{{{*/
+{
+	uint64_t sizes[MEMBERS] = {fsize, fsize + 3 * blksz + 5, fsize + fsize / 2};
+	uint64_t chunks = fsize / blksz / stripe, blks = chunks * stripe * MEMBERS, grown, off = blksz / 2 + 3;
+	size_t cnt = blks * blksz / 4 - 77;
+	char *a = malloc(cnt), *back = malloc(cnt + blksz);
+	struct superblock *sb;
+	struct stat st;
+	int fd;
+
+	for(int m = 0; m < MEMBERS; m++) generate_file(fnames[m], sizes[m]);
+
+	if(fs_format_striped(fnames, MEMBERS, blksz, 0) != NULL || errno != EINVAL) ERROR("FAIL zero stripe\n");
+	if(fs_format_striped(fnames, 0, blksz, stripe) != NULL || errno != EINVAL) ERROR("FAIL no images\n");
+
+	if((sb = fs_format_striped(fnames, MEMBERS, blksz, stripe)) == NULL) ERROR("FAIL format\n");
+	if(sb->blks != blks || sb->members != MEMBERS || sb->stripe != stripe) ERROR("FAIL superblock\n");
+	if(fs_open_striped(fnames, MEMBERS) != NULL || errno != EBUSY) ERROR("FAIL opened FS twice\n");
+
+	/* Large writes and reads go to all images */
+	fill(a, cnt, blksz);
+	if(fs_write_file(sb, "/big", a, cnt)) ERROR("FAIL fs_write_file\n");
+	if(fs_read_file(sb, "/big", back, cnt + blksz) != cnt || memcmp(a, back, cnt)) ERROR("FAIL fs_read_file\n");
+	if(fs_pread_file(sb, "/big", back, 40 * blksz, off) != 40 * blksz || memcmp(a + off, back, 40 * blksz)) {
+		ERROR("FAIL striped fs_pread_file\n");
+	}
+	if(fs_pread_file(sb, "/big", back, 10, off) != 10 || memcmp(a + off, back, 10)) ERROR("FAIL fs_pread_file\n");
+	if(check_images(a, cnt, blksz)) ERROR("FAIL blocks not striped\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+
+	/* Only the whole set opens */
+	if(fs_open(fnames[0]) != NULL || errno != EINVAL) ERROR("FAIL opened first image alone\n");
+	if(fs_open_striped(fnames, MEMBERS - 1) != NULL || errno != EINVAL) ERROR("FAIL opened some images\n");
+	if((sb = fs_open_striped(fnames, MEMBERS)) == NULL) ERROR("FAIL fs_open_striped\n");
+	if(fs_read_file(sb, "/big", back, cnt) != cnt || memcmp(a, back, cnt)) ERROR("FAIL read reopened\n");
+
+	/* Other writers of data blocks */
+	if(fs_pwrite_file(sb, "/big", a + blksz, 20 * blksz, 3 * blksz + 1) != 20 * blksz) ERROR("FAIL fs_pwrite_file\n");
+	memcpy(back, a, cnt);
+	memcpy(back + 3 * blksz + 1, a + blksz, 20 * blksz);
+	if(fs_read_file(sb, "/big", a, cnt) != cnt || memcmp(a, back, cnt)) ERROR("FAIL read after pwrite\n");
+
+	if(fs_setflags(sb, FS_DELALLOC)) ERROR("FAIL fs_setflags\n");
+	if(fs_write_file(sb, "/delayed", a, cnt / 2)) ERROR("FAIL delayed write\n");
+	if(fs_flush(sb)) ERROR("FAIL fs_flush\n");
+	if(fs_setflags(sb, FS_DEDUP)) ERROR("FAIL fs_setflags\n");
+	if(fs_write_file(sb, "/dedup", a, cnt / 2)) ERROR("FAIL dedup write\n");
+	if(fs_read_file(sb, "/delayed", back, cnt) != cnt / 2 || memcmp(a, back, cnt / 2)) ERROR("FAIL read delayed\n");
+	if(fs_read_file(sb, "/dedup", back, cnt) != cnt / 2 || memcmp(a, back, cnt / 2)) ERROR("FAIL read dedup\n");
+	if(fs_unlink(sb, "/delayed") || fs_unlink(sb, "/dedup")) ERROR("FAIL fs_unlink\n");
+	if(fs_setflags(sb, 0)) ERROR("FAIL fs_setflags\n");
+
+	if((fd = open(hostname, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) ERROR("FAIL open host file\n");
+	if(fs_export(sb, "/big", fd)) ERROR("FAIL fs_export\n");
+	if(pread(fd, back, cnt + blksz, 0) != cnt || memcmp(a, back, cnt)) ERROR("FAIL exported data\n");
+	if(fs_import(sb, fd, "/imported")) ERROR("FAIL fs_import\n");
+	close(fd);
+	if(fs_read_file(sb, "/imported", back, cnt) != cnt || memcmp(a, back, cnt)) ERROR("FAIL imported data\n");
+	if(fs_unlink(sb, "/imported")) ERROR("FAIL unlink imported\n");
+
+	/* Every image grows its share */
+	grown = blks + 2 * stripe * MEMBERS + 1;
+	if(fs_grow(sb, grown)) ERROR("FAIL fs_grow\n");
+	for(int m = 0; m < MEMBERS; m++) {
+		uint64_t need = (chunks + 2) * stripe + (m == 0);
+		if(stat(fnames[m], &st) || st.st_size < need * blksz) ERROR("FAIL image not grown\n");
+	}
+	if(fs_unlink(sb, "/big")) ERROR("FAIL fs_unlink\n");
+	cnt = (sb->freeblks - sb->freeblks / 16) * blksz;
+	a = realloc(a, cnt);
+	back = realloc(back, cnt);
+	fill(a, cnt, blksz);
+	if(fs_write_file(sb, "/full", a, cnt)) ERROR("FAIL write to grown FS\n");
+	if(fs_read_file(sb, "/full", back, cnt) != cnt || memcmp(a, back, cnt)) ERROR("FAIL read from grown FS\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+
+	free(a);
+	free(back);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,157 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(const struct backend *backend, uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "test22.img";
+static char *hostname = "test22.dat";
+
+/* A backend of its own: a RAM disk that counts the calls it gets */
+static uint64_t reads, writes;
+
+ssize_t counted_readv(void *image, const struct iovec *iov, int n, uint64_t offset)/*{{{*/
+{
+	__sync_fetch_and_add(&reads, 1);
+	return fs_ram_backend.readv(image, iov, n, offset);
+}
+/*}}}*/
+
+ssize_t counted_writev(void *image, const struct iovec *iov, int n, uint64_t offset)/*{{{*/
+{
+	__sync_fetch_and_add(&writes, 1);
+	return fs_ram_backend.writev(image, iov, n, offset);
+}
+/*}}}*/
+
+static struct backend counted;
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	const struct backend *backends[] = {&fs_file_backend, &fs_mmap_backend, &fs_ram_backend, &counted};
+	uint64_t fsizes[] = {1 << 22};
+	uint64_t blkszs[] = {512, 4096};
+	int i, j, k;
+
+	counted = fs_ram_backend;
+	counted.name   = "counted";
+	counted.readv  = counted_readv;
+	counted.writev = counted_writev;
+
+	for(k = 0; k < NELEMS(backends); k++) {
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("backend %s fsize %d blksz %d\n", backends[k]->name, (int)fsizes[j], (int)blkszs[i]);
+		if(test(backends[k], fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	}
+
+	unlink(fname);
+	unlink(hostname);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void fill(char *buf, size_t cnt, int seed)/*{{{*/
+{
+	for(size_t i = 0; i < cnt; i++) buf[i] = (char)((i * 31 + seed) % 251);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(const struct backend *backend, uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	size_t cnt = fsize / 4 + 13, off = 3 * blksz + 5;
+	char *a = malloc(cnt), *back = malloc(fsize), *list;
+	int ram = (backend->fd == NULL), fd;
+	uint64_t blks;
+	struct superblock *sb;
+	struct view views[4];
+
+	unlink(fname);
+	reads = writes = 0;
+
+	if(fs_format_backend(backend, fname, 0, blksz) != NULL) ERROR("FAIL formatted missing image\n");
+	if((sb = fs_format_backend(backend, fname, fsize, blksz)) == NULL) ERROR("FAIL fs_format_backend\n");
+	if(sb->blks != fsize / blksz || sb->backend != backend) ERROR("FAIL superblock\n");
+	if(ram != (sb->fd == -1)) ERROR("FAIL descriptor\n");
+	if(!ram && fs_format_backend(backend, fname, fsize, blksz) != NULL) ERROR("FAIL formatted image twice\n");
+	if(!ram && (fs_open(fname) != NULL || errno != EBUSY)) ERROR("FAIL opened FS twice\n");
+
+	fill(a, cnt, 1);
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL fs_mkdir\n");
+	if(fs_write_file(sb, "/d/big", a, cnt)) ERROR("FAIL fs_write_file\n");
+	if(fs_write_file(sb, "/small", a + 1, 10)) ERROR("FAIL fs_write_file small\n");
+	if(fs_read_file(sb, "/d/big", back, fsize) != cnt || memcmp(a, back, cnt)) ERROR("FAIL fs_read_file\n");
+	if(fs_pread_file(sb, "/d/big", back, 100, off) != 100 || memcmp(a + off, back, 100)) ERROR("FAIL fs_pread_file\n");
+	if((list = fs_list_dir(sb, "/")) == NULL || strcmp(list, "d/ small")) ERROR("FAIL fs_list_dir\n");
+	free(list);
+
+	/* Cached views and delayed or shared blocks work the same on every backend */
+	if(fs_view_file(sb, "/d/big", off, 2 * blksz, views, 4) < 2 || memcmp(views[0].data, a + off, views[0].len)) {
+		ERROR("FAIL fs_view_file\n");
+	}
+	fs_release_views(sb, views, 4);
+	if(fs_setflags(sb, FS_DELALLOC | FS_DEDUP)) ERROR("FAIL fs_setflags\n");
+	if(fs_write_file(sb, "/copy", a, cnt / 2)) ERROR("FAIL delayed write\n");
+	if(fs_flush(sb)) ERROR("FAIL fs_flush\n");
+	if(fs_read_file(sb, "/copy", back, fsize) != cnt / 2 || memcmp(a, back, cnt / 2)) ERROR("FAIL read flushed\n");
+	if(fs_setflags(sb, 0)) ERROR("FAIL fs_setflags\n");
+
+	/* Host files are copied by the kernel when the image has a descriptor, by hand otherwise */
+	if((fd = open(hostname, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) ERROR("FAIL open host file\n");
+	if(fs_export(sb, "/d/big", fd)) ERROR("FAIL fs_export\n");
+	if(pread(fd, back, fsize, 0) != cnt || memcmp(a, back, cnt)) ERROR("FAIL exported data\n");
+	if(fs_import(sb, fd, "/imported")) ERROR("FAIL fs_import\n");
+	close(fd);
+	if(fs_read_file(sb, "/imported", back, fsize) != cnt || memcmp(a, back, cnt)) ERROR("FAIL imported data\n");
+
+	/* The backend makes room for the new blocks */
+	blks = sb->blks;
+	if(fs_grow(sb, 2 * blks)) ERROR("FAIL fs_grow\n");
+	if(fs_unlink(sb, "/imported") || fs_unlink(sb, "/copy")) ERROR("FAIL fs_unlink\n");
+	a = realloc(a, fsize + cnt);
+	back = realloc(back, fsize + cnt);
+	fill(a, fsize + cnt, 2);
+	if(fs_write_file(sb, "/grown", a, fsize + cnt)) ERROR("FAIL write to grown FS\n");
+	if(fs_read_file(sb, "/grown", back, fsize + cnt) != fsize + cnt || memcmp(a, back, fsize + cnt)) {
+		ERROR("FAIL read from grown FS\n");
+	}
+
+	if(backend == &counted && (reads == 0 || writes == 0)) ERROR("FAIL blocks did not go through the backend\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+
+	if(ram) {
+		if(fs_open_backend(backend, fname) != NULL || errno != ENOENT) ERROR("FAIL reopened RAM disk\n");
+	}
+	else {
+		/* Backends share the image format */
+		const struct backend *other = (backend == &fs_file_backend) ? &fs_mmap_backend : &fs_file_backend;
+		if((sb = fs_open_backend(other, fname)) == NULL) ERROR("FAIL fs_open_backend\n");
+		if(sb->blks != 2 * blks) ERROR("FAIL grown size not saved\n");
+		if(fs_read_file(sb, "/grown", back, fsize + cnt) != fsize + cnt || memcmp(a, back, fsize + cnt)) {
+			ERROR("FAIL read reopened\n");
+		}
+		if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	}
+
+	free(a);
+	free(back);
+	return 0;
+}
+/*}}}*/
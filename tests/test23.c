@@ -0,0 +1,191 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t flags);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 64
+
+static char *fname = "img";
+static char *hostname = "test23.dat";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21};
+	uint64_t blkszs[] = {512, 4096};
+	uint64_t flags[] = {0, FS_DEDUP, FS_DELALLOC};
+	int i, j, k;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < NELEMS(flags); k++) {
+		printf("fsize %d blksz %d flags %d\n", (int)fsizes[j], (int)blkszs[i], (int)flags[k]);
+		if(test(fsizes[j], blkszs[i], flags[k])) exit(EXIT_FAILURE);
+	}
+	}
+	}
+
+	unlink(hostname);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+void fill(char *buf, size_t cnt, int seed)/*{{{*/
+{
+	for(size_t i = 0; i < cnt; i++) buf[i] = (char)((i * 31 + seed) % 251 + 1);
+}
+/*}}}*/
+
+
+/* Size of small file =i, which is all tail */
+size_t small_size(uint64_t blksz, int i)/*{{{*/
+{
+	return (i * 37) % (blksz / 2) + 1;
+}
+/*}}}*/
+
+
+/* Checks that file =name holds the =cnt bytes in =expect, read whole and in pieces */
+int check_file(struct superblock *sb, const char *name, const char *expect, size_t cnt)/*{{{*/
+{
+	char *back = malloc(cnt + 100);
+	int ret = 0;
+
+	if(fs_read_file(sb, name, back, cnt + 100) != cnt || memcmp(back, expect, cnt)) ret = -1;
+
+	for(size_t off = 0; ret == 0 && off < cnt; off += cnt / 3 + 1) {
+		size_t n = (cnt - off < 77) ? cnt - off : 77;
+		if(fs_pread_file(sb, name, back, 77, off) != n || memcmp(back, expect + off, n)) ret = -1;
+	}
+
+	free(back);
+	return ret;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, uint64_t flags)/*{{{*/
+{
+	char name[32];
+	char *a = malloc(6 * blksz), *b = malloc(6 * blksz), *data[NFILES];
+	size_t bigsz = 3 * blksz + blksz / 3, longsz = 2 * blksz + 3 * blksz / 4;
+	uint64_t free0, used;
+	int fd, n;
+	struct superblock *sb, *snap;
+	struct view views[8];
+
+	generate_file(fsize);
+	if((sb = fs_format(fname, blksz)) == NULL) ERROR("FAIL fs_format\n");
+	if(fs_setflags(sb, flags | FS_TAILPACK)) ERROR("FAIL fs_setflags\n");
+	free0 = sb->freeblks;
+
+	/* Small files take their inode and nodeinfo, and share the blocks holding their tails */
+	for(int i = 0; i < NFILES; i++) {
+		data[i] = malloc(small_size(blksz, i));
+		fill(data[i], small_size(blksz, i), i);
+		sprintf(name, "/s%d", i);
+		if(fs_write_file(sb, name, data[i], small_size(blksz, i))) ERROR("FAIL fs_write_file small\n");
+	}
+	if(fs_flush(sb)) ERROR("FAIL fs_flush\n");
+	used = free0 - sb->freeblks;
+	if(used >= 2 * NFILES + NFILES / 2) ERROR("FAIL tails were not packed\n");
+
+	/* Only tails of at most half a block that are not zeros are packed */
+	fill(a, bigsz, 100);
+	if(fs_write_file(sb, "/big", a, bigsz)) ERROR("FAIL fs_write_file big\n");
+	fill(b, longsz, 200);
+	if(fs_write_file(sb, "/long", b, longsz)) ERROR("FAIL fs_write_file long\n");
+	memset(b + blksz, 0, 10);
+	if(fs_write_file(sb, "/zeros", b, blksz + 10)) ERROR("FAIL fs_write_file zeros\n");
+
+	for(int i = 0; i < NFILES; i++) {
+		sprintf(name, "/s%d", i);
+		if(check_file(sb, name, data[i], small_size(blksz, i))) ERROR("FAIL read small file\n");
+	}
+	if(check_file(sb, "/big", a, bigsz)) ERROR("FAIL read big\n");
+	if(check_file(sb, "/zeros", b, blksz + 10)) ERROR("FAIL read zeros\n");
+	fill(b, longsz, 200);
+	if(check_file(sb, "/long", b, longsz)) ERROR("FAIL read long\n");
+
+	/* The tail is viewed inside the block it is packed in */
+	n = fs_view_file(sb, "/big", 2 * blksz + 7, 2 * blksz, views, 8);
+	if(n != 2 || views[1].len != bigsz - 3 * blksz || memcmp(views[1].data, a + 3 * blksz, views[1].len)) {
+		ERROR("FAIL fs_view_file\n");
+	}
+	fs_release_views(sb, views, n);
+
+	if((fd = open(hostname, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) ERROR("FAIL open host file\n");
+	if(fs_export(sb, "/big", fd)) ERROR("FAIL fs_export\n");
+	if(pread(fd, b, 4 * blksz, 0) != bigsz || memcmp(a, b, bigsz)) ERROR("FAIL exported data\n");
+	close(fd);
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	if((sb = fs_open(fname)) == NULL) ERROR("FAIL fs_open\n");
+	if(check_file(sb, "/s5", data[5], small_size(blksz, 5))) ERROR("FAIL read after reopen\n");
+	if(check_file(sb, "/big", a, bigsz)) ERROR("FAIL read big after reopen\n");
+
+	/* Clones and snapshots share the tail, writes move it into a block of its own */
+	if(fs_clone(sb, "/s1", "/c1") || fs_unlink(sb, "/s1")) ERROR("FAIL fs_clone\n");
+	if(check_file(sb, "/c1", data[1], small_size(blksz, 1))) ERROR("FAIL read clone\n");
+	if(fs_snapshot(sb, "snap")) ERROR("FAIL fs_snapshot\n");
+	if(fs_pwrite_file(sb, "/s2", "XY", 2, 0) != 2) ERROR("FAIL fs_pwrite_file\n");
+	if(fs_pwrite_file(sb, "/big", "Z", 1, bigsz + blksz) != 1) ERROR("FAIL fs_pwrite_file past end\n");
+	if(fs_pwrite_file(sb, "/c1", "W", 1, 0) != 1) ERROR("FAIL fs_pwrite_file clone\n");
+	if((snap = fs_open_snapshot(fname, "snap")) == NULL) ERROR("FAIL fs_open_snapshot\n");
+	if(check_file(snap, "/s2", data[2], small_size(blksz, 2))) ERROR("FAIL snapshot changed\n");
+	if(check_file(snap, "/big", a, bigsz)) ERROR("FAIL snapshot big changed\n");
+	if(fs_close(snap)) ERROR("FAIL close snapshot\n");
+
+	memcpy(data[2], "XY", 2);
+	if(check_file(sb, "/s2", data[2], small_size(blksz, 2))) ERROR("FAIL read rewritten tail\n");
+	data[1][0] = 'W';
+	if(check_file(sb, "/c1", data[1], small_size(blksz, 1))) ERROR("FAIL read rewritten clone\n");
+	memset(a + bigsz, 0, blksz);
+	a[bigsz + blksz] = 'Z';
+	if(check_file(sb, "/big", a, bigsz + blksz + 1)) ERROR("FAIL read grown file\n");
+
+	/* Tail blocks are freed with the last tail in them */
+	if(fs_snapshot_delete(sb, "snap")) ERROR("FAIL fs_snapshot_delete\n");
+	for(int i = 0; i < NFILES; i++) {
+		sprintf(name, "/s%d", i);
+		if(i != 1 && fs_unlink(sb, name)) ERROR("FAIL fs_unlink\n");
+		free(data[i]);
+	}
+	if(fs_unlink(sb, "/c1") || fs_unlink(sb, "/big") || fs_unlink(sb, "/long") || fs_unlink(sb, "/zeros")) {
+		ERROR("FAIL fs_unlink\n");
+	}
+	if(sb->freeblks + 2 != free0 || sb->tailpos != 0) ERROR("FAIL blocks leaked\n"); /* Snapshot directory */
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+
+	free(a);
+	free(b);
+	return 0;
+}
+/*}}}*/
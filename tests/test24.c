@@ -0,0 +1,139 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t flags);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 21};
+	uint64_t blkszs[] = {512, 4096};
+	uint64_t flags[] = {0, FS_DELALLOC, FS_TAILPACK};
+	int i, j, k;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < NELEMS(flags); k++) {
+		printf("fsize %d blksz %d flags %d\n", (int)fsizes[j], (int)blkszs[i], (int)flags[k]);
+		if(test(fsizes[j], blkszs[i], flags[k])) exit(EXIT_FAILURE);
+	}
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* Checks the free space figures of =sb against its superblock */
+int check_statfs(struct superblock *sb)/*{{{*/
+{
+	struct fsstatfs st;
+
+	if(fs_statfs(sb, &st)) return -1;
+	if(st.blks != sb->blks || st.blksz != sb->blksz || st.freeblks != sb->freeblks) return -1;
+	if(st.freerange > st.freeblks + st.reserved) return -1;
+	if(st.fragmentation < 0 || st.fragmentation > 1) return -1;
+	if(st.freerange == st.freeblks + st.reserved && st.fragmentation != 0) return -1;
+	return 0;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, uint64_t flags)/*{{{*/
+{
+	char *a = malloc(4 * blksz);
+	size_t asz = 2 * blksz + blksz / 3;
+	uint64_t range;
+	struct superblock *sb;
+	struct fsstat st, st2;
+	struct fsstatfs stfs, stfs2;
+
+	generate_file(fsize);
+	if((sb = fs_format(fname, blksz)) == NULL) ERROR("FAIL fs_format\n");
+	if(fs_setflags(sb, flags)) ERROR("FAIL fs_setflags\n");
+
+	if(check_statfs(sb)) ERROR("FAIL fs_statfs fresh\n");
+
+	if(fs_stat(sb, "/", &st) || st.mode != IMDIR || st.size != 0) ERROR("FAIL fs_stat root\n");
+
+	memset(a, 'a', asz);
+	if(fs_mkdir(sb, "/d")) ERROR("FAIL fs_mkdir\n");
+	if(fs_write_file(sb, "/d/f", a, asz)) ERROR("FAIL fs_write_file\n");
+	if(fs_write_file(sb, "/g", a, 10)) ERROR("FAIL fs_write_file\n");
+	if(fs_flush(sb)) ERROR("FAIL fs_flush\n");
+
+	if(fs_stat(sb, "/", &st) || st.mode != IMDIR || st.size != 2) ERROR("FAIL fs_stat root entries\n");
+	if(fs_stat(sb, "/d", &st) || st.mode != IMDIR || st.size != 1) ERROR("FAIL fs_stat dir\n");
+	if(fs_stat(sb, "/d/f", &st) || st.mode != IMREG || st.size != asz) ERROR("FAIL fs_stat file\n");
+	if(st.blocks != ((flags & FS_TAILPACK) ? 2 : 3)) ERROR("FAIL fs_stat blocks\n");
+	if(fs_stat(sb, "/d/f", &st2) || memcmp(&st, &st2, sizeof st)) ERROR("FAIL fs_stat twice\n");
+	if(fs_stat(sb, "/g", &st2) || st2.size != 10 || st2.inode == st.inode) ERROR("FAIL fs_stat other file\n");
+
+	/* Errors */
+	if(fs_stat(sb, "/none", &st) != -1 || errno != ENOENT) ERROR("FAIL fs_stat missing\n");
+	if(fs_stat(sb, "/d/none", &st) != -1 || errno != ENOENT) ERROR("FAIL fs_stat missing in dir\n");
+	if(fs_stat(sb, "/g/f", &st) != -1 || errno != ENOTDIR) ERROR("FAIL fs_stat through a file\n");
+
+	/* Writing past the end grows the size, leaving a hole that takes no block */
+	if(fs_pwrite_file(sb, "/g", a, 10, 3 * blksz) != 10) ERROR("FAIL fs_pwrite_file\n");
+	if(fs_flush(sb)) ERROR("FAIL fs_flush\n");
+	if(fs_stat(sb, "/g", &st) || st.size != 3 * blksz + 10 || st.blocks > 2) ERROR("FAIL fs_stat after pwrite\n");
+
+	/* Freed blocks go back to the free list */
+	if(check_statfs(sb)) ERROR("FAIL fs_statfs used\n");
+	if(fs_statfs(sb, &stfs)) ERROR("FAIL fs_statfs\n");
+	if(fs_unlink(sb, "/d/f")) ERROR("FAIL fs_unlink\n");
+	if(fs_statfs(sb, &stfs2) || stfs2.freeblks <= stfs.freeblks) ERROR("FAIL fs_statfs unlink\n");
+	if(stfs2.freerange != stfs.freerange) ERROR("FAIL freerange unlink\n");
+	if(check_statfs(sb)) ERROR("FAIL fs_statfs unlink\n");
+	if(fs_stat(sb, "/d", &st) || st.size != 0) ERROR("FAIL fs_stat dir after unlink\n");
+
+	/* Growing extends the free range, so less of the free space is scattered */
+	range = stfs2.freerange;
+	if(fs_grow(sb, sb->blks + 64)) ERROR("FAIL fs_grow\n");
+	if(check_statfs(sb)) ERROR("FAIL fs_statfs grow\n");
+	if(fs_statfs(sb, &stfs) || stfs.freerange != range + 64) ERROR("FAIL freerange grow\n");
+	if(stfs.fragmentation >= stfs2.fragmentation) ERROR("FAIL fragmentation grow\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+
+	/* The figures survive reopening */
+	if((sb = fs_open(fname)) == NULL) ERROR("FAIL fs_open\n");
+	if(fs_stat(sb, "/g", &st) || st.size != 3 * blksz + 10) ERROR("FAIL fs_stat reopen\n");
+	if(check_statfs(sb)) ERROR("FAIL fs_statfs reopen\n");
+	if(fs_statfs(sb, &stfs) || stfs.freerange != range + 64) ERROR("FAIL freerange reopen\n");
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+
+	free(a);
+	return 0;
+}
+/*}}}*/
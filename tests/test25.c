@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t flags);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 100
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 23};
+	uint64_t blkszs[] = {512, 4096};
+	uint64_t flags[] = {0, FS_DEDUP, FS_DELALLOC, FS_TAILPACK};
+	int i, j, k;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < NELEMS(flags); k++) {
+		printf("fsize %d blksz %d flags %d\n", (int)fsizes[j], (int)blkszs[i], (int)flags[k]);
+		if(test(fsizes[j], blkszs[i], flags[k])) exit(EXIT_FAILURE);
+	}
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+void fill(char *buf, size_t cnt, int seed)/*{{{*/
+{
+	for(size_t i = 0; i < cnt; i++) buf[i] = (char)((i * 31 + seed) % 251 + 1);
+}
+/*}}}*/
+
+
+/* Writes file =name with =cnt bytes from =buf, adding it to the totals in =du */
+int put_file(struct superblock *sb, const char *name, char *buf, size_t cnt, struct fsdu *du)/*{{{*/
+{
+	if(fs_write_file(sb, name, buf, cnt)) return -1;
+	du->files++;
+	du->size += cnt;
+	return 0;
+}
+/*}}}*/
+
+
+/* Builds the tree under /t, with a clone of its big file outside it, and returns its totals in =du.
+ * The data blocks are counted once the files are flushed. */
+int build_tree(struct superblock *sb, char *a, size_t bigsz, struct fsdu *du)/*{{{*/
+{
+	char name[64];
+	struct fsstat st;
+
+	memset(du, 0, sizeof *du);
+	if(fs_mkdir(sb, "/t") || fs_mkdir(sb, "/t/a") || fs_mkdir(sb, "/t/a/x") || fs_mkdir(sb, "/t/a/x/y") ||
+	   fs_mkdir(sb, "/t/a/x/y/z") || fs_mkdir(sb, "/t/b") || fs_mkdir(sb, "/t/c") || fs_mkdir(sb, "/t/c/e")) {
+		return -1;
+	}
+	du->dirs = 8;
+
+	/* More entries than an inode links, so the directory takes several */
+	for(int i = 0; i < NFILES; i++) {
+		sprintf(name, "/t/a/f%d", i);
+		if(put_file(sb, name, a + i, (i * 13) % 700 + 1, du)) return -1;
+	}
+	if(put_file(sb, "/t/a/x/y/z/deep.txt", a, 3 * sb->blksz + 5, du)) return -1;
+	if(put_file(sb, "/t/b/big.bin", a, bigsz, du)) return -1;
+	if(put_file(sb, "/t/c/n1.txt", a + 1, 10, du) || put_file(sb, "/t/c/n2.txt", a + 2, 20, du)) return -1;
+	if(put_file(sb, "/t/c/m.dat", a + 3, 2 * sb->blksz, du)) return -1;
+	if(fs_flush(sb)) return -1;
+
+	/* A clone inside the tree and one outside share the big file's blocks */
+	if(fs_clone(sb, "/t/b/big.bin", "/t/c/clone.bin") || fs_clone(sb, "/t/b/big.bin", "/keep")) return -1;
+	du->files++;
+	du->size += bigsz;
+
+	/* A file with a hole */
+	if(fs_write_file(sb, "/t/b/holes", a, 10)) return -1;
+	if(fs_pwrite_file(sb, "/t/b/holes", a, 10, 5 * sb->blksz) != 10) return -1;
+	du->files++;
+	du->size += 5 * sb->blksz + 10;
+	if(fs_flush(sb)) return -1;
+
+	/* Data blocks as each file counts them */
+	for(int i = 0; i < NFILES; i++) {
+		sprintf(name, "/t/a/f%d", i);
+		if(fs_stat(sb, name, &st)) return -1;
+		du->blocks += st.blocks;
+	}
+	const char *others[] = {"/t/a/x/y/z/deep.txt", "/t/b/big.bin", "/t/c/n1.txt", "/t/c/n2.txt", "/t/c/m.dat",
+	                        "/t/c/clone.bin", "/t/b/holes"};
+	for(int i = 0; i < NELEMS(others); i++) {
+		if(fs_stat(sb, others[i], &st)) return -1;
+		du->blocks += st.blocks;
+	}
+
+	return 0;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, uint64_t flags)/*{{{*/
+{
+	/* Past the direct links and the single indirect block, into the double indirect one */
+	size_t bigsz = ((blksz - 32) / 8 - 3 + blksz / 8 + 5) * blksz + 7;
+	char *a = malloc(bigsz + NFILES), *back = malloc(bigsz + 100), *list;
+	uint64_t free0, tables0;
+	int count;
+	struct superblock *sb, *snap;
+	struct fsdu du, expect;
+	struct fsstat st;
+
+	fill(a, bigsz + NFILES, 1);
+	generate_file(fsize);
+	if((sb = fs_format(fname, blksz)) == NULL) ERROR("FAIL fs_format\n");
+	if(fs_setflags(sb, flags)) ERROR("FAIL fs_setflags\n");
+	if(fs_write_file(sb, "/other", a, 100) || fs_flush(sb)) ERROR("FAIL fs_write_file\n");
+	free0 = sb->freeblks;
+	tables0 = (sb->fingerprints != 0) + (sb->refcounts != 0);
+
+	if(build_tree(sb, a, bigsz, &expect)) ERROR("FAIL build tree\n");
+
+	/* Totals of the tree, of a file and of the whole filesystem */
+	if(fs_du(sb, "/t", &du) || memcmp(&du, &expect, sizeof du)) ERROR("FAIL fs_du\n");
+	if(fs_du(sb, "/t/b/big.bin", &du) || du.files != 1 || du.dirs != 0 || du.size != bigsz) ERROR("FAIL fs_du file\n");
+	if(fs_du(sb, "/", &du) || du.files != expect.files + 2 || du.dirs != expect.dirs + 1) ERROR("FAIL fs_du root\n");
+	if(fs_du(sb, "/none", &du) == 0 || errno != ENOENT) ERROR("FAIL fs_du missing\n");
+
+	/* Names are matched at any depth, paths come out sorted */
+	if((list = fs_find(sb, "/t", "*.txt")) == NULL || strcmp(list, "/t/a/x/y/z/deep.txt /t/c/n1.txt /t/c/n2.txt"))
+		ERROR("FAIL fs_find\n");
+	free(list);
+	if((list = fs_find(sb, "//t//c/", "*")) == NULL ||
+	   strcmp(list, "/t/c/clone.bin /t/c/e/ /t/c/m.dat /t/c/n1.txt /t/c/n2.txt")) ERROR("FAIL fs_find all\n");
+	free(list);
+	if((list = fs_find(sb, "/", "[xyz]")) == NULL || strcmp(list, "/t/a/x/ /t/a/x/y/ /t/a/x/y/z/"))
+		ERROR("FAIL fs_find dirs\n");
+	free(list);
+	if((list = fs_find(sb, "/t/a", "f*")) == NULL) ERROR("FAIL fs_find many\n");
+	count = 1;
+	for(char *c = list; *c; c++) count += (*c == ' ');
+	if(count != NFILES || strncmp(list, "/t/a/f0 /t/a/f1 /t/a/f10 ", 25)) ERROR("FAIL fs_find many\n");
+	free(list);
+	if((list = fs_find(sb, "/t", "nothing")) == NULL || strcmp(list, "")) ERROR("FAIL fs_find no match\n");
+	free(list);
+	if(fs_find(sb, "/none", "*") != NULL || errno != ENOENT) ERROR("FAIL fs_find missing\n");
+	if(fs_find(sb, "/other", "*") != NULL || errno != ENOTDIR) ERROR("FAIL fs_find file\n");
+
+	/* Errors */
+	if(fs_rmtree(sb, "/") == 0 || errno != EBUSY) ERROR("FAIL fs_rmtree root\n");
+	if(fs_rmtree(sb, "/none") == 0 || errno != ENOENT) ERROR("FAIL fs_rmtree missing\n");
+	if(fs_rmtree(sb, "/other/x") == 0 || errno != ENOTDIR) ERROR("FAIL fs_rmtree through a file\n");
+
+	/* Removing the tree frees everything but what the clone outside shares */
+	if(fs_rmtree(sb, "/t")) ERROR("FAIL fs_rmtree\n");
+	if(fs_stat(sb, "/t", &st) == 0 || errno != ENOENT) ERROR("FAIL tree still there\n");
+	if(fs_read_file(sb, "/keep", back, bigsz + 100) != bigsz || memcmp(back, a, bigsz)) ERROR("FAIL clone lost\n");
+	if(fs_read_file(sb, "/other", back, 200) != 100 || memcmp(back, a, 100)) ERROR("FAIL other file lost\n");
+	if(fs_unlink(sb, "/keep")) ERROR("FAIL fs_unlink clone\n");
+	if(sb->freeblks + (sb->fingerprints != 0) + (sb->refcounts != 0) != free0 + tables0) ERROR("FAIL blocks leaked\n");
+
+	/* The freed blocks can be used again, and survive reopening */
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	if((sb = fs_open(fname)) == NULL) ERROR("FAIL fs_open\n");
+	if(fs_setflags(sb, flags)) ERROR("FAIL fs_setflags\n");
+	if(build_tree(sb, a, bigsz, &expect)) ERROR("FAIL build tree again\n");
+	if(fs_du(sb, "/t", &du) || memcmp(&du, &expect, sizeof du)) ERROR("FAIL fs_du again\n");
+
+	/* A snapshot keeps the tree it froze */
+	if(fs_snapshot(sb, "s")) ERROR("FAIL fs_snapshot\n");
+	if(fs_rmtree(sb, "/t/a/x")) ERROR("FAIL fs_rmtree subtree\n");
+	if(fs_rmtree(sb, "/t/c/m.dat")) ERROR("FAIL fs_rmtree file\n");
+	if(fs_du(sb, "/t", &du) || du.dirs != expect.dirs - 3 || du.files != expect.files - 2) ERROR("FAIL fs_du subtree\n");
+	if(fs_rmtree(sb, "/t")) ERROR("FAIL fs_rmtree with snapshot\n");
+
+	if((snap = fs_open_snapshot(fname, "s")) == NULL) ERROR("FAIL fs_open_snapshot\n");
+	if(fs_du(snap, "/t", &du) || memcmp(&du, &expect, sizeof du)) ERROR("FAIL fs_du snapshot\n");
+	if(fs_read_file(snap, "/t/b/big.bin", back, bigsz + 100) != bigsz || memcmp(back, a, bigsz))
+		ERROR("FAIL snapshot file\n");
+	if((list = fs_find(snap, "/", "deep.txt")) == NULL || strcmp(list, "/t/a/x/y/z/deep.txt"))
+		ERROR("FAIL fs_find snapshot\n");
+	free(list);
+	if(fs_rmtree(snap, "/t") == 0 || errno != EROFS) ERROR("FAIL fs_rmtree snapshot\n");
+	if(fs_close(snap)) ERROR("FAIL fs_close snapshot\n");
+
+	if(fs_snapshot_delete(sb, "s")) ERROR("FAIL fs_snapshot_delete\n");
+	if(fs_unlink(sb, "/keep")) ERROR("FAIL fs_unlink clone\n");
+	if(sb->freeblks + (sb->fingerprints != 0) + (sb->refcounts != 0) != free0 + tables0 - 2)
+		ERROR("FAIL blocks leaked with snapshot\n"); /* Snapshot directory stays */
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	free(a);
+	free(back);
+	return 0;
+}
+/*}}}*/
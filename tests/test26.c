@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(const struct backend *backend, uint64_t fsize, uint64_t blksz);
+int test_large(uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 16
+#define FILEBLKS 32
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	const struct backend *backends[] = {&fs_file_backend, &fs_mmap_backend, &fs_ram_backend};
+	uint64_t fsizes[] = {1 << 23};
+	uint64_t blkszs[] = {512, 4096};
+	int i, j, k;
+
+	for(k = 0; k < NELEMS(backends); k++) {
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("backend %s fsize %d blksz %d\n", backends[k]->name, (int)fsizes[j], (int)blkszs[i]);
+		if(test(backends[k], fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+	}
+
+	printf("large fsize %llu blksz %d\n", 1ULL << 36, 4096);
+	if(test_large(1ULL << 36, 4096)) exit(EXIT_FAILURE);
+
+	unlink(fname);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void fill(char *buf, size_t cnt, int seed)/*{{{*/
+{
+	for(size_t i = 0; i < cnt; i++) buf[i] = (char)((i * 31 + seed) % 251 + 1);
+}
+/*}}}*/
+
+
+/* Bytes of the image file that take room on the host, or -1 for a RAM disk */
+long long allocated(const struct backend *backend)/*{{{*/
+{
+	struct stat st;
+
+	if(backend == &fs_ram_backend) return -1;
+	if(stat(fname, &st)) return -1;
+	return (long long)st.st_blocks * 512;
+}
+/*}}}*/
+
+
+/* Checks that file number =n under =dir holds what was written to it */
+int check_file(struct superblock *sb, const char *dir, int n, char *buf, char *expect)/*{{{*/
+{
+	char path[64];
+	size_t sz = FILEBLKS * sb->blksz - n;
+
+	sprintf(path, "%s/f%d", dir, n);
+	fill(expect, sz, n);
+	if(fs_read_file(sb, path, buf, FILEBLKS * sb->blksz) != (ssize_t)sz) return -1;
+	return memcmp(buf, expect, sz) ? -1 : 0;
+}
+/*}}}*/
+
+
+int write_file(struct superblock *sb, const char *dir, int n, char *buf)/*{{{*/
+{
+	char path[64];
+	size_t sz = FILEBLKS * sb->blksz - n;
+
+	sprintf(path, "%s/f%d", dir, n);
+	fill(buf, sz, n);
+	return fs_write_file(sb, path, buf, sz);
+}
+/*}}}*/
+
+
+/* Takes every free block, checking none is handed out twice and that they
+ * add up to =sb->freeblks, then puts them all back */
+int check_free(struct superblock *sb)/*{{{*/
+{
+	uint64_t freeblks = sb->freeblks, n = 0, blk;
+	uint64_t *blocks = malloc(sb->blks * sizeof(uint64_t));
+	char *seen = calloc(sb->blks, 1);
+	int ret = 0;
+
+	while((blk = fs_get_block(sb)) != 0 && blk != (uint64_t)-1) {
+		if(blk >= sb->blks || seen[blk]) ret = -1;
+		else seen[blk] = 1;
+		blocks[n++] = blk;
+	}
+	if(n != freeblks || sb->freeblks != 0) ret = -1;
+	for(uint64_t i = 0; i < n; i++) fs_put_block(sb, blocks[i]);
+	if(sb->freeblks != freeblks) ret = -1;
+
+	free(blocks);
+	free(seen);
+	return ret;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(const struct backend *backend, uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	char *buf = malloc(FILEBLKS * blksz);
+	char *expect = malloc(FILEBLKS * blksz);
+	uint64_t freeblks;
+	long long before, after;
+	struct superblock *sb;
+	int i;
+
+	unlink(fname);
+	sb = fs_format_backend(backend, fname, fsize, blksz);
+	if(!sb) ERROR("FAIL format");
+
+	/* Formatting only writes the metadata, trimming keeps the image sparse */
+	before = allocated(backend);
+	if(before != -1 && before > (long long)fsize / 16) ERROR("FAIL formatted image is not sparse");
+	freeblks = sb->freeblks;
+	if(fs_trim(sb)) ERROR("FAIL trim");
+	if(sb->freeblks != freeblks) ERROR("FAIL trim changed the free blocks");
+	after = allocated(backend);
+	if(after != -1 && after > (long long)fsize / 16) ERROR("FAIL trim kept the free blocks");
+
+	/* Without FS_DISCARD the blocks freed keep their room */
+	if(fs_mkdir(sb, "/a")) ERROR("FAIL mkdir");
+	if(fs_mkdir(sb, "/b")) ERROR("FAIL mkdir");
+	for(i = 0; i < NFILES; i++) {
+		if(write_file(sb, "/a", i, buf)) ERROR("FAIL write");
+	}
+	before = allocated(backend);
+	if(before != -1 && before < (long long)(NFILES * FILEBLKS * blksz)) ERROR("FAIL data takes no room");
+	if(fs_unlink(sb, "/a/f0")) ERROR("FAIL unlink");
+	if(fs_trim(sb)) ERROR("FAIL trim");
+	after = allocated(backend);
+	if(after != -1 && after > before - (long long)(FILEBLKS * blksz) / 2) ERROR("FAIL trim kept the unlinked file");
+	if(write_file(sb, "/a", 0, buf)) ERROR("FAIL write");
+
+	/* With FS_DISCARD unlinking gives the room back at once */
+	if(fs_setflags(sb, FS_DISCARD)) ERROR("FAIL setflags");
+	before = allocated(backend);
+	for(i = 0; i < NFILES / 2; i++) {
+		char path[64];
+		sprintf(path, "/a/f%d", i);
+		if(fs_unlink(sb, path)) ERROR("FAIL unlink");
+	}
+	after = allocated(backend);
+	if(after != -1 && after > before - (long long)(NFILES / 2 * FILEBLKS * blksz) / 2) ERROR("FAIL unlink kept its room");
+	for(i = NFILES / 2; i < NFILES; i++) {
+		if(check_file(sb, "/a", i, buf, expect)) ERROR("FAIL file changed by discard");
+	}
+
+	/* Discarded blocks are handed out again */
+	for(i = 0; i < NFILES / 2; i++) {
+		if(write_file(sb, "/b", i, buf)) ERROR("FAIL write");
+	}
+	for(i = 0; i < NFILES / 2; i++) {
+		if(check_file(sb, "/b", i, buf, expect)) ERROR("FAIL file in discarded blocks");
+	}
+	before = allocated(backend);
+	if(fs_rmtree(sb, "/b")) ERROR("FAIL rmtree");
+	after = allocated(backend);
+	if(after != -1 && after > before - (long long)(NFILES / 2 * FILEBLKS * blksz) / 2) ERROR("FAIL rmtree kept its room");
+	if(check_free(sb)) ERROR("FAIL free list with discard");
+
+	if(backend != &fs_ram_backend) {
+		freeblks = sb->freeblks;
+		if(fs_close(sb)) ERROR("FAIL close");
+		sb = fs_open_backend(backend, fname);
+		if(!sb) ERROR("FAIL open");
+		if(sb->freeblks != freeblks) ERROR("FAIL free blocks after reopen");
+		if(!(sb->flags & FS_DISCARD)) ERROR("FAIL flag lost");
+		if(check_free(sb)) ERROR("FAIL free list after reopen");
+	}
+	for(i = NFILES / 2; i < NFILES; i++) {
+		if(check_file(sb, "/a", i, buf, expect)) ERROR("FAIL file after reopen");
+	}
+
+	if(fs_close(sb)) ERROR("FAIL close");
+
+	free(buf);
+	free(expect);
+	return 0;
+}
+/*}}}*/
+
+
+/* A large image is created sparse and formatted without writing its free blocks */
+int test_large(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	char *buf = malloc(FILEBLKS * blksz);
+	char *expect = malloc(FILEBLKS * blksz);
+	struct superblock *sb;
+	struct stat st;
+
+	unlink(fname);
+	sb = fs_format_backend(&fs_file_backend, fname, fsize, blksz);
+	if(!sb) ERROR("FAIL format");
+	if(sb->blks != fsize / blksz || sb->freeblks != sb->blks - 3) ERROR("FAIL blocks");
+	if(stat(fname, &st) || (uint64_t)st.st_size != fsize) ERROR("FAIL image size");
+	if(allocated(&fs_file_backend) > 1 << 20) ERROR("FAIL formatted image is not sparse");
+
+	if(write_file(sb, "", 1, buf)) ERROR("FAIL write");
+	if(fs_close(sb)) ERROR("FAIL close");
+	if(allocated(&fs_file_backend) > 1 << 20) ERROR("FAIL image grew past its data");
+
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL open");
+	if(sb->freeblks != sb->blks - 3 - FILEBLKS - 2) ERROR("FAIL free blocks after reopen");
+	if(check_file(sb, "", 1, buf, expect)) ERROR("FAIL file after reopen");
+	if(fs_close(sb)) ERROR("FAIL close");
+
+	free(buf);
+	free(expect);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t flags);
+int test_corrupt(uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 40
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 23};
+	uint64_t blkszs[] = {512, 4096};
+	uint64_t flags[] = {0, FS_DEDUP, FS_DELALLOC, FS_TAILPACK, FS_DISCARD,
+	                    FS_DEDUP | FS_TAILPACK | FS_DISCARD};
+	int i, j, k;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		for(k = 0; k < NELEMS(flags); k++) {
+			printf("fsize %d blksz %d flags %d\n", (int)fsizes[j], (int)blkszs[i], (int)flags[k]);
+			if(test(fsizes[j], blkszs[i], flags[k])) exit(EXIT_FAILURE);
+		}
+		printf("corrupt fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test_corrupt(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	unlink(fname);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+void fill(char *buf, size_t cnt, int seed)/*{{{*/
+{
+	for(size_t i = 0; i < cnt; i++) buf[i] = (char)((i * 31 + seed) % 251 + 1);
+}
+/*}}}*/
+
+
+/* Runs fsck with =args on the image and returns its exit code, or -1 if it
+ * did not exit.  If =expect is not NULL, it must appear in the report. */
+int fsck(const char *args, const char *expect)/*{{{*/
+{
+	char cmd[128], line[256];
+	int found = 0, status;
+	FILE *p;
+
+	sprintf(cmd, "./fsck %s %s", args, fname);
+	p = popen(cmd, "r");
+	if(!p) return -1;
+	while(fgets(line, sizeof line, p)) {
+		if(expect && strstr(line, expect)) found = 1;
+	}
+	status = pclose(p);
+	if(status == -1 || !WIFEXITED(status)) return -1;
+	if(expect && !found) return -1;
+	return WEXITSTATUS(status);
+}
+/*}}}*/
+
+
+/* Fills the image with a tree of files, clones and a snapshot, then
+ * changes the live tree so that the snapshot shares only part of it */
+int build(struct superblock *sb, char *buf)/*{{{*/
+{
+	char path[64];
+	size_t sz;
+	int i;
+
+	if(fs_mkdir(sb, "/d") || fs_mkdir(sb, "/d/e")) return -1;
+	for(i = 0; i < NFILES; i++) {
+		sprintf(path, "/d/f%d", i);
+		sz = (i % 5) * sb->blksz + (i * 37) % sb->blksz + 1;
+		fill(buf, sz, i % (NFILES / 2));
+		if(fs_write_file(sb, path, buf, sz)) return -1;
+	}
+	if(fs_clone(sb, "/d/f3", "/d/e/c3")) return -1;
+	if(fs_flush(sb)) return -1;
+	if(fs_snapshot(sb, "s")) return -1;
+
+	for(i = 0; i < NFILES; i += 3) {
+		sprintf(path, "/d/f%d", i);
+		if(fs_unlink(sb, path)) return -1;
+	}
+	fill(buf, 3 * sb->blksz, 99);
+	if(fs_write_file(sb, "/d/f1", buf, 3 * sb->blksz)) return -1;
+	if(fs_mkdir(sb, "/x")) return -1;
+	if(fs_write_file(sb, "/x/y", buf, 7)) return -1;
+	return fs_flush(sb);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, uint64_t flags)/*{{{*/
+{
+	char *buf = malloc(5 * blksz);
+	struct superblock *sb;
+
+	generate_file(fsize);
+	sb = fs_format(fname, blksz);
+	if(!sb) ERROR("FAIL format");
+	if(fs_close(sb)) ERROR("FAIL close");
+	if(fsck("", " 0 errors") != 0) ERROR("FAIL fsck on an empty image");
+
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL open");
+	if(fs_setflags(sb, flags)) ERROR("FAIL setflags");
+	if(build(sb, buf)) ERROR("FAIL build");
+	if(fs_close(sb)) ERROR("FAIL close");
+
+	if(fsck("", " 0 errors") != 0) ERROR("FAIL fsck on a consistent image");
+	if(fsck("-j 1", " 0 errors") != 0) ERROR("FAIL fsck with one thread");
+	if(fsck("-j 4 -r", " 0 errors") != 0) ERROR("FAIL fsck repairing a consistent image");
+
+	/* Deleting the snapshot frees what only it used */
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL open");
+	if(fs_snapshot_delete(sb, "s")) ERROR("FAIL snapshot delete");
+	if(fs_close(sb)) ERROR("FAIL close");
+	if(fsck("", " 0 errors") != 0) ERROR("FAIL fsck after deleting the snapshot");
+
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+/* Adds =delta to the free block count stored in the superblock */
+int bump_freeblks(int64_t delta)/*{{{*/
+{
+	uint64_t freeblks;
+	off_t off = offsetof(struct superblock, freeblks);
+	int fd = open(fname, O_RDWR);
+
+	if(fd == -1) return -1;
+	if(pread(fd, &freeblks, sizeof freeblks, off) != sizeof freeblks) return -1;
+	freeblks += delta;
+	if(pwrite(fd, &freeblks, sizeof freeblks, off) != sizeof freeblks) return -1;
+	return close(fd);
+}
+/*}}}*/
+
+
+int test_corrupt(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	char *buf = malloc(5 * blksz);
+	struct superblock *sb;
+
+	generate_file(fsize);
+	sb = fs_format(fname, blksz);
+	if(!sb) ERROR("FAIL format");
+	if(fs_setflags(sb, FS_DEDUP | FS_TAILPACK)) ERROR("FAIL setflags");
+	if(build(sb, buf)) ERROR("FAIL build");
+	if(fs_close(sb)) ERROR("FAIL close");
+	if(fsck("", " 0 errors") != 0) ERROR("FAIL fsck on a consistent image");
+
+	/* A wrong free block count is reported and cannot be repaired */
+	if(bump_freeblks(1)) ERROR("FAIL corrupt superblock");
+	if(fsck("", "free list has") != 4) ERROR("FAIL fsck missed the free block count");
+	if(fsck("-r", "free list has") != 4) ERROR("FAIL fsck repaired the free block count");
+	if(bump_freeblks(-1)) ERROR("FAIL restore superblock");
+	if(fsck("", " 0 errors") != 0) ERROR("FAIL fsck after restoring the superblock");
+
+	/* A block taken from the free list and never used is leaked */
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL open");
+	if(fs_get_block(sb) == 0) ERROR("FAIL get block");
+	if(fs_close(sb)) ERROR("FAIL close");
+	if(fsck("", "1 blocks leaked") != 4) ERROR("FAIL fsck missed the leak");
+	if(fsck("-r", "put back in free list") != 1) ERROR("FAIL fsck did not repair the leak");
+	if(fsck("", " 0 errors") != 0) ERROR("FAIL fsck after repairing the leak");
+
+	free(buf);
+	return 0;
+}
+/*}}}*/
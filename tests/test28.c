@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz, uint64_t flags);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 40
+#define BIGKEY 1000
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 23};
+	uint64_t blkszs[] = {512, 4096};
+	uint64_t flags[] = {0, FS_DEDUP, FS_TAILPACK, FS_DISCARD, FS_DEDUP | FS_TAILPACK | FS_DISCARD};
+	int i, j, k;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+	for(k = 0; k < NELEMS(flags); k++) {
+		printf("fsize %d blksz %d flags %d\n", (int)fsizes[j], (int)blkszs[i], (int)flags[k]);
+		if(test(fsizes[j], blkszs[i], flags[k])) exit(EXIT_FAILURE);
+	}
+	}
+	}
+
+	unlink(fname);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink(fname);
+	FILE *fd = fopen(fname, "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+	free(buf);
+}
+/*}}}*/
+
+
+/* Size of the contents numbered =key; the big file takes more blocks than an
+ * inode links */
+size_t key_size(uint64_t blksz, int key)/*{{{*/
+{
+	if(key == BIGKEY) return ((blksz - 32) / 8 - 3 + blksz / 8 + 5) * blksz + 7;
+	return (key % 5) * blksz + (key * 37) % blksz + 1;
+}
+/*}}}*/
+
+
+void fill(char *buf, size_t cnt, int seed)/*{{{*/
+{
+	for(size_t i = 0; i < cnt; i++) buf[i] = (char)((i * 31 + seed) % 251 + 1);
+}
+/*}}}*/
+
+
+int put_file(struct superblock *sb, const char *path, int key, char *buf)/*{{{*/
+{
+	size_t sz = key_size(sb->blksz, key);
+
+	fill(buf, sz, key);
+	return fs_write_file(sb, path, buf, sz);
+}
+/*}}}*/
+
+
+/* Checks that =path holds the contents numbered =key */
+int check_file(struct superblock *sb, const char *path, int key, char *buf, char *expect)/*{{{*/
+{
+	size_t sz = key_size(sb->blksz, key);
+
+	fill(expect, sz, key);
+	if(fs_read_file(sb, path, buf, sz + 1) != (ssize_t)sz) return -1;
+	return memcmp(buf, expect, sz) ? -1 : 0;
+}
+/*}}}*/
+
+
+/* Runs =cmd and returns its exit code, or -1 if it did not exit */
+int run(const char *cmd)/*{{{*/
+{
+	int status = system(cmd);
+
+	if(status == -1 || !WIFEXITED(status)) return -1;
+	return WEXITSTATUS(status);
+}
+/*}}}*/
+
+
+/* Blocks that `defrag -n` would still move, or -1 on error */
+long long would_move(void)/*{{{*/
+{
+	char line[256];
+	long long moved = -1;
+	FILE *p = popen("./defrag -n img", "r");
+
+	if(!p) return -1;
+	while(fgets(line, sizeof line, p)) {
+		sscanf(line, "%lld blocks would be moved", &moved);
+	}
+	if(pclose(p) != 0) return -1;
+	return moved;
+}
+/*}}}*/
+
+
+/* The snapshot holds the tree as first written: the second half of /d
+ * repeats the contents of the first half, and /c1 is a clone of /d/f1 */
+int check_snapshot(struct superblock *sb, char *buf, char *expect)/*{{{*/
+{
+	char path[64];
+
+	for(int i = 0; i < NFILES; i++) {
+		sprintf(path, "/d/f%d", i);
+		if(check_file(sb, path, i % (NFILES / 2), buf, expect)) return -1;
+	}
+	if(check_file(sb, "/c1", 1, buf, expect)) return -1;
+	if(check_file(sb, "/big", BIGKEY, buf, expect)) return -1;
+	return 0;
+}
+/*}}}*/
+
+
+/* After the snapshot the even files of /d were unlinked, the odd ones
+ * rewritten and /e filled in the holes left */
+int check_live(struct superblock *sb, char *buf, char *expect)/*{{{*/
+{
+	char path[64];
+
+	for(int i = 0; i < NFILES; i++) {
+		sprintf(path, "/d/f%d", i);
+		if(i % 2 == 0) {
+			if(fs_read_file(sb, path, buf, 1) != -1 || errno != ENOENT) return -1;
+		} else if(check_file(sb, path, i + NFILES, buf, expect)) {
+			return -1;
+		}
+		sprintf(path, "/e/g%d", i);
+		if(check_file(sb, path, i * 3 + 1, buf, expect)) return -1;
+	}
+	if(check_file(sb, "/c1", 1, buf, expect)) return -1;
+	if(check_file(sb, "/c2", BIGKEY, buf, expect)) return -1;
+	if(check_file(sb, "/big", BIGKEY, buf, expect)) return -1;
+	return 0;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz, uint64_t flags)/*{{{*/
+{
+	size_t bigsz = key_size(blksz, BIGKEY);
+	char *buf = malloc(bigsz + 1), *expect = malloc(bigsz + 1);
+	char path[64];
+	struct superblock *sb;
+	int i;
+
+	generate_file(fsize);
+	sb = fs_format(fname, blksz);
+	if(!sb) ERROR("FAIL format");
+	if(fs_setflags(sb, flags)) ERROR("FAIL setflags");
+
+	if(fs_mkdir(sb, "/d") || fs_mkdir(sb, "/e")) ERROR("FAIL mkdir");
+	for(i = 0; i < NFILES; i++) {
+		sprintf(path, "/d/f%d", i);
+		if(put_file(sb, path, i % (NFILES / 2), buf)) ERROR("FAIL write");
+	}
+	if(put_file(sb, "/big", BIGKEY, buf)) ERROR("FAIL write");
+	if(fs_clone(sb, "/d/f1", "/c1")) ERROR("FAIL clone");
+	if(fs_snapshot(sb, "s")) ERROR("FAIL snapshot");
+
+	/* Scatter the live tree over the holes the changes leave */
+	for(i = 0; i < NFILES; i += 2) {
+		sprintf(path, "/d/f%d", i);
+		if(fs_unlink(sb, path)) ERROR("FAIL unlink");
+	}
+	for(i = 0; i < NFILES; i++) {
+		sprintf(path, "/e/g%d", i);
+		if(put_file(sb, path, i * 3 + 1, buf)) ERROR("FAIL write");
+		if(i % 2 == 0) continue;
+		sprintf(path, "/d/f%d", i);
+		if(put_file(sb, path, i + NFILES, buf)) ERROR("FAIL rewrite");
+	}
+	if(fs_clone(sb, "/big", "/c2")) ERROR("FAIL clone");
+	if(fs_close(sb)) ERROR("FAIL close");
+
+	if(run("./fsck img > /dev/null") != 0) ERROR("FAIL fsck before defrag");
+	if(run("./defrag img > /dev/null") != 0) ERROR("FAIL defrag");
+	if(run("./fsck img > /dev/null") != 0) ERROR("FAIL fsck after defrag");
+	if(would_move() != 0) ERROR("FAIL defrag left blocks out of place");
+
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL open");
+	if(check_live(sb, buf, expect)) ERROR("FAIL live file changed by defrag");
+	if(fs_close(sb)) ERROR("FAIL close");
+
+	sb = fs_open_snapshot(fname, "s");
+	if(!sb) ERROR("FAIL open snapshot");
+	if(check_snapshot(sb, buf, expect)) ERROR("FAIL snapshot file changed by defrag");
+	if(fs_close(sb)) ERROR("FAIL close");
+
+	/* The defragmented image can still be written */
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL open");
+	if(put_file(sb, "/d/f0", 7, buf)) ERROR("FAIL write after defrag");
+	if(fs_unlink(sb, "/e/g1")) ERROR("FAIL unlink after defrag");
+	if(fs_close(sb)) ERROR("FAIL close");
+	if(run("./fsck img > /dev/null") != 0) ERROR("FAIL fsck after writing");
+
+	free(buf);
+	free(expect);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,210 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t blksz, const char *size);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+#define NFILES 40
+
+static char *fname = "img";
+static char *fname2 = "img2";
+static char *hostdir = "test29.tree";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	const char *sizes[] = {NULL, "8388608"};
+	uint64_t blkszs[] = {512, 4096};
+	int i, j;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(sizes); j++) {
+		printf("fsize %s blksz %d\n", sizes[j] ? sizes[j] : "auto", (int)blkszs[i]);
+		if(test(blkszs[i], sizes[j])) exit(EXIT_FAILURE);
+	}
+	}
+
+	unlink(fname);
+	unlink(fname2);
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void fill(char *buf, size_t cnt, int seed)/*{{{*/
+{
+	for(size_t i = 0; i < cnt; i++) buf[i] = (char)((i * 31 + seed) % 251 + 1);
+}
+/*}}}*/
+
+
+int run(const char *cmd)/*{{{*/
+{
+	int status = system(cmd);
+
+	if(status == -1 || !WIFEXITED(status)) return -1;
+	return WEXITSTATUS(status);
+}
+/*}}}*/
+
+
+int host_file(const char *path, char *buf, size_t sz, int seed)/*{{{*/
+{
+	FILE *f = fopen(path, "w");
+
+	if(!f) return -1;
+	fill(buf, sz, seed);
+	if(fwrite(buf, 1, sz, f) != sz) return -1;
+	return fclose(f);
+}
+/*}}}*/
+
+
+/* Builds the host tree: nested directories, an empty one, empty and short
+ * files, files of several blocks, one of zeros, one reaching the double
+ * indirect block and a symbolic link, which mkimg skips */
+int build_host(uint64_t blksz)/*{{{*/
+{
+	size_t bigsz = ((blksz - 32) / 8 - 3 + blksz / 8 + 5) * blksz + 7;
+	char *buf = malloc(bigsz), path[256];
+
+	if(run("rm -rf test29.tree") != 0) return -1;
+	if(mkdir(hostdir, 0755)) return -1;
+	sprintf(path, "%s/a", hostdir);
+	if(mkdir(path, 0755)) return -1;
+	sprintf(path, "%s/a/b", hostdir);
+	if(mkdir(path, 0755)) return -1;
+	sprintf(path, "%s/a/b/c", hostdir);
+	if(mkdir(path, 0755)) return -1;
+	sprintf(path, "%s/empty", hostdir);
+	if(mkdir(path, 0755)) return -1;
+
+	/* More entries than an inode links, so the directory takes several */
+	for(int i = 0; i < NFILES; i++) {
+		sprintf(path, "%s/a/f%d", hostdir, i);
+		if(host_file(path, buf, (i % 5) * blksz + (i * 37) % blksz, i)) return -1;
+	}
+	sprintf(path, "%s/a/b/c/deep", hostdir);
+	if(host_file(path, buf, 3 * blksz + 5, 1)) return -1;
+	sprintf(path, "%s/big", hostdir);
+	if(host_file(path, buf, bigsz, 2)) return -1;
+	sprintf(path, "%s/zeros", hostdir);
+	memset(buf, 0, 4 * blksz);
+	FILE *f = fopen(path, "w");
+	if(!f || fwrite(buf, 1, 4 * blksz, f) != 4 * blksz || fclose(f)) return -1;
+	sprintf(path, "%s/link", hostdir);
+	if(symlink("big", path)) return -1;
+
+	free(buf);
+	return 0;
+}
+/*}}}*/
+
+
+/* Compares the tree under host directory =dir with the image's directory
+ * =dname, entry by entry */
+int compare_dir(struct superblock *sb, const char *dir, const char *dname, char *buf, char *back)/*{{{*/
+{
+	char hpath[512], ipath[512];
+	struct dirent *ent;
+	struct stat hst;
+	DIR *d = opendir(dir);
+	int n = 0, ret = 0;
+
+	if(!d) return -1;
+	while(ret == 0 && (ent = readdir(d)) != NULL) {
+		if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) continue;
+		sprintf(hpath, "%s/%s", dir, ent->d_name);
+		sprintf(ipath, "%s/%s", dname, ent->d_name);
+		if(lstat(hpath, &hst)) { ret = -1; break; }
+
+		if(S_ISLNK(hst.st_mode)) {
+			if(fs_read_file(sb, ipath, buf, 1) != -1 || errno != ENOENT) ret = -1;
+			continue;
+		}
+		n++;
+		if(S_ISDIR(hst.st_mode)) {
+			ret = compare_dir(sb, hpath, ipath, buf, back);
+			continue;
+		}
+
+		int fd = open(hpath, O_RDONLY);
+		if(fd == -1 || read(fd, back, hst.st_size + 1) != hst.st_size) ret = -1;
+		if(fd != -1) close(fd);
+		if(ret == 0 && fs_read_file(sb, ipath, buf, hst.st_size + 1) != hst.st_size) ret = -1;
+		if(ret == 0 && memcmp(buf, back, hst.st_size)) ret = -1;
+	}
+	closedir(d);
+	if(ret) return ret;
+
+	/* Nothing in the image that the host tree does not have */
+	char *list = fs_list_dir(sb, dname[0] ? dname : "/");
+	int count = 0;
+	if(!list) return -1;
+	for(char *p = strtok(list, " "); p; p = strtok(NULL, " ")) count++;
+	free(list);
+	return count == n ? 0 : -1;
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t blksz, const char *size)/*{{{*/
+{
+	size_t bigsz = ((blksz - 32) / 8 - 3 + blksz / 8 + 5) * blksz + 7;
+	char *buf = malloc(bigsz + 1), *back = malloc(bigsz + 1);
+	char cmd[256], opts[64];
+	struct superblock *sb;
+	struct stat st;
+
+	if(build_host(blksz)) ERROR("FAIL host tree");
+
+	sprintf(opts, "-b %d", (int)blksz);
+	if(size) sprintf(opts + strlen(opts), " -s %s", size);
+	unlink(fname);
+	unlink(fname2);
+	sprintf(cmd, "./mkimg %s -j 1 %s %s > /dev/null", opts, fname, hostdir);
+	if(run(cmd) != 0) ERROR("FAIL mkimg with one thread");
+	sprintf(cmd, "./mkimg %s -j 4 %s %s > /dev/null", opts, fname2, hostdir);
+	if(run(cmd) != 0) ERROR("FAIL mkimg with several threads");
+
+	/* The image does not depend on the number of threads */
+	sprintf(cmd, "cmp -s %s %s", fname, fname2);
+	if(run(cmd) != 0) ERROR("FAIL images differ");
+	if(stat(fname, &st)) ERROR("FAIL stat");
+	if(size && (uint64_t)st.st_size != strtoull(size, NULL, 10)) ERROR("FAIL image size");
+
+	sprintf(cmd, "./fsck %s > /dev/null", fname);
+	if(run(cmd) != 0) ERROR("FAIL fsck");
+
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL open");
+	if(sb->blksz != blksz) ERROR("FAIL block size");
+	if(compare_dir(sb, hostdir, "", buf, back)) ERROR("FAIL image differs from the host tree");
+
+	/* The image can be grown and written like any other */
+	if(!size && fs_grow(sb, sb->blks + 16)) ERROR("FAIL grow");
+	fill(buf, 2 * blksz, 7);
+	if(fs_write_file(sb, "/empty/new", buf, 2 * blksz)) ERROR("FAIL write");
+	if(fs_unlink(sb, "/a/f1")) ERROR("FAIL unlink");
+	if(fs_close(sb)) ERROR("FAIL close");
+	sprintf(cmd, "./fsck %s > /dev/null", fname);
+	if(run(cmd) != 0) ERROR("FAIL fsck after writing");
+
+	if(run("rm -rf test29.tree") != 0) ERROR("FAIL cleanup");
+	free(buf);
+	free(back);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,21 @@
+#!/bin/bash
+set -u
+
+i=29
+
+gcc -g -std=c99 -Wall -c fs.c &>> gcc.log
+gcc -g -std=c99 -Wall -pthread -I. fsck.c fs.o -o fsck &>> gcc.log
+gcc -g -std=c99 -Wall -pthread -I. mkimg.c fs.o -o mkimg &>> gcc.log
+gcc -g -std=c99 -Wall -pthread -I. tests/test$i.c fs.o -o test$i &>> gcc.log
+if [ ! -x test$i ] || [ ! -x fsck ] || [ ! -x mkimg ] ; then
+    echo "[$i] compilation error"
+    exit 1 ;
+fi
+
+if ! ./test$i > test$i.out 2> test$i.err ; then
+    echo "[$i] error"
+    exit 1
+fi
+
+rm -rf test$i test$i.out test$i.err test$i.tree
+exit 0
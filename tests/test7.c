@@ -0,0 +1,104 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 21};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks, datablks, used;
+	size_t cnt = blksz * 8 - blksz / 2;
+	char *data = malloc(cnt);
+	char *back = malloc(cnt);
+
+	for(size_t i = 0; i < cnt; i++) data[i] = (char)(i * 7 + i / blksz);
+	datablks = (cnt + blksz - 1) / blksz;
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	freeblks = sb->freeblks;
+
+	if(fs_setflags(sb, 0xff00) == 0 || errno != EINVAL)
+		ERROR("FAIL accepted unknown flags\n");
+	if(fs_setflags(sb, FS_DEDUP)) ERROR("FAIL fs_setflags\n");
+
+	if(fs_write_file(sb, "/a", data, cnt)) ERROR("FAIL fs_write_file /a\n");
+	used = sb->freeblks;
+	if(fs_write_file(sb, "/b", data, cnt)) ERROR("FAIL fs_write_file /b\n");
+	used -= sb->freeblks;
+	/* inode, nodeinfo and the reference count table blocks */
+	if(used >= datablks) ERROR("FAIL duplicate blocks were not shared\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open\n");
+	if(!(sb->flags & FS_DEDUP)) ERROR("FAIL flags not saved\n");
+
+	if(fs_unlink(sb, "/a")) ERROR("FAIL fs_unlink /a\n");
+	memset(back, 0, cnt);
+	if(fs_read_file(sb, "/b", back, cnt) != cnt) ERROR("FAIL fs_read_file /b\n");
+	if(memcmp(data, back, cnt)) ERROR("FAIL shared blocks freed early\n");
+
+	if(fs_unlink(sb, "/b")) ERROR("FAIL fs_unlink /b\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+	if(sb->refcounts != 0 || sb->fingerprints != 0) ERROR("FAIL tables not freed\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+
+	/* Images enabling unknown features are refused */
+	uint64_t flags = FS_DEDUP | 0xff00;
+	int fd = open(fname, O_RDWR);
+	if(fd == -1 || pwrite(fd, &flags, sizeof flags, offsetof(struct superblock, flags)) != sizeof flags)
+		ERROR("FAIL corrupt flags\n");
+	close(fd);
+	if(fs_open(fname) != NULL || errno != EBADF) ERROR("FAIL opened unknown flags\n");
+	free(data);
+	free(back);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,99 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 20, 1 << 21};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t freeblks, stored = 0;
+	size_t cnt = blksz * 10 - 3;
+	char *data = malloc(cnt);
+	char *back = malloc(cnt);
+
+	memset(data, 0, cnt);
+	for(size_t b = 0; b < 10; b++) {
+		if(b == 1 || b == 2 || b == 3 || b == 5) continue;
+		data[b * blksz + b] = (char)(b + 1);
+		stored++;
+	}
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+	freeblks = sb->freeblks;
+
+	if(fs_write_file(sb, "/sparse", data, cnt)) ERROR("FAIL fs_write_file\n");
+	/* inode, nodeinfo and, when the direct links run out, one indirect block */
+	uint64_t meta = 2 + (10 > (blksz - 32) / sizeof(uint64_t) - 3);
+	if(freeblks - sb->freeblks != stored + meta) ERROR("FAIL zero blocks were allocated\n");
+
+	struct inode *inode = malloc(blksz);
+	struct nodeinfo *info = malloc(blksz);
+	lseek(sb->fd, sb->root * blksz, SEEK_SET);
+	read(sb->fd, inode, blksz);
+	lseek(sb->fd, inode->links[0] * blksz, SEEK_SET);
+	read(sb->fd, inode, blksz);
+	lseek(sb->fd, inode->meta * blksz, SEEK_SET);
+	read(sb->fd, info, blksz);
+	if(info->size != cnt) ERROR("FAIL nodeinfo size\n");
+	if(info->blocks != stored) ERROR("FAIL nodeinfo blocks\n");
+	if(inode->links[1] != 0 || inode->links[5] != 0) ERROR("FAIL hole has a link\n");
+
+	memset(back, 0xff, cnt);
+	if(fs_read_file(sb, "/sparse", back, cnt) != cnt) ERROR("FAIL fs_read_file\n");
+	if(memcmp(data, back, cnt)) ERROR("FAIL holes not read as zeros\n");
+
+	if(fs_unlink(sb, "/sparse")) ERROR("FAIL fs_unlink\n");
+	if(sb->freeblks != freeblks) ERROR("FAIL blocks leaked\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	free(inode);
+	free(info);
+	free(data);
+	free(back);
+	return 0;
+}
+/*}}}*/
@@ -0,0 +1,109 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "fs.h"
+
+int test(uint64_t fsize, uint64_t blksz);
+
+#define NELEMS(x) (sizeof(x)/sizeof(x[0]))
+
+static char *fname = "img";
+
+
+int main(int argc, char **argv)/*{{{*/
+{
+	uint64_t fsizes[] = {1 << 16, 1 << 19};
+	uint64_t blkszs[] = {128, 256, 512, 1024};
+	int i, j;
+
+	for(i = 0; i < NELEMS(blkszs); i++) {
+	for(j = 0; j < NELEMS(fsizes); j++) {
+		printf("fsize %d blksz %d\n", (int)fsizes[j], (int)blkszs[i]);
+		if(test(fsizes[j], blkszs[i])) exit(EXIT_FAILURE);
+	}
+	}
+
+	exit(EXIT_SUCCESS);
+}
+/*}}}*/
+
+
+void generate_file(uint64_t fsize)/*{{{*/
+{
+	char *buf = malloc(fsize);
+	if(!buf) { perror(NULL); exit(EXIT_FAILURE); }
+	memset(buf, 0, fsize);
+	unlink("img");
+	FILE *fd = fopen("img", "w");
+	fwrite(buf, 1, fsize, fd);
+	fclose(fd);
+}
+/*}}}*/
+
+
+#define ERROR(str) { puts(str); return -1; }
+int test(uint64_t fsize, uint64_t blksz)/*{{{*/
+{
+	uint64_t blks = fsize / blksz, freeblks;
+	size_t cnt = fsize / 2;
+	char *data = malloc(cnt);
+	char *back = malloc(cnt);
+	struct stat st;
+
+	for(size_t i = 0; i < cnt; i++) data[i] = (char)(i % 251 + 1);
+
+	generate_file(fsize);
+	struct superblock *sb = fs_format(fname, blksz);
+	if(sb == NULL) ERROR("FAIL no sb\n");
+
+	if(fs_grow(sb, blks - 1) == 0 || errno != EINVAL) ERROR("FAIL shrunk the filesystem\n");
+
+	freeblks = sb->freeblks;
+	if(fs_grow(sb, blks * 4)) ERROR("FAIL fs_grow\n");
+	if(sb->blks != blks * 4) ERROR("FAIL sb->blks after fs_grow\n");
+	if(sb->freeblks != freeblks + blks * 3) ERROR("FAIL sb->freeblks after fs_grow\n");
+	if(stat(fname, &st) || st.st_size != fsize * 4) ERROR("FAIL image not extended\n");
+
+	/* Bigger than the filesystem was before growing */
+	if(fs_write_file(sb, "/big", data, cnt) || fs_write_file(sb, "/big2", data, cnt))
+		ERROR("FAIL fs_write_file after fs_grow\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+	sb = fs_open(fname);
+	if(!sb) ERROR("FAIL fs_open\n");
+	if(sb->blks != blks * 4) ERROR("FAIL fs_grow not saved\n");
+
+	if(fs_read_file(sb, "/big2", back, cnt) != cnt || memcmp(data, back, cnt))
+		ERROR("FAIL fs_read_file after fs_grow\n");
+
+	if(fs_unlink(sb, "/big") || fs_unlink(sb, "/big2")) ERROR("FAIL fs_unlink\n");
+	if(sb->freeblks != freeblks + blks * 3) ERROR("FAIL blocks leaked\n");
+
+	/* Drain every block, the grown range included */
+	uint64_t got = 0, blknum;
+	while((blknum = fs_get_block(sb)) != 0 && blknum != (uint64_t) -1) {
+		if(blknum >= sb->blks) ERROR("FAIL block out of range\n");
+		got++;
+	}
+	if(got != freeblks + blks * 3) ERROR("FAIL fs_get_block after fs_grow\n");
+
+	if(fs_close(sb)) ERROR("FAIL fs_close\n");
+
+	/* Images of another superblock layout are refused */
+	uint64_t version = 3;
+	int fd = open(fname, O_RDWR);
+	if(fd == -1 || pwrite(fd, &version, sizeof version, offsetof(struct superblock, version)) != sizeof version)
+		ERROR("FAIL corrupt version\n");
+	close(fd);
+	if(fs_open(fname) != NULL || errno != EBADF) ERROR("FAIL opened another layout\n");
+	free(data);
+	free(back);
+	return 0;
+}
+/*}}}*/